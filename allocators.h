@@ -0,0 +1,454 @@
+#pragma once
+
+// Allocators for backing hash table storage.  Every table takes an allocator
+// type parameter A (std::allocator<char> by default), and rebinds it for each
+// of its arrays; these are the alternatives bundled here:
+//
+//   ArenaAllocator	- bump allocation out of an Arena. Freeing is a no-op;
+//					  Arena::Reset releases everything at once, so a short-
+//					  lived table costs nothing to tear down.
+//   PoolAllocator	- power-of-two size classes with free lists, carved out
+//					  of an Arena. Arrays freed by Rehash or by destroying a
+//					  table are recycled by the next table that needs them.
+//   HugePageAllocator - for very large tables: big arrays get their own
+//					  mapping backed by 2MB pages, optionally interleaved
+//					  across NUMA nodes and faulted in by several threads.
+//   CountingAllocator - plain new/delete, keeping count of the bytes live
+//					  and the most there have been at once, to measure a
+//					  table's memory as it grows.
+//
+// None of them are thread-safe, same as the tables themselves.
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+#endif
+
+// Bump allocator over a list of malloc'd blocks
+class Arena
+{
+public:
+	explicit Arena(size_t blockSizeInitial = 64 * 1024)
+	:	pBlockHead(nullptr),
+		pCur(nullptr),
+		pEnd(nullptr),
+		blockSizeNext(blockSizeInitial),
+		bytesAllocated(0)
+	{
+	}
+
+	~Arena()
+	{
+		FreeBlocks(nullptr);
+	}
+
+	void * Allocate(size_t sizeBytes, size_t alignment)
+	{
+		assert((alignment & (alignment - 1)) == 0);
+
+		char * p = AlignUp(pCur, alignment);
+		if (!pCur || p + sizeBytes > pEnd)
+		{
+			AddBlock(sizeBytes + alignment);
+			p = AlignUp(pCur, alignment);
+		}
+
+		pCur = p + sizeBytes;
+		bytesAllocated += sizeBytes;
+		return p;
+	}
+
+	// Release everything allocated so far.  Keeps the most recent (largest)
+	// block around, so a workload that repeats fits in it without calling
+	// malloc again; the cost is proportional to the number of blocks, which
+	// grows only logarithmically with the bytes allocated.
+	void Reset()
+	{
+		if (!pBlockHead)
+			return;
+		FreeBlocks(pBlockHead);
+		pBlockHead->pNext = nullptr;
+		pCur = reinterpret_cast<char *>(pBlockHead + 1);
+		bytesAllocated = 0;
+	}
+
+	size_t BytesAllocated() const { return bytesAllocated; }
+
+private:
+	struct Block
+	{
+		Block *	pNext;
+		size_t	sizeBytes;
+		// Pad the header so the payload after it is maximally aligned
+		alignas(std::max_align_t) char pad[1];
+	};
+
+	static char * AlignUp(char * p, size_t alignment)
+	{
+		return reinterpret_cast<char *>(
+			(reinterpret_cast<uintptr_t>(p) + alignment - 1) & ~uintptr_t(alignment - 1));
+	}
+
+	void AddBlock(size_t sizeBytesMin)
+	{
+		// Blocks double in size, and oversized requests get a block to themselves
+		size_t sizeBytes = blockSizeNext;
+		while (sizeBytes < sizeBytesMin)
+			sizeBytes *= 2;
+		blockSizeNext = sizeBytes * 2;
+
+		Block * pBlock = static_cast<Block *>(malloc(sizeof(Block) + sizeBytes));
+		if (!pBlock)
+			throw std::bad_alloc();
+		pBlock->pNext = pBlockHead;
+		pBlock->sizeBytes = sizeBytes;
+		pBlockHead = pBlock;
+
+		pCur = reinterpret_cast<char *>(pBlock + 1);
+		pEnd = pCur + sizeBytes;
+	}
+
+	// Free every block except pKeep (which must be the head, if not null)
+	void FreeBlocks(Block * pKeep)
+	{
+		Block * pBlock = pKeep ? pKeep->pNext : pBlockHead;
+		while (pBlock)
+		{
+			Block * pNext = pBlock->pNext;
+			free(pBlock);
+			pBlock = pNext;
+		}
+		if (!pKeep)
+			pBlockHead = nullptr;
+	}
+
+	Block *	pBlockHead;
+	char *	pCur;
+	char *	pEnd;
+	size_t	blockSizeNext;
+	size_t	bytesAllocated;
+
+	Arena(const Arena &);
+	Arena & operator = (const Arena &);
+};
+
+// Size-classed free lists on top of an Arena
+class SizeClassPool
+{
+public:
+	SizeClassPool()
+	{
+		Reset();
+	}
+
+	void * Allocate(size_t sizeBytes)
+	{
+		int sizeClass = SizeClass(sizeBytes);
+		if (FreeNode * pNode = freeLists[sizeClass])
+		{
+			freeLists[sizeClass] = pNode->pNext;
+			return pNode;
+		}
+		return arena.Allocate(size_t(1) << sizeClass, alignof(std::max_align_t));
+	}
+
+	void Free(void * p, size_t sizeBytes)
+	{
+		if (!p)
+			return;
+		int sizeClass = SizeClass(sizeBytes);
+		FreeNode * pNode = static_cast<FreeNode *>(p);
+		pNode->pNext = freeLists[sizeClass];
+		freeLists[sizeClass] = pNode;
+	}
+
+	// Forget all free lists and release the underlying arena
+	void Reset()
+	{
+		for (int i = 0; i < s_numSizeClasses; ++i)
+			freeLists[i] = nullptr;
+		arena.Reset();
+	}
+
+	size_t BytesAllocated() const { return arena.BytesAllocated(); }
+
+private:
+	struct FreeNode
+	{
+		FreeNode * pNext;
+	};
+
+	static const int s_sizeClassMin = 4;		// 16 bytes
+	static const int s_numSizeClasses = 64;
+
+	static int SizeClass(size_t sizeBytes)
+	{
+		int sizeClass = s_sizeClassMin;
+		while ((size_t(1) << sizeClass) < sizeBytes)
+			++sizeClass;
+		return sizeClass;
+	}
+
+	Arena		arena;
+	FreeNode *	freeLists[s_numSizeClasses];
+
+	SizeClassPool(const SizeClassPool &);
+	SizeClassPool & operator = (const SizeClassPool &);
+};
+
+// STL allocator that bump-allocates from an Arena; deallocate is a no-op
+template <typename T>
+class ArenaAllocator
+{
+public:
+	typedef T value_type;
+
+	Arena * pArena;
+
+	explicit ArenaAllocator(Arena * pArena_) : pArena(pArena_) {}
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U> & other) : pArena(other.pArena) {}
+
+	T * allocate(size_t n)
+	{
+		return static_cast<T *>(pArena->Allocate(n * sizeof(T), alignof(T)));
+	}
+	void deallocate(T *, size_t) {}
+
+	template <typename U>
+	struct rebind { typedef ArenaAllocator<U> other; };
+};
+
+template <typename T, typename U>
+bool operator == (const ArenaAllocator<T> & a, const ArenaAllocator<U> & b) { return a.pArena == b.pArena; }
+template <typename T, typename U>
+bool operator != (const ArenaAllocator<T> & a, const ArenaAllocator<U> & b) { return a.pArena != b.pArena; }
+
+// STL allocator that recycles blocks through a SizeClassPool
+template <typename T>
+class PoolAllocator
+{
+public:
+	typedef T value_type;
+
+	SizeClassPool * pPool;
+
+	explicit PoolAllocator(SizeClassPool * pPool_) : pPool(pPool_) {}
+	template <typename U>
+	PoolAllocator(const PoolAllocator<U> & other) : pPool(other.pPool) {}
+
+	T * allocate(size_t n)
+	{
+		return static_cast<T *>(pPool->Allocate(n * sizeof(T)));
+	}
+	void deallocate(T * p, size_t n)
+	{
+		pPool->Free(p, n * sizeof(T));
+	}
+
+	template <typename U>
+	struct rebind { typedef PoolAllocator<U> other; };
+};
+
+template <typename T, typename U>
+bool operator == (const PoolAllocator<T> & a, const PoolAllocator<U> & b) { return a.pPool == b.pPool; }
+template <typename T, typename U>
+bool operator != (const PoolAllocator<T> & a, const PoolAllocator<U> & b) { return a.pPool != b.pPool; }
+
+// Where HugePageAllocator puts big arrays.  The defaults just ask for huge
+// pages; interleaving and multi-threaded first touch are for tables big
+// enough to span NUMA nodes.
+struct HugePagePolicy
+{
+	bool	hugePages;			// MAP_HUGETLB if pages are reserved, else THP via madvise
+	bool	interleave;			// Spread pages round-robin over all NUMA nodes
+	int		firstTouchThreads;	// Threads that fault the pages in; with the default
+								// first-touch policy each lands on its toucher's node
+	size_t	minSizeBytes;		// Arrays smaller than this just use malloc
+
+	HugePagePolicy()
+	:	hugePages(true),
+		interleave(false),
+		firstTouchThreads(1),
+		minSizeBytes(s_hugePageSize)
+	{
+	}
+
+	static const size_t s_hugePageSize = 2 * 1024 * 1024;
+
+	void * Allocate(size_t sizeBytes) const
+	{
+		if (sizeBytes < minSizeBytes)
+			return Malloc(sizeBytes);
+#if defined(__linux__)
+		size_t sizeMapped = MappedSize(sizeBytes);
+		void * p = MAP_FAILED;
+		if (hugePages)
+			p = mmap(nullptr, sizeMapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p == MAP_FAILED)
+		{
+			p = mmap(nullptr, sizeMapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED)
+				throw std::bad_alloc();
+			if (hugePages)
+				madvise(p, sizeMapped, MADV_HUGEPAGE);
+		}
+
+		// Placement is best-effort: on a single-node machine, or a kernel
+		// without NUMA support, mbind just fails and nothing changes
+		if (interleave)
+		{
+			static const int s_mpolInterleave = 3;	// MPOL_INTERLEAVE, from <numaif.h>
+			unsigned long nodeMask = ~0UL;
+			syscall(SYS_mbind, p, sizeMapped, s_mpolInterleave, &nodeMask, sizeof(nodeMask) * 8, 0);
+		}
+		if (firstTouchThreads > 1)
+			FirstTouch(static_cast<char *>(p), sizeMapped);
+
+		return p;
+#else
+		return Malloc(sizeBytes);
+#endif
+	}
+
+	void Free(void * p, size_t sizeBytes) const
+	{
+		if (!p)
+			return;
+#if defined(__linux__)
+		if (sizeBytes >= minSizeBytes)
+		{
+			munmap(p, MappedSize(sizeBytes));
+			return;
+		}
+#else
+		(void)sizeBytes;
+#endif
+		free(p);
+	}
+
+private:
+	static void * Malloc(size_t sizeBytes)
+	{
+		void * p = malloc(sizeBytes);
+		if (!p)
+			throw std::bad_alloc();
+		return p;
+	}
+
+#if defined(__linux__)
+	static size_t MappedSize(size_t sizeBytes)
+	{
+		return (sizeBytes + s_hugePageSize - 1) & ~(s_hugePageSize - 1);
+	}
+
+	// Write one byte per page from several threads, so the pages are
+	// allocated (and placed) in parallel instead of by the table's first
+	// single-threaded pass over the array
+	void FirstTouch(char * p, size_t sizeBytes) const
+	{
+		size_t numPages = sizeBytes / s_hugePageSize;
+		size_t pagesPerThread = (numPages + firstTouchThreads - 1) / firstTouchThreads;
+		std::vector<std::thread> threads;
+		for (size_t iPageStart = 0; iPageStart < numPages; iPageStart += pagesPerThread)
+		{
+			size_t iPageEnd = std::min(iPageStart + pagesPerThread, numPages);
+			threads.push_back(std::thread([=]()
+			{
+				for (size_t i = iPageStart * s_hugePageSize, iEnd = iPageEnd * s_hugePageSize; i < iEnd; i += 4096)
+					p[i] = 0;
+			}));
+		}
+		for (auto & thread : threads)
+			thread.join();
+	}
+#endif
+};
+
+// STL allocator that places big arrays according to a HugePagePolicy
+template <typename T>
+class HugePageAllocator
+{
+public:
+	typedef T value_type;
+
+	HugePagePolicy policy;
+
+	HugePageAllocator() {}
+	explicit HugePageAllocator(const HugePagePolicy & policy_) : policy(policy_) {}
+	template <typename U>
+	HugePageAllocator(const HugePageAllocator<U> & other) : policy(other.policy) {}
+
+	T * allocate(size_t n)
+	{
+		return static_cast<T *>(policy.Allocate(n * sizeof(T)));
+	}
+	void deallocate(T * p, size_t n)
+	{
+		policy.Free(p, n * sizeof(T));
+	}
+
+	template <typename U>
+	struct rebind { typedef HugePageAllocator<U> other; };
+};
+
+// Only the size threshold matters for freeing, so that's all that has to agree
+template <typename T, typename U>
+bool operator == (const HugePageAllocator<T> & a, const HugePageAllocator<U> & b) { return a.policy.minSizeBytes == b.policy.minSizeBytes; }
+template <typename T, typename U>
+bool operator != (const HugePageAllocator<T> & a, const HugePageAllocator<U> & b) { return !(a == b); }
+
+// What a CountingAllocator (and everything rebound from it) has allocated
+struct AllocationCounter
+{
+	size_t	bytesLive;
+	size_t	bytesPeak;
+
+	AllocationCounter() : bytesLive(0), bytesPeak(0) {}
+};
+
+// STL allocator that allocates with operator new, counting bytes in an
+// AllocationCounter
+template <typename T>
+class CountingAllocator
+{
+public:
+	typedef T value_type;
+
+	AllocationCounter * pCounter;
+
+	explicit CountingAllocator(AllocationCounter * pCounter_) : pCounter(pCounter_) {}
+	template <typename U>
+	CountingAllocator(const CountingAllocator<U> & other) : pCounter(other.pCounter) {}
+
+	T * allocate(size_t n)
+	{
+		T * p = static_cast<T *>(::operator new(n * sizeof(T)));
+		pCounter->bytesLive += n * sizeof(T);
+		pCounter->bytesPeak = std::max(pCounter->bytesPeak, pCounter->bytesLive);
+		return p;
+	}
+	void deallocate(T * p, size_t n)
+	{
+		pCounter->bytesLive -= n * sizeof(T);
+		::operator delete(p);
+	}
+
+	template <typename U>
+	struct rebind { typedef CountingAllocator<U> other; };
+};
+
+template <typename T, typename U>
+bool operator == (const CountingAllocator<T> & a, const CountingAllocator<U> & b) { return a.pCounter == b.pCounter; }
+template <typename T, typename U>
+bool operator != (const CountingAllocator<T> & a, const CountingAllocator<U> & b) { return a.pCounter != b.pCounter; }
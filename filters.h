@@ -0,0 +1,863 @@
+#pragma once
+
+// Approximate membership filters: compact sets that answer "definitely not
+// here" or "maybe here" for a key, at a few bits per key, and never say a
+// key that was added isn't there.  In front of a table, a filter turns most
+// failed lookups into one cache line read instead of a probe sequence.
+//
+//   BlockedBloomFilter  a Bloom filter whose bits for each key all fall in
+//                       one 32-byte block, so a check touches one cache line
+//   FilteredHashTable   any table from hash-tables.h, with a
+//                       BlockedBloomFilter checked before each Lookup, and
+//                       rebuilt from the table's keys as it grows
+//   CuckooFilter        fingerprints in a cuckoo table of 4-slot buckets;
+//                       about 9 bits per key with 8-bit fingerprints
+//   CountingQuotientFilter  fingerprints split into a slot number and a
+//                       remainder, kept sorted by slot; counts duplicates
+//
+// The cuckoo and quotient filters store a fingerprint per key, so unlike the
+// Bloom filter they can take keys back out and merge with another filter
+// of the same shape, and they're used by key rather than by hash.
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "hash-tables.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Bit scans and counts on 64-bit words; for the first two, x must not be 0
+inline int LowestSetBit64(uint64_t x)
+{
+#if defined(_MSC_VER)
+	unsigned long i;
+	_BitScanForward64(&i, x);
+	return int(i);
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+inline int HighestSetBit64(uint64_t x)
+{
+#if defined(_MSC_VER)
+	unsigned long i;
+	_BitScanReverse64(&i, x);
+	return int(i);
+#else
+	return 63 - __builtin_clzll(x);
+#endif
+}
+
+inline int PopCount64(uint64_t x)
+{
+#if defined(_MSC_VER)
+	return int(__popcnt64(x));
+#else
+	return __builtin_popcountll(x);
+#endif
+}
+
+// Hash for the filters: 64 bits, from SpookyHash like HashKey, but seeded
+// differently so a filter's bits don't follow the bits a table indexes by
+static const uint64_t s_filterHashSeed = 0x9ae16a3b2f90404fULL;
+
+template <typename K>
+uint64_t FilterHash(const K & key) { return SpookyHash::Hash64(&key, sizeof(key), s_filterHashSeed); }
+inline uint64_t FilterHash(StrView key) { return SpookyHash::Hash64(key.data, key.size, s_filterHashSeed); }
+inline uint64_t FilterHash(const std::string & key) { return FilterHash(StrView(key)); }
+inline uint64_t FilterHash(const char * key) { return FilterHash(StrView(key)); }
+inline uint64_t FilterHash(char * key) { return FilterHash(StrView(key)); }
+
+// Two independent 64-bit hashes in one go, for filters that want one for
+// where a key goes and another for its fingerprint; h1 matches FilterHash
+template <typename K>
+void FilterHash128(const K & key, uint64_t * h1, uint64_t * h2)
+{
+	*h1 = *h2 = s_filterHashSeed;
+	SpookyHash::Hash128(&key, sizeof(key), h1, h2);
+}
+inline void FilterHash128(StrView key, uint64_t * h1, uint64_t * h2)
+{
+	*h1 = *h2 = s_filterHashSeed;
+	SpookyHash::Hash128(key.data, key.size, h1, h2);
+}
+inline void FilterHash128(const std::string & key, uint64_t * h1, uint64_t * h2) { FilterHash128(StrView(key), h1, h2); }
+inline void FilterHash128(const char * key, uint64_t * h1, uint64_t * h2) { FilterHash128(StrView(key), h1, h2); }
+inline void FilterHash128(char * key, uint64_t * h1, uint64_t * h2) { FilterHash128(StrView(key), h1, h2); }
+
+// Split-block Bloom filter (as in Impala and Parquet): each 32-byte block is
+// eight 32-bit words, and a key sets one bit in each word of one block.  The
+// low bits of the hash pick the block; the high 32, times a different odd
+// constant per word, pick the bit in each.  A check is one aligned 32-byte
+// load and one test, done as a single AVX2 op where the build targets it.
+// At 12 bits per key it gives about a 0.5% false-positive rate.
+//
+// It's sized once, by Reset, for a capacity.  Bits can't be taken back out,
+// and a Bloom filter can't be grown without the keys, so it has no Remove,
+// and going over capacity just raises the false-positive rate; whatever
+// owns it rebuilds it from the keys when either matters.
+class BlockedBloomFilter
+{
+public:
+	static const int s_wordsPerBlock = 8;
+	static const size_t s_bitsPerKeyDefault = 12;
+
+	size_t		blockCount;		// a power of two
+	size_t		capacity;		// keys it's sized for
+	size_t		size;			// Inserts since Reset
+	size_t		bitsPerKey;
+
+	explicit BlockedBloomFilter(size_t bitsPerKey_ = s_bitsPerKeyDefault)
+	:	blockCount(0),
+		capacity(0),
+		size(0),
+		bitsPerKey(bitsPerKey_),
+		iWordFirst(0)
+	{
+		Reset(0);
+	}
+
+	// Empty, with enough blocks for capacityNew keys at bitsPerKey
+	void Reset(size_t capacityNew)
+	{
+		blockCount = 1;
+		while (blockCount * s_wordsPerBlock * 32 < capacityNew * bitsPerKey)
+			blockCount *= 2;
+		capacity = blockCount * s_wordsPerBlock * 32 / bitsPerKey;
+		size = 0;
+
+		words.assign(blockCount * s_wordsPerBlock + s_wordsPerBlock - 1, 0);
+		uintptr_t p = reinterpret_cast<uintptr_t>(words.data());
+		iWordFirst = size_t(((p + 31) & ~uintptr_t(31)) - p) / sizeof(uint32_t);
+	}
+
+	void Insert(uint64_t hash)
+	{
+		uint32_t * block = &words[iWordFirst + (hash & (blockCount - 1)) * s_wordsPerBlock];
+		for (int i = 0; i < s_wordsPerBlock; ++i)
+			block[i] |= uint32_t(1) << BitFor(hash, i);
+		++size;
+	}
+
+	bool MayContain(uint64_t hash) const
+	{
+		const uint32_t * block = &words[iWordFirst + (hash & (blockCount - 1)) * s_wordsPerBlock];
+#if defined(__AVX2__)
+		__m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), _mm256_srli_epi32(_mm256_mullo_epi32(
+							_mm256_set1_epi32(int32_t(hash >> 32)),
+							_mm256_loadu_si256(reinterpret_cast<const __m256i *>(Salts()))), 27));
+		// testc is 1 when every bit of the mask is set in the block
+		return _mm256_testc_si256(_mm256_load_si256(reinterpret_cast<const __m256i *>(block)), mask) != 0;
+#else
+		uint32_t missing = 0;
+		for (int i = 0; i < s_wordsPerBlock; ++i)
+			missing |= ~block[i] & (uint32_t(1) << BitFor(hash, i));
+		return missing == 0;
+#endif
+	}
+
+	size_t Bytes() const
+	{
+		return blockCount * s_wordsPerBlock * sizeof(uint32_t);
+	}
+
+private:
+	// The blocks start at iWordFirst, where the storage is 32-byte aligned
+	std::vector<uint32_t>	words;
+	size_t					iWordFirst;
+
+	// One odd multiplier per word
+	static const uint32_t * Salts()
+	{
+		static const uint32_t s_salts[s_wordsPerBlock] =
+		{
+			0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+			0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+		};
+		return s_salts;
+	}
+
+	static uint32_t BitFor(uint64_t hash, int i)
+	{
+		return (uint32_t(hash >> 32) * Salts()[i]) >> 27;
+	}
+
+	BlockedBloomFilter(const BlockedBloomFilter &);
+	BlockedBloomFilter & operator = (const BlockedBloomFilter &);
+};
+
+// A table with a BlockedBloomFilter in front: Lookup checks the filter first
+// and only probes the table if the key may be there, so a lookup that fails
+// usually costs a hash and one cache line.  Hits pay the filter check on top
+// of the lookup, so it's worth it where most lookups miss.
+//
+// HT is any table from hash-tables.h with keys K and values V, built with
+// whatever arguments the FilteredHashTable is.  The tables can't list their
+// keys, so it keeps its own list of every key it's added to the filter.
+// When that list reaches the filter's capacity, it drops the keys the table
+// no longer has (and repeats), and rebuilds the filter from the rest, sized
+// for twice as many.  Remove leaves a key's bits set until then, which only
+// costs false positives: the filter never has more keys in it than it was
+// sized for.  The list costs sizeof(K) per key, one to two times over, but
+// Lookup never reads it.
+//
+// Reserve, Reset and ShrinkToFit pass through to the table (for tables that
+// have them); Reserve sizes the filter up front too, and Reset empties it.
+template <typename K, typename V, typename HT>
+class FilteredHashTable
+{
+public:
+	HT					table;
+	BlockedBloomFilter	filter;
+	std::vector<K>		filterKeys;		// what's in the filter, removed or not
+
+	template <typename... Args>
+	explicit FilteredHashTable(Args &&... args)
+	:	table(std::forward<Args>(args)...)
+	{
+	}
+
+	void Insert(const K & key, const V & value)
+	{
+		AddToFilter(key);
+		table.Insert(key, value);
+	}
+
+	template <typename Q>
+	V * Lookup(const Q & keyIn)
+	{
+		const typename KeyTraits<K>::Probe & key = keyIn;
+		if (!filter.MayContain(FilterHash(key)))
+			return nullptr;
+		return table.Lookup(key);
+	}
+
+	template <typename Q>
+	bool Remove(const Q & keyIn)
+	{
+		const typename KeyTraits<K>::Probe & key = keyIn;
+		if (!filter.MayContain(FilterHash(key)))
+			return false;
+		return table.Remove(key);
+	}
+
+	template <typename Q>
+	std::pair<V *, bool> FindOrInsert(const Q & keyIn)
+	{
+		const typename KeyTraits<K>::Probe & key = keyIn;
+		auto result = table.FindOrInsert(key);
+		if (result.second)
+		{
+			// A rebuild looks keys up in the table, so it has to come after;
+			// it leaves the table alone, so the pointer stays good
+			AddToFilter(KeyTraits<K>::Make(key));
+		}
+		return result;
+	}
+
+	template <typename Q>
+	bool InsertOrAssign(const Q & key, const V & value)
+	{
+		auto result = FindOrInsert(key);
+		*result.first = value;
+		return result.second;
+	}
+
+	template <typename Q, typename F>
+	bool Upsert(const Q & key, F fn)
+	{
+		auto result = FindOrInsert(key);
+		fn(*result.first);
+		return result.second;
+	}
+
+	void Reserve(size_t maxSize)
+	{
+		table.Reserve(maxSize);
+		if (filter.capacity < maxSize)
+			RebuildFilter(maxSize);
+	}
+
+	void Reset()
+	{
+		table.Reset();
+		filter.Reset(0);
+		filterKeys.clear();
+	}
+
+	void ShrinkToFit()
+	{
+		table.ShrinkToFit();
+	}
+
+private:
+	void AddToFilter(const K & key)
+	{
+		if (filterKeys.size() >= filter.capacity)
+		{
+			// Keep the keys the table still has, once each
+			std::sort(filterKeys.begin(), filterKeys.end());
+			filterKeys.erase(std::unique(filterKeys.begin(), filterKeys.end()), filterKeys.end());
+			filterKeys.erase(std::remove_if(filterKeys.begin(), filterKeys.end(),
+											[this](const K & k) { return !table.Lookup(k); }),
+							 filterKeys.end());
+			RebuildFilter(std::max(filterKeys.size() * 2, size_t(s_hashTableInitialSize)));
+		}
+		filter.Insert(FilterHash(key));
+		filterKeys.push_back(key);
+	}
+
+	void RebuildFilter(size_t capacity)
+	{
+		filter.Reset(capacity);
+		for (size_t i = 0, iEnd = filterKeys.size(); i < iEnd; ++i)
+			filter.Insert(FilterHash(filterKeys[i]));
+	}
+};
+
+// Cuckoo filter (Fan et al., "Cuckoo Filter: Practically Better Than
+// Bloom"): a cuckoo hash table of 4-slot buckets holding only a fingerprint
+// of each key, F's worth of bits, with 0 meaning an empty slot.  A key can
+// be in one of two buckets: its first from the low half of a 128-bit hash,
+// and that one xor a hash of the fingerprint, so either bucket can be found
+// from the other and the fingerprint alone.  That's what lets Insert evict a
+// fingerprint to its other bucket without the key, and lets Merge move
+// another filter's fingerprints over bucket by bucket.
+//
+// Lookups read two buckets, 4 bytes each for 8-bit fingerprints.  The
+// false-positive rate is about 8 / 2^bits, so 3% at 8 bits, 0.01% at 16; sized
+// at 95% load, which is about as full as 4-slot buckets get, that's a bit
+// over 8 bits per key.  When 500 evictions in a row don't find a free slot,
+// the last fingerprint moved is kept aside, and Insert fails from then on.
+//
+// A key inserted twice is in twice, and Remove takes out one; but all its
+// copies share its two buckets, so more than a couple of copies of many keys
+// fill it well short of its capacity.  Removing a key that was never
+// inserted can take out another key's matching fingerprint, so only remove
+// keys known to be in.
+template <typename F = uint8_t>
+class CuckooFilter
+{
+public:
+	static_assert(std::is_unsigned<F>::value, "CuckooFilter fingerprints are unsigned integers");
+
+	static const int s_bucketSlots = 4;
+	static const int s_kicksMax = 500;
+
+	size_t		bucketCount;	// a power of two
+	size_t		size;
+
+	explicit CuckooFilter(size_t capacity = 0)
+	{
+		Reset(capacity);
+	}
+
+	// Empty, with enough buckets for capacity keys at 95% load
+	void Reset(size_t capacity)
+	{
+		bucketCount = 1;
+		while (bucketCount * s_bucketSlots * 19 < capacity * 20)
+			bucketCount *= 2;
+		size = 0;
+		slots.assign(bucketCount * s_bucketSlots, F(0));
+		victim.used = false;
+		rngState = 0x2545f491;
+	}
+
+	// False if it's full
+	template <typename Q>
+	bool Insert(const Q & key)
+	{
+		size_t iBucket;
+		F fingerprint;
+		Locate(key, &iBucket, &fingerprint);
+		return InsertAt(iBucket, fingerprint);
+	}
+
+	template <typename Q>
+	bool MayContain(const Q & key) const
+	{
+		size_t iBucket;
+		F fingerprint;
+		Locate(key, &iBucket, &fingerprint);
+		size_t iBucketAlt = AltBucket(iBucket, fingerprint);
+		return BucketHas(iBucket, fingerprint) || BucketHas(iBucketAlt, fingerprint) ||
+			   (victim.used && victim.fingerprint == fingerprint &&
+				(victim.iBucket == iBucket || victim.iBucket == iBucketAlt));
+	}
+
+	// Takes out one copy of the key's fingerprint; false if there's none
+	template <typename Q>
+	bool Remove(const Q & key)
+	{
+		size_t iBucket;
+		F fingerprint;
+		Locate(key, &iBucket, &fingerprint);
+		size_t iBucketAlt = AltBucket(iBucket, fingerprint);
+		if (victim.used && victim.fingerprint == fingerprint &&
+			(victim.iBucket == iBucket || victim.iBucket == iBucketAlt))
+		{
+			victim.used = false;
+			--size;
+			return true;
+		}
+		if (!RemoveFrom(iBucket, fingerprint) && !RemoveFrom(iBucketAlt, fingerprint))
+			return false;
+		--size;
+
+		// There's room now for whatever was kept aside
+		if (victim.used)
+		{
+			victim.used = false;
+			--size;
+			InsertAt(victim.iBucket, victim.fingerprint);
+		}
+		return true;
+	}
+
+	// Adds every fingerprint in other, which must have the same bucket
+	// count; false if this fills up partway through
+	bool Merge(const CuckooFilter & other)
+	{
+		assert(other.bucketCount == bucketCount);
+		for (size_t i = 0, iEnd = other.slots.size(); i < iEnd; ++i)
+		{
+			if (other.slots[i] != 0 && !InsertAt(i / s_bucketSlots, other.slots[i]))
+				return false;
+		}
+		return !other.victim.used || InsertAt(other.victim.iBucket, other.victim.fingerprint);
+	}
+
+	size_t Bytes() const
+	{
+		return slots.size() * sizeof(F);
+	}
+
+private:
+	struct Victim
+	{
+		size_t		iBucket;
+		F			fingerprint;
+		bool		used;
+	};
+
+	std::vector<F>	slots;			// s_bucketSlots per bucket
+	Victim			victim;
+	uint32_t		rngState;		// picks what to evict
+
+	template <typename Q>
+	void Locate(const Q & key, size_t * pBucket, F * pFingerprint) const
+	{
+		uint64_t h1, h2;
+		FilterHash128(key, &h1, &h2);
+		F fingerprint = F(h2);
+		*pFingerprint = fingerprint ? fingerprint : F(1);
+		*pBucket = size_t(h1) & (bucketCount - 1);
+	}
+
+	size_t AltBucket(size_t iBucket, F fingerprint) const
+	{
+		// MurmurHash2's multiplier spreads the fingerprint's bits; the low
+		// bit is forced on so the two buckets always differ
+		return (iBucket ^ (size_t(uint64_t(fingerprint) * 0x5bd1e995U) | 1)) & (bucketCount - 1);
+	}
+
+	bool BucketHas(size_t iBucket, F fingerprint) const
+	{
+		const F * bucket = &slots[iBucket * s_bucketSlots];
+		return (bucket[0] == fingerprint) | (bucket[1] == fingerprint) |
+			   (bucket[2] == fingerprint) | (bucket[3] == fingerprint);
+	}
+
+	bool AddTo(size_t iBucket, F fingerprint)
+	{
+		F * bucket = &slots[iBucket * s_bucketSlots];
+		for (int i = 0; i < s_bucketSlots; ++i)
+		{
+			if (bucket[i] == 0)
+			{
+				bucket[i] = fingerprint;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool RemoveFrom(size_t iBucket, F fingerprint)
+	{
+		F * bucket = &slots[iBucket * s_bucketSlots];
+		for (int i = 0; i < s_bucketSlots; ++i)
+		{
+			if (bucket[i] == fingerprint)
+			{
+				bucket[i] = 0;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool InsertAt(size_t iBucket, F fingerprint)
+	{
+		if (victim.used)
+			return false;
+		++size;
+		if (AddTo(iBucket, fingerprint) || AddTo(AltBucket(iBucket, fingerprint), fingerprint))
+			return true;
+
+		// Both full: evict a random fingerprint to its other bucket, and so
+		// on, until one lands in a free slot
+		for (int kick = 0; kick < s_kicksMax; ++kick)
+		{
+			rngState ^= rngState << 13;
+			rngState ^= rngState >> 17;
+			rngState ^= rngState << 5;
+			if (rngState & 0x100)
+				iBucket = AltBucket(iBucket, fingerprint);
+			std::swap(fingerprint, slots[iBucket * s_bucketSlots + (rngState & (s_bucketSlots - 1))]);
+			iBucket = AltBucket(iBucket, fingerprint);
+			if (AddTo(iBucket, fingerprint))
+				return true;
+		}
+		victim.iBucket = iBucket;
+		victim.fingerprint = fingerprint;
+		victim.used = true;
+		return true;
+	}
+};
+
+// Quotient filter (Bender et al., "Don't Thrash: How to Cache Your Hash on
+// Flash"), used as a multiset, like the counting quotient filter of Pandey et
+// al.  The top bits of a key's 64-bit hash are its quotient, which picks a
+// home slot; the next sizeof(R) * 8 bits are its remainder, which is all
+// that's stored.  Remainders with the same quotient sit together in a run,
+// runs sit in quotient order, and a run pushed past its home slot by the
+// runs before it is marked as shifted; three bits per slot say which slots
+// have a run, which continue a run, and which are shifted, and from those a
+// lookup finds its run by walking back to the start of the cluster.
+//
+// That costs sizeof(R) * 8 + 3 bits per slot; sized at 95% load, about 11.6
+// bits per key for 8-bit remainders, with a false-positive rate just under
+// 1 / 2^bits (0.4% for 8 bits).  Runs and clusters get long as it fills, so
+// lookups slow down well before it's full; Insert fails at 95%.
+//
+// Each copy of a key takes its own slot, so Count is exact except for false
+// positives, and Remove takes out one copy.  This is where the real CQF
+// saves space, encoding counts in the slots after a remainder; a key added
+// thousands of times is better kept in a table.  Merge adds another filter
+// with the same quotient size, decoding its slots back to fingerprints.
+template <typename R = uint8_t>
+class CountingQuotientFilter
+{
+public:
+	static_assert(std::is_unsigned<R>::value && sizeof(R) <= 4, "CountingQuotientFilter remainders are unsigned integers");
+
+	static const int s_remainderBits = int(sizeof(R) * 8);
+
+	int			quotientBits;
+	size_t		slotCount;		// 2^quotientBits
+	size_t		size;
+
+	explicit CountingQuotientFilter(size_t capacity = 0)
+	{
+		Reset(capacity);
+	}
+
+	// Empty, with enough slots for capacity keys at 95% load
+	void Reset(size_t capacity)
+	{
+		quotientBits = 6;
+		while ((size_t(1) << quotientBits) * 19 < capacity * 20)
+			++quotientBits;
+		slotCount = size_t(1) << quotientBits;
+		size = 0;
+		remainders.assign(slotCount, R(0));
+		occupieds.assign(slotCount / 64, 0);
+		continuations.assign(slotCount / 64, 0);
+		shifteds.assign(slotCount / 64, 0);
+	}
+
+	// False if it's full
+	template <typename Q>
+	bool Insert(const Q & key)
+	{
+		size_t quotient;
+		R remainder;
+		Split(FilterHash(key), &quotient, &remainder);
+		return InsertSplit(quotient, remainder);
+	}
+
+	template <typename Q>
+	bool MayContain(const Q & key) const
+	{
+		size_t quotient;
+		R remainder;
+		Split(FilterHash(key), &quotient, &remainder);
+		if (!GetBit(occupieds, quotient))
+			return false;
+		size_t i = RunStart(quotient);
+		do
+		{
+			if (remainders[i] == remainder)
+				return true;
+			i = Next(i);
+		}
+		while (GetBit(continuations, i));
+		return false;
+	}
+
+	// Copies of the key (or of others with the same fingerprint)
+	template <typename Q>
+	size_t Count(const Q & key) const
+	{
+		size_t quotient;
+		R remainder;
+		Split(FilterHash(key), &quotient, &remainder);
+		if (!GetBit(occupieds, quotient))
+			return 0;
+		size_t count = 0;
+		size_t i = RunStart(quotient);
+		do
+		{
+			count += (remainders[i] == remainder);
+			i = Next(i);
+		}
+		while (GetBit(continuations, i));
+		return count;
+	}
+
+	// Takes out one copy of the key's fingerprint; false if there's none
+	template <typename Q>
+	bool Remove(const Q & key)
+	{
+		size_t quotient;
+		R remainder;
+		Split(FilterHash(key), &quotient, &remainder);
+		if (!GetBit(occupieds, quotient))
+			return false;
+		size_t i = RunStart(quotient);
+		while (remainders[i] != remainder)
+		{
+			i = Next(i);
+			if (!GetBit(continuations, i))
+				return false;
+		}
+		RemoveSlot(i, quotient);
+		--size;
+		return true;
+	}
+
+	// Adds every fingerprint in other, which must have the same quotient
+	// size; false if this fills up partway through
+	bool Merge(const CountingQuotientFilter & other)
+	{
+		assert(other.quotientBits == quotientBits);
+		if (other.size == 0)
+			return true;
+
+		// Start just after an empty slot, which is where a cluster starts,
+		// and follow the quotient along as the runs go by
+		size_t iStart = 0;
+		while (!other.IsEmpty(iStart))
+			++iStart;
+		size_t quotient = 0;
+		for (size_t n = 0, i = Next(iStart); n < slotCount; ++n, i = Next(i))
+		{
+			if (other.IsEmpty(i))
+				continue;
+			if (!GetBit(other.shifteds, i))
+				quotient = i;
+			else if (!GetBit(other.continuations, i))
+			{
+				do
+					quotient = Next(quotient);
+				while (!GetBit(other.occupieds, quotient));
+			}
+			if (!InsertSplit(quotient, other.remainders[i]))
+				return false;
+		}
+		return true;
+	}
+
+	size_t Bytes() const
+	{
+		return remainders.size() * sizeof(R) + (occupieds.size() + continuations.size() + shifteds.size()) * sizeof(uint64_t);
+	}
+
+private:
+	std::vector<R>			remainders;
+	std::vector<uint64_t>	occupieds;		// slot's quotient has a run
+	std::vector<uint64_t>	continuations;	// slot continues the run before it
+	std::vector<uint64_t>	shifteds;		// slot's remainder isn't in its home slot
+
+	static bool GetBit(const std::vector<uint64_t> & bits, size_t i)
+	{
+		return (bits[i / 64] >> (i % 64)) & 1;
+	}
+	static void SetBit(std::vector<uint64_t> & bits, size_t i, bool value)
+	{
+		bits[i / 64] = (bits[i / 64] & ~(uint64_t(1) << (i % 64))) | (uint64_t(value) << (i % 64));
+	}
+
+	size_t Next(size_t i) const		{ return (i + 1) & (slotCount - 1); }
+	size_t Prev(size_t i) const		{ return (i - 1) & (slotCount - 1); }
+
+	bool IsEmpty(size_t i) const
+	{
+		return !GetBit(occupieds, i) && !GetBit(continuations, i) && !GetBit(shifteds, i);
+	}
+
+	void Split(uint64_t hash, size_t * pQuotient, R * pRemainder) const
+	{
+		*pQuotient = size_t(hash >> (64 - quotientBits));
+		*pRemainder = R(hash >> (64 - quotientBits - s_remainderBits));
+	}
+
+	// Where the run for quotient starts, or would go if it has none (as long
+	// as its occupied bit is set).  Back from the quotient, the first slot
+	// that isn't shifted starts the cluster; each quotient from there to
+	// this one with its occupied bit set has a run, and each run starts at
+	// a slot that isn't a continuation, so this run starts at the nth such
+	// slot, for n quotients.  That's a count and a select over the bits, a
+	// word at a time, rather than a walk over the slots.
+	size_t RunStart(size_t quotient) const
+	{
+		size_t iCluster = PrevZero(shifteds, quotient);
+		return SelectZero(continuations, iCluster, CountOnes(occupieds, iCluster, quotient));
+	}
+
+	// The nearest slot at or before i whose bit is 0
+	size_t PrevZero(const std::vector<uint64_t> & bits, size_t i) const
+	{
+		size_t iWord = i / 64;
+		uint64_t zeros = ~bits[iWord] & (~uint64_t(0) >> (63 - i % 64));
+		while (!zeros)
+		{
+			iWord = (iWord == 0) ? bits.size() - 1 : iWord - 1;
+			zeros = ~bits[iWord];
+		}
+		return iWord * 64 + size_t(HighestSetBit64(zeros));
+	}
+
+	// Bits set from iFirst to iLast inclusive, wrapping around the end
+	size_t CountOnes(const std::vector<uint64_t> & bits, size_t iFirst, size_t iLast) const
+	{
+		if (iFirst > iLast)
+			return CountOnes(bits, iFirst, slotCount - 1) + CountOnes(bits, 0, iLast);
+		size_t iWordFirst = iFirst / 64, iWordLast = iLast / 64;
+		uint64_t maskFirst = ~uint64_t(0) << (iFirst % 64);
+		uint64_t maskLast = ~uint64_t(0) >> (63 - iLast % 64);
+		if (iWordFirst == iWordLast)
+			return size_t(PopCount64(bits[iWordFirst] & maskFirst & maskLast));
+		size_t count = size_t(PopCount64(bits[iWordFirst] & maskFirst)) + size_t(PopCount64(bits[iWordLast] & maskLast));
+		for (size_t iWord = iWordFirst + 1; iWord < iWordLast; ++iWord)
+			count += size_t(PopCount64(bits[iWord]));
+		return count;
+	}
+
+	// The nth (from 1) slot from iFirst on whose bit is 0, wrapping around
+	size_t SelectZero(const std::vector<uint64_t> & bits, size_t iFirst, size_t n) const
+	{
+		size_t iWord = iFirst / 64;
+		uint64_t zeros = ~bits[iWord] & (~uint64_t(0) << (iFirst % 64));
+		for (;;)
+		{
+			size_t count = size_t(PopCount64(zeros));
+			if (count >= n)
+				break;
+			n -= count;
+			iWord = (iWord + 1 == bits.size()) ? 0 : iWord + 1;
+			zeros = ~bits[iWord];
+		}
+		for (; n > 1; --n)
+			zeros &= zeros - 1;
+		return iWord * 64 + size_t(LowestSetBit64(zeros));
+	}
+
+	bool InsertSplit(size_t quotient, R remainder)
+	{
+		if (size >= slotCount - slotCount / 20)
+			return false;
+		++size;
+
+		if (IsEmpty(quotient))
+		{
+			SetBit(occupieds, quotient, true);
+			remainders[quotient] = remainder;
+			return true;
+		}
+
+		// Add to the end of the quotient's run, or start one where it goes
+		bool hadRun = GetBit(occupieds, quotient);
+		SetBit(occupieds, quotient, true);
+		size_t i = RunStart(quotient);
+		if (hadRun)
+		{
+			do
+				i = Next(i);
+			while (GetBit(continuations, i));
+		}
+
+		// Put it there, and move everything from there to the next empty
+		// slot along by one; occupied bits belong to slots, so they stay
+		R carryRemainder = remainder;
+		bool carryContinuation = hadRun;
+		bool carryShifted = (i != quotient);
+		while (!IsEmpty(i))
+		{
+			std::swap(carryRemainder, remainders[i]);
+			bool continuation = GetBit(continuations, i);
+			SetBit(continuations, i, carryContinuation);
+			SetBit(shifteds, i, carryShifted);
+			carryContinuation = continuation;
+			carryShifted = true;
+			i = Next(i);
+		}
+		remainders[i] = carryRemainder;
+		SetBit(continuations, i, carryContinuation);
+		SetBit(shifteds, i, carryShifted);
+		return true;
+	}
+
+	void RemoveSlot(size_t iSlot, size_t quotient)
+	{
+		// The quotient's run loses its only remainder, or its first one,
+		// whose successor starts the run from now on
+		bool runStart = !GetBit(continuations, iSlot);
+		if (runStart && !GetBit(continuations, Next(iSlot)))
+			SetBit(occupieds, quotient, false);
+
+		// Move the rest of the cluster back by one, up to the first slot
+		// that's empty or in its home slot, following the quotient along
+		size_t i = iSlot;
+		for (;;)
+		{
+			size_t iNext = Next(i);
+			if (IsEmpty(iNext) || !GetBit(shifteds, iNext))
+				break;
+			bool continuation = GetBit(continuations, iNext);
+			if (!continuation)
+			{
+				do
+					quotient = Next(quotient);
+				while (!GetBit(occupieds, quotient));
+			}
+			remainders[i] = remainders[iNext];
+			SetBit(continuations, i, continuation && !(i == iSlot && runStart));
+			SetBit(shifteds, i, i != quotient);
+			i = iNext;
+		}
+		remainders[i] = R(0);
+		SetBit(continuations, i, false);
+		SetBit(shifteds, i, false);
+	}
+};
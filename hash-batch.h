@@ -0,0 +1,179 @@
+#pragma once
+
+// Batch hashing: HashKey over an array of keys at once, for the batch lookup
+// and insert paths.  For 4- and 8-byte integer keys, HashKey is SpookyHash's
+// short-message path, which for a key that size boils down to a dozen 64-bit
+// add/xor/rotate steps with no branches, so several keys can go through them
+// side by side in SIMD lanes.  The kernels below do exactly the steps
+// SpookyHash::Short does, so they give exactly the hashes HashKey does, and a
+// table can mix batched and one-at-a-time calls freely.
+//
+// The widest kernel the build targets is used: AVX-512 (8 keys per vector)
+// if __AVX512F__ is defined, else AVX2 (4 keys per vector), else plain scalar
+// code.  Each kernel keeps two vectors in flight, so 16 or 8 keys at a time.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+// Included from hash-tables.h, after HashKey
+
+// How many keys the table batch paths hash before probing for them
+static const size_t s_hashBatchBlock = 64;
+
+// The lane types: each has a vector type T of s_count 64-bit lanes and the
+// few operations the hash needs
+struct HashLanesScalar
+{
+	typedef uint64_t T;
+	static const int s_count = 1;
+	static const char * Name() { return "scalar"; }
+
+	static T Set(uint64_t x) { return x; }
+	static T Add(T a, T b) { return a + b; }
+	static T Xor(T a, T b) { return a ^ b; }
+	template <int k> static T Rot(T x) { return (x << k) | (x >> (64 - k)); }
+	static T Load32(const void * p) { uint32_t x; memcpy(&x, p, sizeof(x)); return x; }
+	static T Load64(const void * p) { uint64_t x; memcpy(&x, p, sizeof(x)); return x; }
+	static void Store(T x, uint32_t mask, uint32_t * out) { *out = uint32_t(x) & mask; }
+};
+
+#if defined(__AVX2__)
+struct HashLanesAVX2
+{
+	typedef __m256i T;
+	static const int s_count = 4;
+	static const char * Name() { return "AVX2"; }
+
+	static T Set(uint64_t x) { return _mm256_set1_epi64x(int64_t(x)); }
+	static T Add(T a, T b) { return _mm256_add_epi64(a, b); }
+	static T Xor(T a, T b) { return _mm256_xor_si256(a, b); }
+	// No 64-bit rotate before AVX-512, so it's two shifts
+	template <int k> static T Rot(T x) { return _mm256_or_si256(_mm256_slli_epi64(x, k), _mm256_srli_epi64(x, 64 - k)); }
+	static T Load32(const void * p) { return _mm256_cvtepu32_epi64(_mm_loadu_si128(static_cast<const __m128i *>(p))); }
+	static T Load64(const void * p) { return _mm256_loadu_si256(static_cast<const __m256i *>(p)); }
+	static void Store(T x, uint32_t mask, uint32_t * out)
+	{
+		// Gather the low halves of the lanes into the bottom 128 bits
+		__m256i low = _mm256_permutevar8x32_epi32(x, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6));
+		__m128i hashes = _mm_and_si128(_mm256_castsi256_si128(low), _mm_set1_epi32(int32_t(mask)));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out), hashes);
+	}
+};
+#endif
+
+#if defined(__AVX512F__)
+struct HashLanesAVX512
+{
+	typedef __m512i T;
+	static const int s_count = 8;
+	static const char * Name() { return "AVX-512"; }
+
+	static T Set(uint64_t x) { return _mm512_set1_epi64(int64_t(x)); }
+	static T Add(T a, T b) { return _mm512_add_epi64(a, b); }
+	static T Xor(T a, T b) { return _mm512_xor_si512(a, b); }
+	template <int k> static T Rot(T x) { return _mm512_rol_epi64(x, k); }
+	static T Load32(const void * p) { return _mm512_cvtepu32_epi64(_mm256_loadu_si256(static_cast<const __m256i *>(p))); }
+	static T Load64(const void * p) { return _mm512_loadu_si512(p); }
+	static void Store(T x, uint32_t mask, uint32_t * out)
+	{
+		__m256i hashes = _mm256_and_si256(_mm512_cvtepi64_epi32(x), _mm256_set1_epi32(int32_t(mask)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(out), hashes);
+	}
+};
+typedef HashLanesAVX512 HashLanesBest;
+#elif defined(__AVX2__)
+typedef HashLanesAVX2 HashLanesBest;
+#else
+typedef HashLanesScalar HashLanesBest;
+#endif
+
+// SpookyHash::Short for one 4- or 8-byte key per lane, with a seed of zero:
+// a and b start at the seed, c and d at Spooky's constant; the key is added
+// to c and the length to the top byte of d; then ShortEnd.  The hash is the
+// low 32 bits of a, as in SpookyHash::Hash32.
+template <typename Lanes, int KeyBytes>
+inline void HashLanesOne(const void * key, uint32_t mask, uint32_t * out)
+{
+	typedef typename Lanes::T T;
+	static const uint64_t s_spookyConst = 0xdeadbeefdeadbeefULL;
+
+	T h0 = Lanes::Set(0);
+	T h1 = Lanes::Set(0);
+	T h2 = Lanes::Add(Lanes::Set(s_spookyConst), (KeyBytes == 4) ? Lanes::Load32(key) : Lanes::Load64(key));
+	T h3 = Lanes::Set(s_spookyConst + (uint64_t(KeyBytes) << 56));
+
+	// SpookyHash::ShortEnd
+	h3 = Lanes::Xor(h3, h2);  h2 = Lanes::template Rot<15>(h2);  h3 = Lanes::Add(h3, h2);
+	h0 = Lanes::Xor(h0, h3);  h3 = Lanes::template Rot<52>(h3);  h0 = Lanes::Add(h0, h3);
+	h1 = Lanes::Xor(h1, h0);  h0 = Lanes::template Rot<26>(h0);  h1 = Lanes::Add(h1, h0);
+	h2 = Lanes::Xor(h2, h1);  h1 = Lanes::template Rot<51>(h1);  h2 = Lanes::Add(h2, h1);
+	h3 = Lanes::Xor(h3, h2);  h2 = Lanes::template Rot<28>(h2);  h3 = Lanes::Add(h3, h2);
+	h0 = Lanes::Xor(h0, h3);  h3 = Lanes::template Rot<9>(h3);   h0 = Lanes::Add(h0, h3);
+	h1 = Lanes::Xor(h1, h0);  h0 = Lanes::template Rot<47>(h0);  h1 = Lanes::Add(h1, h0);
+	h2 = Lanes::Xor(h2, h1);  h1 = Lanes::template Rot<54>(h1);  h2 = Lanes::Add(h2, h1);
+	h3 = Lanes::Xor(h3, h2);  h2 = Lanes::template Rot<32>(h2);  h3 = Lanes::Add(h3, h2);
+	h0 = Lanes::Xor(h0, h3);  h3 = Lanes::template Rot<25>(h3);  h0 = Lanes::Add(h0, h3);
+	// (the last step of ShortEnd, h1 ^= h0 etc., rotates h0 by 63 after it's
+	// final; h1 isn't needed)
+	h0 = Lanes::template Rot<63>(h0);
+
+	Lanes::Store(h0, mask, out);
+}
+
+// Hashes count keys of KeyBytes bytes each with the given kernel, writing
+// HashKey(keys[i]) & mask to out[i]; the keys left over after the last full
+// vector go through the scalar kernel
+template <typename Lanes, int KeyBytes>
+inline void HashKeysLanes(const void * keys, size_t count, uint32_t * out, uint32_t mask)
+{
+	const char * p = static_cast<const char *>(keys);
+	const size_t n = Lanes::s_count;
+	size_t i = 0;
+	// Two vectors at a time: their dependency chains are independent, so the
+	// second can fill the latency of the first
+	for (; i + 2 * n <= count; i += 2 * n)
+	{
+		HashLanesOne<Lanes, KeyBytes>(p + i * KeyBytes, mask, out + i);
+		HashLanesOne<Lanes, KeyBytes>(p + (i + n) * KeyBytes, mask, out + i + n);
+	}
+	for (; i + n <= count; i += n)
+		HashLanesOne<Lanes, KeyBytes>(p + i * KeyBytes, mask, out + i);
+	for (; i < count; ++i)
+		HashLanesOne<HashLanesScalar, KeyBytes>(p + i * KeyBytes, mask, out + i);
+}
+
+// Which kernel a key type can use: its size for 4- and 8-byte integers, or 0
+// to fall back to calling HashKey on each key
+template <typename K>
+struct HashBatchKeyBytes : std::integral_constant<int,
+	(std::is_integral<K>::value && (sizeof(K) == 4 || sizeof(K) == 8)) ? int(sizeof(K)) : 0>
+{
+};
+
+template <typename K, int KeyBytes>
+inline void HashKeysBatch(const K * keys, size_t count, uint32_t * hashes, uint32_t mask, std::integral_constant<int, KeyBytes>)
+{
+	HashKeysLanes<HashLanesBest, KeyBytes>(keys, count, hashes, mask);
+}
+
+template <typename K>
+inline void HashKeysBatch(const K * keys, size_t count, uint32_t * hashes, uint32_t mask, std::integral_constant<int, 0>)
+{
+	for (size_t i = 0; i < count; ++i)
+		hashes[i] = HashKey(keys[i]) & mask;
+}
+
+// Writes HashKey(keys[i]) & mask to hashes[i] for each of count keys.  With
+// a mask of the bucket count minus one (for a power-of-two table), that's the
+// keys' starting bucket indices.
+template <typename K>
+inline void HashKeysBatch(const K * keys, size_t count, uint32_t * hashes, uint32_t mask = 0xffffffffU)
+{
+	HashKeysBatch(keys, count, hashes, mask, HashBatchKeyBytes<K>());
+}
@@ -0,0 +1,320 @@
+#pragma once
+
+// Hash quality measurements: how evenly a hash function, together with the
+// way a table turns hashes into bucket indices, spreads a set of keys.  A
+// weak combination shows up here as lopsided bucket counts and long chains
+// or probe sequences, before it shows up as slow lookups.
+//
+// Nothing here touches the tables themselves: the keys are hashed, then
+// dropped into simulated buckets laid out the way each family of engines
+// lays them out:
+//   chained    C0, C1, D0 (and unordered_map): one bucket per key
+//   linear     OL, DO1, DO2, D1: open addressing, at most 2/3 full
+//   quadratic  OQ: as linear, with OQ's triangular probe sequence
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+#include "hash-tables.h"
+
+// Hash functions to compare.  Spooky is what the tables use; the others are
+// common cheap alternatives, there to show what the measurements catch.
+struct HashPolicySpooky
+{
+	static const char * Name() { return "Spooky"; }
+	uint32_t operator() (uint32_t key) const { return HashKey(key); }
+};
+
+// What std::hash gives for integers on most standard libraries
+struct HashPolicyIdentity
+{
+	static const char * Name() { return "identity"; }
+	uint32_t operator() (uint32_t key) const { return key; }
+};
+
+// Knuth's multiplicative hash: the good bits are at the top
+struct HashPolicyFibonacci
+{
+	static const char * Name() { return "Fibonacci"; }
+	uint32_t operator() (uint32_t key) const { return key * 0x9e3779b9U; }
+};
+
+// MurmurHash3's 32-bit finalizer
+struct HashPolicyMurmurMix
+{
+	static const char * Name() { return "Murmur fmix32"; }
+	uint32_t operator() (uint32_t key) const
+	{
+		key ^= key >> 16;
+		key *= 0x85ebca6bU;
+		key ^= key >> 13;
+		key *= 0xc2b2ae35U;
+		key ^= key >> 16;
+		return key;
+	}
+};
+
+// Ways of turning a hash into a bucket index
+enum BUCKETINDEX
+{
+	BUCKETINDEX_Mask,			// hash & (n - 1), n a power of two: what the tables do
+	BUCKETINDEX_Mod,			// hash % n, n prime
+	BUCKETINDEX_Fastrange,		// (hash * n) >> 32, n a power of two: uses the top bits
+	BUCKETINDEX_Count,
+};
+
+inline const char * BucketIndexName(BUCKETINDEX bucketIndex)
+{
+	static const char * s_names[] = { "& (n-1)", "% prime", "fastrange" };
+	return s_names[bucketIndex];
+}
+
+// Bucket count for at least minBuckets: the next power of two, as the tables
+// would size it, or for BUCKETINDEX_Mod the next prime after that, so every
+// index method sees (almost) the same load
+inline size_t HashQualityBucketCount(BUCKETINDEX bucketIndex, size_t minBuckets)
+{
+	size_t n = 1;
+	while (n < minBuckets)
+		n *= 2;
+	if (bucketIndex != BUCKETINDEX_Mod)
+		return n;
+	for (; ; ++n)
+	{
+		bool prime = true;
+		for (size_t d = 2; d * d <= n && prime; ++d)
+			prime = (n % d != 0);
+		if (prime)
+			return n;
+	}
+}
+
+inline size_t HashQualityBucket(BUCKETINDEX bucketIndex, uint32_t hash, size_t bucketCount)
+{
+	switch (bucketIndex)
+	{
+	case BUCKETINDEX_Mod:
+		return hash % bucketCount;
+	case BUCKETINDEX_Fastrange:
+		return size_t((uint64_t(hash) * bucketCount) >> 32);
+	default:
+		return hash & (bucketCount - 1);
+	}
+}
+
+// Key sets to hash.  All are distinct 32-bit keys; the structured ones are
+// the kind real IDs and addresses tend to have.
+enum KEYDIST
+{
+	KEYDIST_Sequential,		// 0, 1, 2, ...
+	KEYDIST_Random,			// xorshift sequence
+	KEYDIST_Stride4K,		// multiples of 4096, like page-aligned addresses
+	KEYDIST_HighBits,		// bit-reversed sequential: only the top bits vary
+	KEYDIST_Count,
+};
+
+inline const char * KeyDistName(KEYDIST dist)
+{
+	static const char * s_names[] = { "sequential", "random", "stride 4K", "high bits" };
+	return s_names[dist];
+}
+
+inline void MakeKeyDist(KEYDIST dist, size_t numKeys, std::vector<uint32_t> & keys)
+{
+	keys.resize(numKeys);
+	uint32_t state = 0x2545f491;
+	for (size_t i = 0; i < numKeys; ++i)
+	{
+		uint32_t key = uint32_t(i);
+		switch (dist)
+		{
+		case KEYDIST_Random:
+			// Xorshift never repeats a state within its period, so no duplicates
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			key = state;
+			break;
+		case KEYDIST_Stride4K:
+			key = uint32_t(i) << 12;
+			break;
+		case KEYDIST_HighBits:
+			key = 0;
+			for (int bit = 0; bit < 32; ++bit)
+				key |= ((uint32_t(i) >> bit) & 1) << (31 - bit);
+			break;
+		default:
+			break;
+		}
+		keys[i] = key;
+	}
+}
+
+// Chain length histogram buckets, like dict.cpp's DICT_STATS_VECTLEN; the
+// last one counts everything at least that long
+static const int s_chainHistogramLength = 6;
+
+struct HashQualityStats
+{
+	// Chained, n keys in about n buckets
+	double	chiSquareZ;			// bucket occupancy chi-square, as standard deviations from what a random hash would give
+	size_t	bucketCollisions;	// keys that landed in an occupied bucket
+	int		maxChain;
+	size_t	chainHistogram[s_chainHistogramLength];	// buckets with each chain length
+	// Open addressing, at most 2/3 full; probe lengths count the buckets
+	// looked at to insert each key (so 1 is a direct hit), up to
+	// s_hashQualityProbeCap
+	int		maxProbeLinear;
+	double	avgProbeLinear;
+	int		maxProbeQuadratic;	// -1 if the bucket count isn't a power of two
+	double	avgProbeQuadratic;
+	// Independent of the bucket index
+	size_t	hashCollisions;		// keys whose full 32-bit hash equals an earlier key's
+};
+
+// Inserts the hashes one by one into an open-addressed table of bucketCount
+// buckets, probing linearly or with OQHashTable's triangular sequence (which
+// needs a power-of-two bucket count), and reports the longest and average
+// probe.  A hash bad enough to need s_hashQualityProbeCap probes for some key
+// would take quadratic time to finish, so the run stops there, and the cap is
+// reported as the longest probe.
+static const int s_hashQualityProbeCap = 1024;
+
+inline void SimulateProbing(
+	const std::vector<uint32_t> & hashes,
+	BUCKETINDEX bucketIndex,
+	size_t bucketCount,
+	bool quadratic,
+	int * pMaxProbe,
+	double * pAvgProbe)
+{
+	std::vector<uint8_t> filled(bucketCount, 0);
+	size_t probesTotal = 0;
+	size_t numInserted = 0;
+	int maxProbe = 0;
+	for (size_t i = 0, iEnd = hashes.size(); i < iEnd; ++i)
+	{
+		size_t iBucketStart = HashQualityBucket(bucketIndex, hashes[i], bucketCount);
+		size_t probe = iBucketStart;
+		int probes = 1;
+		while (filled[probe] && probes < s_hashQualityProbeCap)
+		{
+			probe = quadratic ?
+						(iBucketStart + (size_t(probes) + size_t(probes) * probes) / 2) & (bucketCount - 1) :
+						(probe + 1 == bucketCount) ? 0 : probe + 1;
+			++probes;
+		}
+		maxProbe = std::max(maxProbe, probes);
+		if (filled[probe])
+			break;
+		filled[probe] = 1;
+		probesTotal += probes;
+		++numInserted;
+	}
+	*pMaxProbe = maxProbe;
+	*pAvgProbe = numInserted ? double(probesTotal) / double(numInserted) : 0.0;
+}
+
+inline void MeasureHashQuality(const std::vector<uint32_t> & hashes, BUCKETINDEX bucketIndex, HashQualityStats & stats)
+{
+	const size_t numKeys = hashes.size();
+
+	// Chained
+	{
+		size_t bucketCount = HashQualityBucketCount(bucketIndex, numKeys);
+		std::vector<uint32_t> chainLengths(bucketCount, 0);
+		for (size_t i = 0; i < numKeys; ++i)
+			++chainLengths[HashQualityBucket(bucketIndex, hashes[i], bucketCount)];
+
+		double expected = double(numKeys) / double(bucketCount);
+		double chiSquare = 0.0;
+		stats.maxChain = 0;
+		std::fill(stats.chainHistogram, stats.chainHistogram + s_chainHistogramLength, size_t(0));
+		for (size_t i = 0; i < bucketCount; ++i)
+		{
+			double delta = double(chainLengths[i]) - expected;
+			chiSquare += delta * delta / expected;
+			stats.maxChain = std::max(stats.maxChain, int(chainLengths[i]));
+			++stats.chainHistogram[std::min(int(chainLengths[i]), s_chainHistogramLength - 1)];
+		}
+		double dof = double(bucketCount - 1);
+		stats.chiSquareZ = (chiSquare - dof) / sqrt(2.0 * dof);
+		stats.bucketCollisions = numKeys - (bucketCount - stats.chainHistogram[0]);
+	}
+
+	// Open addressing
+	{
+		size_t bucketCount = HashQualityBucketCount(bucketIndex, numKeys * 3 / 2);
+		SimulateProbing(hashes, bucketIndex, bucketCount, false, &stats.maxProbeLinear, &stats.avgProbeLinear);
+		stats.maxProbeQuadratic = -1;
+		stats.avgProbeQuadratic = -1.0;
+		if ((bucketCount & (bucketCount - 1)) == 0)
+			SimulateProbing(hashes, bucketIndex, bucketCount, true, &stats.maxProbeQuadratic, &stats.avgProbeQuadratic);
+	}
+
+	// Full-hash collisions
+	{
+		std::vector<uint32_t> sorted(hashes);
+		std::sort(sorted.begin(), sorted.end());
+		stats.hashCollisions = 0;
+		for (size_t i = 1; i < numKeys; ++i)
+			stats.hashCollisions += (sorted[i] == sorted[i - 1]);
+	}
+}
+
+template <typename H>
+void MeasureHashQuality(H hash, const std::vector<uint32_t> & keys, BUCKETINDEX bucketIndex, HashQualityStats & stats)
+{
+	std::vector<uint32_t> hashes(keys.size());
+	for (size_t i = 0, iEnd = keys.size(); i < iEnd; ++i)
+		hashes[i] = hash(keys[i]);
+	MeasureHashQuality(hashes, bucketIndex, stats);
+}
+
+// Avalanche: flipping any one bit of the key should flip each bit of the
+// hash half the time.  Returns the worst deviation from one half over all
+// (input bit, output bit) pairs, from numSamples random keys; 0.5 means some
+// output bit ignores some input bit entirely (or always follows it).
+template <typename H>
+double AvalancheWorstBias(H hash, int numSamples)
+{
+	std::vector<uint32_t> flips(32 * 32, 0);
+	uint32_t state = 0x6a09e667;
+	for (int i = 0; i < numSamples; ++i)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		uint32_t h = hash(state);
+		for (int bitIn = 0; bitIn < 32; ++bitIn)
+		{
+			uint32_t diff = h ^ hash(state ^ (1U << bitIn));
+			for (int bitOut = 0; bitOut < 32; ++bitOut)
+				flips[bitIn * 32 + bitOut] += (diff >> bitOut) & 1;
+		}
+	}
+
+	double worst = 0.0;
+	for (size_t i = 0, iEnd = flips.size(); i < iEnd; ++i)
+		worst = std::max(worst, fabs(double(flips[i]) / double(numSamples) - 0.5));
+	return worst;
+}
+
+// Rough pass marks for a hash fit to use in the tables.  With tens of
+// thousands of keys, a random hash stays within a few standard deviations on
+// chi-square, and its longest chain and linear probe are well under these.
+static const double s_hashQualityChiSquareZMax = 6.0;
+static const int s_hashQualityMaxChainMax = 12;
+static const int s_hashQualityMaxProbeMax = 200;
+static const double s_hashQualityAvalancheBiasMax = 0.05;
+
+inline bool HashQualityAcceptable(const HashQualityStats & stats)
+{
+	return stats.chiSquareZ < s_hashQualityChiSquareZMax &&
+		   stats.maxChain <= s_hashQualityMaxChainMax &&
+		   stats.maxProbeLinear <= s_hashQualityMaxProbeMax &&
+		   stats.maxProbeQuadratic <= s_hashQualityMaxProbeMax;
+}
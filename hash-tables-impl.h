@@ -2,9 +2,10 @@
 
 #include <algorithm>
 #include <cassert>
+#include <iterator>
+#include <thread>
+#include <type_traits>
 
-// Master hash function: Bob Jenkins' SpookyHash
-#include "SpookyHash/SpookyV2.h"
 inline size_t HashMemory(void * p, size_t sizeBytes)
 {
 	return size_t(SpookyHash::Hash64(p, sizeBytes, 0));
@@ -12,8 +13,391 @@ inline size_t HashMemory(void * p, size_t sizeBytes)
 
 static const int s_hashTableInitialSize = 16;
 
-template <typename K, typename V>
-D0HashTable<K, V>::D0HashTable()
+// BulkBuild support.  Every key is hashed once up front, then the entries are
+// radix-partitioned by the top bits of their bucket index, so inserting them
+// partition by partition sweeps through the bucket array front to back rather
+// than writing all over it.
+template <typename It>
+struct BulkEntry
+{
+	uint32_t	hash;
+	It			it;
+};
+
+static const int s_bulkPartitionBitsMax = 10;
+static const int s_bulkBucketsPerPartitionBits = 12;
+
+template <typename It>
+void BulkPartition(It first, size_t count, size_t bucketCount, std::vector<BulkEntry<It>> & ordered)
+{
+	assert((bucketCount & (bucketCount - 1)) == 0);
+
+	// Aim for partitions of a few thousand buckets, so the ones being written
+	// stay in cache, but no more partitions than the histogram can hold
+	int bucketBits = 0;
+	while ((size_t(1) << bucketBits) < bucketCount)
+		++bucketBits;
+	int partitionBits = std::max(0, std::min(bucketBits - s_bulkBucketsPerPartitionBits, s_bulkPartitionBitsMax));
+	int shift = bucketBits - partitionBits;
+	size_t mask = bucketCount - 1;
+
+	// First pass: hash everything and count the partition sizes
+	std::vector<uint32_t> hashes(count);
+	std::vector<size_t> partitionStarts((size_t(1) << partitionBits) + 1, 0);
+	It it = first;
+	for (size_t i = 0; i < count; ++i, ++it)
+	{
+		hashes[i] = HashKey(it->first);
+		++partitionStarts[((hashes[i] & mask) >> shift) + 1];
+	}
+	for (size_t i = 1, iEnd = partitionStarts.size(); i < iEnd; ++i)
+		partitionStarts[i] += partitionStarts[i - 1];
+
+	// Second pass: scatter the entries to their partitions
+	ordered.resize(count);
+	it = first;
+	for (size_t i = 0; i < count; ++i, ++it)
+	{
+		BulkEntry<It> & entry = ordered[partitionStarts[(hashes[i] & mask) >> shift]++];
+		entry.hash = hashes[i];
+		entry.it = it;
+	}
+}
+
+// Parallel Rehash support.  The new bucket array is split into one contiguous
+// region per thread.  The entries are first radix-partitioned by the region of
+// their new home bucket (both passes run in parallel, each thread taking a
+// chunk of the old table), then each thread places its own region's entries,
+// so no two threads ever write the same part of the new array.
+static const size_t s_parallelRehashMinBuckets = 1 << 16;
+
+struct RehashEntry
+{
+	size_t	iOld;		// where the entry is now: old bucket, D0 entry, or BulkBuild input index
+	size_t	hash;
+};
+
+// Runs fn(iThread) on numThreads threads, the calling thread being number 0
+template <typename F>
+void RunThreads(int numThreads, F fn)
+{
+	std::vector<std::thread> threads;
+	threads.reserve(numThreads - 1);
+	for (int iThread = 1; iThread < numThreads; ++iThread)
+		threads.emplace_back(fn, iThread);
+	fn(0);
+	for (auto & thread : threads)
+		thread.join();
+}
+
+// Handed to a table's scan function, which calls Add for every entry it finds;
+// counts entries per region on the first pass, and writes them out on the second
+class RehashSink
+{
+public:
+	RehashSink(size_t mask, size_t regionSize, size_t * pRegionCounts, RehashEntry * pEntries)
+	:	mask(mask),
+		regionSize(regionSize),
+		pRegionCounts(pRegionCounts),
+		pEntries(pEntries)
+	{
+	}
+
+	void Add(size_t iOld, size_t hash)
+	{
+		size_t iRegion = (hash & mask) / regionSize;
+		if (pEntries)
+		{
+			RehashEntry & entry = pEntries[pRegionCounts[iRegion]++];
+			entry.iOld = iOld;
+			entry.hash = hash;
+		}
+		else
+			++pRegionCounts[iRegion];
+	}
+
+private:
+	size_t			mask;
+	size_t			regionSize;
+	size_t *		pRegionCounts;		// counts on the first pass, write offsets on the second
+	RehashEntry *	pEntries;
+};
+
+// The buckets each thread places entries into: rounded up to a multiple of
+// 64, so that threads setting states in a packed BucketStates array never
+// share a word of it
+inline size_t RehashRegionSize(size_t bucketCountNew, int numThreads)
+{
+	size_t regionSize = (bucketCountNew + numThreads - 1) / numThreads;
+	return (regionSize + 63) & ~size_t(63);
+}
+
+// scan(iBegin, iEnd, sink) must report every entry held in old slots [iBegin, iEnd).
+// On return, entries holds them grouped by region, and the ones for region i are
+// [regionStarts[i], regionStarts[i + 1]).
+template <typename Scan>
+void PartitionForRehash(
+	size_t slotCount,
+	size_t bucketCountNew,
+	int numThreads,
+	Scan scan,
+	std::vector<RehashEntry> & entries,
+	std::vector<size_t> & regionStarts)
+{
+	assert((bucketCountNew & (bucketCountNew - 1)) == 0);
+
+	size_t regionSize = RehashRegionSize(bucketCountNew, numThreads);
+	size_t chunkSize = (slotCount + numThreads - 1) / numThreads;
+	std::vector<size_t> counts(size_t(numThreads) * numThreads, 0);		// [chunk][region]
+
+	RunThreads(numThreads, [&](int iThread)
+	{
+		RehashSink sink(bucketCountNew - 1, regionSize, &counts[size_t(iThread) * numThreads], nullptr);
+		scan(std::min(iThread * chunkSize, slotCount), std::min((iThread + 1) * chunkSize, slotCount), sink);
+	});
+
+	// Turn the counts into write offsets: region-major, then in chunk order, so
+	// each region's entries come out in the same order as the old table had them
+	regionStarts.assign(numThreads + 1, 0);
+	size_t offset = 0;
+	for (int iRegion = 0; iRegion < numThreads; ++iRegion)
+	{
+		regionStarts[iRegion] = offset;
+		for (int iChunk = 0; iChunk < numThreads; ++iChunk)
+		{
+			size_t & count = counts[size_t(iChunk) * numThreads + iRegion];
+			size_t countChunk = count;
+			count = offset;
+			offset += countChunk;
+		}
+	}
+	regionStarts[numThreads] = offset;
+
+	entries.resize(offset);
+	RunThreads(numThreads, [&](int iThread)
+	{
+		RehashSink sink(bucketCountNew - 1, regionSize, &counts[size_t(iThread) * numThreads], entries.data());
+		scan(std::min(iThread * chunkSize, slotCount), std::min((iThread + 1) * chunkSize, slotCount), sink);
+	});
+}
+
+// Linear-probing placement for the entries PartitionForRehash grouped up.
+// Each thread probes only within its own region; an entry whose probe runs off
+// the end of the region is set aside, and those are placed afterward on the
+// calling thread, probing on into the next region (and wrapping) as usual.
+// Since nothing is removed in between, the run of filled buckets each of them
+// skipped over is still there for Lookup to walk.
+template <typename IsFree, typename Place>
+void PlaceForRehash(
+	const std::vector<RehashEntry> & entries,
+	const std::vector<size_t> & regionStarts,
+	size_t bucketCountNew,
+	int numThreads,
+	IsFree isFree,
+	Place place)
+{
+	size_t regionSize = RehashRegionSize(bucketCountNew, numThreads);
+	std::vector<std::vector<RehashEntry>> spills(numThreads);
+
+	RunThreads(numThreads, [&](int iThread)
+	{
+		size_t iRegionEnd = std::min((iThread + 1) * regionSize, bucketCountNew);
+		for (size_t i = regionStarts[iThread], iEnd = regionStarts[iThread + 1]; i < iEnd; ++i)
+		{
+			const RehashEntry & entry = entries[i];
+			size_t iBucket = entry.hash & (bucketCountNew - 1);
+			while (iBucket < iRegionEnd && !isFree(iBucket))
+				++iBucket;
+			if (iBucket < iRegionEnd)
+				place(entry, iBucket);
+			else
+				spills[iThread].push_back(entry);
+		}
+	});
+
+	for (const auto & spill : spills)
+	{
+		for (const RehashEntry & entry : spill)
+		{
+			size_t iBucket = entry.hash & (bucketCountNew - 1);
+			while (!isFree(iBucket))
+				iBucket = (iBucket + 1) & (bucketCountNew - 1);
+			place(entry, iBucket);
+		}
+	}
+}
+
+// GetStats support.  The open-addressed tables all use 0, 1 and 2 for empty,
+// filled and removed buckets; state(i) gives bucket i's, and hash(i) the hash
+// of the key in filled bucket i.  The chained tables just give the length of
+// each bucket's chain.
+
+inline void StatsHistogramAdd(size_t * histogram, size_t length)
+{
+	++histogram[std::min(length, size_t(s_statsHistogramLength - 1))];
+}
+
+template <typename FState, typename FHash>
+HashTableStats LinearProbeStats(size_t bucketCount, FState state, FHash hash)
+{
+	HashTableStats stats = HashTableStats();
+	stats.bucketCount = bucketCount;
+	if (bucketCount == 0)
+		return stats;
+	const size_t mask = bucketCount - 1;
+
+	// Hits: distance from the home bucket
+	size_t probesHit = 0;
+	size_t iEmpty = bucketCount;
+	for (size_t i = 0; i < bucketCount; ++i)
+	{
+		switch (state(i))
+		{
+		case 0:
+			iEmpty = i;
+			break;
+		case 1:
+		{
+			size_t probes = ((i - size_t(hash(i))) & mask) + 1;
+			probesHit += probes;
+			stats.maxProbeHit = std::max(stats.maxProbeHit, int(probes));
+			++stats.size;
+			break;
+		}
+		default:
+			++stats.tombstones;
+			break;
+		}
+	}
+
+	// Misses: a lookup starting in a run of non-empty buckets scans to its
+	// end, plus the empty bucket that stops it.  Walking backwards from an
+	// empty bucket sees each run whole.
+	size_t probesMiss = 0;
+	if (iEmpty == bucketCount)
+	{
+		probesMiss = bucketCount * bucketCount;
+		stats.maxProbeMiss = int(bucketCount);
+		StatsHistogramAdd(stats.clusterHistogram, bucketCount);
+	}
+	else
+	{
+		size_t run = 0;
+		for (size_t j = 1; j <= bucketCount; ++j)
+		{
+			size_t i = (iEmpty - j) & mask;
+			if (state(i) == 0)
+			{
+				if (run > 0)
+					StatsHistogramAdd(stats.clusterHistogram, run);
+				run = 0;
+			}
+			else
+			{
+				++run;
+			}
+			probesMiss += run + 1;
+			stats.maxProbeMiss = std::max(stats.maxProbeMiss, int(run + 1));
+		}
+	}
+
+	stats.loadFactor = float(stats.size) / float(bucketCount);
+	stats.avgProbeHit = stats.size ? float(probesHit) / float(stats.size) : 0.0f;
+	stats.avgProbeMiss = float(probesMiss) / float(bucketCount);
+	return stats;
+}
+
+// Every key in a chain of length L is a hit taking 1 to L probes, and a miss
+// there compares against all L
+template <typename FChain>
+HashTableStats ChainStats(size_t bucketCount, FChain chainLength)
+{
+	HashTableStats stats = HashTableStats();
+	stats.bucketCount = bucketCount;
+	if (bucketCount == 0)
+		return stats;
+
+	size_t probesHit = 0;
+	for (size_t i = 0; i < bucketCount; ++i)
+	{
+		size_t length = chainLength(i);
+		StatsHistogramAdd(stats.chainHistogram, length);
+		stats.size += length;
+		probesHit += length * (length + 1) / 2;
+		stats.maxProbeHit = std::max(stats.maxProbeHit, int(length));
+	}
+
+	stats.maxProbeMiss = stats.maxProbeHit;
+	stats.loadFactor = float(stats.size) / float(bucketCount);
+	stats.avgProbeHit = stats.size ? float(probesHit) / float(stats.size) : 0.0f;
+	stats.avgProbeMiss = float(stats.size) / float(bucketCount);
+	return stats;
+}
+
+// RehashInPlace support, with state(i) and hash(i) as for LinearProbeStats,
+// setState(i, s) to set bucket i's state, move(iFrom, iTo) to copy the key
+// and value across, and swap(i, j) to exchange two buckets' keys and values
+// (the caller's RehashInPlace updates the stored hashes along with them).
+//
+// Every filled bucket is marked pending and every removed one empty; then
+// each pending key goes to the first bucket on its probe sequence that isn't
+// already holding a placed key.  That bucket is never further along than
+// where the key is now, since the key's own bucket isn't placed yet.  If it's
+// empty the key moves there; if it's pending the two swap, and the key that
+// arrives is placed in turn.  Each step places one key for good, so the
+// whole thing is linear in the bucket count, and the buckets a placed key's
+// probe sequence passes over all stay filled, so lookups find it.
+static const int s_bucketPending = 3;
+
+template <typename FState, typename FSetState, typename FHash, typename FMove, typename FSwap>
+void ReinsertInPlace(size_t bucketCount, bool quadratic, FState state, FSetState setState, FHash hash, FMove move, FSwap swap)
+{
+	const size_t mask = bucketCount - 1;
+
+	for (size_t i = 0; i < bucketCount; ++i)
+	{
+		int s = state(i);
+		if (s == 1)
+			setState(i, s_bucketPending);
+		else if (s == 2)
+			setState(i, 0);
+	}
+
+	for (size_t i = 0; i < bucketCount; ++i)
+	{
+		while (state(i) == s_bucketPending)
+		{
+			const size_t iHome = size_t(hash(i)) & mask;
+			size_t iTarget = iHome;
+			for (size_t j = 1; state(iTarget) == 1; ++j)
+				iTarget = (iHome + (quadratic ? (j + j*j) / 2 : j)) & mask;
+
+			if (iTarget == i)
+			{
+				setState(i, 1);
+			}
+			else if (state(iTarget) == 0)
+			{
+				move(i, iTarget);
+				setState(iTarget, 1);
+				setState(i, 0);
+			}
+			else
+			{
+				swap(i, iTarget);
+				setState(iTarget, 1);
+			}
+		}
+	}
+}
+
+template <typename K, typename V, typename A>
+D0HashTable<K, V, A>::D0HashTable(const A & alloc)
+:	buckets(alloc),
+	keyAndNexts(alloc),
+	values(alloc),
+	rehashThreads(1),
+	autoShrink(false)
 {
 	buckets.resize(16, static_cast<uint32_t>(-1));
 
@@ -21,6 +405,7 @@ D0HashTable<K, V>::D0HashTable()
 	values.resize(16);
 
 	nextFree = 0;
+	size_ = 0;
 
 	for (uint32_t idx = 0; idx < 15; ++idx)
 	{
@@ -29,17 +414,21 @@ D0HashTable<K, V>::D0HashTable()
 
 	keyAndNexts[15].next = static_cast<uint32_t>(-1);
 }
-template <typename K, typename V>
-void D0HashTable<K, V>::Insert(K key, V value)
+template <typename K, typename V, typename A>
+void D0HashTable<K, V, A>::Insert(const K & key, const V & value)
 {
 	if (nextFree == -1)
 	{
 		Rehash(static_cast<uint32_t>(buckets.size() * 2));
 	}
 
-	const auto index = nextFree;
+	InsertHashed(HashKey(key), key, value);
+}
 
-	const auto hash = HashKey(key);
+template <typename K, typename V, typename A>
+void D0HashTable<K, V, A>::InsertHashed(uint32_t hash, const K & key, const V & value)
+{
+	const auto index = nextFree;
 
 	auto& currentIndex = buckets[hash & (buckets.size() - 1)];
 	// auto& currentIndex = buckets[hash % buckets.size()];
@@ -55,11 +444,16 @@ void D0HashTable<K, V>::Insert(K key, V value)
 
 
 	values[index] = value;
+
+	++size_;
 }
 
-template <typename K, typename V>
-V* D0HashTable<K, V>::Lookup(K key)
+template <typename K, typename V, typename A>
+template <typename Q>
+V* D0HashTable<K, V, A>::Lookup(const Q & keyIn)
 {
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
 	const auto hash = HashKey(key);
 
 	auto index = buckets[hash & (buckets.size() - 1)];
@@ -80,9 +474,12 @@ V* D0HashTable<K, V>::Lookup(K key)
 	return nullptr;
 }
 
-template <typename K, typename V>
-bool D0HashTable<K, V>::Remove(K key)
+template <typename K, typename V, typename A>
+template <typename Q>
+bool D0HashTable<K, V, A>::Remove(const Q & keyIn)
 {
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
 	const auto hash = HashKey(key);
 
 	auto hashIndex = hash & (buckets.size() - 1);
@@ -105,6 +502,10 @@ bool D0HashTable<K, V>::Remove(K key)
 			prevKn->next = nextFree;
 			nextFree = index;
 
+			--size_;
+			if (autoShrink)
+				ShrinkIfSparse();
+
 			return true;
 		}
 		else
@@ -124,6 +525,10 @@ bool D0HashTable<K, V>::Remove(K key)
 			kn.next = nextFree;
 			nextFree = index;
 
+			--size_;
+			if (autoShrink)
+				ShrinkIfSparse();
+
 			return true;
 		}
 
@@ -134,8 +539,99 @@ bool D0HashTable<K, V>::Remove(K key)
 	return false;
 }
 
-template <typename K, typename V>
-void D0HashTable<K, V>::Reserve(uint32_t maxSize)
+template <typename K, typename V, typename A>
+template <typename Q>
+std::pair<V *, bool> D0HashTable<K, V, A>::FindOrInsert(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	const auto hash = HashKey(key);
+
+	auto index = buckets[hash & (buckets.size() - 1)];
+	// auto index = buckets[hash % buckets.size()];
+
+	while (index != -1)
+	{
+		auto& kn = keyAndNexts[index];
+
+		if (kn.key == key)
+		{
+			return std::make_pair(&values[index], false);
+		}
+
+		index = kn.next;
+	};
+
+	if (nextFree == -1)
+	{
+		Rehash(static_cast<uint32_t>(buckets.size() * 2));
+	}
+
+	index = nextFree;
+
+	// Bucket array may have been rebuilt, so index it again
+	auto& currentIndex = buckets[hash & (buckets.size() - 1)];
+	// auto& currentIndex = buckets[hash % buckets.size()];
+
+	auto& kn = keyAndNexts[index];
+
+	nextFree = kn.next;
+
+	kn.key = KeyTraits<K>::Make(key);
+	kn.next = currentIndex;
+
+	currentIndex = index;
+
+	values[index] = V();
+
+	++size_;
+
+	return std::make_pair(&values[index], true);
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+bool D0HashTable<K, V, A>::InsertOrAssign(const Q & key, const V & value)
+{
+	auto result = FindOrInsert(key);
+	*result.first = value;
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q, typename F>
+bool D0HashTable<K, V, A>::Upsert(const Q & key, F fn)
+{
+	auto result = FindOrInsert(key);
+	fn(*result.first);
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+template <typename It>
+void D0HashTable<K, V, A>::BulkBuild(It first, It last)
+{
+	static_assert(std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<It>::iterator_category>::value,
+				  "BulkBuild needs a forward range: it counts the range, then reads it again");
+	// Size once for the final count, so no Rehash happens partway through
+	size_t count = size_t(std::distance(first, last));
+	Reserve(static_cast<uint32_t>(size_ + count));
+
+	std::vector<BulkEntry<It>> entries;
+	BulkPartition(first, count, buckets.size(), entries);
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (nextFree == -1)
+		{
+			Rehash(static_cast<uint32_t>(buckets.size() * 2));
+		}
+
+		InsertHashed(entries[i].hash, entries[i].it->first, entries[i].it->second);
+	}
+}
+
+template <typename K, typename V, typename A>
+void D0HashTable<K, V, A>::Reserve(uint32_t maxSize)
 {
     maxSize |= maxSize >> 1;
     maxSize |= maxSize >> 2;
@@ -143,22 +639,88 @@ void D0HashTable<K, V>::Reserve(uint32_t maxSize)
     maxSize |= maxSize >> 8;
     maxSize |= maxSize >> 16;
 
-	Rehash(maxSize);
+	Rehash(maxSize + 1);
 }
 
-template <typename K, typename V>
-void D0HashTable<K, V>::Reset()
+template <typename K, typename V, typename A>
+void D0HashTable<K, V, A>::ShrinkToFit()
+{
+	// The bucket count Reserve(size_) would pick, but Rehash won't go down
+	uint32_t bucketCountNew = 16;
+	while (bucketCountNew <= size_)
+		bucketCountNew *= 2;
+	if (bucketCountNew < buckets.size())
+		Shrink(bucketCountNew);
+}
+
+template <typename K, typename V, typename A>
+void D0HashTable<K, V, A>::ShrinkIfSparse()
+{
+	// Under 1/8 full: rebuild with room for twice the keys left
+	if (size_ * 8 < buckets.size() && buckets.size() > 16)
+	{
+		uint32_t bucketCountNew = 16;
+		while (bucketCountNew <= size_ * 2)
+			bucketCountNew *= 2;
+		Shrink(bucketCountNew);
+	}
+}
+
+// Rehash grows the entry arrays in place and links the new entries onto the
+// free list; going smaller means packing the live entries into new arrays
+template <typename K, typename V, typename A>
+void D0HashTable<K, V, A>::Shrink(uint32_t bucketCountNew)
+{
+	TableVector<uint32_t, A> bucketsNew(bucketCountNew, static_cast<uint32_t>(-1), buckets.get_allocator());
+	TableVector<KN, A> keyAndNextsNew(bucketCountNew, KN(), keyAndNexts.get_allocator());
+	TableVector<V, A> valuesNew(bucketCountNew, V(), values.get_allocator());
+
+	uint32_t indexNew = 0;
+	for (size_t idx = 0, idxEnd = buckets.size(); idx < idxEnd; ++idx)
+	{
+		for (uint32_t index = buckets[idx]; index != static_cast<uint32_t>(-1); index = keyAndNexts[index].next)
+		{
+			auto& kn = keyAndNexts[index];
+			auto& newHead = bucketsNew[HashKey(kn.key) & (bucketCountNew - 1)];
+
+			auto& knNew = keyAndNextsNew[indexNew];
+			knNew.key = std::move(kn.key);
+			knNew.next = newHead;
+			newHead = indexNew;
+			valuesNew[indexNew] = std::move(values[index]);
+
+			++indexNew;
+		}
+	}
+
+	// Free list of the rest
+	for (uint32_t idx = indexNew; idx < bucketCountNew; ++idx)
+	{
+		keyAndNextsNew[idx].next = idx + 1;
+	}
+
+	keyAndNextsNew[bucketCountNew - 1].next = static_cast<uint32_t>(-1);
+	nextFree = (indexNew < bucketCountNew) ? indexNew : static_cast<uint32_t>(-1);
+
+	buckets.swap(bucketsNew);
+	keyAndNexts.swap(keyAndNextsNew);
+	values.swap(valuesNew);
+}
+
+template <typename K, typename V, typename A>
+void D0HashTable<K, V, A>::Reset()
 {
 	buckets.clear();
 	keyAndNexts.clear();
 	values.clear();
 
-	buckets.resize(16);
+	buckets.resize(16, static_cast<uint32_t>(-1));
 
 	keyAndNexts.resize(16);
 	values.resize(16);
 
 	nextFree = 0;
+	size_ = 0;
 
 	for (uint32_t idx = 0; idx < 15; ++idx)
 	{
@@ -168,8 +730,20 @@ void D0HashTable<K, V>::Reset()
 	keyAndNexts[15].next = -1;
 }
 
-template <typename K, typename V>
-void D0HashTable<K, V>::Rehash(uint32_t bucketCountNew)
+template <typename K, typename V, typename A>
+HashTableStats D0HashTable<K, V, A>::GetStats() const
+{
+	return ChainStats(buckets.size(), [&](size_t i)
+		{
+			size_t length = 0;
+			for (uint32_t index = buckets[i]; index != static_cast<uint32_t>(-1); index = keyAndNexts[index].next)
+				++length;
+			return length;
+		});
+}
+
+template <typename K, typename V, typename A>
+void D0HashTable<K, V, A>::Rehash(uint32_t bucketCountNew)
 {
 	uint32_t size = static_cast<uint32_t>(buckets.size());
 
@@ -178,10 +752,16 @@ void D0HashTable<K, V>::Rehash(uint32_t bucketCountNew)
 		return;
 	}
 
+	if (rehashThreads > 1 && bucketCountNew >= s_parallelRehashMinBuckets)
+	{
+		RehashParallel(bucketCountNew);
+		return;
+	}
+
 	keyAndNexts.resize(bucketCountNew);
 	values.resize(bucketCountNew);
 
-	std::vector<uint32_t> bucketsNew(bucketCountNew, static_cast<uint32_t>(-1));
+	TableVector<uint32_t, A> bucketsNew(bucketCountNew, static_cast<uint32_t>(-1), buckets.get_allocator());
 
 	auto newSize = bucketsNew.size();
 
@@ -231,50 +811,137 @@ void D0HashTable<K, V>::Rehash(uint32_t bucketCountNew)
 	buckets.swap(bucketsNew);
 }
 
-// D1HashTable open address
-template <typename K, typename V>
-D1HashTable<K, V>::D1HashTable()
-{
-	keyAndStates.resize(16);
-	values.resize(16);
-	size_ = 0;
-}
-
-template <typename K, typename V>
-void D1HashTable<K, V>::Insert(K key, V value)
+template <typename K, typename V, typename A>
+void D0HashTable<K, V, A>::RehashParallel(uint32_t bucketCountNew)
 {
-	if (size_ * 3 > keyAndStates.size() * 2)
-	{
-		Rehash(static_cast<uint32_t>(keyAndStates.size() * 2));
-	}
+	uint32_t size = static_cast<uint32_t>(buckets.size());
 
-	const auto hash = HashKey(key);
+	keyAndNexts.resize(bucketCountNew);
+	values.resize(bucketCountNew);
 
-	const uint32_t keyEnd = static_cast<uint32_t>(keyAndStates.size());
-	const uint32_t keyStart = hash & (keyEnd - 1);
+	TableVector<uint32_t, A> bucketsNew(bucketCountNew, static_cast<uint32_t>(-1), buckets.get_allocator());
 
-	++size_;
+	// Each thread walks the chains of a range of old buckets
+	std::vector<RehashEntry> entries;
+	std::vector<size_t> regionStarts;
+	PartitionForRehash(size, bucketCountNew, rehashThreads,
+		[&](size_t iBegin, size_t iEnd, RehashSink & sink)
+		{
+			for (size_t idx = iBegin; idx < iEnd; ++idx)
+			{
+				for (uint32_t index = buckets[idx]; index != static_cast<uint32_t>(-1); index = keyAndNexts[index].next)
+					sink.Add(index, HashKey(keyAndNexts[index].key));
+			}
+		},
+		entries, regionStarts);
 
-	for (uint32_t idx = keyStart; idx < keyEnd; ++idx)
+	// Then relinks the entries whose new buckets fall in its region.  Chains
+	// never cross buckets, so there's no spill to deal with here.
+	RunThreads(rehashThreads, [&](int iThread)
 	{
-		auto& ks = keyAndStates[idx];
-
-		if (ks.state != FILLED)
+		for (size_t i = regionStarts[iThread], iEnd = regionStarts[iThread + 1]; i < iEnd; ++i)
 		{
-			ks.state = FILLED;
-			ks.key = key;
-			values[idx] = value;
-
-			return;
+			auto& newIndex = bucketsNew[entries[i].hash & (bucketCountNew - 1)];
+			keyAndNexts[entries[i].iOld].next = newIndex;
+			newIndex = static_cast<uint32_t>(entries[i].iOld);
 		}
-	}
+	});
 
-	for (uint32_t idx = 0; idx < keyStart; ++idx)
+	{
+		for (uint32_t idx = size; idx < bucketCountNew; ++idx)
+		{
+			keyAndNexts[idx].next = idx + 1;
+		}
+
+		keyAndNexts[bucketCountNew - 1].next = nextFree;
+		nextFree = size;
+	}
+
+	buckets.swap(bucketsNew);
+}
+
+template <typename K, typename V, typename A>
+bool D0HashTable<K, V, A>::SaveSnapshot(const char * path) const
+{
+	static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+				  "Only tables of plain-old-data keys and values can be snapshotted");
+
+	SnapshotHeader header = {};
+	header.kind = SNAPSHOTKIND_D0;
+	header.keySize = sizeof(K);
+	header.valueSize = sizeof(V);
+	header.bucketCount = buckets.size();
+	header.size = size_;
+	header.extra = nextFree;
+
+	SnapshotArray arrays[] =
+	{
+		{ buckets.data(), sizeof(uint32_t), buckets.size() },
+		{ keyAndNexts.data(), sizeof(KN), keyAndNexts.size() },
+		{ values.data(), sizeof(V), values.size() },
+	};
+	return WriteSnapshot(path, header, arrays, 3);
+}
+
+// D1HashTable open address
+template <typename K, typename V, typename A>
+D1HashTable<K, V, A>::D1HashTable(const A & alloc)
+:	keyAndStates(alloc),
+	values(alloc),
+	rehashThreads(1),
+	autoShrink(false)
+{
+	keyAndStates.resize(16);
+	values.resize(16);
+	size_ = 0;
+	tombstones = 0;
+}
+
+template <typename K, typename V, typename A>
+void D1HashTable<K, V, A>::Insert(const K & key, const V & value)
+{
+	// Grow past 2/3 full, or clear out the REMOVED slots once they've taken
+	// the slots in use past 3/4
+	if (size_ * 3 > keyAndStates.size() * 2)
+	{
+		Rehash(static_cast<uint32_t>(keyAndStates.size() * 2));
+	}
+	else if ((size_ + tombstones) * 4 > keyAndStates.size() * 3)
+	{
+		RehashInPlace();
+	}
+
+	const auto hash = HashKey(key);
+
+	const uint32_t keyEnd = static_cast<uint32_t>(keyAndStates.size());
+	const uint32_t keyStart = hash & (keyEnd - 1);
+
+	++size_;
+
+	for (uint32_t idx = keyStart; idx < keyEnd; ++idx)
+	{
+		auto& ks = keyAndStates[idx];
+
+		if (ks.state != FILLED)
+		{
+			if (ks.state == REMOVED)
+				--tombstones;
+			ks.state = FILLED;
+			ks.key = key;
+			values[idx] = value;
+
+			return;
+		}
+	}
+
+	for (uint32_t idx = 0; idx < keyStart; ++idx)
 	{
 		auto& ks = keyAndStates[idx];
 
 		if (ks.state != FILLED)
 		{
+			if (ks.state == REMOVED)
+				--tombstones;
 			ks.state = FILLED;
 			ks.key = key;
 			values[idx] = value;
@@ -284,9 +951,12 @@ void D1HashTable<K, V>::Insert(K key, V value)
 	}
 }
 
-template <typename K, typename V>
-V* D1HashTable<K, V>::Lookup(K key)
+template <typename K, typename V, typename A>
+template <typename Q>
+V* D1HashTable<K, V, A>::Lookup(const Q & keyIn)
 {
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
 	const auto hash = HashKey(key);
 
 	const uint32_t keyEnd = static_cast<uint32_t>(keyAndStates.size());
@@ -333,9 +1003,12 @@ V* D1HashTable<K, V>::Lookup(K key)
 	return nullptr;
 }
 
-template <typename K, typename V>
-bool D1HashTable<K, V>::Remove(K key)
+template <typename K, typename V, typename A>
+template <typename Q>
+bool D1HashTable<K, V, A>::Remove(const Q & keyIn)
 {
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
 	const auto hash = HashKey(key);
 
 	const uint32_t keyEnd = static_cast<uint32_t>(keyAndStates.size());
@@ -354,6 +1027,9 @@ bool D1HashTable<K, V>::Remove(K key)
 			{
 				ks.state = REMOVED;
 				--size_;
+				++tombstones;
+				if (autoShrink)
+					ShrinkIfSparse();
 				return true;
 			}
 			break;
@@ -375,6 +1051,9 @@ bool D1HashTable<K, V>::Remove(K key)
 			{
 				ks.state = REMOVED;
 				--size_;
+				++tombstones;
+				if (autoShrink)
+					ShrinkIfSparse();
 				return true;
 			}
 			break;
@@ -386,8 +1065,114 @@ bool D1HashTable<K, V>::Remove(K key)
 	return false;
 }
 
-template <typename K, typename V>
-void D1HashTable<K, V>::Reserve(uint32_t maxSize)
+template <typename K, typename V, typename A>
+template <typename Q>
+std::pair<V *, bool> D1HashTable<K, V, A>::FindOrInsert(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	// Grow past 2/3 full, or clear out the REMOVED slots once they've taken
+	// the slots in use past 3/4
+	if (size_ * 3 > keyAndStates.size() * 2)
+	{
+		Rehash(static_cast<uint32_t>(keyAndStates.size() * 2));
+	}
+	else if ((size_ + tombstones) * 4 > keyAndStates.size() * 3)
+	{
+		RehashInPlace();
+	}
+
+	const auto hash = HashKey(key);
+
+	const uint32_t keyEnd = static_cast<uint32_t>(keyAndStates.size());
+	const uint32_t keyStart = hash & (keyEnd - 1);
+
+	// Remember the first reusable slot on the way, in case the key is absent
+	uint32_t target = keyEnd;
+	bool hitEmpty = false;
+
+	for (uint32_t idx = keyStart; idx < keyEnd && !hitEmpty; ++idx)
+	{
+		auto& ks = keyAndStates[idx];
+
+		switch (ks.state)
+		{
+		case EMPTY:
+			hitEmpty = true;
+			if (target == keyEnd)
+				target = idx;
+			break;
+		case FILLED:
+			if (ks.key == key)
+			{
+				return std::make_pair(&values[idx], false);
+			}
+			break;
+		default:
+			if (target == keyEnd)
+				target = idx;
+			break;
+		}
+	}
+
+	for (uint32_t idx = 0; idx < keyStart && !hitEmpty; ++idx)
+	{
+		auto& ks = keyAndStates[idx];
+
+		switch (ks.state)
+		{
+		case EMPTY:
+			hitEmpty = true;
+			if (target == keyEnd)
+				target = idx;
+			break;
+		case FILLED:
+			if (ks.key == key)
+			{
+				return std::make_pair(&values[idx], false);
+			}
+			break;
+		default:
+			if (target == keyEnd)
+				target = idx;
+			break;
+		}
+	}
+
+	assert(target != keyEnd);
+
+	auto& ks = keyAndStates[target];
+	if (ks.state == REMOVED)
+		--tombstones;
+	ks.state = FILLED;
+	ks.key = KeyTraits<K>::Make(key);
+	values[target] = V();
+
+	++size_;
+
+	return std::make_pair(&values[target], true);
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+bool D1HashTable<K, V, A>::InsertOrAssign(const Q & key, const V & value)
+{
+	auto result = FindOrInsert(key);
+	*result.first = value;
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q, typename F>
+bool D1HashTable<K, V, A>::Upsert(const Q & key, F fn)
+{
+	auto result = FindOrInsert(key);
+	fn(*result.first);
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+void D1HashTable<K, V, A>::Reserve(uint32_t maxSize)
 {
 	maxSize = maxSize * 3 / 2;
 
@@ -397,23 +1182,79 @@ void D1HashTable<K, V>::Reserve(uint32_t maxSize)
     maxSize |= maxSize >> 8;
     maxSize |= maxSize >> 16;
 
-	Rehash(maxSize);
+	Rehash(maxSize + 1);
 }
 
-template <typename K, typename V>
-void D1HashTable<K, V>::Reset()
+template <typename K, typename V, typename A>
+void D1HashTable<K, V, A>::RehashInPlace()
+{
+	// Reinsert every key in the slots it's in; see ReinsertInPlace.  No
+	// stored hashes, so each key is hashed again.
+	ReinsertInPlace(keyAndStates.size(), false,
+		[&](size_t i) { return int(keyAndStates[i].state); },
+		[&](size_t i, int state) { keyAndStates[i].state = State(state); },
+		[&](size_t i) { return HashKey(keyAndStates[i].key); },
+		[&](size_t iFrom, size_t iTo)
+		{
+			keyAndStates[iTo] = keyAndStates[iFrom];
+			values[iTo] = values[iFrom];
+		},
+		[&](size_t i, size_t j)
+		{
+			std::swap(keyAndStates[i], keyAndStates[j]);
+			std::swap(values[i], values[j]);
+		});
+	tombstones = 0;
+}
+
+template <typename K, typename V, typename A>
+void D1HashTable<K, V, A>::ShrinkToFit()
+{
+	// The bucket count Reserve(size_) would pick, but Rehash won't go down
+	uint32_t bucketCountNew = 16;
+	while (bucketCountNew <= size_ * 3 / 2)
+		bucketCountNew *= 2;
+	if (bucketCountNew < keyAndStates.size())
+		Rebuild(bucketCountNew);
+}
+
+template <typename K, typename V, typename A>
+void D1HashTable<K, V, A>::ShrinkIfSparse()
+{
+	// Under 1/8 full: rebuild with room for twice the keys left
+	if (size_ * 8 < keyAndStates.size() && keyAndStates.size() > 16)
+	{
+		uint32_t bucketCountNew = 16;
+		while (bucketCountNew <= size_ * 3)
+			bucketCountNew *= 2;
+		Rebuild(bucketCountNew);
+	}
+}
+
+template <typename K, typename V, typename A>
+void D1HashTable<K, V, A>::Reset()
 {
 	keyAndStates.clear();
 	values.clear();
 
 	keyAndStates.resize(16);
-	buckets.resize(16);
+	values.resize(16);
 
 	size_ = 0;
+	tombstones = 0;
 }
 
-template <typename K, typename V>
-void D1HashTable<K, V>::Rehash(uint32_t bucketCountNew)
+template <typename K, typename V, typename A>
+HashTableStats D1HashTable<K, V, A>::GetStats() const
+{
+	// No stored hashes, so the home buckets mean hashing every key again
+	return LinearProbeStats(keyAndStates.size(),
+		[&](size_t i) { return int(keyAndStates[i].state); },
+		[&](size_t i) { return HashKey(keyAndStates[i].key); });
+}
+
+template <typename K, typename V, typename A>
+void D1HashTable<K, V, A>::Rehash(uint32_t bucketCountNew)
 {
     const uint32_t oldSize = static_cast<uint32_t>(keyAndStates.size());
 
@@ -422,8 +1263,26 @@ void D1HashTable<K, V>::Rehash(uint32_t bucketCountNew)
 		return;
 	}
 
-	std::vector<KS> newKeyAndStates(bucketCountNew);
-	std::vector<V> newValues(bucketCountNew);
+	Rebuild(bucketCountNew);
+}
+
+// Rehash only ever grows; ShrinkToFit comes straight here
+template <typename K, typename V, typename A>
+void D1HashTable<K, V, A>::Rebuild(uint32_t bucketCountNew)
+{
+	const uint32_t oldSize = static_cast<uint32_t>(keyAndStates.size());
+
+	// Rebuilding drops any tombstones
+	tombstones = 0;
+
+	if (rehashThreads > 1 && bucketCountNew >= s_parallelRehashMinBuckets)
+	{
+		RehashParallel(bucketCountNew);
+		return;
+	}
+
+	TableVector<KS, A> newKeyAndStates(bucketCountNew, KS(), keyAndStates.get_allocator());
+	TableVector<V, A> newValues(bucketCountNew, V(), values.get_allocator());
 
     const uint32_t keyEnd = static_cast<uint32_t>(bucketCountNew);
     const uint32_t keyEndS1 = keyEnd - 1;
@@ -477,12 +1336,49 @@ void D1HashTable<K, V>::Rehash(uint32_t bucketCountNew)
 	values.swap(newValues);
 }
 
+template <typename K, typename V, typename A>
+void D1HashTable<K, V, A>::RehashParallel(uint32_t bucketCountNew)
+{
+	TableVector<KS, A> newKeyAndStates(bucketCountNew, KS(), keyAndStates.get_allocator());
+	TableVector<V, A> newValues(bucketCountNew, V(), values.get_allocator());
+
+	// D1 doesn't store hashes, so each key gets hashed on both partitioning passes
+	std::vector<RehashEntry> entries;
+	std::vector<size_t> regionStarts;
+	PartitionForRehash(keyAndStates.size(), bucketCountNew, rehashThreads,
+		[&](size_t iBegin, size_t iEnd, RehashSink & sink)
+		{
+			for (size_t i = iBegin; i < iEnd; ++i)
+			{
+				if (keyAndStates[i].state == FILLED)
+					sink.Add(i, HashKey(keyAndStates[i].key));
+			}
+		},
+		entries, regionStarts);
+
+	PlaceForRehash(entries, regionStarts, bucketCountNew, rehashThreads,
+		[&](size_t i) { return newKeyAndStates[i].state != FILLED; },
+		[&](const RehashEntry & entry, size_t iTarget)
+		{
+			auto& newKs = newKeyAndStates[iTarget];
+			newKs.state = FILLED;
+			newKs.key = keyAndStates[entry.iOld].key;
+			newValues[iTarget] = values[entry.iOld];
+		});
+
+	keyAndStates.swap(newKeyAndStates);
+	values.swap(newValues);
+}
+
 
 // C0HashTable implementation
 
-template <typename K, typename V>
-C0HashTable<K, V>::C0HashTable()
-:	size(0)
+template <typename K, typename V, typename A>
+C0HashTable<K, V, A>::C0HashTable(const A & alloc)
+:	buckets(alloc),
+	elemPool(alloc),
+	size(0),
+	autoShrink(false)
 {
 	// Start off with a small initial size
 	buckets.resize(s_hashTableInitialSize);
@@ -494,8 +1390,8 @@ C0HashTable<K, V>::C0HashTable()
 		elemPool[i].pNext = &elemPool[i+1];
 }
 
-template <typename K, typename V>
-void C0HashTable<K, V>::Insert(K key, V value)
+template <typename K, typename V, typename A>
+void C0HashTable<K, V, A>::Insert(const K & key, const V & value)
 {
 	// Resize larger if we're out of elements
 	if (!pElemFreeHead)
@@ -525,9 +1421,12 @@ void C0HashTable<K, V>::Insert(K key, V value)
 	++size;
 }
 
-template <typename K, typename V>
-V * C0HashTable<K, V>::Lookup(K key)
+template <typename K, typename V, typename A>
+template <typename Q>
+V * C0HashTable<K, V, A>::Lookup(const Q & keyIn)
 {
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
 	// Hash the key and look up the appropriate bucket
 	const auto hash = HashKey(key);
 	// Bucket * b = &buckets[hash % buckets.size()];
@@ -543,9 +1442,12 @@ V * C0HashTable<K, V>::Lookup(K key)
 	return nullptr;
 }
 
-template <typename K, typename V>
-bool C0HashTable<K, V>::Remove(K key)
+template <typename K, typename V, typename A>
+template <typename Q>
+bool C0HashTable<K, V, A>::Remove(const Q & keyIn)
 {
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
 	// Hash the key and look up the appropriate bucket
 	const auto hash = HashKey(key);
 	// Bucket * b = &buckets[hash % buckets.size()];
@@ -586,33 +1488,100 @@ bool C0HashTable<K, V>::Remove(K key)
 		eRemoved->pNext = pElemFreeHead;
 		pElemFreeHead = eRemoved;
 		--size;
+		if (autoShrink)
+			ShrinkIfSparse();
 	}
 
 	return (eRemoved != nullptr);
 }
 
-template <typename K, typename V>
-void C0HashTable<K, V>::Reserve(size_t maxSize)
+template <typename K, typename V, typename A>
+template <typename Q>
+std::pair<V *, bool> C0HashTable<K, V, A>::FindOrInsert(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	// Hash the key and look up the appropriate bucket
+	const auto hash = HashKey(key);
+	// Bucket * b = &buckets[hash % buckets.size()];
+	Bucket * b = &buckets[hash & (buckets.size() - 1)];
+
+	// Walk the chain looking for a matching element
+	for (Elem * e = b->pHead; e; e = e->pNext)
+	{
+		if (e->hash == hash && e->key == key)
+			return std::make_pair(&e->value, false);
+	}
+
+	// Resize larger if we're out of elements
+	if (!pElemFreeHead)
+	{
+		Rehash(buckets.size() * 2);
+
+		// Need to re-lookup the bucket since we resized
+		// b = &buckets[hash % buckets.size()];
+		b = &buckets[hash & (buckets.size() - 1)];
+	}
+
+	// Grab the next element off the free list
+	assert(pElemFreeHead);
+	Elem * e = pElemFreeHead;
+	pElemFreeHead = e->pNext;
+
+	// Insert the new element into the bucket
+	e->pNext = b->pHead;
+	b->pHead = e;
+
+	// Store the hash, key, and value in the element
+	e->hash = hash;
+	e->key = KeyTraits<K>::Make(key);
+	e->value = V();
+
+	++size;
+	return std::make_pair(&e->value, true);
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+bool C0HashTable<K, V, A>::InsertOrAssign(const Q & key, const V & value)
+{
+	auto result = FindOrInsert(key);
+	*result.first = value;
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q, typename F>
+bool C0HashTable<K, V, A>::Upsert(const Q & key, F fn)
+{
+	auto result = FindOrInsert(key);
+	fn(*result.first);
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+void C0HashTable<K, V, A>::Reserve(size_t maxSize)
 {
     maxSize |= maxSize >> 1;
     maxSize |= maxSize >> 2;
     maxSize |= maxSize >> 4;
     maxSize |= maxSize >> 8;
     maxSize |= maxSize >> 16;
+    maxSize |= maxSize >> 32;
 
-	Rehash(maxSize);
+	Rehash(maxSize + 1);
 }
 
-template <typename K, typename V>
-void C0HashTable<K, V>::Rehash(size_t bucketCountNew)
+template <typename K, typename V, typename A>
+void C0HashTable<K, V, A>::Rehash(size_t bucketCountNew)
 {
 	// Can't rehash down to smaller than current size or initial size
 	bucketCountNew = std::max(std::max(bucketCountNew, size),
 						   size_t(s_hashTableInitialSize));
 
 	// Build a new set of buckets and elements
-	std::vector<Bucket> bucketsNew(bucketCountNew);
-	std::vector<Elem> elemPoolNew(bucketCountNew);
+	TableVector<Bucket, A> bucketsNew(bucketCountNew, Bucket(), buckets.get_allocator());
+	TableVector<Elem, A> elemPoolNew(bucketCountNew, Elem(), elemPool.get_allocator());
 
 	// Walk through all the current elements, move them into the new
 	// element pool and insert them into the new buckets
@@ -650,8 +1619,22 @@ void C0HashTable<K, V>::Rehash(size_t bucketCountNew)
 		elemPool[i].pNext = &elemPool[i+1];
 }
 
-template <typename K, typename V>
-void C0HashTable<K, V>::Reset()
+template <typename K, typename V, typename A>
+void C0HashTable<K, V, A>::ShrinkToFit()
+{
+	Reserve(size);
+}
+
+template <typename K, typename V, typename A>
+void C0HashTable<K, V, A>::ShrinkIfSparse()
+{
+	// Under 1/8 full: rebuild with room for twice the keys left
+	if (size * 8 < buckets.size() && buckets.size() > s_hashTableInitialSize)
+		Reserve(size * 2);
+}
+
+template <typename K, typename V, typename A>
+void C0HashTable<K, V, A>::Reset()
 {
 	// Blow away the current table and reset to small initial size
 	buckets.clear();
@@ -667,20 +1650,37 @@ void C0HashTable<K, V>::Reset()
 	size = 0;
 }
 
+template <typename K, typename V, typename A>
+HashTableStats C0HashTable<K, V, A>::GetStats() const
+{
+	return ChainStats(buckets.size(), [&](size_t i)
+		{
+			size_t length = 0;
+			for (const Elem * e = buckets[i].pHead; e; e = e->pNext)
+				++length;
+			return length;
+		});
+}
+
 
 
 // C1HashTable implementation
 
 static const size_t s_63Bits = 0x7fffffffffffffffULL;
 
-template <typename K, typename V>
-C1HashTable<K, V>::C1HashTable()
-:	size(0)
+template <typename K, typename V, typename A>
+C1HashTable<K, V, A>::C1HashTable(const A & alloc)
+:	buckets(alloc),
+	states(alloc),
+	elemPool(alloc),
+	size(0),
+	autoShrink(false)
 {
 	// Start off with a small initial size.  Since we have space for an
 	// element in the bucket itself, start with only half as many elements
 	// in the element pool.
 	buckets.resize(s_hashTableInitialSize);
+	states.Assign(s_hashTableInitialSize);
 	elemPool.resize(s_hashTableInitialSize / 2);
 
 	// Build the initial free list
@@ -689,20 +1689,21 @@ C1HashTable<K, V>::C1HashTable()
 		elemPool[i].pNext = &elemPool[i+1];
 }
 
-template <typename K, typename V>
-void C1HashTable<K, V>::Insert(K key, V value)
+template <typename K, typename V, typename A>
+void C1HashTable<K, V, A>::Insert(const K & key, const V & value)
 {
 	// Hash the key and look up the appropriate bucket
 	const auto hash = HashKey(key) & s_63Bits;
 	// Bucket * b = &buckets[hash % buckets.size()];
-	Bucket * b = &buckets[hash & (buckets.size() - 1)];
+	size_t iBucket = hash & (buckets.size() - 1);
+	Bucket * b = &buckets[iBucket];
 
 	// Is the bucket empty?
-	if (!b->filled)
+	if (!GetBucketState(*b, states, iBucket))
 	{
 		// Store it in the bucket. Done.
-		b->filled = true;
-		b->hash = hash;
+		SetBucketState(*b, states, iBucket, 1);
+		SetBucketHash(*b, hash);
 		b->key = key;
 		b->value = value;
 		++size;
@@ -716,14 +1717,15 @@ void C1HashTable<K, V>::Insert(K key, V value)
 
 		// Need to re-lookup the bucket since we resized
 		// b = &buckets[hash % buckets.size()];
-		b = &buckets[hash & (buckets.size() - 1)];
+		iBucket = hash & (buckets.size() - 1);
+		b = &buckets[iBucket];
 
 		// Is the bucket empty?
-		if (!b->filled)
+		if (!GetBucketState(*b, states, iBucket))
 		{
 			// Store it in the bucket. Done.
-			b->filled = true;
-			b->hash = hash;
+			SetBucketState(*b, states, iBucket, 1);
+			SetBucketHash(*b, hash);
 			b->key = key;
 			b->value = value;
 			++size;
@@ -741,26 +1743,30 @@ void C1HashTable<K, V>::Insert(K key, V value)
 	b->pHead = e;
 
 	// Store the hash, key, and value in the element
-	e->hash = hash;
+	SetBucketHash(*e, hash);
 	e->key = key;
 	e->value = value;
 
 	++size;
 }
 
-template <typename K, typename V>
-V * C1HashTable<K, V>::Lookup(K key)
+template <typename K, typename V, typename A>
+template <typename Q>
+V * C1HashTable<K, V, A>::Lookup(const Q & keyIn)
 {
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
 	// Hash the key and look up the appropriate bucket
 	const auto hash = HashKey(key) & s_63Bits;
 	// Bucket * b = &buckets[hash % buckets.size()];
-	Bucket * b = &buckets[hash & (buckets.size() - 1)];
+	size_t iBucket = hash & (buckets.size() - 1);
+	Bucket * b = &buckets[iBucket];
 
-	if (!b->filled)
+	if (!GetBucketState(*b, states, iBucket))
 		return nullptr;
 
 	// Check if it's in the bucket itself
-	if (b->hash == hash && b->key == key)
+	if (BucketHashMatches(*b, hash) && b->key == key)
 	{
 		return &b->value;
 	}
@@ -768,49 +1774,55 @@ V * C1HashTable<K, V>::Lookup(K key)
 	// Walk the chain looking for a matching element
 	for (Elem * e = b->pHead; e; e = e->pNext)
 	{
-		if (e->hash == hash && e->key == key)
+		if (BucketHashMatches(*e, hash) && e->key == key)
 			return &e->value;
 	}
 
 	return nullptr;
 }
 
-template <typename K, typename V>
-bool C1HashTable<K, V>::Remove(K key)
+template <typename K, typename V, typename A>
+template <typename Q>
+bool C1HashTable<K, V, A>::Remove(const Q & keyIn)
 {
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
 	// Hash the key and look up the appropriate bucket
 	const auto hash = HashKey(key) & s_63Bits;
 	// Bucket * b = &buckets[hash % buckets.size()];
-	Bucket * b = &buckets[hash & (buckets.size() - 1)];
+	size_t iBucket = hash & (buckets.size() - 1);
+	Bucket * b = &buckets[iBucket];
 
-	if (!b->filled)
-		return nullptr;
+	if (!GetBucketState(*b, states, iBucket))
+		return false;
 
 	// Check if it's in the bucket itself
-	if (b->hash == hash && b->key == key)
+	if (BucketHashMatches(*b, hash) && b->key == key)
 	{
 		// If the bucket has a chain, move the first element of the chain
 		// into the bucket
 		if (Elem * pHead = b->pHead)
 		{
 			b->pHead = pHead->pNext;
-			b->hash = pHead->hash;
+			SetBucketHash(*b, BucketHashOr(*pHead, [&]() { return HashKey(pHead->key) & s_63Bits; }));
 			b->key = std::move(pHead->key);
 			b->value = std::move(pHead->value);
 
 			// Put the removed element back on the free list
-			pHead->hash = 0;
+			SetBucketHash(*pHead, 0);
 			pHead->pNext = pElemFreeHead;
 			pElemFreeHead = pHead;
 		}
 		else
 		{
 			// The bucket is now empty
-			b->hash = 0;
-			b->filled = false;
+			SetBucketHash(*b, 0);
+			SetBucketState(*b, states, iBucket, 0);
 		}
 
 		--size;
+		if (autoShrink)
+			ShrinkIfSparse();
 		return true;
 	}
 
@@ -821,7 +1833,7 @@ bool C1HashTable<K, V>::Remove(K key)
 	Elem * eRemoved = nullptr;
 
 	// Check the first element
-	if (pHead->hash == hash && pHead->key == key)
+	if (BucketHashMatches(*pHead, hash) && pHead->key == key)
 	{
 		eRemoved = pHead;
 		b->pHead = pHead->pNext;
@@ -833,7 +1845,7 @@ bool C1HashTable<K, V>::Remove(K key)
 			 e;
 			 ePrev = e, e = e->pNext)
 		{
-			if (e->hash == hash && e->key == key)
+			if (BucketHashMatches(*e, hash) && e->key == key)
 			{
 				eRemoved = e;
 				ePrev->pNext = e->pNext;
@@ -845,37 +1857,127 @@ bool C1HashTable<K, V>::Remove(K key)
 	if (eRemoved)
 	{
 		// Put eRemoved back on the free list
-		eRemoved->hash = 0;
+		SetBucketHash(*eRemoved, 0);
 		eRemoved->pNext = pElemFreeHead;
 		pElemFreeHead = eRemoved;
 		--size;
+		if (autoShrink)
+			ShrinkIfSparse();
 	}
 
 	return (eRemoved != nullptr);
 }
 
-template <typename K, typename V>
-void C1HashTable<K, V>::Reserve(size_t maxSize)
+template <typename K, typename V, typename A>
+template <typename Q>
+std::pair<V *, bool> C1HashTable<K, V, A>::FindOrInsert(const Q & keyIn)
 {
-    maxSize |= maxSize >> 1;
-    maxSize |= maxSize >> 2;
-    maxSize |= maxSize >> 4;
-    maxSize |= maxSize >> 8;
-    maxSize |= maxSize >> 16;
+	const typename KeyTraits<K>::Probe & key = keyIn;
 
-	Rehash(maxSize);
-}
+	// Hash the key and look up the appropriate bucket
+	const auto hash = HashKey(key) & s_63Bits;
+	// Bucket * b = &buckets[hash % buckets.size()];
+	size_t iBucket = hash & (buckets.size() - 1);
+	Bucket * b = &buckets[iBucket];
 
-template <typename K, typename V>
-void C1HashTable<K, V>::Rehash(size_t bucketCountNew)
-{
-	// Can't rehash down to smaller than current size or initial size
-	bucketCountNew = std::max(std::max(bucketCountNew, size),
-						   size_t(s_hashTableInitialSize));
+	if (GetBucketState(*b, states, iBucket))
+	{
+		// Check if it's in the bucket itself
+		if (BucketHashMatches(*b, hash) && b->key == key)
+			return std::make_pair(&b->value, false);
+
+		// Walk the chain looking for a matching element
+		for (Elem * e = b->pHead; e; e = e->pNext)
+		{
+			if (BucketHashMatches(*e, hash) && e->key == key)
+				return std::make_pair(&e->value, false);
+		}
+
+		// Resize larger if we're out of elements
+		if (!pElemFreeHead)
+		{
+			Rehash(buckets.size() * 2);
+
+			// Need to re-lookup the bucket since we resized
+			// b = &buckets[hash % buckets.size()];
+			iBucket = hash & (buckets.size() - 1);
+			b = &buckets[iBucket];
+		}
+	}
+
+	// Is the bucket empty?
+	if (!GetBucketState(*b, states, iBucket))
+	{
+		// Store it in the bucket. Done.
+		SetBucketState(*b, states, iBucket, 1);
+		SetBucketHash(*b, hash);
+		b->key = KeyTraits<K>::Make(key);
+		b->value = V();
+		++size;
+		return std::make_pair(&b->value, true);
+	}
+
+	// Grab the next element off the free list
+	assert(pElemFreeHead);
+	Elem * e = pElemFreeHead;
+	pElemFreeHead = e->pNext;
+
+	// Insert the new element into the bucket
+	e->pNext = b->pHead;
+	b->pHead = e;
+
+	// Store the hash, key, and value in the element
+	SetBucketHash(*e, hash);
+	e->key = KeyTraits<K>::Make(key);
+	e->value = V();
+
+	++size;
+	return std::make_pair(&e->value, true);
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+bool C1HashTable<K, V, A>::InsertOrAssign(const Q & key, const V & value)
+{
+	auto result = FindOrInsert(key);
+	*result.first = value;
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q, typename F>
+bool C1HashTable<K, V, A>::Upsert(const Q & key, F fn)
+{
+	auto result = FindOrInsert(key);
+	fn(*result.first);
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+void C1HashTable<K, V, A>::Reserve(size_t maxSize)
+{
+    maxSize |= maxSize >> 1;
+    maxSize |= maxSize >> 2;
+    maxSize |= maxSize >> 4;
+    maxSize |= maxSize >> 8;
+    maxSize |= maxSize >> 16;
+    maxSize |= maxSize >> 32;
+
+	Rehash(maxSize + 1);
+}
+
+template <typename K, typename V, typename A>
+void C1HashTable<K, V, A>::Rehash(size_t bucketCountNew)
+{
+	// Can't rehash down to smaller than current size or initial size
+	bucketCountNew = std::max(std::max(bucketCountNew, size),
+						   size_t(s_hashTableInitialSize));
 
 	// Build a new set of buckets and elements
-	std::vector<Bucket> bucketsNew(bucketCountNew);
-	std::vector<Elem> elemPoolNew(bucketCountNew / 2);
+	TableVector<Bucket, A> bucketsNew(bucketCountNew, Bucket(), buckets.get_allocator());
+	BucketStates<1, !StoreHash<K>::value, A> statesNew(buckets.get_allocator());
+	statesNew.Assign(bucketCountNew);
+	TableVector<Elem, A> elemPoolNew(bucketCountNew / 2, Elem(), elemPool.get_allocator());
 
 	// Walk through all the current elements, move them into the new
 	// element pool and insert them into the new buckets
@@ -884,18 +1986,19 @@ void C1HashTable<K, V>::Rehash(size_t bucketCountNew)
 	{
 		Bucket * b = &buckets[i];
 
-		if (!b->filled)
+		if (!GetBucketState(*b, states, i))
 			continue;
 
 		// Handle the element in the bucket
-		const auto hash = b->hash;
+		const size_t hash = BucketHashOr(*b, [&]() { return HashKey(b->key) & s_63Bits; });
 		// Bucket * bNew = &bucketsNew[hash % bucketCountNew];
-		Bucket * bNew = &bucketsNew[hash & (bucketCountNew - 1)];
-		if (!bNew->filled)
+		size_t iBucketNew = hash & (bucketCountNew - 1);
+		Bucket * bNew = &bucketsNew[iBucketNew];
+		if (!GetBucketState(*bNew, statesNew, iBucketNew))
 		{
 			// Store it in the bucket. Done.
-			bNew->filled = true;
-			bNew->hash = hash;
+			SetBucketState(*bNew, statesNew, iBucketNew, 1);
+			SetBucketHash(*bNew, hash);
 			// Note: can't move from old key and value because we might
 			// have to use the escape hatch (rehash even bigger) later.
 			bNew->key = b->key;
@@ -919,7 +2022,7 @@ void C1HashTable<K, V>::Rehash(size_t bucketCountNew)
 			bNew->pHead = eNew;
 
 			// Store the hash, key, and value in the element
-			eNew->hash = hash;
+			SetBucketHash(*eNew, hash);
 			// Note: can't move from old key and value because we might
 			// have to use the escape hatch (rehash even bigger) later.
 			eNew->key = b->key;
@@ -929,15 +2032,16 @@ void C1HashTable<K, V>::Rehash(size_t bucketCountNew)
 		// Handle the elements in the chain
 		for (Elem * e = b->pHead; e; e = e->pNext)
 		{
-			const auto hash = e->hash;
+			const size_t hash = BucketHashOr(*e, [&]() { return HashKey(e->key) & s_63Bits; });
 			// Bucket * bNew = &bucketsNew[hash % bucketCountNew];
-			Bucket * bNew = &bucketsNew[hash & (bucketCountNew - 1)];
+			size_t iBucketNew = hash & (bucketCountNew - 1);
+			Bucket * bNew = &bucketsNew[iBucketNew];
 
-			if (!bNew->filled)
+			if (!GetBucketState(*bNew, statesNew, iBucketNew))
 			{
 				// Store it in the bucket. Done.
-				bNew->filled = true;
-				bNew->hash = hash;
+				SetBucketState(*bNew, statesNew, iBucketNew, 1);
+				SetBucketHash(*bNew, hash);
 				// Note: can't move from old key and value because we might
 				// have to use the escape hatch (rehash even bigger) later.
 				bNew->key = e->key;
@@ -961,7 +2065,7 @@ void C1HashTable<K, V>::Rehash(size_t bucketCountNew)
 				bNew->pHead = eNew;
 
 				// Store the hash, key, and value in the element
-				eNew->hash = hash;
+				SetBucketHash(*eNew, hash);
 				// Note: can't move from old key and value because we might
 				// have to use the escape hatch (rehash even bigger) later.
 				eNew->key = e->key;
@@ -972,6 +2076,7 @@ void C1HashTable<K, V>::Rehash(size_t bucketCountNew)
 
 	// Swap the new buckets and elements into place
 	buckets.swap(bucketsNew);
+	states.swap(statesNew);
 	elemPool.swap(elemPoolNew);
 
 	// Build a free list of the remaining elements in the pool
@@ -980,12 +2085,27 @@ void C1HashTable<K, V>::Rehash(size_t bucketCountNew)
 		elemPool[i].pNext = &elemPool[i+1];
 }
 
-template <typename K, typename V>
-void C1HashTable<K, V>::Reset()
+template <typename K, typename V, typename A>
+void C1HashTable<K, V, A>::ShrinkToFit()
+{
+	Reserve(size);
+}
+
+template <typename K, typename V, typename A>
+void C1HashTable<K, V, A>::ShrinkIfSparse()
+{
+	// Under 1/8 full: rebuild with room for twice the keys left
+	if (size * 8 < buckets.size() && buckets.size() > s_hashTableInitialSize)
+		Reserve(size * 2);
+}
+
+template <typename K, typename V, typename A>
+void C1HashTable<K, V, A>::Reset()
 {
 	// Blow away the current table and reset to small initial size
 	buckets.clear();
 	buckets.resize(s_hashTableInitialSize);
+	states.Assign(s_hashTableInitialSize);
 	elemPool.clear();
 	elemPool.resize(s_hashTableInitialSize / 2);
 
@@ -997,31 +2117,403 @@ void C1HashTable<K, V>::Reset()
 	size = 0;
 }
 
+template <typename K, typename V, typename A>
+HashTableStats C1HashTable<K, V, A>::GetStats() const
+{
+	// The element inline in the bucket counts as the first in its chain
+	return ChainStats(buckets.size(), [&](size_t i)
+		{
+			if (!GetBucketState(buckets[i], states, i))
+				return size_t(0);
+			size_t length = 1;
+			for (const Elem * e = buckets[i].pHead; e; e = e->pNext)
+				++length;
+			return length;
+		});
+}
+
+
+
+// LHHashTable implementation
+
+template <typename K, typename V, typename A>
+const int LHHashTable<K, V, A>::s_segmentShift;
+template <typename K, typename V, typename A>
+const size_t LHHashTable<K, V, A>::s_segmentSize;
+template <typename K, typename V, typename A>
+const uint32_t LHHashTable<K, V, A>::s_end;
+
+template <typename K, typename V, typename A>
+LHHashTable<K, V, A>::LHHashTable(const A & alloc)
+:	bucketSegments(alloc),
+	elemSegments(alloc),
+	iElemFree(s_end),
+	bucketCount(0),
+	lowMask(0),
+	iSplit(0),
+	size(0),
+	autoShrink(false)
+{
+	// Start off with a small initial size
+	InitSegments(s_hashTableInitialSize);
+}
+
+template <typename K, typename V, typename A>
+size_t LHHashTable<K, V, A>::BucketIndex(size_t hash) const
+{
+	size_t i = hash & lowMask;
+	if (i < iSplit)
+		i = hash & (lowMask * 2 + 1);
+	return i;
+}
+
+template <typename K, typename V, typename A>
+void LHHashTable<K, V, A>::InitSegments(size_t bucketCountNew)
+{
+	// The bits in use this round: the biggest power of two (times the
+	// initial size) that fits, with the rest of the buckets already split
+	size_t bucketCountLow = s_hashTableInitialSize;
+	while (bucketCountLow * 2 <= bucketCountNew)
+		bucketCountLow *= 2;
+	lowMask = bucketCountLow - 1;
+	iSplit = bucketCountNew - bucketCountLow;
+	bucketCount = bucketCountNew;
+
+	// Segments for the buckets, and for as many elements
+	bucketSegments.clear();
+	elemSegments.clear();
+	iElemFree = s_end;
+	size_t segmentCount = (bucketCountNew + s_segmentSize - 1) >> s_segmentShift;
+	for (size_t i = 0; i < segmentCount; ++i)
+	{
+		bucketSegments.emplace_back(s_segmentSize, s_end, typename BucketSegment::allocator_type(bucketSegments.get_allocator()));
+		AddElemSegment();
+	}
+}
+
+template <typename K, typename V, typename A>
+void LHHashTable<K, V, A>::AddElemSegment()
+{
+	uint32_t iFirst = uint32_t(elemSegments.size() << s_segmentShift);
+	elemSegments.emplace_back(s_segmentSize, Elem(), typename ElemSegment::allocator_type(elemSegments.get_allocator()));
+
+	// Put its elements on the front of the free list, in order, so they're
+	// handed out front to back
+	ElemSegment & segment = elemSegments.back();
+	for (size_t i = s_segmentSize; i-- > 0; )
+	{
+		segment[i].next = iElemFree;
+		iElemFree = iFirst + uint32_t(i);
+	}
+}
+
+template <typename K, typename V, typename A>
+uint32_t LHHashTable<K, V, A>::TakeElem()
+{
+	// Add a segment of elements if we're out of them
+	if (iElemFree == s_end)
+		AddElemSegment();
+
+	uint32_t index = iElemFree;
+	iElemFree = ElemAt(index).next;
+	return index;
+}
+
+template <typename K, typename V, typename A>
+void LHHashTable<K, V, A>::SplitBucket()
+{
+	// The new bucket goes on the end, in a new segment if it's the first of one
+	size_t iNew = bucketCount;
+	if ((iNew >> s_segmentShift) >= bucketSegments.size())
+		bucketSegments.emplace_back(s_segmentSize, s_end, typename BucketSegment::allocator_type(bucketSegments.get_allocator()));
+
+	// Keys with the next bit of the hash set move to it; the rest stay
+	uint32_t & bOld = BucketAt(iSplit);
+	uint32_t & bNew = BucketAt(iNew);
+	const size_t bitNew = lowMask + 1;
+	uint32_t index = bOld;
+	bOld = s_end;
+	while (index != s_end)
+	{
+		Elem & e = ElemAt(index);
+		uint32_t indexNext = e.next;
+		size_t hash = BucketHashOr(e, [&]() { return size_t(HashKey(e.key)); });
+		uint32_t & b = (hash & bitNew) ? bNew : bOld;
+		e.next = b;
+		b = index;
+		index = indexNext;
+	}
+
+	// Once every bucket has split, the next round uses one more bit
+	++bucketCount;
+	if (++iSplit == bitNew)
+	{
+		lowMask = lowMask * 2 + 1;
+		iSplit = 0;
+	}
+}
+
+template <typename K, typename V, typename A>
+void LHHashTable<K, V, A>::Insert(const K & key, const V & value)
+{
+	// Split a bucket for every key past one per bucket
+	if (size >= bucketCount)
+		SplitBucket();
+
+	// Hash the key and look up the appropriate bucket
+	const size_t hash = HashKey(key);
+	uint32_t & b = BucketAt(BucketIndex(hash));
+
+	// Insert a new element into the bucket
+	uint32_t index = TakeElem();
+	Elem & e = ElemAt(index);
+	e.next = b;
+	b = index;
+
+	// Store the hash, key, and value in the element
+	SetBucketHash(e, hash);
+	e.key = key;
+	e.value = value;
+
+	++size;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+V * LHHashTable<K, V, A>::Lookup(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	// Hash the key and look up the appropriate bucket
+	const size_t hash = HashKey(key);
+
+	// Walk the chain looking for a matching element
+	for (uint32_t index = BucketAt(BucketIndex(hash)); index != s_end; )
+	{
+		Elem & e = ElemAt(index);
+		if (BucketHashMatches(e, hash) && e.key == key)
+			return &e.value;
+		index = e.next;
+	}
+
+	return nullptr;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+bool LHHashTable<K, V, A>::Remove(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	// Hash the key and look up the appropriate bucket
+	const size_t hash = HashKey(key);
+
+	// Walk the chain looking for a matching element, keeping the link to it
+	for (uint32_t * pLink = &BucketAt(BucketIndex(hash)); *pLink != s_end; )
+	{
+		uint32_t index = *pLink;
+		Elem & e = ElemAt(index);
+		if (BucketHashMatches(e, hash) && e.key == key)
+		{
+			// Unlink it and put it back on the free list
+			*pLink = e.next;
+			e.next = iElemFree;
+			iElemFree = index;
+			--size;
+			if (autoShrink)
+				ShrinkIfSparse();
+			return true;
+		}
+		pLink = &e.next;
+	}
+
+	return false;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+std::pair<V *, bool> LHHashTable<K, V, A>::FindOrInsert(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	// Hash the key and look up the appropriate bucket
+	const size_t hash = HashKey(key);
+	size_t iBucket = BucketIndex(hash);
+
+	// Walk the chain looking for a matching element
+	for (uint32_t index = BucketAt(iBucket); index != s_end; )
+	{
+		Elem & e = ElemAt(index);
+		if (BucketHashMatches(e, hash) && e.key == key)
+			return std::make_pair(&e.value, false);
+		index = e.next;
+	}
+
+	// Split a bucket for every key past one per bucket; the key's bucket
+	// may be the one that split, so look it up again
+	if (size >= bucketCount)
+	{
+		SplitBucket();
+		iBucket = BucketIndex(hash);
+	}
+
+	// Insert a new element into the bucket
+	uint32_t index = TakeElem();
+	uint32_t & b = BucketAt(iBucket);
+	Elem & e = ElemAt(index);
+	e.next = b;
+	b = index;
+
+	// Store the hash, key, and value in the element
+	SetBucketHash(e, hash);
+	e.key = KeyTraits<K>::Make(key);
+	e.value = V();
+
+	++size;
+	return std::make_pair(&e.value, true);
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+bool LHHashTable<K, V, A>::InsertOrAssign(const Q & key, const V & value)
+{
+	auto result = FindOrInsert(key);
+	*result.first = value;
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q, typename F>
+bool LHHashTable<K, V, A>::Upsert(const Q & key, F fn)
+{
+	auto result = FindOrInsert(key);
+	fn(*result.first);
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+void LHHashTable<K, V, A>::Reserve(size_t maxSize)
+{
+	// Any bucket count will do, so no rounding up to a power of two
+	Rehash(maxSize);
+}
+
+template <typename K, typename V, typename A>
+void LHHashTable<K, V, A>::Rehash(size_t bucketCountNew)
+{
+	// Can't rehash down to smaller than current size or initial size
+	bucketCountNew = std::max(std::max(bucketCountNew, size),
+						   size_t(s_hashTableInitialSize));
+
+	// Build new segments, keeping the old ones to walk
+	TableVector<BucketSegment, A> bucketSegmentsOld(bucketSegments.get_allocator());
+	TableVector<ElemSegment, A> elemSegmentsOld(elemSegments.get_allocator());
+	bucketSegmentsOld.swap(bucketSegments);
+	elemSegmentsOld.swap(elemSegments);
+	const size_t bucketCountOld = bucketCount;
+	InitSegments(bucketCountNew);
+
+	// Walk through all the current elements, move them into the new
+	// elements and insert them into the new buckets
+	for (size_t i = 0; i < bucketCountOld; ++i)
+	{
+		uint32_t index = bucketSegmentsOld[i >> s_segmentShift][i & (s_segmentSize - 1)];
+		while (index != s_end)
+		{
+			Elem & e = elemSegmentsOld[index >> s_segmentShift][index & (s_segmentSize - 1)];
+			size_t hash = BucketHashOr(e, [&]() { return size_t(HashKey(e.key)); });
+
+			uint32_t indexNew = TakeElem();
+			uint32_t & bNew = BucketAt(BucketIndex(hash));
+			Elem & eNew = ElemAt(indexNew);
+			eNew.next = bNew;
+			bNew = indexNew;
+
+			SetBucketHash(eNew, hash);
+			eNew.key = std::move(e.key);
+			eNew.value = std::move(e.value);
+
+			index = e.next;
+		}
+	}
+}
+
+template <typename K, typename V, typename A>
+void LHHashTable<K, V, A>::ShrinkToFit()
+{
+	Reserve(size);
+}
+
+template <typename K, typename V, typename A>
+void LHHashTable<K, V, A>::ShrinkIfSparse()
+{
+	// Under 1/8 full: rebuild with room for twice the keys left
+	if (size * 8 < bucketCount && bucketCount > s_hashTableInitialSize)
+		Reserve(size * 2);
+}
+
+template <typename K, typename V, typename A>
+void LHHashTable<K, V, A>::Reset()
+{
+	// Blow away the current table and reset to small initial size
+	InitSegments(s_hashTableInitialSize);
+
+	size = 0;
+}
+
+template <typename K, typename V, typename A>
+HashTableStats LHHashTable<K, V, A>::GetStats() const
+{
+	return ChainStats(bucketCount, [&](size_t i)
+		{
+			size_t length = 0;
+			for (uint32_t index = BucketAt(i); index != s_end; index = ElemAt(index).next)
+				++length;
+			return length;
+		});
+}
+
 
 
 // OLHashTable implementation
 
 static const size_t s_62Bits = 0x3fffffffffffffffULL;
 
-template <typename K, typename V>
-OLHashTable<K, V>::OLHashTable()
-:	size(0)
+template <typename K, typename V, typename A>
+OLHashTable<K, V, A>::OLHashTable(const A & alloc)
+:	buckets(alloc),
+	states(alloc),
+	size(0),
+	tombstones(0),
+	rehashThreads(1),
+	autoShrink(false)
 {
 	// Start off with a small initial size
 	buckets.resize(s_hashTableInitialSize);
+	states.Assign(s_hashTableInitialSize);
 }
 
-template <typename K, typename V>
-void OLHashTable<K, V>::Insert(K key, V value)
+template <typename K, typename V, typename A>
+void OLHashTable<K, V, A>::Insert(const K & key, const V & value)
 {
-	// Resize larger if the load factor goes over 2/3
+	// Resize larger if the load factor goes over 2/3, or clear out the
+	// tombstones if they've taken the buckets in use over 3/4
 	if (size * 3 > buckets.size() * 2)
 	{
 		Rehash(buckets.size() * 2);
 	}
+	else if ((size + tombstones) * 4 > buckets.size() * 3)
+	{
+		RehashInPlace();
+	}
 
-	// Hash the key and find the starting bucket
-	const auto hash = HashKey(key) & s_62Bits;
+	InsertHashed(HashKey(key) & s_62Bits, key, value);
+}
+
+template <typename K, typename V, typename A>
+void OLHashTable<K, V, A>::InsertHashed(size_t hash, const K & key, const V & value)
+{
+	// Find the starting bucket
 	// size_t iBucketStart = hash % buckets.size();
 	size_t iBucketStart = hash & (buckets.size() - 1);
 
@@ -1030,7 +2522,7 @@ void OLHashTable<K, V>::Insert(K key, V value)
 	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i) 
 	{
 		Bucket * b = &buckets[i];
-		if (b->state != BSTATE_Filled)
+		if (GetBucketState(*b, states, i) != BSTATE_Filled)
 		{
 			bTarget = b;
 			break;
@@ -1041,7 +2533,7 @@ void OLHashTable<K, V>::Insert(K key, V value)
 		for (size_t i = 0; i < iBucketStart; ++i)
 		{
 			Bucket * b = &buckets[i];
-			if (b->state != BSTATE_Filled)
+			if (GetBucketState(*b, states, i) != BSTATE_Filled)
 			{
 				bTarget = b;
 				break;
@@ -1050,21 +2542,45 @@ void OLHashTable<K, V>::Insert(K key, V value)
 	}
 
 	assert(bTarget);
+	size_t iTarget = size_t(bTarget - &buckets[0]);
 
 	// Store the hash, key, and value in the bucket
-	bTarget->hash = hash;
-	bTarget->state = BSTATE_Filled;
+	SetBucketHash(*bTarget, hash);
+	if (GetBucketState(*bTarget, states, iTarget) == BSTATE_Removed)
+		--tombstones;
+	SetBucketState(*bTarget, states, iTarget, BSTATE_Filled);
 	bTarget->key = key;
 	bTarget->value = value;
 
 	++size;
 }
 
-template <typename K, typename V>
-V * OLHashTable<K, V>::Lookup(K key)
+template <typename K, typename V, typename A>
+template <typename Q>
+V * OLHashTable<K, V, A>::Lookup(const Q & keyIn)
 {
-	// Hash the key and find the starting bucket
-	const auto hash = HashKey(key) & s_62Bits;
+	const typename KeyTraits<K>::Probe & key = keyIn;
+	return LookupHashed(HashKey(key) & s_62Bits, key);
+}
+
+template <typename K, typename V, typename A>
+void OLHashTable<K, V, A>::LookupBatch(const K * keys, size_t count, V ** results)
+{
+	// Hash a block of keys together, then probe for each of them
+	uint32_t hashes[s_hashBatchBlock];
+	for (size_t iBlock = 0; iBlock < count; iBlock += s_hashBatchBlock)
+	{
+		size_t n = std::min(count - iBlock, s_hashBatchBlock);
+		HashKeysBatch(keys + iBlock, n, hashes);
+		for (size_t i = 0; i < n; ++i)
+			results[iBlock + i] = LookupHashed(hashes[i] & s_62Bits, keys[iBlock + i]);
+	}
+}
+
+template <typename K, typename V, typename A>
+V * OLHashTable<K, V, A>::LookupHashed(size_t hash, const typename KeyTraits<K>::Probe & key)
+{
+	// Find the starting bucket
 	// size_t iBucketStart = hash % buckets.size();
 	size_t iBucketStart = hash & (buckets.size() - 1);
 
@@ -1072,12 +2588,12 @@ V * OLHashTable<K, V>::Lookup(K key)
 	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i)
 	{
 		Bucket * b = &buckets[i];
-		switch (b->state)
+		switch (GetBucketState(*b, states, i))
 		{
 		case BSTATE_Empty:
 			return nullptr;
 		case BSTATE_Filled:
-			if (b->hash == hash && b->key == key)
+			if (BucketHashMatches(*b, hash) && b->key == key)
 				return &b->value;
 			break;
 		default:
@@ -1087,12 +2603,12 @@ V * OLHashTable<K, V>::Lookup(K key)
 	for (size_t i = 0; i < iBucketStart; ++i)
 	{
 		Bucket * b = &buckets[i];
-		switch (b->state)
+		switch (GetBucketState(*b, states, i))
 		{
 		case BSTATE_Empty:
 			return nullptr;
 		case BSTATE_Filled:
-			if (b->hash == hash && b->key == key)
+			if (BucketHashMatches(*b, hash) && b->key == key)
 				return &b->value;
 			break;
 		default:
@@ -1103,9 +2619,12 @@ V * OLHashTable<K, V>::Lookup(K key)
 	return nullptr;
 }
 
-template <typename K, typename V>
-bool OLHashTable<K, V>::Remove(K key)
+template <typename K, typename V, typename A>
+template <typename Q>
+bool OLHashTable<K, V, A>::Remove(const Q & keyIn)
 {
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
 	// Hash the key and find the starting bucket
 	const auto hash = HashKey(key) & s_62Bits;
 	// size_t iBucketStart = hash % buckets.size();
@@ -1115,16 +2634,19 @@ bool OLHashTable<K, V>::Remove(K key)
 	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i)
 	{
 		Bucket * b = &buckets[i];
-		switch (b->state)
+		switch (GetBucketState(*b, states, i))
 		{
 		case BSTATE_Empty:
 			return false;
 		case BSTATE_Filled:
-			if (b->hash == hash && b->key == key)
+			if (BucketHashMatches(*b, hash) && b->key == key)
 			{
-				b->hash = 0;
-				b->state = BSTATE_Removed;
+				SetBucketHash(*b, 0);
+				SetBucketState(*b, states, i, BSTATE_Removed);
 				--size;
+				++tombstones;
+				if (autoShrink)
+					ShrinkIfSparse();
 				return true;
 			}
 			break;
@@ -1135,16 +2657,19 @@ bool OLHashTable<K, V>::Remove(K key)
 	for (size_t i = 0; i < iBucketStart; ++i)
 	{
 		Bucket * b = &buckets[i];
-		switch (b->state)
+		switch (GetBucketState(*b, states, i))
 		{
 		case BSTATE_Empty:
 			return false;
 		case BSTATE_Filled:
-			if (b->hash == hash && b->key == key)
+			if (BucketHashMatches(*b, hash) && b->key == key)
 			{
-				b->hash = 0;
-				b->state = BSTATE_Removed;
+				SetBucketHash(*b, 0);
+				SetBucketState(*b, states, i, BSTATE_Removed);
 				--size;
+				++tombstones;
+				if (autoShrink)
+					ShrinkIfSparse();
 				return true;
 			}
 			break;
@@ -1156,320 +2681,405 @@ bool OLHashTable<K, V>::Remove(K key)
 	return false;
 }
 
-template <typename K, typename V>
-void OLHashTable<K, V>::Reserve(size_t maxSize)
+template <typename K, typename V, typename A>
+template <typename Q>
+std::pair<V *, bool> OLHashTable<K, V, A>::FindOrInsert(const Q & keyIn)
 {
-	maxSize = maxSize * 3 / 2;
-
-    maxSize |= maxSize >> 1;
-    maxSize |= maxSize >> 2;
-    maxSize |= maxSize >> 4;
-    maxSize |= maxSize >> 8;
-    maxSize |= maxSize >> 16;
+	const typename KeyTraits<K>::Probe & key = keyIn;
 
-	Rehash(maxSize);
-}
+	// Resize larger if the load factor goes over 2/3, or clear out the
+	// tombstones if they've taken the buckets in use over 3/4
+	if (size * 3 > buckets.size() * 2)
+	{
+		Rehash(buckets.size() * 2);
+	}
+	else if ((size + tombstones) * 4 > buckets.size() * 3)
+	{
+		RehashInPlace();
+	}
 
-template <typename K, typename V>
-void OLHashTable<K, V>::Rehash(size_t bucketCountNew)
-{
-	// Can't rehash down to smaller than current size or initial size
-	bucketCountNew = std::max(std::max(bucketCountNew, size),
-						   size_t(s_hashTableInitialSize));
+	// Hash the key and find the starting bucket
+	const auto hash = HashKey(key) & s_62Bits;
+	// size_t iBucketStart = hash % buckets.size();
+	size_t iBucketStart = hash & (buckets.size() - 1);
 
-	// Build a new set of buckets
-	std::vector<Bucket> bucketsNew(bucketCountNew);
-
-	// Walk through all the current elements and insert them into the new buckets
-	for (size_t i = 0, iEnd = buckets.size(); i < iEnd; ++i)
+	// Search the buckets until we hit an empty one, remembering the first
+	// unused bucket along the way in case the key isn't there
+	Bucket * bTarget = nullptr;
+	bool hitEmpty = false;
+	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd && !hitEmpty; ++i)
 	{
 		Bucket * b = &buckets[i];
-		if (b->state != BSTATE_Filled)
-			continue;
-
-		// Hash the key and find the starting bucket
-		const auto hash = b->hash;
-		// size_t iBucketStart = hash % bucketCountNew;
-		size_t iBucketStart = hash & (bucketCountNew - 1);
-
-		// Search for an unused bucket
-		Bucket * bTarget = nullptr;
-		for (size_t j = iBucketStart; j < bucketCountNew; ++j) 
+		switch (GetBucketState(*b, states, i))
 		{
-			Bucket * bNew = &bucketsNew[j];
-			if (bNew->state != BSTATE_Filled)
-			{
-				bTarget = bNew;
-				break;
-			}
-		}
-		if (!bTarget)
-		{
-			for (size_t j = 0; j < iBucketStart; ++j)
-			{
-				Bucket * bNew = &bucketsNew[j];
-				if (bNew->state != BSTATE_Filled)
-				{
-					bTarget = bNew;
-					break;
-				}
-			}
+		case BSTATE_Empty:
+			hitEmpty = true;
+			if (!bTarget)
+				bTarget = b;
+			break;
+		case BSTATE_Filled:
+			if (BucketHashMatches(*b, hash) && b->key == key)
+				return std::make_pair(&b->value, false);
+			break;
+		default:
+			if (!bTarget)
+				bTarget = b;
+			break;
 		}
-
-		assert(bTarget);
-
-		// Store the hash, key, and value in the bucket
-		bTarget->hash = hash;
-		bTarget->state = BSTATE_Filled;
-		bTarget->key = std::move(b->key);
-		bTarget->value = std::move(b->value);
-	}
-
-	// Swap the new buckets into place
-	buckets.swap(bucketsNew);
-}
-
-template <typename K, typename V>
-void OLHashTable<K, V>::Reset()
-{
-	// Blow away the current table and reset to small initial size
-	buckets.clear();
-	buckets.resize(s_hashTableInitialSize);
-
-	size = 0;
-}
-
-
-
-// OQHashTable implementation
-
-template <typename K, typename V>
-OQHashTable<K, V>::OQHashTable()
-:	size(0)
-{
-	// Start off with a small initial size
-	buckets.resize(s_hashTableInitialSize);
-}
-
-template <typename K, typename V>
-void OQHashTable<K, V>::Insert(K key, V value)
-{
-	// Resize larger if the load factor goes over 2/3
-	if (size * 3 > buckets.size() * 2)
-	{
-		Rehash(buckets.size() * 2);
 	}
-
-	// Hash the key and find the starting bucket
-	const auto hash = HashKey(key) & s_62Bits;
-	// size_t iBucketStart = hash % buckets.size();
-	size_t iBucketStart = hash & (buckets.size() - 1);
-
-	// Search for an unused bucket
-	Bucket * bTarget = nullptr;
-	for (size_t i = 0, iEnd = buckets.size(); i < iEnd; ++i)
+	for (size_t i = 0; i < iBucketStart && !hitEmpty; ++i)
 	{
-		// Evaluate the probing sequence.  This one is guaranteed to hit all
-		// elements if the table is power-of-two-sized; see:
-		//   http://en.wikipedia.org/wiki/Quadratic_probing
-		size_t probe = (iBucketStart + (i + i*i) / 2) % iEnd;
-
-		Bucket * b = &buckets[probe];
-		if (b->state != BSTATE_Filled)
+		Bucket * b = &buckets[i];
+		switch (GetBucketState(*b, states, i))
 		{
-			bTarget = b;
+		case BSTATE_Empty:
+			hitEmpty = true;
+			if (!bTarget)
+				bTarget = b;
+			break;
+		case BSTATE_Filled:
+			if (BucketHashMatches(*b, hash) && b->key == key)
+				return std::make_pair(&b->value, false);
+			break;
+		default:
+			if (!bTarget)
+				bTarget = b;
 			break;
 		}
 	}
 
 	assert(bTarget);
+	size_t iTarget = size_t(bTarget - &buckets[0]);
 
 	// Store the hash, key, and value in the bucket
-	bTarget->hash = hash;
-	bTarget->state = BSTATE_Filled;
-	bTarget->key = key;
-	bTarget->value = value;
+	SetBucketHash(*bTarget, hash);
+	if (GetBucketState(*bTarget, states, iTarget) == BSTATE_Removed)
+		--tombstones;
+	SetBucketState(*bTarget, states, iTarget, BSTATE_Filled);
+	bTarget->key = KeyTraits<K>::Make(key);
+	bTarget->value = V();
 
 	++size;
+	return std::make_pair(&bTarget->value, true);
 }
 
-template <typename K, typename V>
-V * OQHashTable<K, V>::Lookup(K key)
+template <typename K, typename V, typename A>
+template <typename Q>
+bool OLHashTable<K, V, A>::InsertOrAssign(const Q & key, const V & value)
 {
-	// Hash the key and find the starting bucket
-	const auto hash = HashKey(key) & s_62Bits;
-	// size_t iBucketStart = hash % buckets.size();
-	size_t iBucketStart = hash & (buckets.size() - 1);
-
-	// Search the buckets until we hit an empty one
-	for (size_t i = 0, iEnd = buckets.size(); i < iEnd; ++i)
-	{
-		// Evaluate the probing sequence
-		size_t probe = (iBucketStart + (i + i*i) / 2) % iEnd;
-
-		Bucket * b = &buckets[probe];
-		switch (b->state)
-		{
-		case BSTATE_Empty:
-			return nullptr;
-		case BSTATE_Filled:
-			if (b->hash == hash && b->key == key)
-				return &b->value;
-			break;
-		default:
-			break;
-		}
-	}
-
-	return nullptr;
+	auto result = FindOrInsert(key);
+	*result.first = value;
+	return result.second;
 }
 
-template <typename K, typename V>
-bool OQHashTable<K, V>::Remove(K key)
+template <typename K, typename V, typename A>
+template <typename Q, typename F>
+bool OLHashTable<K, V, A>::Upsert(const Q & key, F fn)
 {
-	// Hash the key and find the starting bucket
-	const auto hash = HashKey(key) & s_62Bits;
-	// size_t iBucketStart = hash % buckets.size();
-	size_t iBucketStart = hash & (buckets.size() - 1);
+	auto result = FindOrInsert(key);
+	fn(*result.first);
+	return result.second;
+}
 
-	// Search the buckets until we hit an empty one
-	for (size_t i = 0, iEnd = buckets.size(); i < iEnd; ++i)
+template <typename K, typename V, typename A>
+template <typename It>
+void OLHashTable<K, V, A>::BulkBuild(It first, It last)
+{
+	static_assert(std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<It>::iterator_category>::value,
+				  "BulkBuild needs a forward range: it counts the range, then reads it again");
+	// Size once for the final count, so no Rehash happens partway through
+	size_t count = size_t(std::distance(first, last));
+	if ((size + count) * 3 > buckets.size() * 2)
+		Reserve(size + count);
+
+	if (rehashThreads > 1 && count >= s_parallelRehashMinBuckets)
 	{
-		// Evaluate the probing sequence
-		size_t probe = (iBucketStart + (i + i*i) / 2) % iEnd;
-
-		Bucket * b = &buckets[probe];
-		switch (b->state)
-		{
-		case BSTATE_Empty:
-			return false;
-		case BSTATE_Filled:
-			if (b->hash == hash && b->key == key)
+		// Placing on all threads doesn't keep count of the tombstones it
+		// fills, so clear them out first
+		if (tombstones > 0)
+			RehashInPlace();
+
+		// Hash and place on all threads, the same way RehashParallel does;
+		// the keys are hashed on both partitioning passes rather than stored
+		std::vector<It> its;
+		its.reserve(count);
+		for (It it = first; it != last; ++it)
+			its.push_back(it);
+
+		std::vector<RehashEntry> entries;
+		std::vector<size_t> regionStarts;
+		PartitionForRehash(count, buckets.size(), rehashThreads,
+			[&](size_t iBegin, size_t iEnd, RehashSink & sink)
 			{
-				b->hash = 0;
-				b->state = BSTATE_Removed;
-				--size;
-				return true;
-			}
-			break;
-		default:
-			break;
-		}
+				for (size_t i = iBegin; i < iEnd; ++i)
+					sink.Add(i, HashKey(its[i]->first) & s_62Bits);
+			},
+			entries, regionStarts);
+
+		PlaceForRehash(entries, regionStarts, buckets.size(), rehashThreads,
+			[&](size_t i) { return GetBucketState(buckets[i], states, i) != BSTATE_Filled; },
+			[&](const RehashEntry & entry, size_t iBucket)
+			{
+				Bucket * b = &buckets[iBucket];
+				SetBucketHash(*b, entry.hash);
+				SetBucketState(*b, states, iBucket, BSTATE_Filled);
+				b->key = its[entry.iOld]->first;
+				b->value = its[entry.iOld]->second;
+			});
+
+		size += count;
+		return;
 	}
 
-	return false;
+	std::vector<BulkEntry<It>> entries;
+	BulkPartition(first, count, buckets.size(), entries);
+	for (size_t i = 0; i < count; ++i)
+		InsertHashed(entries[i].hash & s_62Bits, entries[i].it->first, entries[i].it->second);
 }
 
-template <typename K, typename V>
-void OQHashTable<K, V>::Reserve(size_t maxSize)
+template <typename K, typename V, typename A>
+void OLHashTable<K, V, A>::Reserve(size_t maxSize)
 {
 	maxSize = maxSize * 3 / 2;
+
     maxSize |= maxSize >> 1;
     maxSize |= maxSize >> 2;
     maxSize |= maxSize >> 4;
     maxSize |= maxSize >> 8;
     maxSize |= maxSize >> 16;
+    maxSize |= maxSize >> 32;
 
-	Rehash(maxSize);
+	Rehash(maxSize + 1);
 }
 
-template <typename K, typename V>
-void OQHashTable<K, V>::Rehash(size_t bucketCountNew)
+template <typename K, typename V, typename A>
+void OLHashTable<K, V, A>::Rehash(size_t bucketCountNew)
 {
 	// Can't rehash down to smaller than current size or initial size
 	bucketCountNew = std::max(std::max(bucketCountNew, size),
 						   size_t(s_hashTableInitialSize));
 
+	// Rebuilding drops any tombstones
+	tombstones = 0;
+
+	if (rehashThreads > 1 && bucketCountNew >= s_parallelRehashMinBuckets)
+	{
+		RehashParallel(bucketCountNew);
+		return;
+	}
+
 	// Build a new set of buckets
-	std::vector<Bucket> bucketsNew(bucketCountNew);
+	TableVector<Bucket, A> bucketsNew(bucketCountNew, Bucket(), buckets.get_allocator());
+	BucketStates<2, !StoreHash<K>::value, A> statesNew(buckets.get_allocator());
+	statesNew.Assign(bucketCountNew);
 
 	// Walk through all the current elements and insert them into the new buckets
 	for (size_t i = 0, iEnd = buckets.size(); i < iEnd; ++i)
 	{
 		Bucket * b = &buckets[i];
-		if (b->state != BSTATE_Filled)
+		if (GetBucketState(*b, states, i) != BSTATE_Filled)
 			continue;
 
 		// Hash the key and find the starting bucket
-		const auto hash = b->hash;
+		const size_t hash = BucketHashOr(*b, [&]() { return HashKey(b->key) & s_62Bits; });
 		// size_t iBucketStart = hash % bucketCountNew;
 		size_t iBucketStart = hash & (bucketCountNew - 1);
 
 		// Search for an unused bucket
 		Bucket * bTarget = nullptr;
-		for (size_t j = 0; j < bucketCountNew; ++j) 
+		for (size_t j = iBucketStart; j < bucketCountNew; ++j) 
 		{
-			// Evaluate the probing sequence
-			size_t probe = (iBucketStart + (j + j*j) / 2) % bucketCountNew;
-
-			Bucket * bNew = &bucketsNew[probe];
-			if (bNew->state != BSTATE_Filled)
+			Bucket * bNew = &bucketsNew[j];
+			if (GetBucketState(*bNew, statesNew, j) != BSTATE_Filled)
 			{
 				bTarget = bNew;
 				break;
 			}
 		}
+		if (!bTarget)
+		{
+			for (size_t j = 0; j < iBucketStart; ++j)
+			{
+				Bucket * bNew = &bucketsNew[j];
+				if (GetBucketState(*bNew, statesNew, j) != BSTATE_Filled)
+				{
+					bTarget = bNew;
+					break;
+				}
+			}
+		}
 
 		assert(bTarget);
 
 		// Store the hash, key, and value in the bucket
-		bTarget->hash = hash;
-		bTarget->state = BSTATE_Filled;
+		SetBucketHash(*bTarget, hash);
+		SetBucketState(*bTarget, statesNew, size_t(bTarget - &bucketsNew[0]), BSTATE_Filled);
 		bTarget->key = std::move(b->key);
 		bTarget->value = std::move(b->value);
 	}
 
 	// Swap the new buckets into place
 	buckets.swap(bucketsNew);
+	states.swap(statesNew);
 }
 
-template <typename K, typename V>
-void OQHashTable<K, V>::Reset()
+template <typename K, typename V, typename A>
+void OLHashTable<K, V, A>::RehashParallel(size_t bucketCountNew)
+{
+	TableVector<Bucket, A> bucketsNew(bucketCountNew, Bucket(), buckets.get_allocator());
+	BucketStates<2, !StoreHash<K>::value, A> statesNew(buckets.get_allocator());
+	statesNew.Assign(bucketCountNew);
+
+	std::vector<RehashEntry> entries;
+	std::vector<size_t> regionStarts;
+	PartitionForRehash(buckets.size(), bucketCountNew, rehashThreads,
+		[&](size_t iBegin, size_t iEnd, RehashSink & sink)
+		{
+			for (size_t i = iBegin; i < iEnd; ++i)
+			{
+				const Bucket & b = buckets[i];
+				if (GetBucketState(b, states, i) == BSTATE_Filled)
+					sink.Add(i, BucketHashOr(b, [&]() { return HashKey(b.key) & s_62Bits; }));
+			}
+		},
+		entries, regionStarts);
+
+	PlaceForRehash(entries, regionStarts, bucketCountNew, rehashThreads,
+		[&](size_t i) { return GetBucketState(bucketsNew[i], statesNew, i) != BSTATE_Filled; },
+		[&](const RehashEntry & entry, size_t iTarget)
+		{
+			Bucket * b = &buckets[entry.iOld];
+			Bucket * bTarget = &bucketsNew[iTarget];
+			SetBucketHash(*bTarget, entry.hash);
+			SetBucketState(*bTarget, statesNew, iTarget, BSTATE_Filled);
+			bTarget->key = std::move(b->key);
+			bTarget->value = std::move(b->value);
+		});
+
+	buckets.swap(bucketsNew);
+	states.swap(statesNew);
+}
+
+template <typename K, typename V, typename A>
+void OLHashTable<K, V, A>::RehashInPlace()
+{
+	// Reinsert every key in the buckets it's in; see ReinsertInPlace
+	ReinsertInPlace(buckets.size(), false,
+		[&](size_t i) { return GetBucketState(buckets[i], states, i); },
+		[&](size_t i, int state) { SetBucketState(buckets[i], states, i, state); },
+		[&](size_t i) { return BucketHashOr(buckets[i], [&]() { return HashKey(buckets[i].key) & s_62Bits; }); },
+		[&](size_t iFrom, size_t iTo) { buckets[iTo] = buckets[iFrom]; },
+		[&](size_t i, size_t j) { std::swap(buckets[i], buckets[j]); });
+	tombstones = 0;
+}
+
+template <typename K, typename V, typename A>
+void OLHashTable<K, V, A>::ShrinkToFit()
+{
+	// Rehash always rebuilds, so this clears out any tombstones too
+	Reserve(size);
+}
+
+template <typename K, typename V, typename A>
+void OLHashTable<K, V, A>::ShrinkIfSparse()
+{
+	// Under 1/8 full: rebuild with room for twice the keys left
+	if (size * 8 < buckets.size() && buckets.size() > s_hashTableInitialSize)
+		Reserve(size * 2);
+}
+
+template <typename K, typename V, typename A>
+void OLHashTable<K, V, A>::Reset()
 {
 	// Blow away the current table and reset to small initial size
 	buckets.clear();
 	buckets.resize(s_hashTableInitialSize);
+	states.Assign(s_hashTableInitialSize);
 
 	size = 0;
+	tombstones = 0;
+}
+
+template <typename K, typename V, typename A>
+HashTableStats OLHashTable<K, V, A>::GetStats() const
+{
+	return LinearProbeStats(buckets.size(),
+		[&](size_t i) { return GetBucketState(buckets[i], states, i); },
+		[&](size_t i) { return BucketHashOr(buckets[i], [&]() { return HashKey(buckets[i].key) & s_62Bits; }); });
 }
 
 
 
-// DO1HashTable implementation
+// OSHashTable implementation
 
-template <typename K, typename V>
-DO1HashTable<K, V>::DO1HashTable()
-:	size(0)
+template <typename K, typename V, typename A>
+OSHashTable<K, V, A>::OSHashTable(const A & alloc)
+:	buckets(alloc),
+	size(0),
+	tombstones(0),
+	autoShrink(false)
 {
+	sideSlots[0] = sideSlots[1] = SideSlot();
+
 	// Start off with a small initial size
-	buckets.resize(s_hashTableInitialSize);
-	keyvals.resize(s_hashTableInitialSize);
+	ResetBuckets(buckets, s_hashTableInitialSize);
 }
 
-template <typename K, typename V>
-void DO1HashTable<K, V>::Insert(K key, V value)
+template <typename K, typename V, typename A>
+void OSHashTable<K, V, A>::ResetBuckets(TableVector<Bucket, A> & bucketsNew, size_t bucketCount)
+{
+	// Every bucket holds the empty key; zero might not be it
+	Bucket bucketEmpty = Bucket();
+	bucketEmpty.key = SentinelKeys<K>::Empty();
+	bucketsNew.assign(bucketCount, bucketEmpty);
+}
+
+template <typename K, typename V, typename A>
+typename OSHashTable<K, V, A>::SideSlot * OSHashTable<K, V, A>::FindSideSlot(const K & key)
+{
+	if (key == SentinelKeys<K>::Empty())
+		return &sideSlots[0];
+	if (key == SentinelKeys<K>::Removed())
+		return &sideSlots[1];
+	return nullptr;
+}
+
+template <typename K, typename V, typename A>
+void OSHashTable<K, V, A>::Insert(const K & key, const V & value)
 {
-	// Resize larger if the load factor goes over 2/3
+	if (SideSlot * s = FindSideSlot(key))
+	{
+		if (!s->filled)
+			++size;
+		s->filled = true;
+		s->value = value;
+		return;
+	}
+
+	// Resize larger if the load factor goes over 2/3, or clear out the
+	// tombstones if they've taken the buckets in use over 3/4
 	if (size * 3 > buckets.size() * 2)
 	{
 		Rehash(buckets.size() * 2);
 	}
+	else if ((size + tombstones) * 4 > buckets.size() * 3)
+	{
+		RehashInPlace();
+	}
 
 	// Hash the key and find the starting bucket
-	const auto hash = HashKey(key) & s_62Bits;
-	// size_t iBucketStart = hash % buckets.size();
-	size_t iBucketStart = hash & (buckets.size() - 1);
+	const K keyEmpty = SentinelKeys<K>::Empty();
+	const K keyRemoved = SentinelKeys<K>::Removed();
+	size_t iBucketStart = HashKey(key) & (buckets.size() - 1);
 
 	// Search for an unused bucket
 	Bucket * bTarget = nullptr;
-	KV * kvTarget = nullptr;
-	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i) 
+	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i)
 	{
 		Bucket * b = &buckets[i];
-		if (b->state != BSTATE_Filled)
+		if (b->key == keyEmpty || b->key == keyRemoved)
 		{
 			bTarget = b;
-			kvTarget = &keyvals[i];
 			break;
 		}
 	}
@@ -1478,315 +3088,4004 @@ void DO1HashTable<K, V>::Insert(K key, V value)
 		for (size_t i = 0; i < iBucketStart; ++i)
 		{
 			Bucket * b = &buckets[i];
-			if (b->state != BSTATE_Filled)
+			if (b->key == keyEmpty || b->key == keyRemoved)
 			{
 				bTarget = b;
-				kvTarget = &keyvals[i];
 				break;
 			}
 		}
 	}
 
 	assert(bTarget);
-	assert(kvTarget);
 
-	// Store the hash, key, and value in the bucket
-	bTarget->hash = hash;
-	bTarget->state = BSTATE_Filled;
-	kvTarget->key = key;
-	kvTarget->value = value;
+	// Store the key and value in the bucket
+	if (bTarget->key == keyRemoved)
+		--tombstones;
+	bTarget->key = key;
+	bTarget->value = value;
 
 	++size;
 }
 
-template <typename K, typename V>
-V * DO1HashTable<K, V>::Lookup(K key)
+template <typename K, typename V, typename A>
+template <typename Q>
+V * OSHashTable<K, V, A>::Lookup(const Q & keyIn)
 {
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	if (SideSlot * s = FindSideSlot(key))
+		return s->filled ? &s->value : nullptr;
+
 	// Hash the key and find the starting bucket
-	const auto hash = HashKey(key) & s_62Bits;
-	// size_t iBucketStart = hash % buckets.size();
-	size_t iBucketStart = hash & (buckets.size() - 1);
+	const K keyEmpty = SentinelKeys<K>::Empty();
+	size_t iBucketStart = HashKey(key) & (buckets.size() - 1);
 
-	// Search the buckets until we hit an empty one
+	// Search the buckets until we hit an empty one; a removed bucket's key
+	// never matches, so it needs no test of its own
 	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i)
 	{
 		Bucket * b = &buckets[i];
-		switch (b->state)
-		{
-		case BSTATE_Empty:
+		if (b->key == key)
+			return &b->value;
+		if (b->key == keyEmpty)
 			return nullptr;
-		case BSTATE_Filled:
-			if (b->hash == hash)
-			{
-				KV * kv = &keyvals[i];
-				if (kv->key == key)
-					return &kv->value;
-			}
-			break;
-		default:
-			break;
-		}
 	}
 	for (size_t i = 0; i < iBucketStart; ++i)
 	{
 		Bucket * b = &buckets[i];
-		switch (b->state)
-		{
-		case BSTATE_Empty:
+		if (b->key == key)
+			return &b->value;
+		if (b->key == keyEmpty)
 			return nullptr;
-		case BSTATE_Filled:
-			if (b->hash == hash)
-			{
-				KV * kv = &keyvals[i];
-				if (kv->key == key)
-					return &kv->value;
-			}
-			break;
-		default:
-			break;
-		}
 	}
 
 	return nullptr;
 }
 
-template <typename K, typename V>
-bool DO1HashTable<K, V>::Remove(K key)
+template <typename K, typename V, typename A>
+template <typename Q>
+bool OSHashTable<K, V, A>::Remove(const Q & keyIn)
 {
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	if (SideSlot * s = FindSideSlot(key))
+	{
+		if (!s->filled)
+			return false;
+		s->filled = false;
+		s->value = V();
+		--size;
+		return true;
+	}
+
 	// Hash the key and find the starting bucket
-	const auto hash = HashKey(key) & s_62Bits;
-	// size_t iBucketStart = hash % buckets.size();
-	size_t iBucketStart = hash & (buckets.size() - 1);
+	const K keyEmpty = SentinelKeys<K>::Empty();
+	size_t iBucketStart = HashKey(key) & (buckets.size() - 1);
 
 	// Search the buckets until we hit an empty one
 	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i)
 	{
 		Bucket * b = &buckets[i];
-		switch (b->state)
+		if (b->key == key)
 		{
-		case BSTATE_Empty:
-			return false;
-		case BSTATE_Filled:
-			if (b->hash == hash)
-			{
-				KV * kv = &keyvals[i];
-				if (kv->key == key)
-				{
-					b->hash = 0;
-					b->state = BSTATE_Removed;
-					--size;
-					return true;
-				}
-			}
-			break;
-		default:
-			break;
+			b->key = SentinelKeys<K>::Removed();
+			--size;
+			++tombstones;
+			if (autoShrink)
+				ShrinkIfSparse();
+			return true;
 		}
+		if (b->key == keyEmpty)
+			return false;
 	}
 	for (size_t i = 0; i < iBucketStart; ++i)
 	{
 		Bucket * b = &buckets[i];
-		switch (b->state)
+		if (b->key == key)
 		{
-		case BSTATE_Empty:
-			return false;
-		case BSTATE_Filled:
-			if (b->hash == hash)
-			{
-				KV * kv = &keyvals[i];
-				if (kv->key == key)
-				{
-					b->hash = 0;
-					b->state = BSTATE_Removed;
-					--size;
-					return true;
-				}
-			}
-			break;
-		default:
-			break;
+			b->key = SentinelKeys<K>::Removed();
+			--size;
+			++tombstones;
+			if (autoShrink)
+				ShrinkIfSparse();
+			return true;
 		}
+		if (b->key == keyEmpty)
+			return false;
 	}
 
 	return false;
 }
 
-template <typename K, typename V>
-void DO1HashTable<K, V>::Reserve(size_t maxSize)
+template <typename K, typename V, typename A>
+template <typename Q>
+std::pair<V *, bool> OSHashTable<K, V, A>::FindOrInsert(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	if (SideSlot * s = FindSideSlot(key))
+	{
+		bool inserted = !s->filled;
+		if (inserted)
+		{
+			s->filled = true;
+			s->value = V();
+			++size;
+		}
+		return std::make_pair(&s->value, inserted);
+	}
+
+	// Resize larger if the load factor goes over 2/3, or clear out the
+	// tombstones if they've taken the buckets in use over 3/4
+	if (size * 3 > buckets.size() * 2)
+	{
+		Rehash(buckets.size() * 2);
+	}
+	else if ((size + tombstones) * 4 > buckets.size() * 3)
+	{
+		RehashInPlace();
+	}
+
+	// Hash the key and find the starting bucket
+	const K keyEmpty = SentinelKeys<K>::Empty();
+	const K keyRemoved = SentinelKeys<K>::Removed();
+	size_t iBucketStart = HashKey(key) & (buckets.size() - 1);
+
+	// Search the buckets until we hit an empty one, remembering the first
+	// unused bucket along the way in case the key isn't there
+	Bucket * bTarget = nullptr;
+	bool hitEmpty = false;
+	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd && !hitEmpty; ++i)
+	{
+		Bucket * b = &buckets[i];
+		if (b->key == key)
+			return std::make_pair(&b->value, false);
+		hitEmpty = (b->key == keyEmpty);
+		if (!bTarget && (hitEmpty || b->key == keyRemoved))
+			bTarget = b;
+	}
+	for (size_t i = 0; i < iBucketStart && !hitEmpty; ++i)
+	{
+		Bucket * b = &buckets[i];
+		if (b->key == key)
+			return std::make_pair(&b->value, false);
+		hitEmpty = (b->key == keyEmpty);
+		if (!bTarget && (hitEmpty || b->key == keyRemoved))
+			bTarget = b;
+	}
+
+	assert(bTarget);
+
+	// Store the key and value in the bucket
+	if (bTarget->key == keyRemoved)
+		--tombstones;
+	bTarget->key = KeyTraits<K>::Make(key);
+	bTarget->value = V();
+
+	++size;
+	return std::make_pair(&bTarget->value, true);
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+bool OSHashTable<K, V, A>::InsertOrAssign(const Q & key, const V & value)
+{
+	auto result = FindOrInsert(key);
+	*result.first = value;
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q, typename F>
+bool OSHashTable<K, V, A>::Upsert(const Q & key, F fn)
+{
+	auto result = FindOrInsert(key);
+	fn(*result.first);
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+void OSHashTable<K, V, A>::Reserve(size_t maxSize)
 {
 	maxSize = maxSize * 3 / 2;
-    maxSize |= maxSize >> 1;
-    maxSize |= maxSize >> 2;
-    maxSize |= maxSize >> 4;
-    maxSize |= maxSize >> 8;
-    maxSize |= maxSize >> 16;
 
-	Rehash(maxSize);
+	maxSize |= maxSize >> 1;
+	maxSize |= maxSize >> 2;
+	maxSize |= maxSize >> 4;
+	maxSize |= maxSize >> 8;
+	maxSize |= maxSize >> 16;
+	maxSize |= maxSize >> 32;
+
+	Rehash(maxSize + 1);
 }
 
-template <typename K, typename V>
-void DO1HashTable<K, V>::Rehash(size_t bucketCountNew)
+template <typename K, typename V, typename A>
+void OSHashTable<K, V, A>::Rehash(size_t bucketCountNew)
 {
 	// Can't rehash down to smaller than current size or initial size
 	bucketCountNew = std::max(std::max(bucketCountNew, size),
 						   size_t(s_hashTableInitialSize));
 
-	// Build a new set of buckets and keyvals
-	std::vector<Bucket> bucketsNew(bucketCountNew);
-	std::vector<KV> keyvalsNew(bucketCountNew);
+	// Rebuilding drops any tombstones
+	tombstones = 0;
 
-	// Walk through all the current elements and insert them into the new buckets
+	// Build a new set of buckets
+	TableVector<Bucket, A> bucketsNew(buckets.get_allocator());
+	ResetBuckets(bucketsNew, bucketCountNew);
+
+	// Walk through all the current elements and insert them into the new
+	// buckets; the side slots stay as they are
+	const K keyEmpty = SentinelKeys<K>::Empty();
+	const K keyRemoved = SentinelKeys<K>::Removed();
+	const size_t mask = bucketCountNew - 1;
 	for (size_t i = 0, iEnd = buckets.size(); i < iEnd; ++i)
 	{
 		Bucket * b = &buckets[i];
-		if (b->state != BSTATE_Filled)
+		if (b->key == keyEmpty || b->key == keyRemoved)
 			continue;
 
-		// Hash the key and find the starting bucket
-		const auto hash = b->hash;
-		// size_t iBucketStart = hash % bucketCountNew;
-		size_t iBucketStart = hash & (bucketCountNew - 1);
+		// Nothing in the new buckets is removed, so the first non-empty
+		// bucket from the key's home is the one
+		size_t iTarget = HashKey(b->key) & mask;
+		while (bucketsNew[iTarget].key != keyEmpty)
+			iTarget = (iTarget + 1) & mask;
+
+		bucketsNew[iTarget].key = b->key;
+		bucketsNew[iTarget].value = std::move(b->value);
+	}
+
+	// Swap the new buckets into place
+	buckets.swap(bucketsNew);
+}
+
+template <typename K, typename V, typename A>
+void OSHashTable<K, V, A>::RehashInPlace()
+{
+	// ReinsertInPlace needs a pending state there's no room for here, so this
+	// goes another way.  Start just past a bucket that was empty all along:
+	// no probe ever crossed it, so every key's probe sequence runs from its
+	// home bucket to where it is without wrapping past the start.  Turn the
+	// tombstones into empty buckets, then take each key in turn from there
+	// and move it to the first empty bucket from its home.  That's never past
+	// where it is now, and the buckets it passes over were all done before
+	// it and stay filled, so lookups still find every key.
+	const K keyEmpty = SentinelKeys<K>::Empty();
+	const K keyRemoved = SentinelKeys<K>::Removed();
+	const size_t bucketCount = buckets.size();
+	const size_t mask = bucketCount - 1;
+
+	size_t iStart = 0;
+	while (iStart < bucketCount && buckets[iStart].key != keyEmpty)
+		++iStart;
+	if (iStart == bucketCount)
+	{
+		// No empty bucket at all, which Insert never lets happen
+		Rehash(bucketCount);
+		return;
+	}
+
+	for (size_t i = 0; i < bucketCount; ++i)
+	{
+		if (buckets[i].key == keyRemoved)
+			buckets[i].key = keyEmpty;
+	}
+
+	for (size_t n = 1; n < bucketCount; ++n)
+	{
+		size_t i = (iStart + n) & mask;
+		if (buckets[i].key == keyEmpty)
+			continue;
+
+		size_t iTarget = HashKey(buckets[i].key) & mask;
+		while (iTarget != i && buckets[iTarget].key != keyEmpty)
+			iTarget = (iTarget + 1) & mask;
+		if (iTarget != i)
+		{
+			buckets[iTarget] = std::move(buckets[i]);
+			buckets[i].key = keyEmpty;
+		}
+	}
+
+	tombstones = 0;
+}
+
+template <typename K, typename V, typename A>
+void OSHashTable<K, V, A>::ShrinkToFit()
+{
+	// Rehash always rebuilds, so this clears out any tombstones too
+	Reserve(size);
+}
+
+template <typename K, typename V, typename A>
+void OSHashTable<K, V, A>::ShrinkIfSparse()
+{
+	// Under 1/8 full: rebuild with room for twice the keys left
+	if (size * 8 < buckets.size() && buckets.size() > s_hashTableInitialSize)
+		Reserve(size * 2);
+}
+
+template <typename K, typename V, typename A>
+void OSHashTable<K, V, A>::Reset()
+{
+	// Blow away the current table and reset to small initial size
+	buckets.clear();
+	ResetBuckets(buckets, s_hashTableInitialSize);
+	sideSlots[0] = sideSlots[1] = SideSlot();
+
+	size = 0;
+	tombstones = 0;
+}
+
+template <typename K, typename V, typename A>
+HashTableStats OSHashTable<K, V, A>::GetStats() const
+{
+	const K keyEmpty = SentinelKeys<K>::Empty();
+	const K keyRemoved = SentinelKeys<K>::Removed();
+	HashTableStats stats = LinearProbeStats(buckets.size(),
+		[&](size_t i) { return (buckets[i].key == keyEmpty) ? 0 : (buckets[i].key == keyRemoved) ? 2 : 1; },
+		[&](size_t i) { return size_t(HashKey(buckets[i].key)); });
+
+	// Keys in the side slots count as hits on the first probe
+	for (const SideSlot & s : sideSlots)
+	{
+		if (s.filled)
+		{
+			++stats.size;
+			stats.avgProbeHit += (1.0f - stats.avgProbeHit) / float(stats.size);
+			stats.maxProbeHit = std::max(stats.maxProbeHit, 1);
+		}
+	}
+	stats.loadFactor = float(stats.size) / float(stats.bucketCount);
+	return stats;
+}
+
+
+
+// OQHashTable implementation
+
+template <typename K, typename V, typename A>
+OQHashTable<K, V, A>::OQHashTable(const A & alloc)
+:	buckets(alloc),
+	size(0),
+	tombstones(0),
+	autoShrink(false)
+{
+	// Start off with a small initial size
+	buckets.resize(s_hashTableInitialSize);
+}
+
+template <typename K, typename V, typename A>
+void OQHashTable<K, V, A>::Insert(const K & key, const V & value)
+{
+	// Resize larger if the load factor goes over 2/3, or clear out the
+	// tombstones if they've taken the buckets in use over 3/4
+	if (size * 3 > buckets.size() * 2)
+	{
+		Rehash(buckets.size() * 2);
+	}
+	else if ((size + tombstones) * 4 > buckets.size() * 3)
+	{
+		RehashInPlace();
+	}
+
+	// Hash the key and find the starting bucket
+	const auto hash = HashKey(key) & s_62Bits;
+	// size_t iBucketStart = hash % buckets.size();
+	size_t iBucketStart = hash & (buckets.size() - 1);
+
+	// Search for an unused bucket
+	Bucket * bTarget = nullptr;
+	for (size_t i = 0, iEnd = buckets.size(); i < iEnd; ++i)
+	{
+		// Evaluate the probing sequence.  This one is guaranteed to hit all
+		// elements if the table is power-of-two-sized; see:
+		//   http://en.wikipedia.org/wiki/Quadratic_probing
+		size_t probe = (iBucketStart + (i + i*i) / 2) % iEnd;
+
+		Bucket * b = &buckets[probe];
+		if (b->state != BSTATE_Filled)
+		{
+			bTarget = b;
+			break;
+		}
+	}
+
+	assert(bTarget);
+
+	// Store the hash, key, and value in the bucket
+	bTarget->hash = hash;
+	if (bTarget->state == BSTATE_Removed)
+		--tombstones;
+	bTarget->state = BSTATE_Filled;
+	bTarget->key = key;
+	bTarget->value = value;
+
+	++size;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+V * OQHashTable<K, V, A>::Lookup(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	// Hash the key and find the starting bucket
+	const auto hash = HashKey(key) & s_62Bits;
+	// size_t iBucketStart = hash % buckets.size();
+	size_t iBucketStart = hash & (buckets.size() - 1);
+
+	// Search the buckets until we hit an empty one
+	for (size_t i = 0, iEnd = buckets.size(); i < iEnd; ++i)
+	{
+		// Evaluate the probing sequence
+		size_t probe = (iBucketStart + (i + i*i) / 2) % iEnd;
+
+		Bucket * b = &buckets[probe];
+		switch (b->state)
+		{
+		case BSTATE_Empty:
+			return nullptr;
+		case BSTATE_Filled:
+			if (b->hash == hash && b->key == key)
+				return &b->value;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return nullptr;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+bool OQHashTable<K, V, A>::Remove(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	// Hash the key and find the starting bucket
+	const auto hash = HashKey(key) & s_62Bits;
+	// size_t iBucketStart = hash % buckets.size();
+	size_t iBucketStart = hash & (buckets.size() - 1);
+
+	// Search the buckets until we hit an empty one
+	for (size_t i = 0, iEnd = buckets.size(); i < iEnd; ++i)
+	{
+		// Evaluate the probing sequence
+		size_t probe = (iBucketStart + (i + i*i) / 2) % iEnd;
+
+		Bucket * b = &buckets[probe];
+		switch (b->state)
+		{
+		case BSTATE_Empty:
+			return false;
+		case BSTATE_Filled:
+			if (b->hash == hash && b->key == key)
+			{
+				b->hash = 0;
+				b->state = BSTATE_Removed;
+				--size;
+				++tombstones;
+				if (autoShrink)
+					ShrinkIfSparse();
+				return true;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	return false;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+std::pair<V *, bool> OQHashTable<K, V, A>::FindOrInsert(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	// Resize larger if the load factor goes over 2/3, or clear out the
+	// tombstones if they've taken the buckets in use over 3/4
+	if (size * 3 > buckets.size() * 2)
+	{
+		Rehash(buckets.size() * 2);
+	}
+	else if ((size + tombstones) * 4 > buckets.size() * 3)
+	{
+		RehashInPlace();
+	}
+
+	// Hash the key and find the starting bucket
+	const auto hash = HashKey(key) & s_62Bits;
+	// size_t iBucketStart = hash % buckets.size();
+	size_t iBucketStart = hash & (buckets.size() - 1);
+
+	// Search the buckets until we hit an empty one, remembering the first
+	// unused bucket along the way in case the key isn't there
+	Bucket * bTarget = nullptr;
+	for (size_t i = 0, iEnd = buckets.size(); i < iEnd; ++i)
+	{
+		// Evaluate the probing sequence
+		size_t probe = (iBucketStart + (i + i*i) / 2) % iEnd;
+
+		Bucket * b = &buckets[probe];
+		if (b->state == BSTATE_Empty)
+		{
+			if (!bTarget)
+				bTarget = b;
+			break;
+		}
+		if (b->state == BSTATE_Filled)
+		{
+			if (b->hash == hash && b->key == key)
+				return std::make_pair(&b->value, false);
+		}
+		else if (!bTarget)
+		{
+			bTarget = b;
+		}
+	}
+
+	assert(bTarget);
+
+	// Store the hash, key, and value in the bucket
+	bTarget->hash = hash;
+	if (bTarget->state == BSTATE_Removed)
+		--tombstones;
+	bTarget->state = BSTATE_Filled;
+	bTarget->key = KeyTraits<K>::Make(key);
+	bTarget->value = V();
+
+	++size;
+	return std::make_pair(&bTarget->value, true);
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+bool OQHashTable<K, V, A>::InsertOrAssign(const Q & key, const V & value)
+{
+	auto result = FindOrInsert(key);
+	*result.first = value;
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q, typename F>
+bool OQHashTable<K, V, A>::Upsert(const Q & key, F fn)
+{
+	auto result = FindOrInsert(key);
+	fn(*result.first);
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+void OQHashTable<K, V, A>::Reserve(size_t maxSize)
+{
+	maxSize = maxSize * 3 / 2;
+    maxSize |= maxSize >> 1;
+    maxSize |= maxSize >> 2;
+    maxSize |= maxSize >> 4;
+    maxSize |= maxSize >> 8;
+    maxSize |= maxSize >> 16;
+    maxSize |= maxSize >> 32;
+
+	Rehash(maxSize + 1);
+}
+
+template <typename K, typename V, typename A>
+void OQHashTable<K, V, A>::Rehash(size_t bucketCountNew)
+{
+	// Can't rehash down to smaller than current size or initial size
+	bucketCountNew = std::max(std::max(bucketCountNew, size),
+						   size_t(s_hashTableInitialSize));
+
+	// Rebuilding drops any tombstones
+	tombstones = 0;
+
+	// Build a new set of buckets
+	TableVector<Bucket, A> bucketsNew(bucketCountNew, Bucket(), buckets.get_allocator());
+
+	// Walk through all the current elements and insert them into the new buckets
+	for (size_t i = 0, iEnd = buckets.size(); i < iEnd; ++i)
+	{
+		Bucket * b = &buckets[i];
+		if (b->state != BSTATE_Filled)
+			continue;
+
+		// Hash the key and find the starting bucket
+		const auto hash = b->hash;
+		// size_t iBucketStart = hash % bucketCountNew;
+		size_t iBucketStart = hash & (bucketCountNew - 1);
+
+		// Search for an unused bucket
+		Bucket * bTarget = nullptr;
+		for (size_t j = 0; j < bucketCountNew; ++j) 
+		{
+			// Evaluate the probing sequence
+			size_t probe = (iBucketStart + (j + j*j) / 2) % bucketCountNew;
+
+			Bucket * bNew = &bucketsNew[probe];
+			if (bNew->state != BSTATE_Filled)
+			{
+				bTarget = bNew;
+				break;
+			}
+		}
+
+		assert(bTarget);
+
+		// Store the hash, key, and value in the bucket
+		bTarget->hash = hash;
+		bTarget->state = BSTATE_Filled;
+		bTarget->key = std::move(b->key);
+		bTarget->value = std::move(b->value);
+	}
+
+	// Swap the new buckets into place
+	buckets.swap(bucketsNew);
+}
+
+template <typename K, typename V, typename A>
+void OQHashTable<K, V, A>::RehashInPlace()
+{
+	// Reinsert every key in the buckets it's in, along the quadratic probe
+	// sequence; see ReinsertInPlace
+	ReinsertInPlace(buckets.size(), true,
+		[&](size_t i) { return int(buckets[i].state); },
+		[&](size_t i, int state) { buckets[i].state = size_t(state); },
+		[&](size_t i) { return size_t(buckets[i].hash); },
+		[&](size_t iFrom, size_t iTo) { buckets[iTo] = buckets[iFrom]; },
+		[&](size_t i, size_t j) { std::swap(buckets[i], buckets[j]); });
+	tombstones = 0;
+}
+
+template <typename K, typename V, typename A>
+void OQHashTable<K, V, A>::ShrinkToFit()
+{
+	// Rehash always rebuilds, so this clears out any tombstones too
+	Reserve(size);
+}
+
+template <typename K, typename V, typename A>
+void OQHashTable<K, V, A>::ShrinkIfSparse()
+{
+	// Under 1/8 full: rebuild with room for twice the keys left
+	if (size * 8 < buckets.size() && buckets.size() > s_hashTableInitialSize)
+		Reserve(size * 2);
+}
+
+template <typename K, typename V, typename A>
+void OQHashTable<K, V, A>::Reset()
+{
+	// Blow away the current table and reset to small initial size
+	buckets.clear();
+	buckets.resize(s_hashTableInitialSize);
+
+	size = 0;
+	tombstones = 0;
+}
+
+template <typename K, typename V, typename A>
+HashTableStats OQHashTable<K, V, A>::GetStats() const
+{
+	HashTableStats stats = HashTableStats();
+	const size_t bucketCount = buckets.size();
+	const size_t mask = bucketCount - 1;
+	stats.bucketCount = bucketCount;
+
+	// Hits and misses both follow the probe sequence from the home bucket
+	// (so this is slower than the linear tables' GetStats)
+	size_t probesHit = 0, probesMiss = 0, run = 0;
+	for (size_t i = 0; i < bucketCount; ++i)
+	{
+		const Bucket & b = buckets[i];
+		if (b.state == BSTATE_Filled)
+		{
+			size_t iBucketStart = b.hash & mask;
+			size_t probes = 1;
+			while (((iBucketStart + (probes - 1 + (probes - 1) * (probes - 1)) / 2) & mask) != i)
+				++probes;
+			probesHit += probes;
+			stats.maxProbeHit = std::max(stats.maxProbeHit, int(probes));
+			++stats.size;
+		}
+		else if (b.state == BSTATE_Removed)
+		{
+			++stats.tombstones;
+		}
+
+		size_t probes = 1;
+		while (probes < bucketCount && buckets[(i + (probes - 1 + (probes - 1) * (probes - 1)) / 2) & mask].state != BSTATE_Empty)
+			++probes;
+		probesMiss += probes;
+		stats.maxProbeMiss = std::max(stats.maxProbeMiss, int(probes));
+
+		// Quadratic probing is meant to break these up, so they're worth seeing
+		if (b.state != BSTATE_Empty)
+		{
+			++run;
+		}
+		else if (run > 0)
+		{
+			StatsHistogramAdd(stats.clusterHistogram, run);
+			run = 0;
+		}
+	}
+	if (run > 0)
+		StatsHistogramAdd(stats.clusterHistogram, run);
+
+	stats.loadFactor = float(stats.size) / float(bucketCount);
+	stats.avgProbeHit = stats.size ? float(probesHit) / float(stats.size) : 0.0f;
+	stats.avgProbeMiss = float(probesMiss) / float(bucketCount);
+	return stats;
+}
+
+
+
+// F14HashTable implementation
+
+template <typename K, typename V, bool IndirectValues, typename A>
+const int F14HashTable<K, V, IndirectValues, A>::s_chunkSlots;
+template <typename K, typename V, bool IndirectValues, typename A>
+const int F14HashTable<K, V, IndirectValues, A>::s_chunkSlotsMax;
+template <typename K, typename V, bool IndirectValues, typename A>
+const size_t F14HashTable<K, V, IndirectValues, A>::s_chunkCountInitial;
+
+template <typename K, typename V, bool IndirectValues, typename A>
+F14HashTable<K, V, IndirectValues, A>::F14HashTable(const A & alloc)
+:	chunks(nullptr),
+	chunkCount(0),
+	size(0),
+	values(alloc),
+	valueSlots(alloc),
+	autoShrink(false),
+	storage(alloc)
+{
+	// Start off with a small initial size
+	ResetChunks(storage, chunks, s_chunkCountInitial);
+	chunkCount = s_chunkCountInitial;
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+void F14HashTable<K, V, IndirectValues, A>::ResetChunks(TableVector<uint8_t, A> & storageNew, Chunk *& chunksNew, size_t chunkCountNew)
+{
+	// Zeroed bytes are empty chunks: every tag and overflow count 0, and
+	// the items are trivially copyable, so need no constructing
+	storageNew.assign(chunkCountNew * sizeof(Chunk) + alignof(Chunk) - 1, 0);
+	uintptr_t p = reinterpret_cast<uintptr_t>(storageNew.data());
+	chunksNew = reinterpret_cast<Chunk *>((p + alignof(Chunk) - 1) & ~uintptr_t(alignof(Chunk) - 1));
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+size_t F14HashTable<K, V, IndirectValues, A>::FindEmptyProbe(size_t hash, size_t iProbe) const
+{
+	// The probe sequence visits every chunk once in its first chunkCount
+	// steps, and the table is never full, so this finds one
+	while (!F14TagMatch(chunks[ProbeChunk(hash, iProbe)].tags, 0))
+		++iProbe;
+	return iProbe;
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+typename F14HashTable<K, V, IndirectValues, A>::Item & F14HashTable<K, V, IndirectValues, A>::Claim(size_t hash, size_t iProbe, size_t * piSlot)
+{
+	// The chunks before iProbe in the key's sequence are all full, and the
+	// key overflows past each of them
+	for (size_t i = 0; i < iProbe; ++i)
+	{
+		Chunk & c = chunks[ProbeChunk(hash, i)];
+		if (c.outboundOverflow < 255)
+			++c.outboundOverflow;
+	}
+
+	// Take the first empty slot in the chunk at iProbe
+	size_t iChunk = ProbeChunk(hash, iProbe);
+	Chunk & c = chunks[iChunk];
+	int iSlot = LowestSetBit(F14TagMatch(c.tags, 0));
+	c.tags[iSlot] = Tag(hash);
+	*piSlot = iChunk * s_chunkSlots + iSlot;
+	return c.items[iSlot];
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+typename F14HashTable<K, V, IndirectValues, A>::Item * F14HashTable<K, V, IndirectValues, A>::FindItem(size_t hash, const typename KeyTraits<K>::Probe & key, size_t * piProbe)
+{
+	// Compare keys only in the slots whose tags match, and stop at the
+	// first chunk no key has overflowed past
+	const uint8_t tag = Tag(hash);
+	for (size_t iProbe = 0; iProbe < chunkCount; ++iProbe)
+	{
+		Chunk & c = chunks[ProbeChunk(hash, iProbe)];
+		for (uint32_t match = F14TagMatch(c.tags, tag); match; match &= match - 1)
+		{
+			Item & item = c.items[LowestSetBit(match)];
+			if (item.key == key)
+			{
+				*piProbe = iProbe;
+				return &item;
+			}
+		}
+		if (c.outboundOverflow == 0)
+			return nullptr;
+	}
+
+	return nullptr;
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+void F14HashTable<K, V, IndirectValues, A>::AddValue(Item & item, size_t, const V & value, std::false_type)
+{
+	item.value = value;
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+void F14HashTable<K, V, IndirectValues, A>::AddValue(Item & item, size_t iSlot, const V & value, std::true_type)
+{
+	item.iValue = uint32_t(values.size());
+	values.push_back(value);
+	valueSlots.push_back(uint32_t(iSlot));
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+void F14HashTable<K, V, IndirectValues, A>::RemoveValue(Item & item, std::true_type)
+{
+	// Move the last value into the hole, and point its key at where it went
+	uint32_t iValue = item.iValue;
+	uint32_t iLast = uint32_t(values.size() - 1);
+	if (iValue != iLast)
+	{
+		uint32_t iSlotLast = valueSlots[iLast];
+		chunks[iSlotLast / s_chunkSlots].items[iSlotLast % s_chunkSlots].iValue = iValue;
+		values[iValue] = values[iLast];
+		valueSlots[iValue] = iSlotLast;
+	}
+	values.pop_back();
+	valueSlots.pop_back();
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+void F14HashTable<K, V, IndirectValues, A>::Insert(const K & key, const V & value)
+{
+	// Resize larger once the chunks average 12 of their 14 slots filled
+	if (size >= chunkCount * s_chunkSlotsMax)
+		Rehash(chunkCount * 2);
+
+	size_t hash = HashKey(key);
+	size_t iSlot;
+	Item & item = Claim(hash, FindEmptyProbe(hash, 0), &iSlot);
+	item.key = key;
+	AddValue(item, iSlot, value, Indirect());
+
+	++size;
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+template <typename Q>
+V * F14HashTable<K, V, IndirectValues, A>::Lookup(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	size_t iProbe;
+	Item * item = FindItem(HashKey(key), key, &iProbe);
+	return item ? &ValueOf(*item) : nullptr;
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+template <typename Q>
+bool F14HashTable<K, V, IndirectValues, A>::Remove(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	size_t hash = HashKey(key);
+	size_t iProbe;
+	Item * item = FindItem(hash, key, &iProbe);
+	if (!item)
+		return false;
+
+	Chunk & c = chunks[ProbeChunk(hash, iProbe)];
+	c.tags[item - c.items] = 0;
+	RemoveValue(*item, Indirect());
+
+	// Take back the overflow counts the key added on its way here; a
+	// saturated count no longer knows how many it stands for, so it stays
+	for (size_t i = 0; i < iProbe; ++i)
+	{
+		Chunk & cPassed = chunks[ProbeChunk(hash, i)];
+		if (cPassed.outboundOverflow < 255)
+			--cPassed.outboundOverflow;
+	}
+
+	--size;
+	if (autoShrink)
+		ShrinkIfSparse();
+	return true;
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+template <typename Q>
+std::pair<V *, bool> F14HashTable<K, V, IndirectValues, A>::FindOrInsert(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	// Resize larger once the chunks average 12 of their 14 slots filled
+	if (size >= chunkCount * s_chunkSlotsMax)
+		Rehash(chunkCount * 2);
+
+	// Search as Lookup does, remembering the first chunk with room along the
+	// way in case the key isn't there
+	const size_t hash = HashKey(key);
+	const uint8_t tag = Tag(hash);
+	const size_t iProbeNone = ~size_t(0);
+	size_t iProbeTarget = iProbeNone;
+	size_t iProbe = 0;
+	for (; iProbe < chunkCount; ++iProbe)
+	{
+		Chunk & c = chunks[ProbeChunk(hash, iProbe)];
+		for (uint32_t match = F14TagMatch(c.tags, tag); match; match &= match - 1)
+		{
+			Item & item = c.items[LowestSetBit(match)];
+			if (item.key == key)
+				return std::make_pair(&ValueOf(item), false);
+		}
+		if (iProbeTarget == iProbeNone && F14TagMatch(c.tags, 0))
+			iProbeTarget = iProbe;
+		if (c.outboundOverflow == 0)
+			break;
+	}
+	if (iProbeTarget == iProbeNone)
+		iProbeTarget = FindEmptyProbe(hash, iProbe + 1);
+
+	size_t iSlot;
+	Item & item = Claim(hash, iProbeTarget, &iSlot);
+	item.key = KeyTraits<K>::Make(key);
+	AddValue(item, iSlot, V(), Indirect());
+
+	++size;
+	return std::make_pair(&ValueOf(item), true);
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+template <typename Q>
+bool F14HashTable<K, V, IndirectValues, A>::InsertOrAssign(const Q & key, const V & value)
+{
+	auto result = FindOrInsert(key);
+	*result.first = value;
+	return result.second;
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+template <typename Q, typename F>
+bool F14HashTable<K, V, IndirectValues, A>::Upsert(const Q & key, F fn)
+{
+	auto result = FindOrInsert(key);
+	fn(*result.first);
+	return result.second;
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+void F14HashTable<K, V, IndirectValues, A>::Reserve(size_t maxSize)
+{
+	if (IndirectValues)
+	{
+		values.reserve(maxSize);
+		valueSlots.reserve(maxSize);
+	}
+	Rehash((maxSize + s_chunkSlotsMax - 1) / s_chunkSlotsMax);
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+void F14HashTable<K, V, IndirectValues, A>::Rehash(size_t chunkCountNew)
+{
+	// Can't rehash down to smaller than the keys need or initial size
+	chunkCountNew = std::max(chunkCountNew, (size + s_chunkSlotsMax - 1) / s_chunkSlotsMax);
+	size_t chunkCountPow2 = s_chunkCountInitial;
+	while (chunkCountPow2 < chunkCountNew)
+		chunkCountPow2 *= 2;
+
+	// Build a new set of chunks and swap them into place, keeping the old
+	// ones to walk
+	TableVector<uint8_t, A> storageOld(storage.get_allocator());
+	Chunk * chunksNew;
+	ResetChunks(storageOld, chunksNew, chunkCountPow2);
+	storage.swap(storageOld);
+	Chunk * chunksOld = chunks;
+	size_t chunkCountOld = chunkCount;
+	chunks = chunksNew;
+	chunkCount = chunkCountPow2;
+
+	// Walk through all the current items and claim slots for them in the new
+	// chunks, which rebuilds the overflow counts; the values don't move
+	for (size_t iChunk = 0; iChunk < chunkCountOld; ++iChunk)
+	{
+		Chunk & c = chunksOld[iChunk];
+		for (uint32_t filled = ~F14TagMatch(c.tags, 0) & 0x3fffU; filled; filled &= filled - 1)
+		{
+			const Item & itemOld = c.items[LowestSetBit(filled)];
+			size_t hash = HashKey(itemOld.key);
+			size_t iSlot;
+			Item & itemNew = Claim(hash, FindEmptyProbe(hash, 0), &iSlot);
+			itemNew = itemOld;
+			MoveValue(itemNew, iSlot, Indirect());
+		}
+	}
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+void F14HashTable<K, V, IndirectValues, A>::ShrinkToFit()
+{
+	Reserve(size);
+	if (IndirectValues)
+	{
+		values.shrink_to_fit();
+		valueSlots.shrink_to_fit();
+	}
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+void F14HashTable<K, V, IndirectValues, A>::ShrinkIfSparse()
+{
+	// Under 1/8 full: rebuild with room for twice the keys left
+	if (size * 8 < chunkCount * s_chunkSlots && chunkCount > s_chunkCountInitial)
+		Reserve(size * 2);
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+void F14HashTable<K, V, IndirectValues, A>::Reset()
+{
+	// Blow away the current table and reset to small initial size
+	storage.clear();
+	ResetChunks(storage, chunks, s_chunkCountInitial);
+	chunkCount = s_chunkCountInitial;
+	values.clear();
+	valueSlots.clear();
+
+	size = 0;
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+HashTableStats F14HashTable<K, V, IndirectValues, A>::GetStats() const
+{
+	// A probe here is one chunk looked at, and the buckets are the slots;
+	// there are no tombstones or clusters, and chainHistogram counts the
+	// chunks by how many slots they have filled
+	HashTableStats stats = {};
+	stats.bucketCount = chunkCount * s_chunkSlots;
+	stats.size = size;
+	stats.loadFactor = float(size) / float(stats.bucketCount);
+
+	size_t probesHit = 0;
+	size_t probesMiss = 0;
+	for (size_t iChunk = 0; iChunk < chunkCount; ++iChunk)
+	{
+		const Chunk & c = chunks[iChunk];
+		uint32_t filled = ~F14TagMatch(c.tags, 0) & 0x3fffU;
+		int filledCount = 0;
+		for (; filled; filled &= filled - 1)
+		{
+			// Where this chunk comes in the key's probe sequence
+			size_t hash = HashKey(c.items[LowestSetBit(filled)].key);
+			int probes = 1;
+			while (ProbeChunk(hash, size_t(probes - 1)) != iChunk)
+				++probes;
+			probesHit += probes;
+			stats.maxProbeHit = std::max(stats.maxProbeHit, probes);
+			++filledCount;
+		}
+		++stats.chainHistogram[std::min(filledCount, s_statsHistogramLength - 1)];
+
+		// A miss starting here runs to the first chunk nothing overflowed
+		int probes = 1;
+		while (probes < int(chunkCount) && chunks[ProbeChunk(iChunk, size_t(probes - 1))].outboundOverflow != 0)
+			++probes;
+		probesMiss += probes;
+		stats.maxProbeMiss = std::max(stats.maxProbeMiss, probes);
+	}
+	stats.avgProbeHit = size ? float(probesHit) / float(size) : 0.0f;
+	stats.avgProbeMiss = float(probesMiss) / float(chunkCount);
+	return stats;
+}
+
+template <typename K, typename V, bool IndirectValues, typename A>
+size_t F14HashTable<K, V, IndirectValues, A>::Bytes() const
+{
+	return storage.size() + values.size() * sizeof(V) + valueSlots.size() * sizeof(uint32_t);
+}
+
+
+
+// DO1HashTable implementation
+
+template <typename K, typename V, typename A>
+DO1HashTable<K, V, A>::DO1HashTable(const A & alloc)
+:	buckets(alloc),
+	keyvals(alloc),
+	size(0),
+	tombstones(0),
+	rehashThreads(1),
+	autoShrink(false)
+{
+	// Start off with a small initial size
+	buckets.resize(s_hashTableInitialSize);
+	keyvals.resize(s_hashTableInitialSize);
+}
+
+template <typename K, typename V, typename A>
+void DO1HashTable<K, V, A>::Insert(const K & key, const V & value)
+{
+	// Resize larger if the load factor goes over 2/3, or clear out the
+	// tombstones if they've taken the buckets in use over 3/4
+	if (size * 3 > buckets.size() * 2)
+	{
+		Rehash(buckets.size() * 2);
+	}
+	else if ((size + tombstones) * 4 > buckets.size() * 3)
+	{
+		RehashInPlace();
+	}
+
+	InsertHashed(HashKey(key) & s_62Bits, key, value);
+}
+
+template <typename K, typename V, typename A>
+void DO1HashTable<K, V, A>::InsertHashed(size_t hash, const K & key, const V & value)
+{
+	// Find the starting bucket
+	// size_t iBucketStart = hash % buckets.size();
+	size_t iBucketStart = hash & (buckets.size() - 1);
+
+	// Search for an unused bucket
+	Bucket * bTarget = nullptr;
+	KV * kvTarget = nullptr;
+	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i) 
+	{
+		Bucket * b = &buckets[i];
+		if (b->state != BSTATE_Filled)
+		{
+			bTarget = b;
+			kvTarget = &keyvals[i];
+			break;
+		}
+	}
+	if (!bTarget)
+	{
+		for (size_t i = 0; i < iBucketStart; ++i)
+		{
+			Bucket * b = &buckets[i];
+			if (b->state != BSTATE_Filled)
+			{
+				bTarget = b;
+				kvTarget = &keyvals[i];
+				break;
+			}
+		}
+	}
+
+	assert(bTarget);
+	assert(kvTarget);
+
+	// Store the hash, key, and value in the bucket
+	SetBucketHash(*bTarget, hash);
+	if (bTarget->state == BSTATE_Removed)
+		--tombstones;
+	bTarget->state = BSTATE_Filled;
+	kvTarget->key = key;
+	kvTarget->value = value;
+
+	++size;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+V * DO1HashTable<K, V, A>::Lookup(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+	return LookupHashed(HashKey(key) & s_62Bits, key);
+}
+
+template <typename K, typename V, typename A>
+void DO1HashTable<K, V, A>::LookupBatch(const K * keys, size_t count, V ** results)
+{
+	// Hash a block of keys together, then probe for each of them
+	uint32_t hashes[s_hashBatchBlock];
+	for (size_t iBlock = 0; iBlock < count; iBlock += s_hashBatchBlock)
+	{
+		size_t n = std::min(count - iBlock, s_hashBatchBlock);
+		HashKeysBatch(keys + iBlock, n, hashes);
+		for (size_t i = 0; i < n; ++i)
+			results[iBlock + i] = LookupHashed(hashes[i] & s_62Bits, keys[iBlock + i]);
+	}
+}
+
+template <typename K, typename V, typename A>
+void DO1HashTable<K, V, A>::InsertBatch(const K * keys, const V * values, size_t count)
+{
+	// Grow once for the whole batch, so only tombstones are left to check
+	// for per key; then hash a block of keys together and insert each
+	if ((size + count) * 3 > buckets.size() * 2)
+		Reserve(size + count);
+
+	uint32_t hashes[s_hashBatchBlock];
+	for (size_t iBlock = 0; iBlock < count; iBlock += s_hashBatchBlock)
+	{
+		size_t n = std::min(count - iBlock, s_hashBatchBlock);
+		HashKeysBatch(keys + iBlock, n, hashes);
+		for (size_t i = 0; i < n; ++i)
+		{
+			if ((size + tombstones) * 4 > buckets.size() * 3)
+				RehashInPlace();
+			InsertHashed(hashes[i] & s_62Bits, keys[iBlock + i], values[iBlock + i]);
+		}
+	}
+}
+
+template <typename K, typename V, typename A>
+V * DO1HashTable<K, V, A>::LookupHashed(size_t hash, const typename KeyTraits<K>::Probe & key)
+{
+	// Find the starting bucket
+	// size_t iBucketStart = hash % buckets.size();
+	size_t iBucketStart = hash & (buckets.size() - 1);
+
+	// Search the buckets until we hit an empty one
+	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i)
+	{
+		Bucket * b = &buckets[i];
+		switch (b->state)
+		{
+		case BSTATE_Empty:
+			return nullptr;
+		case BSTATE_Filled:
+			if (BucketHashMatches(*b, hash))
+			{
+				KV * kv = &keyvals[i];
+				if (kv->key == key)
+					return &kv->value;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	for (size_t i = 0; i < iBucketStart; ++i)
+	{
+		Bucket * b = &buckets[i];
+		switch (b->state)
+		{
+		case BSTATE_Empty:
+			return nullptr;
+		case BSTATE_Filled:
+			if (BucketHashMatches(*b, hash))
+			{
+				KV * kv = &keyvals[i];
+				if (kv->key == key)
+					return &kv->value;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	return nullptr;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+bool DO1HashTable<K, V, A>::Remove(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	// Hash the key and find the starting bucket
+	const auto hash = HashKey(key) & s_62Bits;
+	// size_t iBucketStart = hash % buckets.size();
+	size_t iBucketStart = hash & (buckets.size() - 1);
+
+	// Search the buckets until we hit an empty one
+	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i)
+	{
+		Bucket * b = &buckets[i];
+		switch (b->state)
+		{
+		case BSTATE_Empty:
+			return false;
+		case BSTATE_Filled:
+			if (BucketHashMatches(*b, hash))
+			{
+				KV * kv = &keyvals[i];
+				if (kv->key == key)
+				{
+					SetBucketHash(*b, 0);
+					b->state = BSTATE_Removed;
+					--size;
+					++tombstones;
+					if (autoShrink)
+						ShrinkIfSparse();
+					return true;
+				}
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	for (size_t i = 0; i < iBucketStart; ++i)
+	{
+		Bucket * b = &buckets[i];
+		switch (b->state)
+		{
+		case BSTATE_Empty:
+			return false;
+		case BSTATE_Filled:
+			if (BucketHashMatches(*b, hash))
+			{
+				KV * kv = &keyvals[i];
+				if (kv->key == key)
+				{
+					SetBucketHash(*b, 0);
+					b->state = BSTATE_Removed;
+					--size;
+					++tombstones;
+					if (autoShrink)
+						ShrinkIfSparse();
+					return true;
+				}
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	return false;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+std::pair<V *, bool> DO1HashTable<K, V, A>::FindOrInsert(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	// Resize larger if the load factor goes over 2/3, or clear out the
+	// tombstones if they've taken the buckets in use over 3/4
+	if (size * 3 > buckets.size() * 2)
+	{
+		Rehash(buckets.size() * 2);
+	}
+	else if ((size + tombstones) * 4 > buckets.size() * 3)
+	{
+		RehashInPlace();
+	}
+
+	// Hash the key and find the starting bucket
+	const auto hash = HashKey(key) & s_62Bits;
+	// size_t iBucketStart = hash % buckets.size();
+	size_t iBucketStart = hash & (buckets.size() - 1);
+
+	// Search the buckets until we hit an empty one, remembering the first
+	// unused bucket along the way in case the key isn't there
+	Bucket * bTarget = nullptr;
+	KV * kvTarget = nullptr;
+	bool hitEmpty = false;
+	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd && !hitEmpty; ++i)
+	{
+		Bucket * b = &buckets[i];
+		switch (b->state)
+		{
+		case BSTATE_Empty:
+			hitEmpty = true;
+			if (!bTarget)
+			{
+				bTarget = b;
+				kvTarget = &keyvals[i];
+			}
+			break;
+		case BSTATE_Filled:
+			if (BucketHashMatches(*b, hash))
+			{
+				KV * kv = &keyvals[i];
+				if (kv->key == key)
+					return std::make_pair(&kv->value, false);
+			}
+			break;
+		default:
+			if (!bTarget)
+			{
+				bTarget = b;
+				kvTarget = &keyvals[i];
+			}
+			break;
+		}
+	}
+	for (size_t i = 0; i < iBucketStart && !hitEmpty; ++i)
+	{
+		Bucket * b = &buckets[i];
+		switch (b->state)
+		{
+		case BSTATE_Empty:
+			hitEmpty = true;
+			if (!bTarget)
+			{
+				bTarget = b;
+				kvTarget = &keyvals[i];
+			}
+			break;
+		case BSTATE_Filled:
+			if (BucketHashMatches(*b, hash))
+			{
+				KV * kv = &keyvals[i];
+				if (kv->key == key)
+					return std::make_pair(&kv->value, false);
+			}
+			break;
+		default:
+			if (!bTarget)
+			{
+				bTarget = b;
+				kvTarget = &keyvals[i];
+			}
+			break;
+		}
+	}
+
+	assert(bTarget);
+	assert(kvTarget);
+
+	// Store the hash, key, and value in the bucket
+	SetBucketHash(*bTarget, hash);
+	if (bTarget->state == BSTATE_Removed)
+		--tombstones;
+	bTarget->state = BSTATE_Filled;
+	kvTarget->key = KeyTraits<K>::Make(key);
+	kvTarget->value = V();
+
+	++size;
+	return std::make_pair(&kvTarget->value, true);
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+bool DO1HashTable<K, V, A>::InsertOrAssign(const Q & key, const V & value)
+{
+	auto result = FindOrInsert(key);
+	*result.first = value;
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q, typename F>
+bool DO1HashTable<K, V, A>::Upsert(const Q & key, F fn)
+{
+	auto result = FindOrInsert(key);
+	fn(*result.first);
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+template <typename It>
+void DO1HashTable<K, V, A>::BulkBuild(It first, It last)
+{
+	static_assert(std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<It>::iterator_category>::value,
+				  "BulkBuild needs a forward range: it counts the range, then reads it again");
+	// Size once for the final count, so no Rehash happens partway through
+	size_t count = size_t(std::distance(first, last));
+	if ((size + count) * 3 > buckets.size() * 2)
+		Reserve(size + count);
+
+	if (rehashThreads > 1 && count >= s_parallelRehashMinBuckets)
+	{
+		// Placing on all threads doesn't keep count of the tombstones it
+		// fills, so clear them out first
+		if (tombstones > 0)
+			RehashInPlace();
+
+		// Hash and place on all threads, the same way RehashParallel does;
+		// the keys are hashed on both partitioning passes rather than stored
+		std::vector<It> its;
+		its.reserve(count);
+		for (It it = first; it != last; ++it)
+			its.push_back(it);
+
+		std::vector<RehashEntry> entries;
+		std::vector<size_t> regionStarts;
+		PartitionForRehash(count, buckets.size(), rehashThreads,
+			[&](size_t iBegin, size_t iEnd, RehashSink & sink)
+			{
+				for (size_t i = iBegin; i < iEnd; ++i)
+					sink.Add(i, HashKey(its[i]->first) & s_62Bits);
+			},
+			entries, regionStarts);
+
+		PlaceForRehash(entries, regionStarts, buckets.size(), rehashThreads,
+			[&](size_t i) { return buckets[i].state != BSTATE_Filled; },
+			[&](const RehashEntry & entry, size_t iBucket)
+			{
+				SetBucketHash(buckets[iBucket], entry.hash);
+				buckets[iBucket].state = BSTATE_Filled;
+				keyvals[iBucket].key = its[entry.iOld]->first;
+				keyvals[iBucket].value = its[entry.iOld]->second;
+			});
+
+		size += count;
+		return;
+	}
+
+	std::vector<BulkEntry<It>> entries;
+	BulkPartition(first, count, buckets.size(), entries);
+	for (size_t i = 0; i < count; ++i)
+		InsertHashed(entries[i].hash & s_62Bits, entries[i].it->first, entries[i].it->second);
+}
+
+template <typename K, typename V, typename A>
+void DO1HashTable<K, V, A>::Reserve(size_t maxSize)
+{
+	maxSize = maxSize * 3 / 2;
+    maxSize |= maxSize >> 1;
+    maxSize |= maxSize >> 2;
+    maxSize |= maxSize >> 4;
+    maxSize |= maxSize >> 8;
+    maxSize |= maxSize >> 16;
+    maxSize |= maxSize >> 32;
+
+	Rehash(maxSize + 1);
+}
+
+template <typename K, typename V, typename A>
+void DO1HashTable<K, V, A>::Rehash(size_t bucketCountNew)
+{
+	// Can't rehash down to smaller than current size or initial size
+	bucketCountNew = std::max(std::max(bucketCountNew, size),
+						   size_t(s_hashTableInitialSize));
+
+	// Rebuilding drops any tombstones
+	tombstones = 0;
+
+	if (rehashThreads > 1 && bucketCountNew >= s_parallelRehashMinBuckets)
+	{
+		RehashParallel(bucketCountNew);
+		return;
+	}
+
+	// Build a new set of buckets and keyvals
+	TableVector<Bucket, A> bucketsNew(bucketCountNew, Bucket(), buckets.get_allocator());
+	TableVector<KV, A> keyvalsNew(bucketCountNew, KV(), keyvals.get_allocator());
+
+	// Walk through all the current elements and insert them into the new buckets
+	for (size_t i = 0, iEnd = buckets.size(); i < iEnd; ++i)
+	{
+		Bucket * b = &buckets[i];
+		if (b->state != BSTATE_Filled)
+			continue;
+
+		// Hash the key and find the starting bucket
+		const size_t hash = BucketHashOr(*b, [&]() { return HashKey(keyvals[i].key) & s_62Bits; });
+		// size_t iBucketStart = hash % bucketCountNew;
+		size_t iBucketStart = hash & (bucketCountNew - 1);
+
+		// Search for an unused bucket
+		Bucket * bTarget = nullptr;
+		KV * kvTarget = nullptr;
+		for (size_t j = iBucketStart; j < bucketCountNew; ++j) 
+		{
+			Bucket * bNew = &bucketsNew[j];
+			if (bNew->state != BSTATE_Filled)
+			{
+				bTarget = bNew;
+				kvTarget = &keyvalsNew[j];
+				break;
+			}
+		}
+		if (!bTarget)
+		{
+			for (size_t j = 0; j < iBucketStart; ++j)
+			{
+				Bucket * bNew = &bucketsNew[j];
+				if (bNew->state != BSTATE_Filled)
+				{
+					bTarget = bNew;
+					kvTarget = &keyvalsNew[j];
+					break;
+				}
+			}
+		}
+
+		assert(bTarget);
+		assert(kvTarget);
+
+		// Store the hash, key, and value in the bucket
+		SetBucketHash(*bTarget, hash);
+		bTarget->state = BSTATE_Filled;
+		KV * kv = &keyvals[i];
+		kvTarget->key = std::move(kv->key);
+		kvTarget->value = std::move(kv->value);
+	}
+
+	// Swap the new buckets and keyvals into place
+	buckets.swap(bucketsNew);
+	keyvals.swap(keyvalsNew);
+}
+
+template <typename K, typename V, typename A>
+void DO1HashTable<K, V, A>::RehashParallel(size_t bucketCountNew)
+{
+	TableVector<Bucket, A> bucketsNew(bucketCountNew, Bucket(), buckets.get_allocator());
+	TableVector<KV, A> keyvalsNew(bucketCountNew, KV(), keyvals.get_allocator());
+
+	std::vector<RehashEntry> entries;
+	std::vector<size_t> regionStarts;
+	PartitionForRehash(buckets.size(), bucketCountNew, rehashThreads,
+		[&](size_t iBegin, size_t iEnd, RehashSink & sink)
+		{
+			for (size_t i = iBegin; i < iEnd; ++i)
+			{
+				if (buckets[i].state == BSTATE_Filled)
+					sink.Add(i, BucketHashOr(buckets[i], [&]() { return HashKey(keyvals[i].key) & s_62Bits; }));
+			}
+		},
+		entries, regionStarts);
+
+	PlaceForRehash(entries, regionStarts, bucketCountNew, rehashThreads,
+		[&](size_t i) { return bucketsNew[i].state != BSTATE_Filled; },
+		[&](const RehashEntry & entry, size_t iTarget)
+		{
+			SetBucketHash(bucketsNew[iTarget], entry.hash);
+			bucketsNew[iTarget].state = BSTATE_Filled;
+			keyvalsNew[iTarget].key = std::move(keyvals[entry.iOld].key);
+			keyvalsNew[iTarget].value = std::move(keyvals[entry.iOld].value);
+		});
+
+	buckets.swap(bucketsNew);
+	keyvals.swap(keyvalsNew);
+}
+
+template <typename K, typename V, typename A>
+void DO1HashTable<K, V, A>::RehashInPlace()
+{
+	// Reinsert every key in the buckets it's in; see ReinsertInPlace
+	ReinsertInPlace(buckets.size(), false,
+		[&](size_t i) { return int(buckets[i].state); },
+		[&](size_t i, int state) { buckets[i].state = size_t(state); },
+		[&](size_t i) { return BucketHashOr(buckets[i], [&]() { return HashKey(keyvals[i].key) & s_62Bits; }); },
+		[&](size_t iFrom, size_t iTo)
+		{
+			buckets[iTo] = buckets[iFrom];
+			keyvals[iTo] = keyvals[iFrom];
+		},
+		[&](size_t i, size_t j)
+		{
+			std::swap(buckets[i], buckets[j]);
+			std::swap(keyvals[i], keyvals[j]);
+		});
+	tombstones = 0;
+}
+
+template <typename K, typename V, typename A>
+void DO1HashTable<K, V, A>::ShrinkToFit()
+{
+	// Rehash always rebuilds, so this clears out any tombstones too
+	Reserve(size);
+}
+
+template <typename K, typename V, typename A>
+void DO1HashTable<K, V, A>::ShrinkIfSparse()
+{
+	// Under 1/8 full: rebuild with room for twice the keys left
+	if (size * 8 < buckets.size() && buckets.size() > s_hashTableInitialSize)
+		Reserve(size * 2);
+}
+
+template <typename K, typename V, typename A>
+void DO1HashTable<K, V, A>::Reset()
+{
+	// Blow away the current table and reset to small initial size
+	buckets.clear();
+	buckets.resize(s_hashTableInitialSize);
+	keyvals.clear();
+	keyvals.resize(s_hashTableInitialSize);
+
+	size = 0;
+	tombstones = 0;
+}
+
+template <typename K, typename V, typename A>
+HashTableStats DO1HashTable<K, V, A>::GetStats() const
+{
+	return LinearProbeStats(buckets.size(),
+		[&](size_t i) { return int(buckets[i].state); },
+		[&](size_t i) { return BucketHashOr(buckets[i], [&]() { return HashKey(keyvals[i].key) & s_62Bits; }); });
+}
+
+
+
+// DO2HashTable implementation
+
+template <typename K, typename V, typename A>
+DO2HashTable<K, V, A>::DO2HashTable(const A & alloc)
+:	buckets(alloc),
+	keys(alloc),
+	values(alloc),
+	size(0),
+	tombstones(0),
+	rehashThreads(1),
+	autoShrink(false)
+{
+	// Start off with a small initial size
+	buckets.resize(s_hashTableInitialSize);
+	keys.resize(s_hashTableInitialSize);
+	values.resize(s_hashTableInitialSize);
+}
+
+template <typename K, typename V, typename A>
+void DO2HashTable<K, V, A>::Insert(const K & key, const V & value)
+{
+	// Resize larger if the load factor goes over 2/3, or clear out the
+	// tombstones if they've taken the buckets in use over 3/4
+	if (size * 3 > buckets.size() * 2)
+	{
+		Rehash(buckets.size() * 2);
+	}
+	else if ((size + tombstones) * 4 > buckets.size() * 3)
+	{
+		RehashInPlace();
+	}
+
+	InsertHashed(HashKey(key) & s_62Bits, key, value);
+}
+
+template <typename K, typename V, typename A>
+void DO2HashTable<K, V, A>::InsertHashed(size_t hash, const K & key, const V & value)
+{
+	// Find the starting bucket
+	// size_t iBucketStart = hash % buckets.size();
+	size_t iBucketStart = hash & (buckets.size() - 1);
+
+	// Search for an unused bucket
+	Bucket * bTarget = nullptr;
+	size_t iBucketTarget = 0;
+	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i) 
+	{
+		Bucket * b = &buckets[i];
+		if (b->state != BSTATE_Filled)
+		{
+			bTarget = b;
+			iBucketTarget = i;
+			break;
+		}
+	}
+	if (!bTarget)
+	{
+		for (size_t i = 0; i < iBucketStart; ++i)
+		{
+			Bucket * b = &buckets[i];
+			if (b->state != BSTATE_Filled)
+			{
+				bTarget = b;
+				iBucketTarget = i;
+				break;
+			}
+		}
+	}
+
+	assert(bTarget);
+
+	// Store the hash, key, and value in the bucket
+	bTarget->hash = hash;
+	if (bTarget->state == BSTATE_Removed)
+		--tombstones;
+	bTarget->state = BSTATE_Filled;
+	keys[iBucketTarget] = key;
+	values[iBucketTarget] = value;
+
+	++size;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+V * DO2HashTable<K, V, A>::Lookup(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+	return LookupHashed(HashKey(key) & s_62Bits, key);
+}
+
+template <typename K, typename V, typename A>
+void DO2HashTable<K, V, A>::LookupBatch(const K * keys, size_t count, V ** results)
+{
+	// Hash a block of keys together, then probe for each of them
+	uint32_t hashes[s_hashBatchBlock];
+	for (size_t iBlock = 0; iBlock < count; iBlock += s_hashBatchBlock)
+	{
+		size_t n = std::min(count - iBlock, s_hashBatchBlock);
+		HashKeysBatch(keys + iBlock, n, hashes);
+		for (size_t i = 0; i < n; ++i)
+			results[iBlock + i] = LookupHashed(hashes[i] & s_62Bits, keys[iBlock + i]);
+	}
+}
+
+template <typename K, typename V, typename A>
+V * DO2HashTable<K, V, A>::LookupHashed(size_t hash, const typename KeyTraits<K>::Probe & key)
+{
+	// Find the starting bucket
+	// size_t iBucketStart = hash % buckets.size();
+	size_t iBucketStart = hash & (buckets.size() - 1);
+
+	// Search the buckets until we hit an empty one
+	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i)
+	{
+		Bucket * b = &buckets[i];
+		switch (b->state)
+		{
+		case BSTATE_Empty:
+			return nullptr;
+		case BSTATE_Filled:
+			if (b->hash == hash && keys[i] == key)
+				return &values[i];
+			break;
+		default:
+			break;
+		}
+	}
+	for (size_t i = 0; i < iBucketStart; ++i)
+	{
+		Bucket * b = &buckets[i];
+		switch (b->state)
+		{
+		case BSTATE_Empty:
+			return nullptr;
+		case BSTATE_Filled:
+			if (b->hash == hash && keys[i] == key)
+				return &values[i];
+			break;
+		default:
+			break;
+		}
+	}
+
+	return nullptr;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+bool DO2HashTable<K, V, A>::Remove(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	// Hash the key and find the starting bucket
+	const auto hash = HashKey(key) & s_62Bits;
+	// size_t iBucketStart = hash % buckets.size();
+	size_t iBucketStart = hash & (buckets.size() - 1);
+
+	// Search the buckets until we hit an empty one
+	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i)
+	{
+		Bucket * b = &buckets[i];
+		switch (b->state)
+		{
+		case BSTATE_Empty:
+			return false;
+		case BSTATE_Filled:
+			if (b->hash == hash && keys[i] == key)
+			{
+				b->hash = 0;
+				b->state = BSTATE_Removed;
+				--size;
+				++tombstones;
+				if (autoShrink)
+					ShrinkIfSparse();
+				return true;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	for (size_t i = 0; i < iBucketStart; ++i)
+	{
+		Bucket * b = &buckets[i];
+		switch (b->state)
+		{
+		case BSTATE_Empty:
+			return false;
+		case BSTATE_Filled:
+			if (b->hash == hash && keys[i] == key)
+			{
+				b->hash = 0;
+				b->state = BSTATE_Removed;
+				--size;
+				++tombstones;
+				if (autoShrink)
+					ShrinkIfSparse();
+				return true;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	return false;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+std::pair<V *, bool> DO2HashTable<K, V, A>::FindOrInsert(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	// Resize larger if the load factor goes over 2/3, or clear out the
+	// tombstones if they've taken the buckets in use over 3/4
+	if (size * 3 > buckets.size() * 2)
+	{
+		Rehash(buckets.size() * 2);
+	}
+	else if ((size + tombstones) * 4 > buckets.size() * 3)
+	{
+		RehashInPlace();
+	}
+
+	// Hash the key and find the starting bucket
+	const auto hash = HashKey(key) & s_62Bits;
+	// size_t iBucketStart = hash % buckets.size();
+	size_t iBucketStart = hash & (buckets.size() - 1);
+
+	// Search the buckets until we hit an empty one, remembering the first
+	// unused bucket along the way in case the key isn't there
+	Bucket * bTarget = nullptr;
+	size_t iBucketTarget = 0;
+	bool hitEmpty = false;
+	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd && !hitEmpty; ++i)
+	{
+		Bucket * b = &buckets[i];
+		switch (b->state)
+		{
+		case BSTATE_Empty:
+			hitEmpty = true;
+			if (!bTarget)
+			{
+				bTarget = b;
+				iBucketTarget = i;
+			}
+			break;
+		case BSTATE_Filled:
+			if (b->hash == hash && keys[i] == key)
+				return std::make_pair(&values[i], false);
+			break;
+		default:
+			if (!bTarget)
+			{
+				bTarget = b;
+				iBucketTarget = i;
+			}
+			break;
+		}
+	}
+	for (size_t i = 0; i < iBucketStart && !hitEmpty; ++i)
+	{
+		Bucket * b = &buckets[i];
+		switch (b->state)
+		{
+		case BSTATE_Empty:
+			hitEmpty = true;
+			if (!bTarget)
+			{
+				bTarget = b;
+				iBucketTarget = i;
+			}
+			break;
+		case BSTATE_Filled:
+			if (b->hash == hash && keys[i] == key)
+				return std::make_pair(&values[i], false);
+			break;
+		default:
+			if (!bTarget)
+			{
+				bTarget = b;
+				iBucketTarget = i;
+			}
+			break;
+		}
+	}
+
+	assert(bTarget);
+
+	// Store the hash, key, and value in the bucket
+	bTarget->hash = hash;
+	if (bTarget->state == BSTATE_Removed)
+		--tombstones;
+	bTarget->state = BSTATE_Filled;
+	keys[iBucketTarget] = KeyTraits<K>::Make(key);
+	values[iBucketTarget] = V();
+
+	++size;
+	return std::make_pair(&values[iBucketTarget], true);
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+bool DO2HashTable<K, V, A>::InsertOrAssign(const Q & key, const V & value)
+{
+	auto result = FindOrInsert(key);
+	*result.first = value;
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q, typename F>
+bool DO2HashTable<K, V, A>::Upsert(const Q & key, F fn)
+{
+	auto result = FindOrInsert(key);
+	fn(*result.first);
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+template <typename It>
+void DO2HashTable<K, V, A>::BulkBuild(It first, It last)
+{
+	static_assert(std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<It>::iterator_category>::value,
+				  "BulkBuild needs a forward range: it counts the range, then reads it again");
+	// Size once for the final count, so no Rehash happens partway through
+	size_t count = size_t(std::distance(first, last));
+	if ((size + count) * 3 > buckets.size() * 2)
+		Reserve(size + count);
+
+	if (rehashThreads > 1 && count >= s_parallelRehashMinBuckets)
+	{
+		// Placing on all threads doesn't keep count of the tombstones it
+		// fills, so clear them out first
+		if (tombstones > 0)
+			RehashInPlace();
+
+		// Hash and place on all threads, the same way RehashParallel does;
+		// the keys are hashed on both partitioning passes rather than stored
+		std::vector<It> its;
+		its.reserve(count);
+		for (It it = first; it != last; ++it)
+			its.push_back(it);
+
+		std::vector<RehashEntry> entries;
+		std::vector<size_t> regionStarts;
+		PartitionForRehash(count, buckets.size(), rehashThreads,
+			[&](size_t iBegin, size_t iEnd, RehashSink & sink)
+			{
+				for (size_t i = iBegin; i < iEnd; ++i)
+					sink.Add(i, HashKey(its[i]->first) & s_62Bits);
+			},
+			entries, regionStarts);
+
+		PlaceForRehash(entries, regionStarts, buckets.size(), rehashThreads,
+			[&](size_t i) { return buckets[i].state != BSTATE_Filled; },
+			[&](const RehashEntry & entry, size_t iBucket)
+			{
+				buckets[iBucket].hash = entry.hash;
+				buckets[iBucket].state = BSTATE_Filled;
+				keys[iBucket] = its[entry.iOld]->first;
+				values[iBucket] = its[entry.iOld]->second;
+			});
+
+		size += count;
+		return;
+	}
+
+	std::vector<BulkEntry<It>> entries;
+	BulkPartition(first, count, buckets.size(), entries);
+	for (size_t i = 0; i < count; ++i)
+		InsertHashed(entries[i].hash & s_62Bits, entries[i].it->first, entries[i].it->second);
+}
+
+template <typename K, typename V, typename A>
+void DO2HashTable<K, V, A>::Reserve(size_t maxSize)
+{
+	maxSize = maxSize * 3 / 2;
+    maxSize |= maxSize >> 1;
+    maxSize |= maxSize >> 2;
+    maxSize |= maxSize >> 4;
+    maxSize |= maxSize >> 8;
+    maxSize |= maxSize >> 16;
+    maxSize |= maxSize >> 32;
+
+	Rehash(maxSize + 1);
+}
+
+template <typename K, typename V, typename A>
+void DO2HashTable<K, V, A>::Rehash(size_t bucketCountNew)
+{
+	// Can't rehash down to smaller than current size or initial size
+	bucketCountNew = std::max(std::max(bucketCountNew, size),
+						   size_t(s_hashTableInitialSize));
+
+	// Rebuilding drops any tombstones
+	tombstones = 0;
+
+	if (rehashThreads > 1 && bucketCountNew >= s_parallelRehashMinBuckets)
+	{
+		RehashParallel(bucketCountNew);
+		return;
+	}
+
+	// Build a new set of buckets, keys, and values
+	TableVector<Bucket, A> bucketsNew(bucketCountNew, Bucket(), buckets.get_allocator());
+	TableVector<K, A> keysNew(bucketCountNew, K(), keys.get_allocator());
+	TableVector<V, A> valuesNew(bucketCountNew, V(), values.get_allocator());
+
+	// Walk through all the current elements and insert them into the new buckets
+	for (size_t i = 0, iEnd = buckets.size(); i < iEnd; ++i)
+	{
+		Bucket * b = &buckets[i];
+		if (b->state != BSTATE_Filled)
+			continue;
+
+		// Hash the key and find the starting bucket
+		const auto hash = b->hash;
+		// size_t iBucketStart = hash % bucketCountNew;
+		size_t iBucketStart = hash & (bucketCountNew - 1);
+
+		// Search for an unused bucket
+		Bucket * bTarget = nullptr;
+		size_t iBucketTarget = 0;
+		for (size_t j = iBucketStart; j < bucketCountNew; ++j) 
+		{
+			Bucket * bNew = &bucketsNew[j];
+			if (bNew->state != BSTATE_Filled)
+			{
+				bTarget = bNew;
+				iBucketTarget = j;
+				break;
+			}
+		}
+		if (!bTarget)
+		{
+			for (size_t j = 0; j < iBucketStart; ++j)
+			{
+				Bucket * bNew = &bucketsNew[j];
+				if (bNew->state != BSTATE_Filled)
+				{
+					bTarget = bNew;
+					iBucketTarget = j;
+					break;
+				}
+			}
+		}
+
+		assert(bTarget);
+
+		// Store the hash, key, and value in the bucket
+		bTarget->hash = hash;
+		bTarget->state = BSTATE_Filled;
+		keysNew[iBucketTarget] = std::move(keys[i]);
+		valuesNew[iBucketTarget] = std::move(values[i]);
+	}
+
+	// Swap the new buckets, keys, and values into place
+	buckets.swap(bucketsNew);
+	keys.swap(keysNew);
+	values.swap(valuesNew);
+}
+
+template <typename K, typename V, typename A>
+void DO2HashTable<K, V, A>::RehashParallel(size_t bucketCountNew)
+{
+	TableVector<Bucket, A> bucketsNew(bucketCountNew, Bucket(), buckets.get_allocator());
+	TableVector<K, A> keysNew(bucketCountNew, K(), keys.get_allocator());
+	TableVector<V, A> valuesNew(bucketCountNew, V(), values.get_allocator());
+
+	std::vector<RehashEntry> entries;
+	std::vector<size_t> regionStarts;
+	PartitionForRehash(buckets.size(), bucketCountNew, rehashThreads,
+		[&](size_t iBegin, size_t iEnd, RehashSink & sink)
+		{
+			for (size_t i = iBegin; i < iEnd; ++i)
+			{
+				if (buckets[i].state == BSTATE_Filled)
+					sink.Add(i, buckets[i].hash);
+			}
+		},
+		entries, regionStarts);
+
+	PlaceForRehash(entries, regionStarts, bucketCountNew, rehashThreads,
+		[&](size_t i) { return bucketsNew[i].state != BSTATE_Filled; },
+		[&](const RehashEntry & entry, size_t iTarget)
+		{
+			bucketsNew[iTarget].hash = entry.hash;
+			bucketsNew[iTarget].state = BSTATE_Filled;
+			keysNew[iTarget] = std::move(keys[entry.iOld]);
+			valuesNew[iTarget] = std::move(values[entry.iOld]);
+		});
+
+	buckets.swap(bucketsNew);
+	keys.swap(keysNew);
+	values.swap(valuesNew);
+}
+
+template <typename K, typename V, typename A>
+void DO2HashTable<K, V, A>::RehashInPlace()
+{
+	// Reinsert every key in the buckets it's in; see ReinsertInPlace
+	ReinsertInPlace(buckets.size(), false,
+		[&](size_t i) { return int(buckets[i].state); },
+		[&](size_t i, int state) { buckets[i].state = size_t(state); },
+		[&](size_t i) { return size_t(buckets[i].hash); },
+		[&](size_t iFrom, size_t iTo)
+		{
+			buckets[iTo] = buckets[iFrom];
+			keys[iTo] = keys[iFrom];
+			values[iTo] = values[iFrom];
+		},
+		[&](size_t i, size_t j)
+		{
+			std::swap(buckets[i], buckets[j]);
+			std::swap(keys[i], keys[j]);
+			std::swap(values[i], values[j]);
+		});
+	tombstones = 0;
+}
+
+template <typename K, typename V, typename A>
+void DO2HashTable<K, V, A>::ShrinkToFit()
+{
+	// Rehash always rebuilds, so this clears out any tombstones too
+	Reserve(size);
+}
+
+template <typename K, typename V, typename A>
+void DO2HashTable<K, V, A>::ShrinkIfSparse()
+{
+	// Under 1/8 full: rebuild with room for twice the keys left
+	if (size * 8 < buckets.size() && buckets.size() > s_hashTableInitialSize)
+		Reserve(size * 2);
+}
+
+template <typename K, typename V, typename A>
+void DO2HashTable<K, V, A>::Reset()
+{
+	// Blow away the current table and reset to small initial size
+	buckets.clear();
+	buckets.resize(s_hashTableInitialSize);
+	keys.clear();
+	keys.resize(s_hashTableInitialSize);
+	values.clear();
+	values.resize(s_hashTableInitialSize);
+
+	size = 0;
+	tombstones = 0;
+}
+
+template <typename K, typename V, typename A>
+HashTableStats DO2HashTable<K, V, A>::GetStats() const
+{
+	return LinearProbeStats(buckets.size(),
+		[&](size_t i) { return int(buckets[i].state); },
+		[&](size_t i) { return size_t(buckets[i].hash); });
+}
+
+template <typename K, typename V, typename A>
+bool DO2HashTable<K, V, A>::SaveSnapshot(const char * path) const
+{
+	static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+				  "Only tables of plain-old-data keys and values can be snapshotted");
+
+	SnapshotHeader header = {};
+	header.kind = SNAPSHOTKIND_DO2;
+	header.keySize = sizeof(K);
+	header.valueSize = sizeof(V);
+	header.bucketCount = buckets.size();
+	header.size = size;
+
+	SnapshotArray arrays[] =
+	{
+		{ buckets.data(), sizeof(Bucket), buckets.size() },
+		{ keys.data(), sizeof(K), keys.size() },
+		{ values.data(), sizeof(V), values.size() },
+	};
+	return WriteSnapshot(path, header, arrays, 3);
+}
+
+
+
+// Snapshot tables implementation
+
+template <typename K, typename V>
+DO2SnapshotTable<K, V>::DO2SnapshotTable()
+:	buckets(nullptr),
+	keys(nullptr),
+	values(nullptr),
+	bucketCount(0),
+	size(0)
+{
+}
+
+template <typename K, typename V>
+bool DO2SnapshotTable<K, V>::Open(const char * path, bool verifyPayload)
+{
+	Close();
+
+	static const uint64_t s_elemSizes[] = { sizeof(Bucket), sizeof(K), sizeof(V) };
+	const SnapshotHeader * pHeader = OpenSnapshot(file, path, SNAPSHOTKIND_DO2, sizeof(K), sizeof(V),
+												  s_elemSizes, 3, verifyPayload);
+	if (!pHeader)
+		return false;
+
+	// All three arrays must have one entry per bucket
+	if (pHeader->arrays[0].count != pHeader->bucketCount ||
+		pHeader->arrays[1].count != pHeader->bucketCount ||
+		pHeader->arrays[2].count != pHeader->bucketCount ||
+		pHeader->bucketCount == 0)
+	{
+		file.Close();
+		return false;
+	}
+
+	buckets = reinterpret_cast<const Bucket *>(file.data + pHeader->arrays[0].offset);
+	keys = reinterpret_cast<const K *>(file.data + pHeader->arrays[1].offset);
+	values = reinterpret_cast<const V *>(file.data + pHeader->arrays[2].offset);
+	bucketCount = size_t(pHeader->bucketCount);
+	size = size_t(pHeader->size);
+	return true;
+}
+
+template <typename K, typename V>
+void DO2SnapshotTable<K, V>::Close()
+{
+	file.Close();
+	buckets = nullptr;
+	keys = nullptr;
+	values = nullptr;
+	bucketCount = 0;
+	size = 0;
+}
+
+template <typename K, typename V>
+template <typename Q>
+const V * DO2SnapshotTable<K, V>::Lookup(const Q & keyIn) const
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	// Same probe sequence as DO2HashTable::Lookup
+	const auto hash = HashKey(key) & s_62Bits;
+	size_t iBucketStart = hash & (bucketCount - 1);
+
+	// Search the buckets until we hit an empty one
+	for (size_t i = iBucketStart; i < bucketCount; ++i)
+	{
+		const Bucket * b = &buckets[i];
+		switch (b->state)
+		{
+		case DO2HashTable<K, V>::BSTATE_Empty:
+			return nullptr;
+		case DO2HashTable<K, V>::BSTATE_Filled:
+			if (b->hash == hash && keys[i] == key)
+				return &values[i];
+			break;
+		default:
+			break;
+		}
+	}
+	for (size_t i = 0; i < iBucketStart; ++i)
+	{
+		const Bucket * b = &buckets[i];
+		switch (b->state)
+		{
+		case DO2HashTable<K, V>::BSTATE_Empty:
+			return nullptr;
+		case DO2HashTable<K, V>::BSTATE_Filled:
+			if (b->hash == hash && keys[i] == key)
+				return &values[i];
+			break;
+		default:
+			break;
+		}
+	}
+
+	return nullptr;
+}
+
+template <typename K, typename V>
+D0SnapshotTable<K, V>::D0SnapshotTable()
+:	buckets(nullptr),
+	keyAndNexts(nullptr),
+	values(nullptr),
+	bucketCount(0),
+	size(0)
+{
+}
+
+template <typename K, typename V>
+bool D0SnapshotTable<K, V>::Open(const char * path, bool verifyPayload)
+{
+	Close();
+
+	static const uint64_t s_elemSizes[] = { sizeof(uint32_t), sizeof(KN), sizeof(V) };
+	const SnapshotHeader * pHeader = OpenSnapshot(file, path, SNAPSHOTKIND_D0, sizeof(K), sizeof(V),
+												  s_elemSizes, 3, verifyPayload);
+	if (!pHeader)
+		return false;
+
+	// Chain indices can point anywhere in keyAndNexts, which values must cover
+	if (pHeader->arrays[0].count != pHeader->bucketCount ||
+		pHeader->arrays[1].count != pHeader->arrays[2].count ||
+		pHeader->bucketCount == 0)
+	{
+		file.Close();
+		return false;
+	}
+
+	buckets = reinterpret_cast<const uint32_t *>(file.data + pHeader->arrays[0].offset);
+	keyAndNexts = reinterpret_cast<const KN *>(file.data + pHeader->arrays[1].offset);
+	values = reinterpret_cast<const V *>(file.data + pHeader->arrays[2].offset);
+	bucketCount = size_t(pHeader->bucketCount);
+	size = size_t(pHeader->size);
+	return true;
+}
+
+template <typename K, typename V>
+void D0SnapshotTable<K, V>::Close()
+{
+	file.Close();
+	buckets = nullptr;
+	keyAndNexts = nullptr;
+	values = nullptr;
+	bucketCount = 0;
+	size = 0;
+}
+
+template <typename K, typename V>
+template <typename Q>
+const V * D0SnapshotTable<K, V>::Lookup(const Q & keyIn) const
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	// Same chain walk as D0HashTable::Lookup
+	const auto hash = HashKey(key);
+
+	auto index = buckets[hash & (bucketCount - 1)];
+
+	while (index != static_cast<uint32_t>(-1))
+	{
+		const KN & kn = keyAndNexts[index];
+
+		if (kn.key == key)
+		{
+			return &values[index];
+		}
+
+		index = kn.next;
+	}
+
+	return nullptr;
+}
+
+
+
+// EHHashTable implementation
+
+template <typename K, typename V>
+const size_t EHHashTable<K, V>::s_pageSlots;
+template <typename K, typename V>
+const size_t EHHashTable<K, V>::s_pageSlotsFull;
+
+template <typename K, typename V>
+EHHashTable<K, V>::EHHashTable()
+:	globalDepth(0),
+	pageCount(0),
+	size(0)
+{
+}
+
+template <typename K, typename V>
+bool EHHashTable<K, V>::Open(const char * path, size_t cacheFrames)
+{
+	Close();
+	if (!cache.Open(path, std::max(cacheFrames, s_pageCacheFramesMin)))
+		return false;
+
+	// One empty page, which every hash maps to
+	cache.Create(0);
+	directory.assign(1, 0);
+	globalDepth = 0;
+	pageCount = 1;
+	size = 0;
+	return true;
+}
+
+template <typename K, typename V>
+void EHHashTable<K, V>::Close()
+{
+	cache.Close();
+	directory.clear();
+	globalDepth = 0;
+	pageCount = 0;
+	size = 0;
+}
+
+template <typename K, typename V>
+bool EHHashTable<K, V>::Flush()
+{
+	return cache.Flush();
+}
+
+template <typename K, typename V>
+typename EHHashTable<K, V>::Page * EHHashTable<K, V>::FetchPage(size_t hash, bool dirty)
+{
+	uint32_t iPage = directory[hash & (directory.size() - 1)];
+	return reinterpret_cast<Page *>(cache.Fetch(iPage, dirty));
+}
+
+template <typename K, typename V>
+int EHHashTable<K, V>::FindSlot(const Page & page, size_t hash, const typename KeyTraits<K>::Probe & key)
+{
+	// Search the slots until we hit an empty one; the page is never full
+	for (size_t i = SlotHome(hash); SlotFilled(page, i); i = (i + 1 == s_pageSlots) ? 0 : i + 1)
+	{
+		if (page.slots[i].key == key)
+			return int(i);
+	}
+	return -1;
+}
+
+template <typename K, typename V>
+uint32_t EHHashTable<K, V>::FindInChain(const Page & page, size_t hash, const typename KeyTraits<K>::Probe & key, int & iSlot)
+{
+	// Only the hash the page overflowed with has anything on its chain
+	if (page.overflow == 0 || page.overflowHash != uint32_t(hash))
+		return 0;
+	for (uint32_t iPage = page.overflow; iPage != 0; )
+	{
+		const Page & pageChain = *reinterpret_cast<Page *>(cache.Fetch(iPage, false));
+		iSlot = FindSlot(pageChain, hash, key);
+		if (iSlot >= 0)
+			return iPage;
+		iPage = pageChain.overflow;
+	}
+	return 0;
+}
+
+template <typename K, typename V>
+bool EHHashTable<K, V>::PageAllHash(const Page & page, size_t hash)
+{
+	if (page.overflow != 0 && page.overflowHash != uint32_t(hash))
+		return false;
+	for (size_t i = 0; i < s_pageSlots; ++i)
+	{
+		if (SlotFilled(page, i) && HashKey(page.slots[i].key) != hash)
+			return false;
+	}
+	return true;
+}
+
+template <typename K, typename V>
+size_t EHHashTable<K, V>::PlaceEntry(Page & page, size_t hash, const Entry & entry)
+{
+	size_t i = SlotHome(hash);
+	while (SlotFilled(page, i))
+		i = (i + 1 == s_pageSlots) ? 0 : i + 1;
+	page.filled[i / 64] |= uint64_t(1) << (i % 64);
+	page.slots[i] = entry;
+	++page.count;
+	return i;
+}
+
+template <typename K, typename V>
+void EHHashTable<K, V>::RemoveSlot(Page & page, size_t iSlot)
+{
+	// Backward-shift deletion: move later entries of the run into the hole
+	// whenever their home slot allows it, so no tombstone is left behind
+	size_t iHole = iSlot;
+	for (size_t i = iHole; ; )
+	{
+		i = (i + 1 == s_pageSlots) ? 0 : i + 1;
+		if (!SlotFilled(page, i))
+			break;
+
+		// The entry can fill the hole unless its home is cyclically in
+		// (iHole, i], i.e. past the hole
+		size_t iHome = SlotHome(HashKey(page.slots[i].key));
+		bool homePastHole = (iHole <= i) ? (iHome > iHole && iHome <= i) : (iHome > iHole || iHome <= i);
+		if (!homePastHole)
+		{
+			page.slots[iHole] = page.slots[i];
+			iHole = i;
+		}
+	}
+	page.filled[iHole / 64] &= ~(uint64_t(1) << (iHole % 64));
+	--page.count;
+}
+
+template <typename K, typename V>
+void EHHashTable<K, V>::SplitPage(size_t hash)
+{
+	uint32_t iPageOld = directory[hash & (directory.size() - 1)];
+	int depth = reinterpret_cast<Page *>(cache.Fetch(iPageOld, true))->localDepth;
+	assert(depth < 32);
+
+	// The page already uses every bit the directory does: double the
+	// directory, each new entry pointing where its lower twin does
+	if (depth == globalDepth)
+	{
+		size_t directorySize = directory.size();
+		directory.resize(directorySize * 2);
+		std::copy(directory.begin(), directory.begin() + directorySize, directory.begin() + directorySize);
+		++globalDepth;
+	}
+
+	// Take the old page's entries out, and put each back in it or in a new
+	// page by the next bit of its hash.  The cache keeps the last few pages
+	// fetched, so the old one is still where it was.
+	uint32_t iPageNew = pageCount++;
+	Page & pageNew = *reinterpret_cast<Page *>(cache.Create(iPageNew));
+	Page & pageOld = *reinterpret_cast<Page *>(cache.Fetch(iPageOld, true));
+	Page pageCopy = pageOld;
+	pageOld.count = 0;
+	std::fill(pageOld.filled, pageOld.filled + s_pageFilledWords, uint64_t(0));
+	pageOld.localDepth = pageNew.localDepth = uint8_t(depth + 1);
+	pageOld.overflow = 0;
+	for (size_t i = 0; i < s_pageSlots; ++i)
+	{
+		if (!SlotFilled(pageCopy, i))
+			continue;
+		size_t hashEntry = HashKey(pageCopy.slots[i].key);
+		PlaceEntry(((hashEntry >> depth) & 1) ? pageNew : pageOld, hashEntry, pageCopy.slots[i]);
+	}
+
+	// An overflow chain goes with the entries of its hash
+	if (pageCopy.overflow != 0)
+	{
+		Page & pageChain = ((pageCopy.overflowHash >> depth) & 1) ? pageNew : pageOld;
+		pageChain.overflow = pageCopy.overflow;
+		pageChain.overflowHash = pageCopy.overflowHash;
+	}
+
+	// Point the directory entries for the old page with that bit set at the
+	// new one
+	size_t step = size_t(1) << depth;
+	for (size_t i = (hash & (step - 1)) | step, iEnd = directory.size(); i < iEnd; i += step * 2)
+		directory[i] = iPageNew;
+}
+
+template <typename K, typename V>
+typename EHHashTable<K, V>::Entry & EHHashTable<K, V>::InsertHashed(size_t hash, const K & key)
+{
+	// Split until the key's page has room; a split can send every entry
+	// the same way, so it may take more than one.  If the page and its chain
+	// hold nothing but the key's hash, no split would ever part them (and
+	// the splits would run out of hash bits), so it goes on the chain.
+	Page * page = FetchPage(hash, true);
+	while (page->count >= s_pageSlotsFull)
+	{
+		if (PageAllHash(*page, hash))
+			return InsertOverflow(hash, key);
+		SplitPage(hash);
+		page = FetchPage(hash, true);
+	}
+
+	Entry entry;
+	entry.key = key;
+	entry.value = V();
+	size_t iSlot = PlaceEntry(*page, hash, entry);
+	++size;
+	return page->slots[iSlot];
+}
+
+template <typename K, typename V>
+typename EHHashTable<K, V>::Entry & EHHashTable<K, V>::InsertOverflow(size_t hash, const K & key)
+{
+	// Into the first page on the chain with room, or a new one on its end
+	uint32_t iPage = directory[hash & (directory.size() - 1)];
+	Page * page = reinterpret_cast<Page *>(cache.Fetch(iPage, true));
+	page->overflowHash = uint32_t(hash);
+	while (page->count >= s_pageSlotsFull && page->overflow != 0)
+	{
+		iPage = page->overflow;
+		page = reinterpret_cast<Page *>(cache.Fetch(iPage, false));
+	}
+	if (page->count >= s_pageSlotsFull)
+	{
+		uint32_t iPageNew = pageCount++;
+		reinterpret_cast<Page *>(cache.Fetch(iPage, true))->overflow = iPageNew;
+		page = reinterpret_cast<Page *>(cache.Create(iPageNew));
+	}
+	else
+	{
+		page = reinterpret_cast<Page *>(cache.Fetch(iPage, true));
+	}
+
+	Entry entry;
+	entry.key = key;
+	entry.value = V();
+	size_t iSlot = PlaceEntry(*page, hash, entry);
+	++size;
+	return page->slots[iSlot];
+}
+
+template <typename K, typename V>
+void EHHashTable<K, V>::Insert(const K & key, const V & value)
+{
+	InsertHashed(HashKey(key), key).value = value;
+}
+
+template <typename K, typename V>
+template <typename Q>
+const V * EHHashTable<K, V>::Lookup(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+	const auto hash = HashKey(key);
+	Page * page = FetchPage(hash, false);
+	int iSlot = FindSlot(*page, hash, key);
+	if (iSlot < 0)
+	{
+		uint32_t iPage = FindInChain(*page, hash, key, iSlot);
+		if (iPage == 0)
+			return nullptr;
+		page = reinterpret_cast<Page *>(cache.Fetch(iPage, false));
+	}
+	return &page->slots[iSlot].value;
+}
+
+template <typename K, typename V>
+template <typename Q>
+bool EHHashTable<K, V>::Remove(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+	const auto hash = HashKey(key);
+	uint32_t iPage = directory[hash & (directory.size() - 1)];
+	Page * page = reinterpret_cast<Page *>(cache.Fetch(iPage, false));
+	int iSlot = FindSlot(*page, hash, key);
+	if (iSlot < 0)
+	{
+		iPage = FindInChain(*page, hash, key, iSlot);
+		if (iPage == 0)
+			return false;
+	}
+
+	// Only mark the page dirty once there's a change to write back
+	page = reinterpret_cast<Page *>(cache.Fetch(iPage, true));
+	RemoveSlot(*page, size_t(iSlot));
+	--size;
+	return true;
+}
+
+template <typename K, typename V>
+template <typename Q>
+std::pair<V *, bool> EHHashTable<K, V>::FindOrInsert(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+	const auto hash = HashKey(key);
+
+	// The caller can write through the pointer either way, so the page is
+	// dirty either way
+	Page * page = FetchPage(hash, true);
+	int iSlot = FindSlot(*page, hash, key);
+	if (iSlot < 0)
+	{
+		uint32_t iPage = FindInChain(*page, hash, key, iSlot);
+		if (iPage != 0)
+			page = reinterpret_cast<Page *>(cache.Fetch(iPage, true));
+	}
+	if (iSlot >= 0)
+		return std::make_pair(&page->slots[iSlot].value, false);
+
+	return std::make_pair(&InsertHashed(hash, KeyTraits<K>::Make(key)).value, true);
+}
+
+template <typename K, typename V>
+template <typename Q>
+bool EHHashTable<K, V>::InsertOrAssign(const Q & key, const V & value)
+{
+	auto result = FindOrInsert(key);
+	*result.first = value;
+	return result.second;
+}
+
+template <typename K, typename V>
+template <typename Q, typename F>
+bool EHHashTable<K, V>::Upsert(const Q & key, F fn)
+{
+	auto result = FindOrInsert(key);
+	fn(*result.first);
+	return result.second;
+}
+
+
+
+// MMHashTable implementation
+
+template <typename K, typename V, typename A>
+MMHashTable<K, V, A>::MMHashTable(const A & alloc)
+:	buckets(alloc),
+	values(alloc),
+	keyCount(0),
+	size(0),
+	holes(0)
+{
+	// Start off with a small initial size
+	buckets.resize(s_hashTableInitialSize);
+}
+
+template <typename K, typename V, typename A>
+size_t MMHashTable<K, V, A>::FindBucket(size_t hash, const typename KeyTraits<K>::Probe & key) const
+{
+	// Search the buckets until we hit an empty one
+	const size_t mask = buckets.size() - 1;
+	for (size_t i = BucketHome(hash); buckets[i].capacity != 0; i = (i + 1) & mask)
+	{
+		const Bucket & b = buckets[i];
+		if (BucketHashMatches(b, hash) && b.key == key)
+			return i;
+	}
+	return s_none;
+}
+
+template <typename K, typename V, typename A>
+typename MMHashTable<K, V, A>::Bucket & MMHashTable<K, V, A>::FindOrAddKey(size_t hash, const K & key)
+{
+	// Resize larger if the distinct keys go over 2/3 of the buckets
+	if ((keyCount + 1) * 3 > buckets.size() * 2)
+		Rehash(buckets.size() * 2);
+
+	const size_t mask = buckets.size() - 1;
+	size_t i = BucketHome(hash);
+	for (; buckets[i].capacity != 0; i = (i + 1) & mask)
+	{
+		Bucket & b = buckets[i];
+		if (BucketHashMatches(b, hash) && b.key == key)
+			return b;
+	}
+
+	// A new key, with no values and no room yet; the caller gives it room
+	// before anything else probes, since until then the bucket looks empty
+	Bucket & b = buckets[i];
+	SetBucketHash(b, hash);
+	b.key = key;
+	b.offset = 0;
+	b.count = 0;
+	++keyCount;
+	return b;
+}
+
+template <typename K, typename V, typename A>
+void MMHashTable<K, V, A>::GrowRun(Bucket & b)
+{
+	assert(values.size() + b.capacity * 2 + 1 <= s_none);
+
+	uint32_t capacityNew = std::max(b.capacity * 2, uint32_t(1));
+	if (b.capacity != 0 && b.offset + b.capacity == values.size())
+	{
+		// Last in the array: grow it where it is
+		values.resize(b.offset + capacityNew);
+	}
+	else
+	{
+		// Move it to the end with twice the room, leaving a hole
+		size_t offsetNew = values.size();
+		values.resize(offsetNew + capacityNew);
+		std::move(values.begin() + b.offset, values.begin() + b.offset + b.count, values.begin() + offsetNew);
+		holes += b.capacity;
+		b.offset = uint32_t(offsetNew);
+	}
+	b.capacity = capacityNew;
+}
+
+template <typename K, typename V, typename A>
+void MMHashTable<K, V, A>::Insert(const K & key, const V & value)
+{
+	Bucket & b = FindOrAddKey(HashKey(key), key);
+	if (b.count == b.capacity)
+		GrowRun(b);
+	values[b.offset + b.count] = value;
+	++b.count;
+	++size;
+
+	// Pack the runs once the holes are more than half the array
+	if (holes * 2 > values.size())
+		Compact();
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+V * MMHashTable<K, V, A>::Lookup(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+	size_t i = FindBucket(HashKey(key), key);
+	if (i == s_none)
+		return nullptr;
+	return &values[buckets[i].offset];
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+std::pair<V *, V *> MMHashTable<K, V, A>::EqualRange(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+	size_t i = FindBucket(HashKey(key), key);
+	if (i == s_none)
+		return std::pair<V *, V *>(nullptr, nullptr);
+	V * pFirst = &values[buckets[i].offset];
+	return std::make_pair(pFirst, pFirst + buckets[i].count);
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+size_t MMHashTable<K, V, A>::Count(const Q & keyIn) const
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+	size_t i = FindBucket(HashKey(key), key);
+	return (i == s_none) ? 0 : buckets[i].count;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+bool MMHashTable<K, V, A>::Remove(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+	size_t i = FindBucket(HashKey(key), key);
+	if (i == s_none)
+		return false;
+
+	holes += buckets[i].capacity;
+	size -= buckets[i].count;
+	--keyCount;
+
+	// Walk the rest of the run, moving back into the hole any key whose home
+	// bucket is at or before it, so every key stays reachable from its home
+	const size_t mask = buckets.size() - 1;
+	size_t iHole = i;
+	for (size_t j = (i + 1) & mask; buckets[j].capacity != 0; j = (j + 1) & mask)
+	{
+		size_t iHome = BucketHome(HashOf(buckets[j]));
+		if (((j - iHome) & mask) >= ((j - iHole) & mask))
+		{
+			buckets[iHole] = std::move(buckets[j]);
+			iHole = j;
+		}
+	}
+	buckets[iHole].capacity = 0;
+	buckets[iHole].count = 0;
+
+	if (keyCount == 0)
+	{
+		values.clear();
+		holes = 0;
+	}
+	else if (holes * 2 > values.size())
+	{
+		Compact();
+	}
+	return true;
+}
+
+template <typename K, typename V, typename A>
+template <typename It>
+void MMHashTable<K, V, A>::BulkBuild(It first, It last)
+{
+	static_assert(std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<It>::iterator_category>::value,
+				  "BulkBuild needs a forward range: it counts the range, then reads it again");
+	// Counting sort by key: every key in the range gets a bucket, with
+	// capacity counting up its values on top of those it has, then Relayout
+	// gives each run exactly that much room and the values go straight in.
+	// Keys already here give up any room they had beyond their values first.
+	for (Bucket & b : buckets)
+	{
+		if (b.capacity != 0)
+			b.capacity = b.count;
+	}
+
+	size_t count = size_t(std::distance(first, last));
+	assert(values.size() - holes + count <= s_none);
+	std::vector<uint32_t> hashes(count);
+	It it = first;
+	for (size_t i = 0; i < count; ++i, ++it)
+	{
+		hashes[i] = HashKey(it->first);
+		++FindOrAddKey(hashes[i], it->first).capacity;
+	}
+
+	Relayout();
+
+	// No more keys come in, so the buckets stay put
+	it = first;
+	for (size_t i = 0; i < count; ++i, ++it)
+	{
+		Bucket & b = buckets[FindBucket(hashes[i], it->first)];
+		values[b.offset + b.count] = it->second;
+		++b.count;
+	}
+	size += count;
+}
+
+template <typename K, typename V, typename A>
+void MMHashTable<K, V, A>::Relayout()
+{
+	// Each run goes to a new array in bucket order, with the room its
+	// capacity says, keeping the values it has
+	size_t total = 0;
+	for (const Bucket & b : buckets)
+		total += b.capacity;
+
+	TableVector<V, A> valuesNew(values.get_allocator());
+	valuesNew.resize(total);
+	size_t offset = 0;
+	for (Bucket & b : buckets)
+	{
+		if (b.capacity == 0)
+			continue;
+		std::move(values.begin() + b.offset, values.begin() + b.offset + b.count, valuesNew.begin() + offset);
+		b.offset = uint32_t(offset);
+		offset += b.capacity;
+	}
+
+	values.swap(valuesNew);
+	holes = 0;
+}
+
+template <typename K, typename V, typename A>
+void MMHashTable<K, V, A>::Compact()
+{
+	// Packed: every run's room is just its values
+	for (Bucket & b : buckets)
+	{
+		if (b.capacity != 0)
+			b.capacity = b.count;
+	}
+	Relayout();
+}
+
+template <typename K, typename V, typename A>
+void MMHashTable<K, V, A>::Reserve(size_t maxKeys, size_t maxValues)
+{
+	maxKeys = maxKeys * 3 / 2;
+
+	maxKeys |= maxKeys >> 1;
+	maxKeys |= maxKeys >> 2;
+	maxKeys |= maxKeys >> 4;
+	maxKeys |= maxKeys >> 8;
+	maxKeys |= maxKeys >> 16;
+	maxKeys |= maxKeys >> 32;
+
+	Rehash(maxKeys + 1);
+	values.reserve(maxValues);
+}
+
+template <typename K, typename V, typename A>
+void MMHashTable<K, V, A>::Rehash(size_t bucketCountNew)
+{
+	// Can't rehash down to smaller than current size or initial size
+	bucketCountNew = std::max(std::max(bucketCountNew, keyCount),
+						   size_t(s_hashTableInitialSize));
+
+	// Build a new set of buckets and move the keys across; the values stay
+	// where they are
+	TableVector<Bucket, A> bucketsNew(bucketCountNew, Bucket(), buckets.get_allocator());
+	const size_t mask = bucketCountNew - 1;
+	for (Bucket & b : buckets)
+	{
+		if (b.capacity == 0)
+			continue;
+		size_t j = HashOf(b) & mask;
+		while (bucketsNew[j].capacity != 0)
+			j = (j + 1) & mask;
+		bucketsNew[j] = std::move(b);
+	}
+
+	buckets.swap(bucketsNew);
+}
+
+template <typename K, typename V, typename A>
+void MMHashTable<K, V, A>::Reset()
+{
+	// Blow away the current table and reset to small initial size
+	buckets.clear();
+	buckets.resize(s_hashTableInitialSize);
+	values.clear();
+
+	keyCount = 0;
+	size = 0;
+	holes = 0;
+}
+
+template <typename K, typename V, typename A>
+HashTableStats MMHashTable<K, V, A>::GetStats() const
+{
+	return LinearProbeStats(buckets.size(),
+		[&](size_t i) { return buckets[i].capacity != 0 ? 1 : 0; },
+		[&](size_t i) { return HashOf(buckets[i]); });
+}
+
+
+
+// RPHashTable implementation
+
+template <typename K, typename V, typename A>
+const size_t RPHashTable<K, V, A>::s_lookupSliceMax;
+
+template <typename K, typename V, typename A>
+RPHashTable<K, V, A>::RPHashTable(const A & allocIn)
+:	subTables(allocIn),
+	partitionBits(0),
+	size(0),
+	alloc(allocIn)
+{
+	// The most buckets whose states and keyvals fit, as a power of two
+	const size_t bucketBytes = sizeof(typename SubTable::Bucket) + sizeof(typename SubTable::KV);
+	subTableBucketCount = s_hashTableInitialSize;
+	while (subTableBucketCount * 2 * bucketBytes <= s_subTableBytesMax)
+		subTableBucketCount *= 2;
+	subTableSizeMax = subTableBucketCount * 2 / 3;
+
+	// Start off with one small sub-table
+	subTables.emplace_back(alloc);
+}
+
+template <typename K, typename V, typename A>
+void RPHashTable<K, V, A>::InsertIntoSubTable(SubTable & subTable, size_t hash, const K & key, const V & value)
+{
+	// As DO1's Insert: grow over 2/3 full, or clear out tombstones over 3/4.
+	// Once split, the sub-tables are presized, so this only grows the first,
+	// or one the hash has overfilled.
+	if (subTable.size * 3 > subTable.buckets.size() * 2)
+	{
+		subTable.Rehash(subTable.buckets.size() * 2);
+	}
+	else if ((subTable.size + subTable.tombstones) * 4 > subTable.buckets.size() * 3)
+	{
+		subTable.RehashInPlace();
+	}
+
+	subTable.InsertHashed(hash, key, value);
+}
+
+template <typename K, typename V, typename A>
+bool RPHashTable<K, V, A>::SplitWanted(const SubTable & subTable) const
+{
+	// Full, and the sub-tables are at least half full on average (a split
+	// when only this one is full would just leave most of them empty)
+	return subTable.size >= subTableSizeMax &&
+		   size * 2 >= subTableSizeMax << partitionBits &&
+		   partitionBits < s_partitionBitsMax;
+}
+
+template <typename K, typename V, typename A>
+void RPHashTable<K, V, A>::InsertHashed(size_t hash, const K & key, const V & value)
+{
+	if (SplitWanted(SubTableFor(hash)))
+		Repartition(partitionBits + 1);
+	InsertIntoSubTable(SubTableFor(hash), hash, key, value);
+	++size;
+}
+
+template <typename K, typename V, typename A>
+void RPHashTable<K, V, A>::Insert(const K & key, const V & value)
+{
+	InsertHashed(HashKey(key) & s_62Bits, key, value);
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+V * RPHashTable<K, V, A>::Lookup(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+	const size_t hash = HashKey(key) & s_62Bits;
+	return SubTableFor(hash).LookupHashed(hash, key);
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+bool RPHashTable<K, V, A>::Remove(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+	if (!SubTableFor(HashKey(key) & s_62Bits).Remove(key))
+		return false;
+	--size;
+	return true;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+std::pair<V *, bool> RPHashTable<K, V, A>::FindOrInsert(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+	const size_t hash = HashKey(key) & s_62Bits;
+
+	// Split first if the key would go in a full sub-table, so the pointer
+	// returned stays good
+	if (SplitWanted(SubTableFor(hash)))
+		Repartition(partitionBits + 1);
+	auto result = SubTableFor(hash).FindOrInsert(key);
+	if (result.second)
+		++size;
+	return result;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q>
+bool RPHashTable<K, V, A>::InsertOrAssign(const Q & key, const V & value)
+{
+	auto result = FindOrInsert(key);
+	*result.first = value;
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+template <typename Q, typename F>
+bool RPHashTable<K, V, A>::Upsert(const Q & key, F fn)
+{
+	auto result = FindOrInsert(key);
+	fn(*result.first);
+	return result.second;
+}
+
+template <typename K, typename V, typename A>
+void RPHashTable<K, V, A>::PartitionBatch(const K * keys, size_t count)
+{
+	// Hash a block of keys together, counting the keys per sub-table, then
+	// scatter them to their sub-table's group
+	batchHashes.resize(count);
+	for (size_t iBlock = 0; iBlock < count; iBlock += s_hashBatchBlock)
+		HashKeysBatch(keys + iBlock, std::min(count - iBlock, s_hashBatchBlock), &batchHashes[iBlock]);
+
+	batchStarts.assign(subTables.size() + 1, 0);
+	for (size_t i = 0; i < count; ++i)
+		++batchStarts[SubTableIndex(batchHashes[i]) + 1];
+	for (size_t i = 1, iEnd = batchStarts.size(); i < iEnd; ++i)
+		batchStarts[i] += batchStarts[i - 1];
+
+	batchEntries.resize(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		BatchEntry & entry = batchEntries[batchStarts[SubTableIndex(batchHashes[i])]++];
+		entry.hash = batchHashes[i];
+		entry.index = uint32_t(i);
+		entry.key = keys[i];
+	}
+
+	// The scatter moved each start up to the next one's; put them back
+	for (size_t i = batchStarts.size() - 1; i > 0; --i)
+		batchStarts[i] = batchStarts[i - 1];
+	batchStarts[0] = 0;
+}
+
+template <typename K, typename V, typename A>
+void RPHashTable<K, V, A>::LookupBatch(const K * keys, size_t count, V ** results)
+{
+	assert(count <= ~uint32_t(0));
+	if (partitionBits == 0)
+	{
+		subTables[0].LookupBatch(keys, count, results);
+		return;
+	}
+
+	// A batch seldom gives a sub-table enough keys to pull much of it into
+	// cache, so most probes still miss; what grouping buys is that the next
+	// keys' buckets are known ahead of time, so they're fetched while this
+	// one is probed.  That needs no more than a slice of the batch, and a
+	// bigger one only spills the scratch and scatters the results.
+	for (size_t iSlice = 0; iSlice < count; iSlice += s_lookupSliceMax)
+	{
+		size_t sliceCount = std::min(count - iSlice, s_lookupSliceMax);
+		V ** sliceResults = results + iSlice;
+		PartitionBatch(keys + iSlice, sliceCount);
+		for (size_t j = 0; j < sliceCount && j < s_batchPrefetchDistance; ++j)
+			PrefetchHome(batchEntries[j]);
+		for (size_t iSub = 0, iSubEnd = subTables.size(); iSub < iSubEnd; ++iSub)
+		{
+			SubTable & subTable = subTables[iSub];
+			for (size_t j = batchStarts[iSub], jEnd = batchStarts[iSub + 1]; j < jEnd; ++j)
+			{
+				if (j + s_batchPrefetchDistance < sliceCount)
+					PrefetchHome(batchEntries[j + s_batchPrefetchDistance]);
+				const BatchEntry & entry = batchEntries[j];
+				sliceResults[entry.index] = subTable.LookupHashed(entry.hash & s_62Bits, entry.key);
+			}
+		}
+	}
+}
+
+template <typename K, typename V, typename A>
+void RPHashTable<K, V, A>::PrefetchHome(const BatchEntry & entry) const
+{
+	const SubTable & subTable = subTables[SubTableIndex(entry.hash)];
+	size_t iBucket = entry.hash & (subTable.buckets.size() - 1);
+	PrefetchRead(&subTable.buckets[iBucket]);
+	PrefetchRead(&subTable.keyvals[iBucket]);
+}
+
+template <typename K, typename V, typename A>
+void RPHashTable<K, V, A>::InsertBatch(const K * keys, const V * values, size_t count)
+{
+	assert(count <= ~uint32_t(0));
+
+	// Split up front as far as the batch will take it, leaving them 3/4 full
+	// at most on average, so a sub-table seldom splits partway through
+	int partitionBitsNew = partitionBits;
+	while ((subTableSizeMax << partitionBitsNew) * 3 < (size + count) * 4 && partitionBitsNew < s_partitionBitsMax)
+		++partitionBitsNew;
+	if (partitionBitsNew > partitionBits)
+		Repartition(partitionBitsNew);
+
+	// Keys grouped for the sub-tables there are now; if one overfills and
+	// they split anyway, InsertHashed still puts each key where it belongs
+	PartitionBatch(keys, count);
+	for (size_t iSub = 0, iSubEnd = batchStarts.size() - 1; iSub < iSubEnd; ++iSub)
+	{
+		for (size_t j = batchStarts[iSub], jEnd = batchStarts[iSub + 1]; j < jEnd; ++j)
+		{
+			const BatchEntry & entry = batchEntries[j];
+			InsertHashed(entry.hash & s_62Bits, entry.key, values[entry.index]);
+		}
+	}
+}
+
+template <typename K, typename V, typename A>
+void RPHashTable<K, V, A>::Repartition(int partitionBitsNew)
+{
+	assert(partitionBitsNew > partitionBits);
+
+	// Every key in an old sub-table goes to one of the new ones it splits
+	// into, by the next bits of its hash.  Those are consecutive, so they're
+	// made (at full size, so moving the keys in doesn't rehash them) just as
+	// their old one is drained, and it's given back as soon as it's empty:
+	// at the peak, the memory live is the new sub-tables plus one old one.
+	TableVector<SubTable, A> subTablesNew(subTables.get_allocator());
+	subTablesNew.reserve(size_t(1) << partitionBitsNew);
+	const size_t splitsPerOld = size_t(1) << (partitionBitsNew - partitionBits);
+	partitionBits = partitionBitsNew;
+	for (SubTable & subTable : subTables)
+	{
+		for (size_t i = 0; i < splitsPerOld; ++i)
+		{
+			subTablesNew.emplace_back(alloc);
+			subTablesNew.back().Rehash(subTableBucketCount);
+		}
+
+		for (size_t i = 0, iEnd = subTable.buckets.size(); i < iEnd; ++i)
+		{
+			const typename SubTable::Bucket & b = subTable.buckets[i];
+			if (b.state != SubTable::BSTATE_Filled)
+				continue;
+			const typename SubTable::KV & kv = subTable.keyvals[i];
+			const size_t hash = BucketHashOr(b, [&]() { return HashKey(kv.key) & s_62Bits; });
+			InsertIntoSubTable(subTablesNew[SubTableIndex(hash)], hash, kv.key, kv.value);
+		}
+		TableVector<typename SubTable::Bucket, A>(alloc).swap(subTable.buckets);
+		TableVector<typename SubTable::KV, A>(alloc).swap(subTable.keyvals);
+	}
+
+	subTables.swap(subTablesNew);
+}
+
+template <typename K, typename V, typename A>
+void RPHashTable<K, V, A>::Reserve(size_t maxSize)
+{
+	// Enough sub-tables that none should have to split (3/4 full at most on
+	// average, as InsertBatch leaves them), or if one will do, room in it
+	int partitionBitsNew = partitionBits;
+	while ((subTableSizeMax << partitionBitsNew) * 3 < maxSize * 4 && partitionBitsNew < s_partitionBitsMax)
+		++partitionBitsNew;
+	if (partitionBitsNew > partitionBits)
+		Repartition(partitionBitsNew);
+	else if (partitionBits == 0)
+		subTables[0].Reserve(maxSize);
+}
+
+template <typename K, typename V, typename A>
+void RPHashTable<K, V, A>::Reset()
+{
+	// Back to one small sub-table
+	subTables.clear();
+	subTables.emplace_back(alloc);
+	partitionBits = 0;
+	size = 0;
+}
+
+template <typename K, typename V, typename A>
+HashTableStats RPHashTable<K, V, A>::GetStats() const
+{
+	// Totals over the sub-tables; the averages weighted by the keys (hits) or
+	// buckets (misses) behind them, since that's what a random lookup sees
+	HashTableStats stats = HashTableStats();
+	double probesHit = 0.0, probesMiss = 0.0;
+	for (const SubTable & subTable : subTables)
+	{
+		HashTableStats sub = subTable.GetStats();
+		stats.bucketCount += sub.bucketCount;
+		stats.size += sub.size;
+		stats.tombstones += sub.tombstones;
+		probesHit += double(sub.avgProbeHit) * double(sub.size);
+		probesMiss += double(sub.avgProbeMiss) * double(sub.bucketCount);
+		stats.maxProbeHit = std::max(stats.maxProbeHit, sub.maxProbeHit);
+		stats.maxProbeMiss = std::max(stats.maxProbeMiss, sub.maxProbeMiss);
+		for (int i = 0; i < s_statsHistogramLength; ++i)
+		{
+			stats.clusterHistogram[i] += sub.clusterHistogram[i];
+			stats.chainHistogram[i] += sub.chainHistogram[i];
+		}
+	}
+
+	stats.loadFactor = float(stats.size) / float(stats.bucketCount);
+	stats.avgProbeHit = stats.size ? float(probesHit / double(stats.size)) : 0.0f;
+	stats.avgProbeMiss = float(probesMiss / double(stats.bucketCount));
+	return stats;
+}
+
+
+
+// FixedHashTable implementation
+
+template <typename K, typename V, int N, bool LinearScan>
+const size_t FixedHashTable<K, V, N, LinearScan>::s_bucketCount;
+template <typename K, typename V, int N, bool LinearScan>
+const size_t FixedHashTable<K, V, N, LinearScan>::s_mask;
+
+template <typename K, typename V, int N, bool LinearScan>
+FixedHashTable<K, V, N, LinearScan>::FixedHashTable()
+:	states(),
+	size(0)
+{
+}
+
+template <typename K, typename V, int N, bool LinearScan>
+void FixedHashTable<K, V, N, LinearScan>::Insert(const K & key, const V & value)
+{
+	assert(size < size_t(N));
+
+	if (LinearScan)
+	{
+		keys[size] = key;
+		values[size] = value;
+		++size;
+		return;
+	}
+
+	// Never more than 2/3 full, so there's always an empty bucket to stop at
+	size_t i = HashKey(key) & s_mask;
+	while (states[i] == BSTATE_Filled)
+		i = (i + 1) & s_mask;
+
+	states[i] = BSTATE_Filled;
+	keys[i] = key;
+	values[i] = value;
+	++size;
+}
+
+template <typename K, typename V, int N, bool LinearScan>
+template <typename Q>
+V * FixedHashTable<K, V, N, LinearScan>::Lookup(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	if (LinearScan)
+	{
+		for (size_t i = 0; i < size; ++i)
+		{
+			if (keys[i] == key)
+				return &values[i];
+		}
+		return nullptr;
+	}
+
+	for (size_t i = HashKey(key) & s_mask; states[i] == BSTATE_Filled; i = (i + 1) & s_mask)
+	{
+		if (keys[i] == key)
+			return &values[i];
+	}
+	return nullptr;
+}
+
+template <typename K, typename V, int N, bool LinearScan>
+template <typename Q>
+bool FixedHashTable<K, V, N, LinearScan>::Remove(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	if (LinearScan)
+	{
+		for (size_t i = 0; i < size; ++i)
+		{
+			if (keys[i] == key)
+			{
+				// Fill the hole from the end, to keep the keys packed
+				--size;
+				if (i != size)
+				{
+					keys[i] = std::move(keys[size]);
+					values[i] = std::move(values[size]);
+				}
+				return true;
+			}
+		}
+		return false;
+	}
+
+	size_t i = HashKey(key) & s_mask;
+	for (;;)
+	{
+		if (states[i] != BSTATE_Filled)
+			return false;
+		if (keys[i] == key)
+			break;
+		i = (i + 1) & s_mask;
+	}
+
+	// Walk the rest of the run, moving back into the hole any entry whose home
+	// bucket is at or before it, so every entry stays reachable from its home
+	size_t iHole = i;
+	for (size_t j = (i + 1) & s_mask; states[j] == BSTATE_Filled; j = (j + 1) & s_mask)
+	{
+		size_t iHome = HashKey(keys[j]) & s_mask;
+		if (((j - iHome) & s_mask) >= ((j - iHole) & s_mask))
+		{
+			keys[iHole] = std::move(keys[j]);
+			values[iHole] = std::move(values[j]);
+			iHole = j;
+		}
+	}
+
+	states[iHole] = BSTATE_Empty;
+	--size;
+	return true;
+}
+
+template <typename K, typename V, int N, bool LinearScan>
+template <typename Q>
+std::pair<V *, bool> FixedHashTable<K, V, N, LinearScan>::FindOrInsert(const Q & keyIn)
+{
+	const typename KeyTraits<K>::Probe & key = keyIn;
+
+	if (LinearScan)
+	{
+		for (size_t i = 0; i < size; ++i)
+		{
+			if (keys[i] == key)
+				return std::make_pair(&values[i], false);
+		}
+
+		assert(size < size_t(N));
+		keys[size] = KeyTraits<K>::Make(key);
+		values[size] = V();
+		return std::make_pair(&values[size++], true);
+	}
+
+	// No tombstones, so the first empty bucket is both where the search ends
+	// and where the key goes
+	size_t i = HashKey(key) & s_mask;
+	for (; states[i] == BSTATE_Filled; i = (i + 1) & s_mask)
+	{
+		if (keys[i] == key)
+			return std::make_pair(&values[i], false);
+	}
+
+	assert(size < size_t(N));
+	states[i] = BSTATE_Filled;
+	keys[i] = KeyTraits<K>::Make(key);
+	values[i] = V();
+	++size;
+	return std::make_pair(&values[i], true);
+}
+
+template <typename K, typename V, int N, bool LinearScan>
+template <typename Q>
+bool FixedHashTable<K, V, N, LinearScan>::InsertOrAssign(const Q & key, const V & value)
+{
+	auto result = FindOrInsert(key);
+	*result.first = value;
+	return result.second;
+}
+
+template <typename K, typename V, int N, bool LinearScan>
+template <typename Q, typename F>
+bool FixedHashTable<K, V, N, LinearScan>::Upsert(const Q & key, F fn)
+{
+	auto result = FindOrInsert(key);
+	fn(*result.first);
+	return result.second;
+}
+
+template <typename K, typename V, int N, bool LinearScan>
+void FixedHashTable<K, V, N, LinearScan>::Reserve(size_t maxSize)
+{
+	(void)maxSize;
+	assert(maxSize <= size_t(N));
+}
+
+template <typename K, typename V, int N, bool LinearScan>
+void FixedHashTable<K, V, N, LinearScan>::Reset()
+{
+	// The keys and values are left as they are, to be overwritten
+	states.fill(BSTATE_Empty);
+	size = 0;
+}
+
+
+
+// PerfectHashTable implementation
+
+template <typename K, typename V, typename A>
+const size_t PerfectHashTable<K, V, A>::s_keysPerBucket;
+
+// Spreads a pilot over 64 bits, so consecutive pilots move keys far apart
+inline uint64_t PerfectHashPilot(uint32_t pilot)
+{
+	uint64_t x = (uint64_t(pilot) + 1) * 0x9e3779b97f4a7c15ULL;
+	return x ^ (x >> 29);
+}
+
+// Maps a 32-bit hash onto [0, range) with a multiply rather than a divide
+inline size_t PerfectHashRange(uint64_t hash, size_t range)
+{
+	return size_t((uint64_t(uint32_t(hash)) * range) >> 32);
+}
+
+// PTHash's skewed bucket mapping: 60% of the keys go to the first 30% of the
+// buckets.  Those dense buckets get placed first, while the slots are mostly
+// free, which leaves only small buckets for when they're nearly all taken.
+inline size_t PerfectHashBucket(uint64_t hash, size_t bucketCount)
+{
+	// Which way this goes is random, so pick the range with a mask rather than
+	// leave the compiler a branch to mispredict
+	size_t denseCount = bucketCount * 3 / 10;
+	size_t denseMask = size_t(0) - size_t(uint32_t(hash >> 32) < 0x9999999aU);
+	size_t first = denseCount & ~denseMask;
+	size_t count = (denseCount & denseMask) | ((bucketCount - denseCount) & ~denseMask);
+	return first + PerfectHashRange(hash, count);
+}
+
+// The slot for a key under a given pilot.  The XOR has to be mixed before it's
+// ranged: otherwise two keys whose hashes share their top bits would share
+// them under every pilot, and could never be separated.
+inline size_t PerfectHashSlot(uint64_t hash, uint64_t pilotHash, size_t slotCount)
+{
+	uint64_t x = (hash ^ pilotHash) * 0xff51afd7ed558ccdULL;
+	return PerfectHashRange(x >> 32, slotCount);
+}
+
+template <typename K, typename V, typename A>
+PerfectHashTable<K, V, A>::PerfectHashTable(const A & alloc)
+:	pilots(alloc),
+	remap(alloc),
+	keyvals(alloc),
+	seed(0),
+	slotCount(0),
+	size(0)
+{
+}
+
+template <typename K, typename V, typename A>
+template <typename It>
+bool PerfectHashTable<K, V, A>::Build(It first, It last)
+{
+	static const int s_seedsMax = 32;
+
+	pilots.clear();
+	remap.clear();
+	keyvals.clear();
+	slotCount = 0;
+	size = 0;
+
+	size_t count = size_t(std::distance(first, last));
+	if (count == 0)
+		return true;
+	assert(count < (size_t(1) << 32));
+
+	// ~2% spare slots: the last few buckets placed would take forever to find
+	// room for if every slot had to be used exactly
+	size_t bucketCount = (count + s_keysPerBucket - 1) / s_keysPerBucket;
+	size_t slotCountNew = count + count / 50;
+
+	struct KeyHash
+	{
+		uint32_t	bucket;
+		uint32_t	index;		// into its
+		uint64_t	hash;		// for the slot
+	};
+	std::vector<It> its;
+	its.reserve(count);
+	for (It it = first; it != last; ++it)
+		its.push_back(it);
+	std::vector<KeyHash> keyHashes(count);
+	std::vector<KeyHash> byBucket(count);
+	std::vector<uint32_t> bucketStarts(bucketCount + 1);
+	std::vector<uint32_t> bucketOrder(bucketCount);
+	std::vector<uint16_t> pilotsNew(bucketCount);
+	std::vector<bool> taken(slotCountNew);		// bits, to stay in cache while searching
+
+	for (uint64_t seedNew = 0; seedNew < s_seedsMax; ++seedNew)
+	{
+		// Hash everything, and counting-sort it by bucket
+		std::fill(bucketStarts.begin(), bucketStarts.end(), 0);
+		for (size_t i = 0; i < count; ++i)
+		{
+			uint64_t hash1, hash2;
+			PerfectHashKey(its[i]->first, seedNew, &hash1, &hash2);
+			keyHashes[i].bucket = uint32_t(PerfectHashBucket(hash1, bucketCount));
+			keyHashes[i].index = uint32_t(i);
+			keyHashes[i].hash = hash2;
+			++bucketStarts[keyHashes[i].bucket + 1];
+		}
+		size_t bucketSizeMax = 0;
+		for (size_t i = 1; i <= bucketCount; ++i)
+		{
+			bucketSizeMax = std::max(bucketSizeMax, size_t(bucketStarts[i]));
+			bucketStarts[i] += bucketStarts[i - 1];
+		}
+		{
+			std::vector<uint32_t> offsets(bucketStarts.begin(), bucketStarts.end() - 1);
+			for (size_t i = 0; i < count; ++i)
+				byBucket[offsets[keyHashes[i].bucket]++] = keyHashes[i];
+		}
 
-		// Search for an unused bucket
-		Bucket * bTarget = nullptr;
-		KV * kvTarget = nullptr;
-		for (size_t j = iBucketStart; j < bucketCountNew; ++j) 
+		// Keys in the same bucket with the same slot hash would collide whatever
+		// the pilot: that's either the same key twice, or (with 64 bits of hash,
+		// practically never) a reason to try another seed
+		bool retry = false;
+		for (size_t bucket = 0; bucket < bucketCount; ++bucket)
 		{
-			Bucket * bNew = &bucketsNew[j];
-			if (bNew->state != BSTATE_Filled)
+			for (uint32_t i = bucketStarts[bucket], iEnd = bucketStarts[bucket + 1]; i < iEnd; ++i)
 			{
-				bTarget = bNew;
-				kvTarget = &keyvalsNew[j];
-				break;
+				for (uint32_t j = i + 1; j < iEnd; ++j)
+				{
+					if (byBucket[i].hash != byBucket[j].hash)
+						continue;
+					if (its[byBucket[i].index]->first == its[byBucket[j].index]->first)
+						return false;
+					retry = true;
+				}
 			}
 		}
-		if (!bTarget)
+		if (retry)
+			continue;
+
+		// Place the biggest buckets first, while there's plenty of room
 		{
-			for (size_t j = 0; j < iBucketStart; ++j)
+			std::vector<uint32_t> sizeStarts(bucketSizeMax + 2, 0);
+			for (size_t bucket = 0; bucket < bucketCount; ++bucket)
+				++sizeStarts[bucketSizeMax - (bucketStarts[bucket + 1] - bucketStarts[bucket]) + 1];
+			for (size_t i = 1; i < sizeStarts.size(); ++i)
+				sizeStarts[i] += sizeStarts[i - 1];
+			for (size_t bucket = 0; bucket < bucketCount; ++bucket)
+				bucketOrder[sizeStarts[bucketSizeMax - (bucketStarts[bucket + 1] - bucketStarts[bucket])]++] = uint32_t(bucket);
+		}
+
+		std::fill(taken.begin(), taken.end(), false);
+		bool placedAll = true;
+		for (size_t iOrder = 0; iOrder < bucketCount && placedAll; ++iOrder)
+		{
+			uint32_t bucket = bucketOrder[iOrder];
+			uint32_t iBegin = bucketStarts[bucket], iEnd = bucketStarts[bucket + 1];
+			if (iBegin == iEnd)
+				break;
+
+			// Try pilots until all this bucket's keys land on free slots
+			placedAll = false;
+			for (uint32_t pilot = 0; pilot <= 0xffff && !placedAll; ++pilot)
 			{
-				Bucket * bNew = &bucketsNew[j];
-				if (bNew->state != BSTATE_Filled)
+				uint64_t pilotHash = PerfectHashPilot(pilot);
+				uint32_t i = iBegin;
+				for (; i < iEnd; ++i)
 				{
-					bTarget = bNew;
-					kvTarget = &keyvalsNew[j];
-					break;
+					size_t slot = PerfectHashSlot(byBucket[i].hash, pilotHash, slotCountNew);
+					if (taken[slot])
+						break;
+					taken[slot] = true;
+				}
+				if (i == iEnd)
+				{
+					pilotsNew[bucket] = uint16_t(pilot);
+					placedAll = true;
+				}
+				else
+				{
+					// Undo the partial placement
+					for (uint32_t j = iBegin; j < i; ++j)
+						taken[PerfectHashSlot(byBucket[j].hash, pilotHash, slotCountNew)] = false;
 				}
 			}
 		}
+		if (!placedAll)
+			continue;
 
-		assert(bTarget);
-		assert(kvTarget);
+		// Found one: lay out the keys and values by slot
+		seed = seedNew;
+		slotCount = slotCountNew;
+		size = count;
+		pilots.assign(pilotsNew.begin(), pilotsNew.end());
 
-		// Store the hash, key, and value in the bucket
-		bTarget->hash = hash;
-		bTarget->state = BSTATE_Filled;
-		KV * kv = &keyvals[i];
-		kvTarget->key = std::move(kv->key);
-		kvTarget->value = std::move(kv->value);
+		// Slots past the end are redirected, in order, to the holes below it
+		remap.assign(slotCount - count, 0);
+		size_t iHole = 0;
+		for (size_t slot = count; slot < slotCount; ++slot)
+		{
+			if (!taken[slot])
+				continue;
+			while (taken[iHole])
+				++iHole;
+			remap[slot - count] = uint32_t(iHole++);
+		}
+
+		keyvals.resize(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			size_t slot = PerfectHashSlot(keyHashes[i].hash, PerfectHashPilot(pilots[keyHashes[i].bucket]), slotCount);
+			if (slot >= count)
+				slot = remap[slot - count];
+			keyvals[slot].key = its[keyHashes[i].index]->first;
+			keyvals[slot].value = its[keyHashes[i].index]->second;
+		}
+		return true;
 	}
 
-	// Swap the new buckets and keyvals into place
-	buckets.swap(bucketsNew);
-	keyvals.swap(keyvalsNew);
+	// Out of seeds; not expected to happen for any real key set
+	assert(false);
+	return false;
 }
 
-template <typename K, typename V>
-void DO1HashTable<K, V>::Reset()
+template <typename K, typename V, typename A>
+template <typename Q>
+const V * PerfectHashTable<K, V, A>::Lookup(const Q & keyIn) const
 {
-	// Blow away the current table and reset to small initial size
-	buckets.clear();
-	buckets.resize(s_hashTableInitialSize);
-	keyvals.clear();
-	keyvals.resize(s_hashTableInitialSize);
+	const typename KeyTraits<K>::Probe & key = keyIn;
 
-	size = 0;
+	if (size == 0)
+		return nullptr;
+
+	uint64_t hash1, hash2;
+	PerfectHashKey(key, seed, &hash1, &hash2);
+	size_t bucket = PerfectHashBucket(hash1, pilots.size());
+	size_t slot = PerfectHashSlot(hash2, PerfectHashPilot(pilots[bucket]), slotCount);
+	if (slot >= size)
+		slot = remap[slot - size];
+
+	// Every slot is filled, so a key that isn't in the set still lands on
+	// some other key; one compare tells them apart
+	const KV & kv = keyvals[slot];
+	if (kv.key == key)
+		return &kv.value;
+	return nullptr;
+}
+
+template <typename K, typename V, typename A>
+size_t PerfectHashTable<K, V, A>::MetadataBytes() const
+{
+	return pilots.size() * sizeof(uint16_t) + remap.size() * sizeof(uint32_t);
 }
 
 
 
-// DO2HashTable implementation
+// DO1StrHashTable implementation
 
-template <typename K, typename V>
-DO2HashTable<K, V>::DO2HashTable()
-:	size(0)
+template <typename V, typename A>
+DO1StrHashTable<V, A>::DO1StrHashTable(const A & alloc)
+:	buckets(alloc),
+	keyvals(alloc),
+	arena(alloc),
+	arenaDead(0),
+	size(0),
+	tombstones(0),
+	autoShrink(false)
 {
 	// Start off with a small initial size
 	buckets.resize(s_hashTableInitialSize);
-	keys.resize(s_hashTableInitialSize);
-	values.resize(s_hashTableInitialSize);
+	keyvals.resize(s_hashTableInitialSize);
 }
 
-template <typename K, typename V>
-void DO2HashTable<K, V>::Insert(K key, V value)
+template <typename V, typename A>
+StrView DO1StrHashTable<V, A>::KeyAt(size_t iBucket) const
+{
+	const Bucket & b = buckets[iBucket];
+	const KV & kv = keyvals[iBucket];
+	if (b.tag != s_tagSpilled)
+		return StrView(kv.key.chars, b.tag);
+	return StrView(&arena[kv.key.spilled.offset], kv.key.spilled.length);
+}
+
+template <typename V, typename A>
+bool DO1StrHashTable<V, A>::KeyMatches(size_t iBucket, uint32_t hash, uint8_t tag, StrView key) const
+{
+	// First pass: hash and length tag, both in the bucket array
+	const Bucket & b = buckets[iBucket];
+	if (b.hash != hash || b.tag != tag)
+		return false;
+
+	// Only now touch the keyval (and maybe the arena)
+	const KV & kv = keyvals[iBucket];
+	if (tag != s_tagSpilled)
+		return memcmp(kv.key.chars, key.data, key.size) == 0;
+	return kv.key.spilled.length == key.size &&
+		   memcmp(&arena[kv.key.spilled.offset], key.data, key.size) == 0;
+}
+
+template <typename V, typename A>
+void DO1StrHashTable<V, A>::Store(size_t iBucket, uint32_t hash, StrView key)
+{
+	Bucket & b = buckets[iBucket];
+	KV & kv = keyvals[iBucket];
+	b.hash = hash;
+	if (b.state == BSTATE_Removed)
+		--tombstones;
+	b.state = BSTATE_Filled;
+	b.tag = TagFor(key);
+	if (b.tag != s_tagSpilled)
+	{
+		memcpy(kv.key.chars, key.data, key.size);
+	}
+	else
+	{
+		kv.key.spilled.offset = arena.size();
+		kv.key.spilled.length = key.size;
+		arena.insert(arena.end(), key.data, key.data + key.size);
+	}
+}
+
+template <typename V, typename A>
+void DO1StrHashTable<V, A>::Insert(StrView key, const V & value)
 {
-	// Resize larger if the load factor goes over 2/3
+	// Resize larger if the load factor goes over 2/3, rebuild at the same
+	// size if the arena's mostly removed keys, or clear out the tombstones
+	// if they've taken the buckets in use over 3/4
 	if (size * 3 > buckets.size() * 2)
 	{
 		Rehash(buckets.size() * 2);
 	}
+	else if (ArenaMostlyDead())
+	{
+		Rehash(buckets.size());
+	}
+	else if ((size + tombstones) * 4 > buckets.size() * 3)
+	{
+		RehashInPlace();
+	}
 
 	// Hash the key and find the starting bucket
-	const auto hash = HashKey(key) & s_62Bits;
-	// size_t iBucketStart = hash % buckets.size();
+	const auto hash = HashKey(key);
 	size_t iBucketStart = hash & (buckets.size() - 1);
 
 	// Search for an unused bucket
-	Bucket * bTarget = nullptr;
-	size_t iBucketTarget = 0;
-	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i) 
+	size_t iBucketTarget = buckets.size();
+	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i)
 	{
-		Bucket * b = &buckets[i];
-		if (b->state != BSTATE_Filled)
+		if (buckets[i].state != BSTATE_Filled)
 		{
-			bTarget = b;
 			iBucketTarget = i;
 			break;
 		}
 	}
-	if (!bTarget)
+	if (iBucketTarget == buckets.size())
 	{
 		for (size_t i = 0; i < iBucketStart; ++i)
 		{
-			Bucket * b = &buckets[i];
-			if (b->state != BSTATE_Filled)
+			if (buckets[i].state != BSTATE_Filled)
 			{
-				bTarget = b;
 				iBucketTarget = i;
 				break;
 			}
 		}
 	}
 
-	assert(bTarget);
+	assert(iBucketTarget < buckets.size());
 
 	// Store the hash, key, and value in the bucket
-	bTarget->hash = hash;
-	bTarget->state = BSTATE_Filled;
-	keys[iBucketTarget] = key;
-	values[iBucketTarget] = value;
+	Store(iBucketTarget, hash, key);
+	keyvals[iBucketTarget].value = value;
 
 	++size;
 }
 
-template <typename K, typename V>
-V * DO2HashTable<K, V>::Lookup(K key)
+template <typename V, typename A>
+template <typename Q>
+V * DO1StrHashTable<V, A>::Lookup(const Q & keyIn)
 {
+	const StrView key = keyIn;
+
 	// Hash the key and find the starting bucket
-	const auto hash = HashKey(key) & s_62Bits;
-	// size_t iBucketStart = hash % buckets.size();
+	const auto hash = HashKey(key);
+	const uint8_t tag = TagFor(key);
 	size_t iBucketStart = hash & (buckets.size() - 1);
 
 	// Search the buckets until we hit an empty one
 	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i)
 	{
-		Bucket * b = &buckets[i];
-		switch (b->state)
+		switch (buckets[i].state)
 		{
 		case BSTATE_Empty:
 			return nullptr;
 		case BSTATE_Filled:
-			if (b->hash == hash && keys[i] == key)
-				return &values[i];
+			if (KeyMatches(i, hash, tag, key))
+				return &keyvals[i].value;
 			break;
 		default:
 			break;
@@ -1794,14 +7093,13 @@ V * DO2HashTable<K, V>::Lookup(K key)
 	}
 	for (size_t i = 0; i < iBucketStart; ++i)
 	{
-		Bucket * b = &buckets[i];
-		switch (b->state)
+		switch (buckets[i].state)
 		{
 		case BSTATE_Empty:
 			return nullptr;
 		case BSTATE_Filled:
-			if (b->hash == hash && keys[i] == key)
-				return &values[i];
+			if (KeyMatches(i, hash, tag, key))
+				return &keyvals[i].value;
 			break;
 		default:
 			break;
@@ -1811,28 +7109,35 @@ V * DO2HashTable<K, V>::Lookup(K key)
 	return nullptr;
 }
 
-template <typename K, typename V>
-bool DO2HashTable<K, V>::Remove(K key)
+template <typename V, typename A>
+template <typename Q>
+bool DO1StrHashTable<V, A>::Remove(const Q & keyIn)
 {
+	const StrView key = keyIn;
+
 	// Hash the key and find the starting bucket
-	const auto hash = HashKey(key) & s_62Bits;
-	// size_t iBucketStart = hash % buckets.size();
+	const auto hash = HashKey(key);
+	const uint8_t tag = TagFor(key);
 	size_t iBucketStart = hash & (buckets.size() - 1);
 
 	// Search the buckets until we hit an empty one
 	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd; ++i)
 	{
-		Bucket * b = &buckets[i];
-		switch (b->state)
+		switch (buckets[i].state)
 		{
 		case BSTATE_Empty:
 			return false;
 		case BSTATE_Filled:
-			if (b->hash == hash && keys[i] == key)
+			if (KeyMatches(i, hash, tag, key))
 			{
-				b->hash = 0;
-				b->state = BSTATE_Removed;
+				if (tag == s_tagSpilled)
+					arenaDead += key.size;
+				buckets[i].hash = 0;
+				buckets[i].state = BSTATE_Removed;
 				--size;
+				++tombstones;
+				if (autoShrink)
+					ShrinkIfSparse();
 				return true;
 			}
 			break;
@@ -1842,17 +7147,21 @@ bool DO2HashTable<K, V>::Remove(K key)
 	}
 	for (size_t i = 0; i < iBucketStart; ++i)
 	{
-		Bucket * b = &buckets[i];
-		switch (b->state)
+		switch (buckets[i].state)
 		{
 		case BSTATE_Empty:
 			return false;
 		case BSTATE_Filled:
-			if (b->hash == hash && keys[i] == key)
+			if (KeyMatches(i, hash, tag, key))
 			{
-				b->hash = 0;
-				b->state = BSTATE_Removed;
+				if (tag == s_tagSpilled)
+					arenaDead += key.size;
+				buckets[i].hash = 0;
+				buckets[i].state = BSTATE_Removed;
 				--size;
+				++tombstones;
+				if (autoShrink)
+					ShrinkIfSparse();
 				return true;
 			}
 			break;
@@ -1864,95 +7173,248 @@ bool DO2HashTable<K, V>::Remove(K key)
 	return false;
 }
 
-template <typename K, typename V>
-void DO2HashTable<K, V>::Reserve(size_t maxSize)
+template <typename V, typename A>
+template <typename Q>
+std::pair<V *, bool> DO1StrHashTable<V, A>::FindOrInsert(const Q & keyIn)
 {
-	maxSize = maxSize * 3 / 2;
-    maxSize |= maxSize >> 1;
-    maxSize |= maxSize >> 2;
-    maxSize |= maxSize >> 4;
-    maxSize |= maxSize >> 8;
-    maxSize |= maxSize >> 16;
+	const StrView key = keyIn;
 
-	Rehash(maxSize);
+	// Resize larger if the load factor goes over 2/3, rebuild at the same
+	// size if the arena's mostly removed keys, or clear out the tombstones
+	// if they've taken the buckets in use over 3/4
+	if (size * 3 > buckets.size() * 2)
+	{
+		Rehash(buckets.size() * 2);
+	}
+	else if (ArenaMostlyDead())
+	{
+		Rehash(buckets.size());
+	}
+	else if ((size + tombstones) * 4 > buckets.size() * 3)
+	{
+		RehashInPlace();
+	}
+
+	// Hash the key and find the starting bucket
+	const auto hash = HashKey(key);
+	const uint8_t tag = TagFor(key);
+	size_t iBucketStart = hash & (buckets.size() - 1);
+
+	// Search the buckets until we hit an empty one, remembering the first
+	// unused bucket along the way in case the key isn't there
+	size_t iBucketTarget = buckets.size();
+	bool hitEmpty = false;
+	for (size_t i = iBucketStart, iEnd = buckets.size(); i < iEnd && !hitEmpty; ++i)
+	{
+		switch (buckets[i].state)
+		{
+		case BSTATE_Empty:
+			hitEmpty = true;
+			if (iBucketTarget == buckets.size())
+				iBucketTarget = i;
+			break;
+		case BSTATE_Filled:
+			if (KeyMatches(i, hash, tag, key))
+				return std::make_pair(&keyvals[i].value, false);
+			break;
+		default:
+			if (iBucketTarget == buckets.size())
+				iBucketTarget = i;
+			break;
+		}
+	}
+	for (size_t i = 0; i < iBucketStart && !hitEmpty; ++i)
+	{
+		switch (buckets[i].state)
+		{
+		case BSTATE_Empty:
+			hitEmpty = true;
+			if (iBucketTarget == buckets.size())
+				iBucketTarget = i;
+			break;
+		case BSTATE_Filled:
+			if (KeyMatches(i, hash, tag, key))
+				return std::make_pair(&keyvals[i].value, false);
+			break;
+		default:
+			if (iBucketTarget == buckets.size())
+				iBucketTarget = i;
+			break;
+		}
+	}
+
+	assert(iBucketTarget < buckets.size());
+
+	// Store the hash, key, and value in the bucket
+	Store(iBucketTarget, hash, key);
+	keyvals[iBucketTarget].value = V();
+
+	++size;
+	return std::make_pair(&keyvals[iBucketTarget].value, true);
 }
 
-template <typename K, typename V>
-void DO2HashTable<K, V>::Rehash(size_t bucketCountNew)
+template <typename V, typename A>
+template <typename Q>
+bool DO1StrHashTable<V, A>::InsertOrAssign(const Q & key, const V & value)
+{
+	auto result = FindOrInsert(key);
+	*result.first = value;
+	return result.second;
+}
+
+template <typename V, typename A>
+template <typename Q, typename F>
+bool DO1StrHashTable<V, A>::Upsert(const Q & key, F fn)
+{
+	auto result = FindOrInsert(key);
+	fn(*result.first);
+	return result.second;
+}
+
+template <typename V, typename A>
+void DO1StrHashTable<V, A>::Reserve(size_t maxSize)
+{
+	maxSize = maxSize * 3 / 2;
+	maxSize |= maxSize >> 1;
+	maxSize |= maxSize >> 2;
+	maxSize |= maxSize >> 4;
+	maxSize |= maxSize >> 8;
+	maxSize |= maxSize >> 16;
+	maxSize |= maxSize >> 32;
+
+	// maxSize is now all ones; one more makes it a power of two
+	Rehash(maxSize + 1);
+}
+
+template <typename V, typename A>
+void DO1StrHashTable<V, A>::Rehash(size_t bucketCountNew)
 {
 	// Can't rehash down to smaller than current size or initial size
 	bucketCountNew = std::max(std::max(bucketCountNew, size),
-						   size_t(s_hashTableInitialSize));
+							  size_t(s_hashTableInitialSize));
 
-	// Build a new set of buckets, keys, and values
-	std::vector<Bucket> bucketsNew(bucketCountNew);
-	std::vector<K> keysNew(bucketCountNew);
-	std::vector<V> valuesNew(bucketCountNew);
+	// Rebuilding drops any tombstones, and removed keys' characters
+	tombstones = 0;
+	arenaDead = 0;
+
+	// Build a new set of buckets and keyvals, and a compacted arena
+	TableVector<Bucket, A> bucketsNew(bucketCountNew, Bucket(), buckets.get_allocator());
+	TableVector<KV, A> keyvalsNew(bucketCountNew, KV(), keyvals.get_allocator());
+	TableVector<char, A> arenaNew(arena.get_allocator());
 
 	// Walk through all the current elements and insert them into the new buckets
 	for (size_t i = 0, iEnd = buckets.size(); i < iEnd; ++i)
 	{
-		Bucket * b = &buckets[i];
-		if (b->state != BSTATE_Filled)
+		const Bucket & b = buckets[i];
+		if (b.state != BSTATE_Filled)
 			continue;
 
-		// Hash the key and find the starting bucket
-		const auto hash = b->hash;
-		// size_t iBucketStart = hash % bucketCountNew;
-		size_t iBucketStart = hash & (bucketCountNew - 1);
+		// Find the starting bucket from the stored hash
+		size_t iBucketStart = b.hash & (bucketCountNew - 1);
 
 		// Search for an unused bucket
-		Bucket * bTarget = nullptr;
-		size_t iBucketTarget = 0;
-		for (size_t j = iBucketStart; j < bucketCountNew; ++j) 
+		size_t iBucketTarget = bucketCountNew;
+		for (size_t j = iBucketStart; j < bucketCountNew; ++j)
 		{
-			Bucket * bNew = &bucketsNew[j];
-			if (bNew->state != BSTATE_Filled)
+			if (bucketsNew[j].state != BSTATE_Filled)
 			{
-				bTarget = bNew;
 				iBucketTarget = j;
 				break;
 			}
 		}
-		if (!bTarget)
+		if (iBucketTarget == bucketCountNew)
 		{
 			for (size_t j = 0; j < iBucketStart; ++j)
 			{
-				Bucket * bNew = &bucketsNew[j];
-				if (bNew->state != BSTATE_Filled)
+				if (bucketsNew[j].state != BSTATE_Filled)
 				{
-					bTarget = bNew;
 					iBucketTarget = j;
 					break;
 				}
 			}
 		}
 
-		assert(bTarget);
+		assert(iBucketTarget < bucketCountNew);
 
-		// Store the hash, key, and value in the bucket
-		bTarget->hash = hash;
-		bTarget->state = BSTATE_Filled;
-		keysNew[iBucketTarget] = std::move(keys[i]);
-		valuesNew[iBucketTarget] = std::move(values[i]);
+		// Copy the bucket and keyval across, re-homing spilled keys
+		bucketsNew[iBucketTarget] = b;
+		KV & kvNew = keyvalsNew[iBucketTarget];
+		KV & kv = keyvals[i];
+		kvNew.key = kv.key;
+		if (b.tag == s_tagSpilled)
+		{
+			kvNew.key.spilled.offset = arenaNew.size();
+			arenaNew.insert(arenaNew.end(),
+							arena.begin() + kv.key.spilled.offset,
+							arena.begin() + kv.key.spilled.offset + kv.key.spilled.length);
+		}
+		kvNew.value = std::move(kv.value);
 	}
 
-	// Swap the new buckets, keys, and values into place
+	// Swap the new buckets, keyvals, and arena into place
 	buckets.swap(bucketsNew);
-	keys.swap(keysNew);
-	values.swap(valuesNew);
+	keyvals.swap(keyvalsNew);
+	arena.swap(arenaNew);
 }
 
-template <typename K, typename V>
-void DO2HashTable<K, V>::Reset()
+template <typename V, typename A>
+void DO1StrHashTable<V, A>::RehashInPlace()
+{
+	// Reinsert every key in the buckets it's in; see ReinsertInPlace.  The
+	// arena isn't touched, so removed spilled keys' characters stay in it
+	// until the next Rehash (see ArenaMostlyDead).
+	ReinsertInPlace(buckets.size(), false,
+		[&](size_t i) { return int(buckets[i].state); },
+		[&](size_t i, int state) { buckets[i].state = uint8_t(state); },
+		[&](size_t i) { return size_t(buckets[i].hash); },
+		[&](size_t iFrom, size_t iTo)
+		{
+			buckets[iTo] = buckets[iFrom];
+			keyvals[iTo] = keyvals[iFrom];
+		},
+		[&](size_t i, size_t j)
+		{
+			std::swap(buckets[i], buckets[j]);
+			std::swap(keyvals[i], keyvals[j]);
+		});
+	tombstones = 0;
+}
+
+template <typename V, typename A>
+void DO1StrHashTable<V, A>::ShrinkToFit()
+{
+	// Rehash always rebuilds, so this clears out any tombstones and
+	// compacts the arena too
+	Reserve(size);
+}
+
+template <typename V, typename A>
+void DO1StrHashTable<V, A>::ShrinkIfSparse()
+{
+	// Under 1/8 full: rebuild with room for twice the keys left
+	if (size * 8 < buckets.size() && buckets.size() > s_hashTableInitialSize)
+		Reserve(size * 2);
+}
+
+template <typename V, typename A>
+void DO1StrHashTable<V, A>::Reset()
 {
 	// Blow away the current table and reset to small initial size
 	buckets.clear();
 	buckets.resize(s_hashTableInitialSize);
-	keys.clear();
-	keys.resize(s_hashTableInitialSize);
-	values.clear();
-	values.resize(s_hashTableInitialSize);
+	keyvals.clear();
+	keyvals.resize(s_hashTableInitialSize);
+	arena.clear();
+	arenaDead = 0;
 
 	size = 0;
+	tombstones = 0;
+}
+
+template <typename V, typename A>
+HashTableStats DO1StrHashTable<V, A>::GetStats() const
+{
+	return LinearProbeStats(buckets.size(),
+		[&](size_t i) { return int(buckets[i].state); },
+		[&](size_t i) { return size_t(buckets[i].hash); });
 }
@@ -1,22 +1,291 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+// Master hash function: Bob Jenkins' SpookyHash
+#include "SpookyHash/SpookyV2.h"
+
+#include "snapshot-file.h"
+#include "paged-file.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 static_assert(sizeof(size_t) == 8, "Compiling for 32-bit not supported!");
 
+// Hint to start pulling a cache line in for reading, ahead of needing it
+inline void PrefetchRead(const void * p)
+{
+#if defined(__SSE2__) || defined(_M_X64)
+	_mm_prefetch(static_cast<const char *>(p), _MM_HINT_T0);
+#else
+	(void)p;
+#endif
+}
+
+// All the tables below share the same basic interface:
+//   Insert(key, value)          blind insert; does NOT check for an existing key
+//   Lookup(key)                 pointer to the value, or nullptr
+//   Remove(key)                 true if the key was found and removed
+//   FindOrInsert(key)           (pointer to value, inserted?) in a single probe;
+//                               inserts a value-initialized V on a miss
+//   InsertOrAssign(key, value)  like FindOrInsert, then overwrites the value
+//   Upsert(key, fn)             like FindOrInsert, then calls fn(value)
+//   BulkBuild(first, last)      OL, DO1, DO2 and D0 only: blind insert of a
+//                               forward range of (key, value) pairs, sized up
+//                               front and written in bucket order
+//   GetStats()                  occupancy and probe-length statistics (see
+//                               HashTableStats); not on the read-only tables
+//                               or FixedHashTable
+//   LookupBatch(keys, n, out)   OL, DO1, DO2 and RP only: Lookup of each of an
+//                               array of keys, hashed a block at a time (see
+//                               hash-batch.h), with the results written to out
+//   InsertBatch(keys, vals, n)  DO1 and RP only: blind Insert of each of an
+//                               array of keys and values, hashed the same way
+//   RehashInPlace()             open-addressed tables only: same-size rehash
+//                               that clears out the tombstones Remove leaves,
+//                               without allocating; Insert and FindOrInsert
+//                               call it once they're too many
+//   ShrinkToFit()               rebuild at the size Reserve(current size)
+//                               would pick, giving back what a table that
+//                               has lost most of its keys no longer needs
+// The read-only tables (the snapshot tables and PerfectHashTable) have only
+// Lookup, and are filled some other way.  MMHashTable, a multimap, has an
+// interface of its own; see it below.
+// Lookup, Remove and the find-or-insert family take any type convertible to
+// the key type's probe type (see KeyTraits below), so string-keyed tables can
+// be searched with a StrView or C string without building a std::string.
+//
+// Each table also takes an allocator type A, which it rebinds for each of its
+// arrays and copies from the one passed to its constructor; see allocators.h.
+// (FixedHashTable is the exception: its storage is inline, so it has none;
+// EHHashTable's is a file and its page cache.)
+//
+// OL, DO1, DO2, D0 and D1 also have a rehashThreads member (default 1): when
+// it's more than 1, Rehash of a big enough table, and BulkBuild on OL, DO1 and
+// DO2, split the work across that many threads.
+//
+// Every table with ShrinkToFit also has an autoShrink member (default false):
+// when it's set, Remove shrinks a table that's fallen under 1/8 full to the
+// size Reserve would pick for twice the keys left.  Growing and shrinking
+// then both take the key count changing by a factor of two or more, so a
+// table hovering around one size doesn't keep rebuilding.
+
+// Non-owning view of a run of characters, standing in for C++17's
+// std::string_view (we build as C++11)
+struct StrView
+{
+	const char *	data;
+	size_t			size;
+
+	StrView() : data(nullptr), size(0) {}
+	StrView(const char * data_, size_t size_) : data(data_), size(size_) {}
+	StrView(const char * str) : data(str), size(strlen(str)) {}
+	StrView(const std::string & str) : data(str.data()), size(str.size()) {}
+};
+
+// Length is compared first, so most mismatches never touch the characters
+inline bool operator == (StrView a, StrView b)
+{
+	return a.size == b.size && memcmp(a.data, b.data, a.size) == 0;
+}
+inline bool operator == (const std::string & a, StrView b) { return StrView(a) == b; }
+inline bool operator == (StrView a, const std::string & b) { return a == StrView(b); }
+
 // Hash function: just digests memory, unless you specialize it
 // to do something else (e.g. digest the contents of a string)
 size_t HashMemory(void * p, size_t sizeBytes);
 template <typename K>
-// size_t HashKey(K key) { return HashMemory(&key, sizeof(key)); }
-uint32_t HashKey(K key) { return SpookyHash::Hash32(&key, sizeof(key), 0); }
+// size_t HashKey(const K & key) { return HashMemory(&key, sizeof(key)); }
+uint32_t HashKey(const K & key) { return SpookyHash::Hash32(&key, sizeof(key), 0); }
+
+// Variable-length keys digest their contents, not the object holding them, so
+// a std::string, a StrView and a C string with the same characters all agree
+inline uint32_t HashKey(StrView key) { return SpookyHash::Hash32(key.data, key.size, 0); }
+inline uint32_t HashKey(const std::string & key) { return HashKey(StrView(key)); }
+inline uint32_t HashKey(const char * key) { return HashKey(StrView(key)); }
+inline uint32_t HashKey(char * key) { return HashKey(StrView(key)); }
+
+// HashKey over an array of keys at once, SIMD for integer keys (it needs
+// HashKey declared first)
+#include "hash-batch.h"
+
+// Per-key-type policy for heterogeneous lookup.  Probe is the type that
+// lookups hash and compare against stored keys; Make builds a stored key from
+// a probe, and is only called when a key is actually inserted.
+template <typename K>
+struct KeyTraits
+{
+	typedef K Probe;
+	static const K & Make(const K & probe) { return probe; }
+};
 
-template <typename K, typename V>
+template <>
+struct KeyTraits<std::string>
+{
+	typedef StrView Probe;
+	static std::string Make(StrView probe) { return std::string(probe.data, probe.size); }
+};
+
+// The arrays a table keeps its data in: a vector using the table's allocator
+template <typename T, typename A>
+using TableVector = std::vector<T, typename std::allocator_traits<A>::template rebind_alloc<T>>;
+
+// Whether OL, DO1 and C1 store each key's hash in its bucket.  A stored hash
+// saves hashing every key again on Rehash, and rejects most mismatches in a
+// probe without comparing keys.  Integers, enums and pointers compare as
+// cheaply as the hash would and hash again quickly, so for them the hash is
+// dropped.  The state bits that shared its word go in a BucketStates bitmap
+// beside the buckets for OL and C1, which for 4-byte keys and values takes an
+// OL bucket from 16 bytes to 8; DO1's separate array of hashes and states
+// becomes one of state bytes.  Specialize it to choose for another key type.
+template <typename K>
+struct StoreHash : std::integral_constant<bool, !(std::is_scalar<K>::value && sizeof(K) <= sizeof(size_t))>
+{
+};
+
+// Bases for the bucket types of those tables: a stored hash with the state
+// bits packed into the same word, a stored hash alone (C1's chain elements,
+// which have no state), nothing, or just a state byte
+template <int StateBits>
+struct BucketHashAndState
+{
+	size_t	hash:64 - StateBits;
+	size_t	state:StateBits;
+};
+
+struct BucketHash
+{
+	size_t	hash;
+};
+
+struct BucketNoHash
+{
+};
+
+struct BucketStateOnly : BucketNoHash
+{
+	uint8_t	state;
+};
+
+// Packed array of Bits-bit bucket states (at most 8 bits), for buckets with
+// nowhere to keep them.  When Used is false, as when the buckets have state
+// bits of their own, it's empty and holds nothing.
+template <int Bits, bool Used, typename A>
+class BucketStates
+{
+public:
+	template <typename Alloc> explicit BucketStates(const Alloc & alloc) : words(alloc) {}
+
+	int Get(size_t i) const
+	{
+		return int((words[i / s_perWord] >> (i % s_perWord * Bits)) & s_mask);
+	}
+	void Set(size_t i, int state)
+	{
+		uint64_t & word = words[i / s_perWord];
+		size_t shift = i % s_perWord * Bits;
+		word = (word & ~(s_mask << shift)) | (uint64_t(state) << shift);
+	}
+
+	// All states 0 (empty)
+	void Assign(size_t count)	{ words.assign((count + s_perWord - 1) / s_perWord, 0); }
+	void swap(BucketStates & other)	{ words.swap(other.words); }
+	size_t Bytes() const			{ return words.size() * sizeof(uint64_t); }
+
+private:
+	static const size_t s_perWord = 64 / Bits;
+	static const uint64_t s_mask = (uint64_t(1) << Bits) - 1;
+
+	TableVector<uint64_t, A>	words;
+};
+
+template <int Bits, typename A>
+class BucketStates<Bits, false, A>
+{
+public:
+	template <typename Alloc> explicit BucketStates(const Alloc &) {}
+
+	int Get(size_t) const			{ return 0; }
+	void Set(size_t, int)			{}
+	void Assign(size_t)				{}
+	void swap(BucketStates &)		{}
+	size_t Bytes() const			{ return 0; }
+};
+
+// Access to a bucket's state and stored hash, wherever they're kept.  These
+// overload on the bucket's base class, so a table calls the same thing for
+// either layout; i is the bucket's index, for the states bitmap.  (DO1's
+// buckets have a state field either way, so it uses that directly.)
+template <int Bits, typename States>
+inline int GetBucketState(const BucketHashAndState<Bits> & b, const States &, size_t)		{ return int(b.state); }
+template <typename States>
+inline int GetBucketState(const BucketNoHash &, const States & states, size_t i)				{ return states.Get(i); }
+template <int Bits, typename States>
+inline void SetBucketState(BucketHashAndState<Bits> & b, States &, size_t, int state)		{ b.state = size_t(state); }
+template <typename States>
+inline void SetBucketState(BucketNoHash &, States & states, size_t i, int state)				{ states.Set(i, state); }
+
+template <int Bits>
+inline bool BucketHashMatches(const BucketHashAndState<Bits> & b, size_t hash)	{ return b.hash == hash; }
+inline bool BucketHashMatches(const BucketHash & b, size_t hash)					{ return b.hash == hash; }
+inline bool BucketHashMatches(const BucketNoHash &, size_t)							{ return true; }
+template <int Bits>
+inline void SetBucketHash(BucketHashAndState<Bits> & b, size_t hash)				{ b.hash = hash; }
+inline void SetBucketHash(BucketHash & b, size_t hash)								{ b.hash = hash; }
+inline void SetBucketHash(BucketNoHash &, size_t)									{}
+
+// The stored hash, or rehash() to work it out from the key
+template <int Bits, typename F>
+inline size_t BucketHashOr(const BucketHashAndState<Bits> & b, F)					{ return b.hash; }
+template <typename F>
+inline size_t BucketHashOr(const BucketHash & b, F)									{ return b.hash; }
+template <typename F>
+inline size_t BucketHashOr(const BucketNoHash &, F rehash)							{ return rehash(); }
+
+// Length of GetStats' histograms; the last entry counts everything at least
+// that long
+static const int s_statsHistogramLength = 16;
+
+// What GetStats reports.  A probe is one bucket looked at (open addressing)
+// or one element compared (chaining), so a hit in its home bucket takes 1.
+// Misses are averaged over every bucket as the starting point, which is what
+// a random missing key sees.
+struct HashTableStats
+{
+	size_t	bucketCount;
+	size_t	size;
+	size_t	tombstones;			// removed buckets, which lookups still probe past
+	float	loadFactor;			// size / bucketCount
+	float	avgProbeHit;
+	int		maxProbeHit;
+	float	avgProbeMiss;
+	int		maxProbeMiss;
+	// Open addressing: runs of consecutive non-empty buckets (filled or
+	// removed), by length
+	size_t	clusterHistogram[s_statsHistogramLength];
+	// Chaining: buckets, by chain length (so [0] is the empty ones)
+	size_t	chainHistogram[s_statsHistogramLength];
+};
+
+template <typename K, typename V, typename A = std::allocator<char>>
 class D0HashTable
 {
 public:
-	std::vector<uint32_t> buckets;
+	TableVector<uint32_t, A> buckets;
 
 	struct KN
 	{
@@ -24,27 +293,54 @@ public:
 		uint32_t next;
 	};
 
-	std::vector<KN> keyAndNexts;
-	std::vector<V> values;
+	TableVector<KN, A> keyAndNexts;
+	TableVector<V, A> values;
 
 	uint32_t nextFree;
+	uint32_t size_;
+
+	// Threads for Rehash to use; 1 means do it all on the calling thread
+	int rehashThreads;
+	// Shrink once under 1/8 full; see the top of the file
+	bool autoShrink;
 
-	D0HashTable();
+	explicit D0HashTable(const A & alloc = A());
 	
-	void Insert(K key, V value);
+	void Insert(const K & key, const V & value);
 	
-	V * Lookup(K key);
+	template <typename Q> V * Lookup(const Q & key);
 	
-	bool Remove(K key);
+	template <typename Q> bool Remove(const Q & key);
+	
+	template <typename Q> std::pair<V *, bool> FindOrInsert(const Q & key);
+	
+	template <typename Q> bool InsertOrAssign(const Q & key, const V & value);
+	
+	template <typename Q, typename F> bool Upsert(const Q & key, F fn);
+	
+	template <typename It> void BulkBuild(It first, It last);
 	
 	void Reserve(uint32_t maxSize);
 	
 	void Reset();
 	
 	void Rehash(uint32_t bucketCountNew);
+	
+	void ShrinkToFit();
+	
+	HashTableStats GetStats() const;
+	
+	// Write the arrays out for D0SnapshotTable to map; false on I/O failure
+	bool SaveSnapshot(const char * path) const;
+
+private:
+	void InsertHashed(uint32_t hash, const K & key, const V & value);
+	void RehashParallel(uint32_t bucketCountNew);
+	void Shrink(uint32_t bucketCountNew);
+	void ShrinkIfSparse();
 };
 
-template <typename K, typename V>
+template <typename K, typename V, typename A = std::allocator<char>>
 class D1HashTable
 {
 public:
@@ -61,28 +357,52 @@ public:
 		K key;
 	};
 
-	std::vector<KS> keyAndStates;
-	std::vector<V> values;
+	TableVector<KS, A> keyAndStates;
+	TableVector<V, A> values;
 	uint32_t size_;
+	// REMOVED slots, until RehashInPlace clears them out
+	uint32_t tombstones;
 
-	D1HashTable();
+	// Threads for Rehash to use; 1 means do it all on the calling thread
+	int rehashThreads;
+	// Shrink once under 1/8 full; see the top of the file
+	bool autoShrink;
+
+	explicit D1HashTable(const A & alloc = A());
+	
+	void Insert(const K & key, const V & value);
 	
-	void Insert(K key, V value);
+	template <typename Q> V * Lookup(const Q & key);
 	
-	V * Lookup(K key);
+	template <typename Q> bool Remove(const Q & key);
 	
-	bool Remove(K key);
+	template <typename Q> std::pair<V *, bool> FindOrInsert(const Q & key);
+	
+	template <typename Q> bool InsertOrAssign(const Q & key, const V & value);
+	
+	template <typename Q, typename F> bool Upsert(const Q & key, F fn);
 	
 	void Reserve(uint32_t maxSize);
 	
 	void Reset();
 	
 	void Rehash(uint32_t bucketCountNew);
+	
+	void RehashInPlace();
+	
+	void ShrinkToFit();
+	
+	HashTableStats GetStats() const;
+
+private:
+	void Rebuild(uint32_t bucketCountNew);
+	void RehashParallel(uint32_t bucketCountNew);
+	void ShrinkIfSparse();
 };
 
 
 // Hash table with separate chaining and no inline elements
-template <typename K, typename V>
+template <typename K, typename V, typename A = std::allocator<char>>
 class C0HashTable
 {
 public:
@@ -101,69 +421,174 @@ public:
 		Elem *	pHead;
 	};
 
-	std::vector<Bucket> buckets;
-	std::vector<Elem>	elemPool;
-	Elem *				pElemFreeHead;
-	size_t				size;
+	TableVector<Bucket, A>	buckets;
+	TableVector<Elem, A>	elemPool;
+	Elem *					pElemFreeHead;
+	size_t					size;
+	// Shrink once under 1/8 full; see the top of the file
+	bool					autoShrink;
+
+	explicit C0HashTable(const A & alloc = A());
 
-	C0HashTable();
+	void Insert(const K & key, const V & value);
+	template <typename Q> V * Lookup(const Q & key);
+	template <typename Q> bool Remove(const Q & key);
 
-	void Insert(K key, V value);
-	V * Lookup(K key);
-	bool Remove(K key);
+	template <typename Q> std::pair<V *, bool> FindOrInsert(const Q & key);
+	template <typename Q> bool InsertOrAssign(const Q & key, const V & value);
+	template <typename Q, typename F> bool Upsert(const Q & key, F fn);
 
 	void Reserve(size_t maxSize);
 	void Reset();
 
 	void Rehash(size_t bucketCountNew);
+	void ShrinkToFit();
+	HashTableStats GetStats() const;
+
+private:
+	void ShrinkIfSparse();
 };
 
 // Hash table with separate chaining and one inline element
-template <typename K, typename V>
+template <typename K, typename V, typename A = std::allocator<char>>
 class C1HashTable
 {
 public:
-	struct Elem
+	// The hash, if there is one, is first, so it can go in a base class
+	// (see StoreHash)
+	struct Elem : std::conditional<StoreHash<K>::value, BucketHash, BucketNoHash>::type
 	{
 		Elem *	pNext;
-		size_t	hash;
 		// Note: in a real implementation, instead of K and V this should just
 		// be *storage* for K and V, to be constructed/destructed as needed
 		K		key;
 		V		value;
 	};
 
-	struct Bucket
+	// Steal a bit from the hash value to say whether the bucket is filled;
+	// without a hash, that bit goes in states
+	struct Bucket : std::conditional<StoreHash<K>::value, BucketHashAndState<1>, BucketNoHash>::type
 	{
 		Elem *	pHead;
-		// Steal a bit from the hash value to say whether the bucket is filled
-		size_t	hash:63;
-		size_t	filled:1;
 		// Note: in a real implementation, instead of K and V this should just
 		// be *storage* for K and V, to be constructed/destructed as needed
 		K		key;
 		V		value;
 	};
 
-	std::vector<Bucket> buckets;
-	std::vector<Elem>	elemPool;
-	Elem *				pElemFreeHead;
-	size_t				size;
+	TableVector<Bucket, A>	buckets;
+	BucketStates<1, !StoreHash<K>::value, A>	states;
+	TableVector<Elem, A>	elemPool;
+	Elem *					pElemFreeHead;
+	size_t					size;
+	// Shrink once under 1/8 full; see the top of the file
+	bool					autoShrink;
+
+	explicit C1HashTable(const A & alloc = A());
 
-	C1HashTable();
+	void Insert(const K & key, const V & value);
+	template <typename Q> V * Lookup(const Q & key);
+	template <typename Q> bool Remove(const Q & key);
 
-	void Insert(K key, V value);
-	V * Lookup(K key);
-	bool Remove(K key);
+	template <typename Q> std::pair<V *, bool> FindOrInsert(const Q & key);
+	template <typename Q> bool InsertOrAssign(const Q & key, const V & value);
+	template <typename Q, typename F> bool Upsert(const Q & key, F fn);
 
 	void Reserve(size_t maxSize);
 	void Reset();
 
 	void Rehash(size_t bucketCountNew);
+	void ShrinkToFit();
+	HashTableStats GetStats() const;
+
+private:
+	void ShrinkIfSparse();
+};
+
+// Hash table with separate chaining and linear hashing (Litwin's): instead
+// of doubling the buckets all at once, it splits one bucket at a time, in
+// order, whenever the keys outnumber the buckets.  Splitting bucket i moves
+// the keys that have the next bit of the hash set to a new bucket on the
+// end; a key's bucket is its hash masked to the bits in use this round, or
+// to one bit more if that bucket has split already.
+//
+// The buckets and elements live in fixed-size segments that never move,
+// under a small directory of segments, so growing never copies more than
+// the one chain being split, and memory grows a segment at a time instead
+// of doubling (and briefly tripling, mid-rehash).
+template <typename K, typename V, typename A = std::allocator<char>>
+class LHHashTable
+{
+public:
+	// Buckets or elements per segment
+	static const int s_segmentShift = 10;
+	static const size_t s_segmentSize = size_t(1) << s_segmentShift;
+	// Ends a chain or the free list
+	static const uint32_t s_end = ~uint32_t(0);
+
+	// Elements link by index, as in D0HashTable.  The hash, if there is one,
+	// is first, so it can go in a base class (see StoreHash); without it,
+	// splitting a bucket hashes its keys again.
+	struct Elem : std::conditional<StoreHash<K>::value, BucketHash, BucketNoHash>::type
+	{
+		uint32_t	next;
+		// Note: in a real implementation, instead of K and V this should just
+		// be *storage* for K and V, to be constructed/destructed as needed
+		K			key;
+		V			value;
+	};
+
+	// Each bucket is the index of the head of its chain
+	typedef TableVector<uint32_t, A>	BucketSegment;
+	typedef TableVector<Elem, A>		ElemSegment;
+
+	TableVector<BucketSegment, A>	bucketSegments;
+	TableVector<ElemSegment, A>		elemSegments;
+	uint32_t						iElemFree;
+	size_t							bucketCount;
+	// This round's bits of the hash: the buckets before iSplit have split,
+	// and bucketCount is lowMask + 1 + iSplit
+	size_t							lowMask;
+	size_t							iSplit;
+	size_t							size;
+	// Shrink once under 1/8 full; see the top of the file
+	bool							autoShrink;
+
+	explicit LHHashTable(const A & alloc = A());
+
+	void Insert(const K & key, const V & value);
+	template <typename Q> V * Lookup(const Q & key);
+	template <typename Q> bool Remove(const Q & key);
+
+	template <typename Q> std::pair<V *, bool> FindOrInsert(const Q & key);
+	template <typename Q> bool InsertOrAssign(const Q & key, const V & value);
+	template <typename Q, typename F> bool Upsert(const Q & key, F fn);
+
+	void Reserve(size_t maxSize);
+	void Reset();
+
+	// Rebuilds with exactly bucketCountNew buckets (but at least as many as
+	// keys, and the initial size), and the elements packed into as few
+	// segments as hold that many
+	void Rehash(size_t bucketCountNew);
+	void ShrinkToFit();
+	HashTableStats GetStats() const;
+
+private:
+	uint32_t & BucketAt(size_t i)				{ return bucketSegments[i >> s_segmentShift][i & (s_segmentSize - 1)]; }
+	uint32_t BucketAt(size_t i) const			{ return bucketSegments[i >> s_segmentShift][i & (s_segmentSize - 1)]; }
+	Elem & ElemAt(uint32_t i)					{ return elemSegments[i >> s_segmentShift][i & (s_segmentSize - 1)]; }
+	const Elem & ElemAt(uint32_t i) const		{ return elemSegments[i >> s_segmentShift][i & (s_segmentSize - 1)]; }
+	size_t BucketIndex(size_t hash) const;
+	void InitSegments(size_t bucketCountNew);
+	void AddElemSegment();
+	uint32_t TakeElem();
+	void SplitBucket();
+	void ShrinkIfSparse();
 };
 
 // Hash table with open addressing and linear probing
-template <typename K, typename V>
+template <typename K, typename V, typename A = std::allocator<char>>
 class OLHashTable
 {
 public:
@@ -174,35 +599,124 @@ public:
 		BSTATE_Removed,
 	};
 
+	// Steal a couple bits from the hash value to say whether the bucket is
+	// empty, filled, or removed (different from empty); without a hash (see
+	// StoreHash), those bits go in states
+	struct Bucket : std::conditional<StoreHash<K>::value, BucketHashAndState<2>, BucketNoHash>::type
+	{
+		// Note: in a real implementation, instead of K and V this should just
+		// be *storage* for K and V, to be constructed/destructed as needed
+		K		key;
+		V		value;
+	};
+
+	TableVector<Bucket, A>	buckets;
+	BucketStates<2, !StoreHash<K>::value, A>	states;
+	size_t					size;
+	// Removed buckets, until RehashInPlace clears them out
+	size_t					tombstones;
+	// Threads for Rehash (and BulkBuild) to use; 1 means do it all on the calling thread
+	int						rehashThreads;
+	// Shrink once under 1/8 full; see the top of the file
+	bool					autoShrink;
+
+	explicit OLHashTable(const A & alloc = A());
+
+	void Insert(const K & key, const V & value);
+	template <typename Q> V * Lookup(const Q & key);
+	template <typename Q> bool Remove(const Q & key);
+
+	template <typename Q> std::pair<V *, bool> FindOrInsert(const Q & key);
+	template <typename Q> bool InsertOrAssign(const Q & key, const V & value);
+	template <typename Q, typename F> bool Upsert(const Q & key, F fn);
+	template <typename It> void BulkBuild(It first, It last);
+	void LookupBatch(const K * keys, size_t count, V ** results);
+
+	void Reserve(size_t maxSize);
+	void Reset();
+
+	void Rehash(size_t bucketCountNew);
+	void RehashInPlace();
+	void ShrinkToFit();
+	HashTableStats GetStats() const;
+
+private:
+	void ShrinkIfSparse();
+	void InsertHashed(size_t hash, const K & key, const V & value);
+	V * LookupHashed(size_t hash, const typename KeyTraits<K>::Probe & key);
+	void RehashParallel(size_t bucketCountNew);
+};
+
+// The two key values OSHashTable reserves to mark empty and removed buckets.
+// Specialize it to reserve others, e.g. for keys where 0 is common.
+template <typename K>
+struct SentinelKeys
+{
+	static K Empty()	{ return K(0); }
+	static K Removed()	{ return K(~K(0)); }
+};
+
+// Hash table with open addressing and linear probing, like OL, but for
+// integer keys only: two key values (see SentinelKeys) mark empty and removed
+// buckets, so a bucket is just the key and value, and a probe reads nothing
+// else.  Entries whose keys are the sentinels themselves go in side slots.
+template <typename K, typename V, typename A = std::allocator<char>>
+class OSHashTable
+{
+public:
+	static_assert(std::is_integral<K>::value, "OSHashTable needs integer keys");
+
 	struct Bucket
 	{
-		// Steal a couple bits from the hash value to say whether the bucket
-		// is empty, filled, or removed (different from empty)
-		size_t	hash:62;
-		size_t	state:2;
 		// Note: in a real implementation, instead of K and V this should just
 		// be *storage* for K and V, to be constructed/destructed as needed
 		K		key;
 		V		value;
 	};
 
-	std::vector<Bucket> buckets;
-	size_t				size;
+	// For the sentinel keys: [0] holds SentinelKeys<K>::Empty()'s value, and
+	// [1] Removed()'s
+	struct SideSlot
+	{
+		bool	filled;
+		V		value;
+	};
+
+	TableVector<Bucket, A>	buckets;
+	SideSlot				sideSlots[2];
+	// Includes the side slots
+	size_t					size;
+	// Removed buckets, until RehashInPlace clears them out
+	size_t					tombstones;
+	// Shrink once under 1/8 full; see the top of the file
+	bool					autoShrink;
+
+	explicit OSHashTable(const A & alloc = A());
 
-	OLHashTable();
+	void Insert(const K & key, const V & value);
+	template <typename Q> V * Lookup(const Q & key);
+	template <typename Q> bool Remove(const Q & key);
 
-	void Insert(K key, V value);
-	V * Lookup(K key);
-	bool Remove(K key);
+	template <typename Q> std::pair<V *, bool> FindOrInsert(const Q & key);
+	template <typename Q> bool InsertOrAssign(const Q & key, const V & value);
+	template <typename Q, typename F> bool Upsert(const Q & key, F fn);
 
 	void Reserve(size_t maxSize);
 	void Reset();
 
 	void Rehash(size_t bucketCountNew);
+	void RehashInPlace();
+	void ShrinkToFit();
+	HashTableStats GetStats() const;
+
+private:
+	void ShrinkIfSparse();
+	void ResetBuckets(TableVector<Bucket, A> & bucketsNew, size_t bucketCount);
+	SideSlot * FindSideSlot(const K & key);
 };
 
 // Hash table with open addressing and quadratic probing
-template <typename K, typename V>
+template <typename K, typename V, typename A = std::allocator<char>>
 class OQHashTable
 {
 public:
@@ -225,24 +739,179 @@ public:
 		V		value;
 	};
 
-	std::vector<Bucket> buckets;
-	size_t				size;
+	TableVector<Bucket, A>	buckets;
+	size_t					size;
+	// Removed buckets, until RehashInPlace clears them out
+	size_t					tombstones;
+	// Shrink once under 1/8 full; see the top of the file
+	bool					autoShrink;
+
+	explicit OQHashTable(const A & alloc = A());
 
-	OQHashTable();
+	void Insert(const K & key, const V & value);
+	template <typename Q> V * Lookup(const Q & key);
+	template <typename Q> bool Remove(const Q & key);
 
-	void Insert(K key, V value);
-	V * Lookup(K key);
-	bool Remove(K key);
+	template <typename Q> std::pair<V *, bool> FindOrInsert(const Q & key);
+	template <typename Q> bool InsertOrAssign(const Q & key, const V & value);
+	template <typename Q, typename F> bool Upsert(const Q & key, F fn);
 
 	void Reserve(size_t maxSize);
 	void Reset();
 
 	void Rehash(size_t bucketCountNew);
+	void RehashInPlace();
+	void ShrinkToFit();
+	HashTableStats GetStats() const;
+
+private:
+	void ShrinkIfSparse();
+};
+
+// Bit mask of the slots in a 14-slot chunk whose tag equals tag: bit i set if
+// tags[i] == tag.  With SSE2 that's one compare of all 16 tag bytes (the last
+// two aren't tags, so they're masked off).
+inline uint32_t F14TagMatch(const uint8_t * tags, uint8_t tag)
+{
+#if defined(__SSE2__) || defined(_M_X64)
+	__m128i cmp = _mm_cmpeq_epi8(_mm_load_si128(reinterpret_cast<const __m128i *>(tags)), _mm_set1_epi8(char(tag)));
+	return uint32_t(_mm_movemask_epi8(cmp)) & 0x3fffU;
+#else
+	uint32_t match = 0;
+	for (int i = 0; i < 14; ++i)
+		match |= uint32_t(tags[i] == tag) << i;
+	return match;
+#endif
+}
+
+// Index of the lowest set bit; mask must not be 0
+inline int LowestSetBit(uint32_t mask)
+{
+#if defined(_MSC_VER)
+	unsigned long i;
+	_BitScanForward(&i, mask);
+	return int(i);
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// Hash table modeled on F14 (folly's F14 tables): open addressing over
+// chunks of 14 slots, aligned to cache lines.  Each chunk starts with a
+// 1-byte tag per slot, made from 7 bits of the key's hash with the top bit
+// set (so a tag is never 0, which marks an empty slot), and one compare
+// checks all 14 tags, so keys are only compared when their tags match.
+//
+// A key whose home chunk is full goes to later chunks in a quadratic
+// sequence, bumping the overflow count of each full chunk it passes; a
+// failed lookup stops at the first chunk with an overflow count of 0, so
+// misses stay short at the 12-of-14 load it grows at.  Remove takes the
+// counts back down along the removed key's probe sequence, so there are no
+// tombstones; a count that's hit 255 stays there.
+//
+// With IndirectValues, a slot holds the key and the index of its value in a
+// dense values array (as D0HashTable does), so chunks stay small however
+// big the values are.  Chunks live in raw storage, aligned by hand (C++11's
+// std::allocator ignores over-alignment), so keys and values have to be
+// trivially copyable.
+template <typename K, typename V, bool IndirectValues = false, typename A = std::allocator<char>>
+class F14HashTable
+{
+public:
+	static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+				  "F14HashTable keeps keys and values in raw storage");
+
+	static const int s_chunkSlots = 14;
+	// Grows once the slots average this many filled per chunk
+	static const int s_chunkSlotsMax = 12;
+	// 28 slots to start, the first chunk count with the 16 buckets the
+	// other tables start with
+	static const size_t s_chunkCountInitial = 2;
+
+	struct ItemInline
+	{
+		K		key;
+		V		value;
+	};
+
+	struct ItemIndirect
+	{
+		K			key;
+		uint32_t	iValue;
+	};
+
+	typedef typename std::conditional<IndirectValues, ItemIndirect, ItemInline>::type Item;
+
+	struct alignas(64) Chunk
+	{
+		uint8_t	tags[s_chunkSlots];
+		// Keys that probed past this chunk because it was full; saturates
+		uint8_t	outboundOverflow;
+		uint8_t	unused;
+		Item	items[s_chunkSlots];
+	};
+
+	Chunk *						chunks;
+	size_t						chunkCount;
+	size_t						size;
+	// IndirectValues only: the values, packed, and for each one the slot
+	// (chunk index * 14 + slot index) holding its key
+	TableVector<V, A>			values;
+	TableVector<uint32_t, A>	valueSlots;
+	// Shrink once under 1/8 full; see the top of the file
+	bool						autoShrink;
+
+	explicit F14HashTable(const A & alloc = A());
+	F14HashTable(const F14HashTable &) = delete;
+	F14HashTable & operator = (const F14HashTable &) = delete;
+
+	void Insert(const K & key, const V & value);
+	template <typename Q> V * Lookup(const Q & key);
+	template <typename Q> bool Remove(const Q & key);
+
+	template <typename Q> std::pair<V *, bool> FindOrInsert(const Q & key);
+	template <typename Q> bool InsertOrAssign(const Q & key, const V & value);
+	template <typename Q, typename F> bool Upsert(const Q & key, F fn);
+
+	void Reserve(size_t maxSize);
+	void Reset();
+
+	// Rebuilds with chunkCountNew chunks (rounded up to a power of two, and
+	// to enough for the keys there are)
+	void Rehash(size_t chunkCountNew);
+	void ShrinkToFit();
+	HashTableStats GetStats() const;
+	// Bytes held: the chunks, plus the value arrays for IndirectValues
+	size_t Bytes() const;
+
+private:
+	typedef std::integral_constant<bool, IndirectValues> Indirect;
+
+	// Backs chunks, with room to align them
+	TableVector<uint8_t, A>		storage;
+
+	void ShrinkIfSparse();
+	void ResetChunks(TableVector<uint8_t, A> & storageNew, Chunk *& chunksNew, size_t chunkCountNew);
+	static uint8_t Tag(size_t hash)						{ return uint8_t(0x80 | (hash >> 25)); }
+	size_t ProbeChunk(size_t hash, size_t iProbe) const	{ return (hash + (iProbe + iProbe * iProbe) / 2) & (chunkCount - 1); }
+	Item * FindItem(size_t hash, const typename KeyTraits<K>::Probe & key, size_t * piProbe);
+	size_t FindEmptyProbe(size_t hash, size_t iProbe) const;
+	Item & Claim(size_t hash, size_t iProbe, size_t * piSlot);
+
+	V & ValueOf(Item & item)							{ return ValueOf(item, Indirect()); }
+	V & ValueOf(Item & item, std::false_type)			{ return item.value; }
+	V & ValueOf(Item & item, std::true_type)			{ return values[item.iValue]; }
+	void AddValue(Item & item, size_t iSlot, const V & value, std::false_type);
+	void AddValue(Item & item, size_t iSlot, const V & value, std::true_type);
+	void RemoveValue(Item &, std::false_type)			{}
+	void RemoveValue(Item & item, std::true_type);
+	void MoveValue(const Item &, size_t, std::false_type)				{}
+	void MoveValue(const Item & item, size_t iSlot, std::true_type)	{ valueSlots[item.iValue] = uint32_t(iSlot); }
 };
 
 // "Data-oriented" hash table: open addressing, linear probing, but
 // stores the hashes in a separate array from the keys & values
-template <typename K, typename V>
+template <typename K, typename V, typename A = std::allocator<char>>
 class DO1HashTable
 {
 public:
@@ -253,12 +922,11 @@ public:
 		BSTATE_Removed,
 	};
 
-	struct Bucket
+	// Steal a couple bits from the hash value to say whether the bucket is
+	// empty, filled, or removed (different from empty); without a hash (see
+	// StoreHash), just a byte for the state
+	struct Bucket : std::conditional<StoreHash<K>::value, BucketHashAndState<2>, BucketStateOnly>::type
 	{
-		// Steal a couple bits from the hash value to say whether the bucket
-		// is empty, filled, or removed (different from empty)
-		size_t	hash:62;
-		size_t	state:2;
 	};
 
 	struct KV
@@ -269,25 +937,50 @@ public:
 		V		value;
 	};
 
-	std::vector<Bucket>	buckets;
-	std::vector<KV>		keyvals;
-	size_t				size;
-
-	DO1HashTable();
-
-	void Insert(K key, V value);
-	V * Lookup(K key);
-	bool Remove(K key);
+	TableVector<Bucket, A>	buckets;
+	TableVector<KV, A>		keyvals;
+	size_t					size;
+	// Removed buckets, until RehashInPlace clears them out
+	size_t					tombstones;
+	// Threads for Rehash (and BulkBuild) to use; 1 means do it all on the calling thread
+	int						rehashThreads;
+	// Shrink once under 1/8 full; see the top of the file
+	bool					autoShrink;
+
+	explicit DO1HashTable(const A & alloc = A());
+
+	void Insert(const K & key, const V & value);
+	template <typename Q> V * Lookup(const Q & key);
+	template <typename Q> bool Remove(const Q & key);
+
+	template <typename Q> std::pair<V *, bool> FindOrInsert(const Q & key);
+	template <typename Q> bool InsertOrAssign(const Q & key, const V & value);
+	template <typename Q, typename F> bool Upsert(const Q & key, F fn);
+	template <typename It> void BulkBuild(It first, It last);
+	void LookupBatch(const K * keys, size_t count, V ** results);
+	void InsertBatch(const K * keys, const V * values, size_t count);
 
 	void Reserve(size_t maxSize);
 	void Reset();
 
 	void Rehash(size_t bucketCountNew);
+	void RehashInPlace();
+	void ShrinkToFit();
+	HashTableStats GetStats() const;
+
+private:
+	// RPHashTable hashes each key once, to choose a DO1, then probes it
+	template <typename, typename, typename> friend class RPHashTable;
+
+	void ShrinkIfSparse();
+	void InsertHashed(size_t hash, const K & key, const V & value);
+	V * LookupHashed(size_t hash, const typename KeyTraits<K>::Probe & key);
+	void RehashParallel(size_t bucketCountNew);
 };
 
 // "Data-oriented" hash table: open addressing, linear probing, but
 // stores the hashes/keys/values all in separate arrays
-template <typename K, typename V>
+template <typename K, typename V, typename A = std::allocator<char>>
 class DO2HashTable
 {
 public:
@@ -306,57 +999,630 @@ public:
 		size_t	state:2;
 	};
 
-	std::vector<Bucket>	buckets;
+	TableVector<Bucket, A>	buckets;
 	// Note: in a real implementation, instead of K and V this should just
 	// be *storage* for K and V, to be constructed/destructed as needed
-	std::vector<K>		keys;
-	std::vector<V>		values;
-	size_t				size;
+	TableVector<K, A>		keys;
+	TableVector<V, A>		values;
+	size_t					size;
+	// Removed buckets, until RehashInPlace clears them out
+	size_t					tombstones;
+	// Threads for Rehash (and BulkBuild) to use; 1 means do it all on the calling thread
+	int						rehashThreads;
+	// Shrink once under 1/8 full; see the top of the file
+	bool					autoShrink;
+
+	explicit DO2HashTable(const A & alloc = A());
+
+	void Insert(const K & key, const V & value);
+	template <typename Q> V * Lookup(const Q & key);
+	template <typename Q> bool Remove(const Q & key);
+
+	template <typename Q> std::pair<V *, bool> FindOrInsert(const Q & key);
+	template <typename Q> bool InsertOrAssign(const Q & key, const V & value);
+	template <typename Q, typename F> bool Upsert(const Q & key, F fn);
+	template <typename It> void BulkBuild(It first, It last);
+	void LookupBatch(const K * keys, size_t count, V ** results);
+
+	void Reserve(size_t maxSize);
+	void Reset();
+
+	void Rehash(size_t bucketCountNew);
+	void RehashInPlace();
+	void ShrinkToFit();
+	HashTableStats GetStats() const;
+
+	// Write the arrays out for DO2SnapshotTable to map; false on I/O failure
+	bool SaveSnapshot(const char * path) const;
+
+private:
+	void ShrinkIfSparse();
+	void InsertHashed(size_t hash, const K & key, const V & value);
+	V * LookupHashed(size_t hash, const typename KeyTraits<K>::Probe & key);
+	void RehashParallel(size_t bucketCountNew);
+};
+
+// Read-only tables served straight out of a mapped snapshot file (see
+// snapshot-file.h), written by SaveSnapshot on the corresponding table.
+// Opening one maps the file and checks its header; pages are only read in
+// as lookups touch them, so there's nothing to rebuild at startup.
+template <typename K, typename V>
+class DO2SnapshotTable
+{
+public:
+	typedef typename DO2HashTable<K, V>::Bucket Bucket;
+
+	MappedFile		file;
+	const Bucket *	buckets;
+	const K *		keys;
+	const V *		values;
+	size_t			bucketCount;
+	size_t			size;
+
+	DO2SnapshotTable();
+
+	bool Open(const char * path, bool verifyPayload = false);
+	void Close();
+
+	template <typename Q> const V * Lookup(const Q & key) const;
+};
+
+template <typename K, typename V>
+class D0SnapshotTable
+{
+public:
+	typedef typename D0HashTable<K, V>::KN KN;
+
+	MappedFile		file;
+	const uint32_t *buckets;
+	const KN *		keyAndNexts;
+	const V *		values;
+	size_t			bucketCount;
+	size_t			size;
+
+	D0SnapshotTable();
+
+	bool Open(const char * path, bool verifyPayload = false);
+	void Close();
+
+	template <typename Q> const V * Lookup(const Q & key) const;
+};
+
+// Hash table for data bigger than memory: extendible hashing over 4 KB pages
+// of a file (see paged-file.h), with only an LRU cache of them in memory.  A
+// directory of 2^globalDepth page numbers, indexed by the low bits of the
+// hash, is all that's always in memory; entries share a page until it fills,
+// and then it splits in two on the next bit of the hash, doubling the
+// directory first only if the page already uses every bit the directory
+// does.  Growing writes two pages and never moves the rest of the file.
+//
+// Within a page, entries sit in an open-addressed array with linear probing,
+// filled to 3/4 before the page splits; Remove shifts later entries back
+// rather than leaving tombstones.  No split can part entries with the same
+// hash (copies of a key from blind Insert, or a full collision), so a page
+// full of only those chains on overflow pages instead, which aren't in the
+// directory and which Lookup and Remove walk only for that hash.
+//
+// The file is scratch space: the directory and counts live only in memory,
+// so a table can't be reopened from its file.  Keys and values go into the
+// pages as raw bytes, so both must be trivially copyable.  Lookup returns a
+// pointer into the cache, good until the next call on the table, and const,
+// since writing through it wouldn't mark the page to be written back.
+template <typename K, typename V>
+class EHHashTable
+{
+public:
+	static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+				  "EHHashTable keeps keys and values in file pages");
+
+	struct Entry
+	{
+		K		key;
+		V		value;
+	};
+
+	// A page is a small header, a bitmap of filled slots, and the slots
+	static const size_t s_pageHeaderBytes = 16;
+	static const size_t s_pageSlotsBound = (s_pageSize - s_pageHeaderBytes) * 8 / (sizeof(Entry) * 8 + 1);
+	static const size_t s_pageFilledWords = (s_pageSlotsBound + 63) / 64;
+	static const size_t s_pageSlots = (s_pageSize - s_pageHeaderBytes - s_pageFilledWords * 8) / sizeof(Entry);
+	static const size_t s_pageSlotsFull = s_pageSlots * 3 / 4;
+
+	struct Page
+	{
+		uint16_t	count;
+		uint8_t		localDepth;		// bits of the hash all its keys share
+		uint8_t		unused[5];
+		// First of its chain of overflow pages (0 if none; page 0 is never
+		// one), all holding entries with the hash overflowHash
+		uint32_t	overflow;
+		uint32_t	overflowHash;
+		uint64_t	filled[s_pageFilledWords];
+		Entry		slots[s_pageSlots];
+	};
 
-	DO2HashTable();
+	static_assert(sizeof(Page) <= s_pageSize, "EHHashTable page overflows s_pageSize");
+
+	PageCache				cache;
+	std::vector<uint32_t>	directory;
+	int						globalDepth;
+	uint32_t				pageCount;
+	size_t					size;
+
+	EHHashTable();
+
+	// Creates (or empties) the file at path, with a cache of cacheFrames
+	// pages (at least s_pageCacheFramesMin); false if it can't
+	bool Open(const char * path, size_t cacheFrames);
+	// Writes back the cached pages and closes the file
+	void Close();
+	// Writes back the cached pages; false if any read or write has failed
+	bool Flush();
+
+	void Insert(const K & key, const V & value);
+	template <typename Q> const V * Lookup(const Q & key);
+	template <typename Q> bool Remove(const Q & key);
+
+	template <typename Q> std::pair<V *, bool> FindOrInsert(const Q & key);
+	template <typename Q> bool InsertOrAssign(const Q & key, const V & value);
+	template <typename Q, typename F> bool Upsert(const Q & key, F fn);
+
+private:
+	Page * FetchPage(size_t hash, bool dirty);
+	static size_t SlotHome(size_t hash)					{ return size_t((uint64_t(uint32_t(hash)) * s_pageSlots) >> 32); }
+	static bool SlotFilled(const Page & page, size_t i)	{ return (page.filled[i / 64] >> (i % 64)) & 1; }
+	static int FindSlot(const Page & page, size_t hash, const typename KeyTraits<K>::Probe & key);
+	uint32_t FindInChain(const Page & page, size_t hash, const typename KeyTraits<K>::Probe & key, int & iSlot);
+	static bool PageAllHash(const Page & page, size_t hash);
+	static size_t PlaceEntry(Page & page, size_t hash, const Entry & entry);
+	static void RemoveSlot(Page & page, size_t iSlot);
+	Entry & InsertHashed(size_t hash, const K & key);
+	Entry & InsertOverflow(size_t hash, const K & key);
+	void SplitPage(size_t hash);
+};
+
+// Multimap for duplicate keys (a join index): open addressing with linear
+// probing over the distinct keys, each bucket saying where that key's values
+// are in one shared array.  A key's values are always contiguous, so
+// EqualRange is a pair of pointers and scanning them is a straight read.
+//
+// Insert appends to the key's run in place while the run has room, or while
+// it's at the end of the array; otherwise the run moves to the end with twice
+// the room, leaving a hole behind.  Once the holes outnumber the slots the
+// runs cover, Compact packs the runs back together, in bucket order.
+// BulkBuild counts the values per key first and scatters them straight into
+// place, so a bulk-built table's runs are exactly packed.
+//
+// Its interface differs from the others': Insert adds another value for the
+// key rather than a duplicate key, Lookup is the key's first value, Remove
+// takes out all of a key's values, and there's no find-or-insert family.
+// Pointers into the values are good until the next Insert, Remove or
+// BulkBuild.
+template <typename K, typename V, typename A = std::allocator<char>>
+class MMHashTable
+{
+public:
+	// A key and its run of values: where the run starts, how many values it
+	// has, and how many it has room for before it must move.  An empty bucket
+	// has no room; a key always has room for at least one value, and is
+	// removed along with its last.  The hash, if there is one, is first, so
+	// it can go in a base class (see StoreHash).
+	struct Bucket : std::conditional<StoreHash<K>::value, BucketHash, BucketNoHash>::type
+	{
+		// Note: in a real implementation, instead of K this should just be
+		// *storage* for K, to be constructed/destructed as needed
+		K			key;
+		uint32_t	offset;
+		uint32_t	count;
+		uint32_t	capacity;
+	};
+
+	TableVector<Bucket, A>	buckets;
+	TableVector<V, A>		values;
+	// Distinct keys
+	size_t					keyCount;
+	// Values, over all the keys
+	size_t					size;
+	// Slots in values left behind by runs that moved or were removed, until
+	// Compact packs them out
+	size_t					holes;
+
+	explicit MMHashTable(const A & alloc = A());
+
+	void Insert(const K & key, const V & value);
+	template <typename Q> V * Lookup(const Q & key);
+	// The key's values, as [first, second); both null if it has none
+	template <typename Q> std::pair<V *, V *> EqualRange(const Q & key);
+	template <typename Q> size_t Count(const Q & key) const;
+	template <typename Q> bool Remove(const Q & key);
+	template <typename It> void BulkBuild(It first, It last);
+
+	// Room for maxKeys distinct keys without a Rehash, and maxValues values
+	// without growing the array
+	void Reserve(size_t maxKeys, size_t maxValues = 0);
+	void Reset();
+
+	void Rehash(size_t bucketCountNew);
+	void Compact();
+	HashTableStats GetStats() const;
+
+private:
+	static const uint32_t s_none = ~uint32_t(0);
+
+	size_t BucketHome(size_t hash) const		{ return hash & (buckets.size() - 1); }
+	size_t HashOf(const Bucket & b) const		{ return BucketHashOr(b, [&]() { return size_t(HashKey(b.key)); }); }
+	size_t FindBucket(size_t hash, const typename KeyTraits<K>::Probe & key) const;
+	Bucket & FindOrAddKey(size_t hash, const K & key);
+	void GrowRun(Bucket & b);
+	void Relayout();
+};
 
-	void Insert(K key, V value);
-	V * Lookup(K key);
-	bool Remove(K key);
+// Radix-partitioned table: 2^partitionBits DO1 sub-tables, each small enough
+// to stay in L2 (s_subTableBytesMax), with a key's sub-table chosen by the
+// top bits of its hash and its bucket there by the low bits.  LookupBatch
+// and InsertBatch hash a batch of keys, group them by sub-table, and work
+// through one sub-table's keys at a time.  That only keeps a sub-table in
+// cache while a batch gives each one many keys; with hundreds of sub-tables
+// and random keys it seldom does, and a lookup still misses to DRAM.  Then
+// LookupBatch relies on prefetching the buckets of the keys coming up, and
+// measures about level with DO1's own LookupBatch, not ahead of it.  One key
+// at a time, it's a DO1 with an extra indirection.
+//
+// It starts as a single sub-table that grows as usual.  Once a sub-table
+// reaches subTableSizeMax (2/3 of the most buckets that fit), every one
+// splits in two, into sub-tables that are all at that full size from then
+// on; the load stays between 1/3 and 2/3, as in a plain DO1.  A sub-table
+// the hash has overfilled while the rest are still under half full grows on
+// its own instead, so (say) many copies of one key can't set off splits.
+//
+// Remove and the find-or-insert family go through DO1's own, which hash the
+// key again.
+template <typename K, typename V, typename A = std::allocator<char>>
+class RPHashTable
+{
+public:
+	typedef DO1HashTable<K, V, A> SubTable;
+
+	static const size_t s_subTableBytesMax = 256 * 1024;
+	static const int s_partitionBitsMax = 20;
+	// How many keys ahead LookupBatch prefetches home buckets, and the most
+	// keys it groups at once, so its scratch and results stay in cache
+	static const size_t s_batchPrefetchDistance = 16;
+	static const size_t s_lookupSliceMax = 64 * 1024;
+
+	TableVector<SubTable, A>	subTables;
+	int							partitionBits;
+	size_t						size;
+	// Buckets in each sub-table once there's more than one, and keys one may
+	// hold before they split
+	size_t						subTableBucketCount;
+	size_t						subTableSizeMax;
+
+	explicit RPHashTable(const A & alloc = A());
+
+	void Insert(const K & key, const V & value);
+	template <typename Q> V * Lookup(const Q & key);
+	template <typename Q> bool Remove(const Q & key);
+
+	template <typename Q> std::pair<V *, bool> FindOrInsert(const Q & key);
+	template <typename Q> bool InsertOrAssign(const Q & key, const V & value);
+	template <typename Q, typename F> bool Upsert(const Q & key, F fn);
+
+	// Lookup of each of an array of keys, and blind Insert of each of an
+	// array of keys and values, a sub-table at a time
+	void LookupBatch(const K * keys, size_t count, V ** results);
+	void InsertBatch(const K * keys, const V * values, size_t count);
+
+	void Reserve(size_t maxSize);
+	void Reset();
+	HashTableStats GetStats() const;
+
+private:
+	// A batch's key, with its hash and where it is in the batch, copied out
+	// so each sub-table's group is read front to back
+	struct BatchEntry
+	{
+		uint32_t	hash;
+		uint32_t	index;
+		K			key;
+	};
+
+	A							alloc;
+	// LookupBatch and InsertBatch's scratch: each key's hash, the keys
+	// grouped by sub-table, and where each sub-table's group starts
+	std::vector<uint32_t>		batchHashes;
+	std::vector<BatchEntry>		batchEntries;
+	std::vector<size_t>			batchStarts;
+
+	size_t SubTableIndex(size_t hash) const		{ return size_t(uint32_t(hash)) >> (32 - partitionBits); }
+	SubTable & SubTableFor(size_t hash)			{ return subTables[SubTableIndex(hash)]; }
+	void InsertHashed(size_t hash, const K & key, const V & value);
+	static void InsertIntoSubTable(SubTable & subTable, size_t hash, const K & key, const V & value);
+	bool SplitWanted(const SubTable & subTable) const;
+	void Repartition(int partitionBitsNew);
+	void PartitionBatch(const K * keys, size_t count);
+	void PrefetchHome(const BatchEntry & entry) const;
+};
+
+// Smallest power of two >= n, for sizing FixedHashTable at compile time
+constexpr size_t FixedBucketCount(size_t n, size_t count = 1)
+{
+	return count >= n ? count : FixedBucketCount(n, count * 2);
+}
+
+// Fixed-capacity table for small key sets whose maximum size is known at
+// compile time.  Storage is inline, so one on the stack never touches the
+// heap; the bucket count and mask are compile-time constants; and there's no
+// load check or Rehash, so inserting more than N keys is a bug (it asserts).
+// Open addressing with linear probing, at most 2/3 full, and Remove shifts
+// the rest of the run back rather than leaving a tombstone.  In LinearScan
+// mode (the default for N <= 16) nothing is hashed at all: the keys are kept
+// packed at the front of the array and Lookup just scans them.
+template <typename K, typename V, int N, bool LinearScan = (N <= 16)>
+class FixedHashTable
+{
+public:
+	static_assert(N > 0, "FixedHashTable needs room for at least one key");
+
+	static const size_t s_bucketCount = LinearScan ? N : FixedBucketCount((N * 3 + 1) / 2);
+	static const size_t s_mask = s_bucketCount - 1;
+
+	enum BSTATE
+	{
+		BSTATE_Empty,
+		BSTATE_Filled,
+	};
+
+	// LinearScan mode uses the first size keys and values, and no states
+	std::array<uint8_t, LinearScan ? 1 : s_bucketCount>	states;
+	std::array<K, s_bucketCount>						keys;
+	std::array<V, s_bucketCount>						values;
+	size_t												size;
+
+	FixedHashTable();
+
+	void Insert(const K & key, const V & value);
+	template <typename Q> V * Lookup(const Q & key);
+	template <typename Q> bool Remove(const Q & key);
+
+	template <typename Q> std::pair<V *, bool> FindOrInsert(const Q & key);
+	template <typename Q> bool InsertOrAssign(const Q & key, const V & value);
+	template <typename Q, typename F> bool Upsert(const Q & key, F fn);
+
+	// Only checks that maxSize fits; there's nothing to allocate
+	void Reserve(size_t maxSize);
+	void Reset();
+};
+
+// The hash family for PerfectHashTable: SpookyHash's 128-bit hash, seeded, so
+// a failed build can just try again with the next seed.  Like HashKey, this
+// digests the characters of string keys rather than the object holding them.
+template <typename K>
+void PerfectHashKey(const K & key, uint64_t seed, uint64_t * pHash1, uint64_t * pHash2)
+{
+	*pHash1 = *pHash2 = seed;
+	SpookyHash::Hash128(&key, sizeof(key), pHash1, pHash2);
+}
+inline void PerfectHashKey(StrView key, uint64_t seed, uint64_t * pHash1, uint64_t * pHash2)
+{
+	*pHash1 = *pHash2 = seed;
+	SpookyHash::Hash128(key.data, key.size, pHash1, pHash2);
+}
+inline void PerfectHashKey(const std::string & key, uint64_t seed, uint64_t * pHash1, uint64_t * pHash2)
+{
+	PerfectHashKey(StrView(key), seed, pHash1, pHash2);
+}
+
+// Read-only table over a key set known up front, using a minimal perfect hash
+// (PTHash-style hash-and-displace) so every lookup is exactly one probe.
+// Keys are hashed into buckets of ~s_keysPerBucket; each bucket stores a
+// 16-bit pilot, chosen at build time so that the bucket's keys, XORed with
+// the pilot's hash, land in distinct free slots.  Slots run a little past
+// size to make the search easy, and the few keys that land past the end are
+// sent back into the holes through remap.  All told, ~4 bits per key on top
+// of the keys and values themselves.  A lookup reads the pilot, the KV, and
+// for ~2% of keys a remap entry.
+template <typename K, typename V, typename A = std::allocator<char>>
+class PerfectHashTable
+{
+public:
+	static const size_t s_keysPerBucket = 5;
+
+	struct KV
+	{
+		K		key;
+		V		value;
+	};
+
+	TableVector<uint16_t, A>	pilots;
+	TableVector<uint32_t, A>	remap;		// where slots [size, slotCount) really live
+	TableVector<KV, A>			keyvals;	// together, so a lookup touches one cache line
+	uint64_t					seed;
+	size_t						slotCount;
+	size_t						size;
+
+	explicit PerfectHashTable(const A & alloc = A());
+
+	// Replaces the contents with the (key, value) pairs in [first, last); false
+	// if the keys aren't all distinct (the table is left empty then)
+	template <typename It> bool Build(It first, It last);
+
+	template <typename Q> const V * Lookup(const Q & key) const;
+
+	// Bytes of hash metadata (pilots and remap), not counting keys and values
+	size_t MetadataBytes() const;
+};
+
+// "Data-oriented" hash table specialized for string keys: same split of
+// hashes and keyvals as DO1HashTable, but keys of up to s_inlineKeyMax bytes
+// are stored inline in the keyval slot and only longer keys spill into a
+// side arena, so most lookups never chase a pointer to the key characters
+template <typename V, typename A = std::allocator<char>>
+class DO1StrHashTable
+{
+public:
+	enum BSTATE
+	{
+		BSTATE_Empty,
+		BSTATE_Filled,
+		BSTATE_Removed,
+	};
+
+	static const size_t s_inlineKeyMax = 22;
+	static const uint8_t s_tagSpilled = 0xff;
+
+	struct Bucket
+	{
+		// The tag is the key length for inline keys, or s_tagSpilled for
+		// keys in the arena; together with the hash it rejects almost every
+		// mismatch without touching the keyvals
+		uint32_t	hash;
+		uint8_t		state;
+		uint8_t		tag;
+	};
+
+	struct KV
+	{
+		union
+		{
+			char		chars[s_inlineKeyMax];
+			struct
+			{
+				size_t	offset;
+				size_t	length;
+			}			spilled;
+		}			key;
+		V			value;
+	};
+
+	TableVector<Bucket, A>	buckets;
+	TableVector<KV, A>		keyvals;
+	// Characters of spilled keys.  Removing a spilled key leaves its
+	// characters behind (counted in arenaDead) until the next Rehash
+	// compacts the arena; Insert and FindOrInsert rebuild rather than
+	// RehashInPlace once they outnumber the live ones.
+	TableVector<char, A>	arena;
+	size_t					arenaDead;
+	size_t					size;
+	// Removed buckets, until RehashInPlace clears them out
+	size_t					tombstones;
+	// Shrink once under 1/8 full; see the top of the file
+	bool					autoShrink;
+
+	explicit DO1StrHashTable(const A & alloc = A());
+
+	void Insert(StrView key, const V & value);
+	template <typename Q> V * Lookup(const Q & key);
+	template <typename Q> bool Remove(const Q & key);
+
+	template <typename Q> std::pair<V *, bool> FindOrInsert(const Q & key);
+	template <typename Q> bool InsertOrAssign(const Q & key, const V & value);
+	template <typename Q, typename F> bool Upsert(const Q & key, F fn);
 
 	void Reserve(size_t maxSize);
 	void Reset();
 
 	void Rehash(size_t bucketCountNew);
+	void RehashInPlace();
+	void ShrinkToFit();
+	HashTableStats GetStats() const;
+
+	StrView KeyAt(size_t iBucket) const;
+
+private:
+	void ShrinkIfSparse();
+	static uint8_t TagFor(StrView key)
+	{
+		return (key.size <= s_inlineKeyMax) ? uint8_t(key.size) : s_tagSpilled;
+	}
+	// Mostly dead characters, and more of them than buckets, so compacting
+	// pays for walking the buckets
+	bool ArenaMostlyDead() const
+	{
+		return arenaDead * 2 > arena.size() && arenaDead > buckets.size();
+	}
+	bool KeyMatches(size_t iBucket, uint32_t hash, uint8_t tag, StrView key) const;
+	void Store(size_t iBucket, uint32_t hash, StrView key);
 };
 
 // Wrapper around unordered_map with the same interface as the others,
 // and using the same hash function (instead of whatever std::hash is)
-template <typename K, typename V>
+template <typename K, typename V, typename A = std::allocator<char>>
 class UMHashTable
 {
 public:
 	struct Hasher
 	{
-		size_t operator() (K key) const
+		size_t operator() (const K & key) const
 		{
 			return HashKey(key);
 		}
 	};
 
-	std::unordered_map<K, V, Hasher> map;
+	typedef typename std::allocator_traits<A>::template rebind_alloc<std::pair<const K, V>> MapAllocator;
+
+	std::unordered_map<K, V, Hasher, std::equal_to<K>, MapAllocator> map;
+
+	// Shrink once under 1/8 full; see the top of the file
+	bool autoShrink;
 
-	void Insert(K key, V value)
+	explicit UMHashTable(const A & alloc = A())
+	:	map(0, Hasher(), std::equal_to<K>(), MapAllocator(alloc)),
+		autoShrink(false)
+	{
+	}
+
+	void Insert(const K & key, const V & value)
 	{
 		map.insert(std::make_pair(key, value));
 	}
 
-	V * Lookup(K key)
+	// Note: unordered_map has no heterogeneous find() until C++20, so
+	// looking up by anything other than a K builds a temporary K
+	template <typename Q>
+	V * Lookup(const Q & key)
 	{
-		auto it = map.find(key);
+		auto it = map.find(MakeKey(key));
 		if (it == map.end())
 			return nullptr;
 		return &it->second;
 	}
 
-	bool Remove(K key)
+	template <typename Q>
+	bool Remove(const Q & key)
+	{
+		if (map.erase(MakeKey(key)) == 0)
+			return false;
+		// unordered_map grows at a load factor of 1, so this leaves it 1/2 full
+		if (autoShrink && map.size() * 8 < map.bucket_count())
+			map.rehash(map.size() * 2);
+		return true;
+	}
+
+	template <typename Q>
+	std::pair<V *, bool> FindOrInsert(const Q & key)
+	{
+		// operator[] probes once and only allocates a node on a miss
+		// (unlike insert(), which builds the node up front)
+		size_t sizeOld = map.size();
+		V * pValue = &map[MakeKey(key)];
+		return std::make_pair(pValue, map.size() != sizeOld);
+	}
+
+	template <typename Q>
+	bool InsertOrAssign(const Q & key, const V & value)
+	{
+		auto result = FindOrInsert(key);
+		*result.first = value;
+		return result.second;
+	}
+
+	template <typename Q, typename F>
+	bool Upsert(const Q & key, F fn)
 	{
-		return (map.erase(key) > 0);
+		auto result = FindOrInsert(key);
+		fn(*result.first);
+		return result.second;
 	}
 
 	void Reserve(size_t bucketCountNew)
@@ -368,6 +1634,25 @@ public:
 	{
 		map.clear();
 	}
+
+	void ShrinkToFit()
+	{
+		// Asking for no buckets gets the fewest that hold the current size
+		map.rehash(0);
+	}
+
+	HashTableStats GetStats() const
+	{
+		return ChainStats(map.bucket_count(), [&](size_t i) { return map.bucket_size(i); });
+	}
+
+private:
+	template <typename Q>
+	static K MakeKey(const Q & key)
+	{
+		const typename KeyTraits<K>::Probe & probe = key;
+		return KeyTraits<K>::Make(probe);
+	}
 };
 
 #include "hash-tables-impl.h"
@@ -5,6 +5,11 @@
 #include <cstdio>
 #include <ctime>
 #include <algorithm>
+#include <cassert>
+#include <thread>
+#include "allocators.h"
+#include "filters.h"
+#include "hash-quality.h"
 #include "hash-tables.h"
 #include "timer.h"
 
@@ -25,11 +30,56 @@ static_assert(sizeof(size_t) + sizeof(data128) == 128 , "data128 has wrong size!
 static_assert(sizeof(size_t) + sizeof(data1K ) == 1024, "data1K has wrong size!" );
 static_assert(sizeof(size_t) + sizeof(data4K ) == 4096, "data4K has wrong size!" );
 
+// Integer keys don't get a stored hash (see StoreHash): OL's buckets are just
+// the key and value, C1's add the chain pointer, and DO1's are a state byte
+static_assert(sizeof(OLHashTable<unsigned int, unsigned int>::Bucket) == 8, "OLHashTable bucket has wrong size!");
+static_assert(sizeof(C1HashTable<unsigned int, unsigned int>::Bucket) == 16, "C1HashTable bucket has wrong size!");
+static_assert(sizeof(DO1HashTable<unsigned int, unsigned int>::Bucket) == 1, "DO1HashTable bucket has wrong size!");
+
 void UnitTests();
-template<typename K, typename V> void FillTiming(int numKeys, bool presize);
+template<typename K, typename V, typename A = std::allocator<char>> void FillTiming(int numKeys, bool presize);
 template<typename K, typename V> void LookupTiming(int numKeys, bool fail);
 template<typename K, typename V> void RemoveTiming(int numKeys);
-template<typename K, typename V> void DestructTiming(int numKeys);
+template<typename K, typename V, typename A = std::allocator<char>> void DestructTiming(int numKeys);
+template<typename K, typename V> void CountTiming(int numKeys, bool findOrInsert);
+template<typename A> void LargeTableTiming(int numKeys, int numLookups, const A & alloc);
+void SnapshotTiming(int numKeys);
+void BulkBuildTiming(int numKeys);
+void ParallelRehashTiming(int numKeys);
+template<int N> void SmallTableTiming(int numTables);
+void PerfectHashTiming(int numKeys, int numLookups);
+void BatchHashTiming(int numKeys);
+void HashQualityReport(int numKeys);
+void TableStatsTiming(int numKeys);
+void ChurnTiming(int numKeys, int numCycles);
+void ShrinkTiming(int numKeys);
+void SentinelKeyTiming(int numKeys);
+template<typename V> void ChunkedTiming(int numKeys, const char * payload);
+void GrowthTiming(int numKeys);
+void DiskTableTiming(int numKeys);
+void FilterTiming(int numKeys, int missPercent);
+void FilterStructureTiming(int numKeys);
+void MultimapTiming(int numRows, int valuesPerKey);
+template<typename V> void JoinTiming(int numBuild, int numProbe, int matchPercent, bool skewed, bool partitioned, const char * payload);
+void PartitionedTiming(int numKeys, int batchSize);
+
+// Key length distribution for string-key workloads: lengths are uniform in
+// [minLength, maxLength], except for longPercent% of the keys, which are
+// uniform in (maxLength, longMaxLength]
+struct StringKeyLengths
+{
+	int minLength;
+	int maxLength;
+	int longPercent;
+	int longMaxLength;
+};
+static const StringKeyLengths s_shortStringKeys = { 8, 24, 0, 0 };
+static const StringKeyLengths s_longStringKeys = { 64, 256, 0, 0 };
+// Roughly what our services see: 90% of keys fit in 22 bytes
+static const StringKeyLengths s_mixedStringKeys = { 8, 22, 10, 128 };
+
+template<typename V> void StringFillTiming(int numKeys, const StringKeyLengths & lengths);
+template<typename V> void StringLookupTiming(int numKeys, const StringKeyLengths & lengths);
 
 FILE * g_pFileOut = nullptr;
 void Log(const char * fmt, ...)
@@ -85,6 +135,29 @@ int main (int argc, const char ** argv)
 	bool timeFailedLookup	= true;
 	bool timeRemove			= true;
 	bool timeDestruct		= true;
+	bool timeCount			= true;
+	bool timeStringKeys		= true;
+	bool timeAllocators		= true;
+	bool timeSmallTables	= true;
+	bool timePerfectHash	= true;
+	bool timeBatchHash		= true;
+	bool reportHashQuality	= true;
+	bool timeTableStats		= true;
+	bool timeShrink			= true;
+	bool timeSentinelKeys	= true;
+	bool timeChunked		= true;
+	bool timeGrowth			= true;
+	bool timeDiskTable		= true;			// Note: writes a page file of a few tens of MB
+	bool timeFilters		= true;
+	bool timeFilterStructures	= true;
+	bool timeMultimap		= true;
+	bool timeJoin			= true;
+	bool timePartitioned	= true;
+	bool timeChurn			= false;		// Note: 100M remove/insert cycles per table; takes a while
+	bool timeLargeTable		= false;		// Note: needs a few GB of memory and takes a while
+	bool timeSnapshots		= true;
+	bool timeBulkBuild		= false;		// Note: up to 500M entries; needs a big machine
+	bool timeParallelRehash	= false;		// Note: needs a few GB of memory, and cores to scale onto
 
 	clock_t clockStart = clock();
 
@@ -103,6 +176,14 @@ int main (int argc, const char ** argv)
 		"\tOL = open addressing with linear probing\n"
 		"\tDO1 = \"data-oriented\": OA, linear, with hashes stored separately from keys and values\n"
 		"\tDO2 = \"data-oriented\": OA, linear, with hashes, keys, and values all separate\n"
+		"\tDS = DO1 for string keys: keys up to 22 bytes inline, longer ones in an arena\n"
+		"\tOS = OL for integer keys, with two key values marking empty and removed buckets\n"
+		"\tF14 = OA over 14-slot chunks with 1-byte tags and overflow counts; F14i keeps values in a separate array\n"
+		"\tLH = linear hashing: chaining, split one bucket at a time, with buckets and elements in fixed-size segments\n"
+		"\tEH = extendible hashing: 4K pages in a file behind an LRU page cache, with a directory of pages in memory\n"
+		"\tMM = multimap: OA, linear, over the distinct keys, with each key's values contiguous in one array\n"
+		"\tUMM = unordered_multimap\n"
+		"\tRP = radix-partitioned: DO1 sub-tables small enough for L2, chosen by the top bits of the hash\n"
 		);
 
 	if (timeFill)
@@ -267,6 +348,397 @@ int main (int argc, const char ** argv)
 		}
 	}
 
+	if (timeAllocators)
+	{
+		Log(
+			"\n"
+			"Fill time by allocator (ms)\tstd::allocator\t\t\t\t\t\tArenaAllocator\t\t\t\t\t\tPoolAllocator\n"
+			"Elem count\tUM\tCh\tOL\tDO1\tDO2\tD0\tD1\t\tUM\tCh\tOL\tDO1\tDO2\tD0\tD1\t\tUM\tCh\tOL\tDO1\tDO2\tD0\tD1\n"
+			);
+		for (int numKeys = stepSize; numKeys <= numKeysMax; numKeys += stepSize)
+		{
+			Log("%d", numKeys);
+			FillTiming<uint, uint>(numKeys, false); Log("\t");
+			FillTiming<uint, uint, ArenaAllocator<char>>(numKeys, false); Log("\t");
+			FillTiming<uint, uint, PoolAllocator<char>>(numKeys, false);
+			Log("\n");
+		}
+
+		Log(
+			"\n"
+			"Destruction time by allocator (ms)\tstd::allocator\t\t\t\t\t\tArenaAllocator\t\t\t\t\t\tPoolAllocator\n"
+			"Elem count\tUM\tCh\tOL\tDO1\tDO2\tD0\tD1\t\tUM\tCh\tOL\tDO1\tDO2\tD0\tD1\t\tUM\tCh\tOL\tDO1\tDO2\tD0\tD1\n"
+			);
+		for (int numKeys = stepSize; numKeys <= numKeysMax; numKeys += stepSize)
+		{
+			Log("%d", numKeys);
+			DestructTiming<uint, uint>(numKeys); Log("\t");
+			DestructTiming<uint, uint, ArenaAllocator<char>>(numKeys); Log("\t");
+			DestructTiming<uint, uint, PoolAllocator<char>>(numKeys);
+			Log("\n");
+		}
+	}
+
+	if (timeCount)
+	{
+		Log(
+			"\n"
+			"Word-count time, 8 words per elem (ms)\tLookup + Insert\t\t\t\t\t\t\tFindOrInsert\n"
+			"Elem count\tUM\tCh\tOL\tDO1\tDO2\tD0\tD1\t\tUM\tCh\tOL\tDO1\tDO2\tD0\tD1\n"
+			);
+		for (int numKeys = stepSize; numKeys <= numKeysMax; numKeys += stepSize)
+		{
+			Log("%d", numKeys);
+			CountTiming<uint, uint>(numKeys, false); Log("\t");
+			CountTiming<uint, uint>(numKeys, true);
+			Log("\n");
+		}
+	}
+
+	if (timeStringKeys)
+	{
+		Log(
+			"\n"
+			"String-key fill time (ms)\t8-24 bytes\t\t\t\t\t\t\t\t64-256 bytes\t\t\t\t\t\t\t\tMixed, 90% <= 22 bytes\n"
+			"Elem count\tUM\tCh\tOL\tDO1\tDO2\tD0\tD1\tDS\t\tUM\tCh\tOL\tDO1\tDO2\tD0\tD1\tDS\t\tUM\tCh\tOL\tDO1\tDO2\tD0\tD1\tDS\n"
+			);
+		for (int numKeys = stepSize; numKeys <= numKeysMax; numKeys += stepSize)
+		{
+			Log("%d", numKeys);
+			StringFillTiming<uint>(numKeys, s_shortStringKeys); Log("\t");
+			StringFillTiming<uint>(numKeys, s_longStringKeys); Log("\t");
+			StringFillTiming<uint>(numKeys, s_mixedStringKeys);
+			Log("\n");
+		}
+
+		Log(
+			"\n"
+			"Time for 100K string-key lookups by StrView (ms)\t8-24 bytes\t\t\t\t\t\t\t\t64-256 bytes\t\t\t\t\t\t\t\tMixed, 90% <= 22 bytes\n"
+			"Elem count\tUM\tCh\tOL\tDO1\tDO2\tD0\tD1\tDS\t\tUM\tCh\tOL\tDO1\tDO2\tD0\tD1\tDS\t\tUM\tCh\tOL\tDO1\tDO2\tD0\tD1\tDS\n"
+			);
+		for (int numKeys = stepSize; numKeys <= numKeysMax; numKeys += stepSize)
+		{
+			Log("%d", numKeys);
+			StringLookupTiming<uint>(numKeys, s_shortStringKeys); Log("\t");
+			StringLookupTiming<uint>(numKeys, s_longStringKeys); Log("\t");
+			StringLookupTiming<uint>(numKeys, s_mixedStringKeys);
+			Log("\n");
+		}
+	}
+
+	if (timeSmallTables)
+	{
+		static const int numTables = 100000;
+		Log(
+			"\n"
+			"Small tables: construct + fill + lookup + destroy, x%d (ms)\n"
+			"Elem count\tFixed (scan)\tFixed (hashed)\tUM\tOL\tDO1\tD0\tD1\n",
+			numTables
+			);
+		Log("4");  SmallTableTiming<4>(numTables);  Log("\n");
+		Log("8");  SmallTableTiming<8>(numTables);  Log("\n");
+		Log("16"); SmallTableTiming<16>(numTables); Log("\n");
+		Log("32"); SmallTableTiming<32>(numTables); Log("\n");
+		Log("64"); SmallTableTiming<64>(numTables); Log("\n");
+	}
+
+	if (timePerfectHash)
+	{
+		static const int s_perfectHashSizes[] = { 10000, 100000, 1000000, 10000000 };
+		static const int numLookups = 1000000;
+		Log(
+			"\n"
+			"Read-only key sets\tBuild time (ms)\t\t\t\t\tTime for %d lookups (ms)\t\t\t\t\tBytes per key\n"
+			"Elem count\tPerfect\tOL\tDO2\tD0\t\tPerfect\tOL\tDO2\tD0\t\tPerfect\tOL\tDO2\tD0\n",
+			numLookups
+			);
+		for (int numKeys : s_perfectHashSizes)
+		{
+			Log("%d", numKeys);
+			PerfectHashTiming(numKeys, numLookups);
+			Log("\n");
+		}
+	}
+
+	if (timeBatchHash)
+	{
+		// Few enough keys to stay in cache, so it's the hashing that's timed
+		static const int numKeys = 1 << 14;
+		Log(
+			"\n"
+			"Batch hashing, millions of keys hashed per second\n"
+			"Key size\tHashKey\tscalar\tAVX2\tAVX-512\n"
+			);
+		BatchHashTiming(numKeys);
+	}
+
+	if (reportHashQuality)
+	{
+		static const int numKeys = 1 << 16;
+		Log(
+			"\n"
+			"Hash quality (%d keys)\t\t\tChained, n buckets\t\t\t\t\t\t\t\t\t\tOpen addressing, <= 2/3 full\t\t\t\t\tFull hash\n"
+			"Hash\tIndex\tKeys\tChi-square z\tBucket collisions\tMax chain\tChains of 0\t1\t2\t3\t4\t5+\t\tMax linear probe\tAvg linear probe\tMax quadratic probe\tAvg quadratic probe\t\tCollisions\n",
+			numKeys
+			);
+		HashQualityReport(numKeys);
+	}
+
+	if (timeTableStats)
+	{
+		// Each table is filled, then churned (a quarter of the keys removed and
+		// as many new ones inserted) so the open-addressed ones have tombstones
+		static const int s_statsSizes[] = { 100000, 1000000 };
+		Log(
+			"\n"
+			"Table stats after churn\t\t\t\t\tProbes per hit\t\tProbes per miss\t\tTime for 100K lookups (ms)\t\tClusters (open addressing) or chains, by length\n"
+			"Elem count\tTable\tLoad\tTombstones\t\tAvg\tMax\tAvg\tMax\tHit\tMiss\t0\t1\t2\t3\t4\t5\t6\t7\t8\t9\t10\t11\t12\t13\t14\t15+\n"
+			);
+		for (int numKeys : s_statsSizes)
+			TableStatsTiming(numKeys);
+	}
+
+	if (timeShrink)
+	{
+		// Each table spikes to 10x the keys it ends up holding, as in a batch
+		// job; the lookups of the keys left are timed before and after
+		// ShrinkToFit hands the spike's buckets back
+		static const int numKeys = 100000;
+		Log(
+			"\n"
+			"Shrink after a 10x spike\t\tBuckets\t\tTime for 100K lookups (ms)\n"
+			"Elem count\tTable\tBefore\tAfter\tBefore\tAfter\n"
+			);
+		ShrinkTiming(numKeys);
+	}
+
+	if (timeSentinelKeys)
+	{
+		// 8-byte payloads, where per-bucket state costs the most: OS keeps
+		// none, OL keeps it in a bitmap, DO1 in a byte array, and D1 beside
+		// each key
+		Log(
+			"\n"
+			"Sentinel keys, 8 bytes\t\t\tFill\tTime for 100K lookups (ms)\n"
+			"Elem count\tTable\tBytes/key\t(ms)\tHits\tMisses\n"
+			);
+		for (int numKeys = 10000; numKeys <= 1000000; numKeys *= 10)
+			SentinelKeyTiming(numKeys);
+	}
+
+	if (timeChunked)
+	{
+		// F14 fills its chunks to 12 of 14 slots before growing, where the
+		// open-addressed tables stop at 2/3, and its misses stop at the first
+		// chunk no key overflowed; F14i moves the values out of the chunks,
+		// which is what keeps 4K payloads from spreading lookups over pages
+		Log(
+			"\n"
+			"Chunked (F14)\t\t\t\tFill\tTime for 100K lookups (ms)\n"
+			"Elem count\tPayload\tTable\tBytes/key\t(ms)\tHits\tMisses\n"
+			);
+		for (int numKeys = 10000; numKeys <= 1000000; numKeys *= 10)
+			ChunkedTiming<uint>(numKeys, "8 bytes");
+		for (int numKeys = 1000; numKeys <= 10000; numKeys *= 10)
+			ChunkedTiming<data4K>(numKeys, "4K bytes");
+	}
+
+	if (timeGrowth)
+	{
+		// Each table grows from empty to 4M keys, one insert at a time, with
+		// each insert timed on its own; the peak memory includes the old and
+		// new arrays both being live during a rehash
+		Log(
+			"\n"
+			"Growth, memory (MB)\tLH\t\tOL\t\tD0\n"
+			"Elem count\tLive\tPeak\tLive\tPeak\tLive\tPeak\n"
+			);
+		GrowthTiming(4000000);
+	}
+
+	if (timeDiskTable)
+	{
+		// EH fills a file of pages through caches from all of it down to 1%,
+		// then looks up keys in random order; the cache columns are over the
+		// lookups, the reads and writes over the whole run.  Reads the cache
+		// misses may still come from the OS's file cache.
+		Log(
+			"\n"
+			"Extendible hashing (EH), 2M keys, 8 bytes\t\tTime (ms)\t\t\tPage cache\n"
+			"Cache pages\tOf file\tFill\t100K hits\t100K misses\tHit rate\tReads\tWrites\n"
+			);
+		DiskTableTiming(2000000);
+	}
+
+	if (timeFilters)
+	{
+		// 80% of the mixed lookups miss, as in our traffic.  Filtered tables
+		// check a Bloom filter, presized at 12 bits per key, before probing,
+		// so a miss mostly costs a hash and one cache line, and a hit pays
+		// for the check on top of the lookup.
+		Log(
+			"\n"
+			"Bloom filter front-end\t\tTime for 100K lookups (ms)\n"
+			"\t\t80%% misses\t\t\tHits\t\t\tMisses\t\t\tFilter\n"
+			"Elem count\tTable\tPlain\tFiltered\t\tPlain\tFiltered\t\tPlain\tFiltered\t\tBits/key\tFalse +\n"
+			);
+		for (int numKeys = 10000; numKeys <= 1000000; numKeys *= 10)
+			FilterTiming(numKeys, 80);
+	}
+
+	if (timeFilterStructures)
+	{
+		// Each filter is sized for the keys, which fill its slots (or bits)
+		// 90% (0.9 * 2^20 keys); bits/key is the whole filter's.  Merge
+		// combines two filters of half the keys each, and Remove takes half
+		// of them out again.
+		Log(
+			"\n"
+			"Filters, %d keys\t\t\tTime (ms)\n"
+			"Filter\tBits/key\tFalse +\tInsert\tHits\tMisses\tMerge\tRemove half\n",
+			943718
+			);
+		FilterStructureTiming(943718);
+	}
+
+	if (timeMultimap)
+	{
+		// The probe side of a hash join: 2M build rows, with 1 to 64 values
+		// per key, then 2M probe rows, half of them hitting, each reading
+		// every value its key has.  MM bulk is BulkBuild (values packed in
+		// bucket order); MM is Insert one row at a time.
+		Log(
+			"\n"
+			"Multimap join, 2M build rows, 2M probe rows\tBuild (ms)\t\t\t\tProbe (ms)\t\t\t\tMatches\tMM bulk\n"
+			"Values/key\tUMM\tMM\tMM bulk\t\tUMM\tMM\tMM bulk\t\t\tM probes/s\n"
+			);
+		for (int valuesPerKey = 1; valuesPerKey <= 64; valuesPerKey *= 4)
+			MultimapTiming(2000000, valuesPerKey);
+	}
+
+	if (timeJoin)
+	{
+		// 1M build rows with unique keys, presized, then 4M probe rows at
+		// 10-100% matching, evenly or skewed; partitioned, both sides are
+		// radix-partitioned first so each partition's table fits in L2
+		// (the partition count is in the fourth column).  Build and probe
+		// are in millions of rows a second, partitioning included.
+		Log(
+			"\n"
+			"Hash join, 1M build rows, 4M probe rows\t\t\t\tBuild (M rows/s)\t\t\t\t\t\t\tProbe (M rows/s)\n"
+			"Payload\tProbe keys\tMatch %%\tPartitions\tUM\tOL\tDO1\tD0\tF14\tMM\t\tUM\tOL\tDO1\tD0\tF14\tMM\n"
+			);
+		for (int partitioned = 0; partitioned < 2; ++partitioned)
+		{
+			JoinTiming<uint>(1000000, 4000000, 10, false, partitioned != 0, "8 bytes");
+			JoinTiming<uint>(1000000, 4000000, 50, false, partitioned != 0, "8 bytes");
+			JoinTiming<uint>(1000000, 4000000, 100, false, partitioned != 0, "8 bytes");
+			JoinTiming<uint>(1000000, 4000000, 50, true, partitioned != 0, "8 bytes");
+			JoinTiming<data32>(1000000, 4000000, 10, false, partitioned != 0, "32 bytes");
+			JoinTiming<data32>(1000000, 4000000, 50, false, partitioned != 0, "32 bytes");
+			JoinTiming<data32>(1000000, 4000000, 100, false, partitioned != 0, "32 bytes");
+			JoinTiming<data32>(1000000, 4000000, 50, true, partitioned != 0, "32 bytes");
+		}
+	}
+
+	if (timePartitioned)
+	{
+		// All three are presized with Reserve, then RP fills with InsertBatch,
+		// the others one key at a time; then 4M lookups of random keys,
+		// batchSize at a time through LookupBatch, and RP's again one at a
+		// time through Lookup.
+		Log(
+			"\n"
+			"Radix-partitioned, 8 bytes\t\t\tFill (ms)\t\t\t\t4M lookups (ms)\n"
+			"Elem count\tBatch\tRP parts\tDO1\tOL\tRP\t\tDO1\tOL\tRP\tRP single\n"
+			);
+		for (int numKeys = 1000000; numKeys <= 16000000; numKeys *= 4)
+		{
+			PartitionedTiming(numKeys, 65536);
+			PartitionedTiming(numKeys, 1048576);
+		}
+	}
+
+	if (timeChurn)
+	{
+		// Each table holds a steady 1M keys while one is removed and another
+		// inserted, over and over; lookups should stay as fast as they start
+		Log(
+			"\n"
+			"Churn, time for 100K lookups (ms)\n"
+			"Remove/insert cycles\tOL\tOQ\tDO1\tDO2\tD1\n"
+			);
+		ChurnTiming(1000000, 100000000);
+	}
+
+	if (timeSnapshots)
+	{
+		// Writes its snapshot files to the current directory
+		Log(
+			"\n"
+			"Snapshot startup (ms)\tDO2\t\t\t\t\tD0\n"
+			"Elem count\tRebuild\tMap\tMap+verify\t100K lookups\t\tRebuild\tMap\tMap+verify\t100K lookups\n"
+			);
+		for (int numKeys = stepSize * 100; numKeys <= numKeysMax * 100; numKeys += stepSize * 100)
+		{
+			Log("%d", numKeys);
+			SnapshotTiming(numKeys);
+			Log("\n");
+		}
+	}
+
+	if (timeBulkBuild)
+	{
+		static const int s_bulkBuildSizes[] = { 10000000, 50000000, 100000000, 500000000 };
+		Log(
+			"\n"
+			"Bulk build time (ms)\tOL\t\t\t\tDO1\t\t\t\tDO2\t\t\t\tD0\n"
+			"Elem count\tFill\tPresized\tBulk\t\tFill\tPresized\tBulk\t\tFill\tPresized\tBulk\t\tFill\tPresized\tBulk\n"
+			);
+		for (int numKeys : s_bulkBuildSizes)
+		{
+			Log("%d", numKeys);
+			BulkBuildTiming(numKeys);
+			Log("\n");
+		}
+	}
+
+	if (timeParallelRehash)
+	{
+		static const int numKeys = 1 << 24;
+		Log(
+			"\n"
+			"Parallel rehash (%d keys), time (ms)\tGrow for 2x keys\t\t\t\t\t\tBulk build\n"
+			"Threads\tOL\tDO1\tDO2\tD0\tD1\t\tOL\tDO1\tDO2\n",
+			numKeys
+			);
+		ParallelRehashTiming(numKeys);
+	}
+
+	if (timeLargeTable)
+	{
+		// Big enough that the arrays span far more memory than the dTLB covers
+		// with 4K pages, so most lookups take a TLB miss as well as a cache miss
+		static const int numKeys = 1 << 25;
+		static const int numLookups = 10000000;
+		Log(
+			"\n"
+			"Large table (%d keys): time for %d lookups (ms)\t\t\t\t\tdTLB load misses (millions)\n"
+			"Allocation\tOL\tDO1\tDO2\tD0\t\tOL\tDO1\tDO2\tD0\n",
+			numKeys, numLookups
+			);
+		HugePagePolicy policy;
+		Log("std::allocator");
+		LargeTableTiming(numKeys, numLookups, std::allocator<char>());
+		Log("\nHuge pages");
+		LargeTableTiming(numKeys, numLookups, HugePageAllocator<char>(policy));
+		policy.interleave = true;
+		policy.firstTouchThreads = std::max(1, int(std::thread::hardware_concurrency()));
+		Log("\nHuge pages, NUMA interleave, %d-thread first touch", policy.firstTouchThreads);
+		LargeTableTiming(numKeys, numLookups, HugePageAllocator<char>(policy));
+		Log("\n");
+	}
+
 	fclose(g_pFileOut);
 	printf("Results written to results.txt\n");
 
@@ -285,8 +757,8 @@ public:
 	typedef uint result_type;
 	result_type state;
 
-	static result_type min() { return 0; }
-	static result_type max() { return result_type(-1); }
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return result_type(-1); }
 	result_type operator() ()
 	{
 		// Xorshift algorithm from George Marsaglia's paper
@@ -302,16 +774,17 @@ public:
 // Unit tests, to make sure hash tables are functioning correctly
 
 // Helper functions to run tests
-template<typename HT>
+template<typename HT, typename A = std::allocator<char>>
 void UnitTests(
 	int numKeys,
 	const std::vector<uint> & keys,
 	const std::vector<uint> & values,
-	const char * name)
+	const char * name,
+	const A & alloc = A())
 {
 	// First test: insertion and lookup
 	{
-		HT ht;
+		HT ht(alloc);
 		// First insert some keys
 		for (int i = 0; i < numKeys; ++i)
 			ht.Insert(keys[i], values[i]);
@@ -330,11 +803,32 @@ void UnitTests(
 				return;
 			}
 		}
+		// After a Reset the table must be empty, and usable again
+		ht.Reset();
+		for (int i = 0; i < numKeys; ++i)
+		{
+			if (ht.Lookup(keys[i]))
+			{
+				printf("%s: key still findable after Reset\n", name);
+				return;
+			}
+		}
+		for (int i = 0; i < numKeys; ++i)
+			ht.Insert(keys[i], values[i]);
+		for (int i = 0; i < numKeys; ++i)
+		{
+			uint * pValue = ht.Lookup(keys[i]);
+			if (!pValue || *pValue != values[i])
+			{
+				printf("%s: lookup returned wrong value after Reset\n", name);
+				return;
+			}
+		}
 	}
 
 	// Second test: repeated insertion and removal
 	{
-		HT ht;
+		HT ht(alloc);
 		int numRounds = 10;
 		int keysPerRound = numKeys / numRounds;
 		// First insert two rounds' worth of keys
@@ -381,678 +875,4110 @@ void UnitTests(
 		}
 	}
 	
+	// Third test: single-probe find-or-insert, insert-or-assign and upsert
+	{
+		HT ht(alloc);
+		for (int i = 0; i < numKeys; ++i)
+		{
+			auto result = ht.FindOrInsert(keys[i]);
+			if (!result.second || *result.first != 0)
+			{
+				printf("%s: FindOrInsert didn't insert a fresh value for a new key\n", name);
+				return;
+			}
+			*result.first = values[i];
+		}
+		for (int i = 0; i < numKeys; ++i)
+		{
+			auto result = ht.FindOrInsert(keys[i]);
+			if (result.second || *result.first != values[i])
+			{
+				printf("%s: FindOrInsert didn't find a previously-inserted key\n", name);
+				return;
+			}
+		}
+		for (int i = 0; i < numKeys; i += 2)
+		{
+			if (ht.InsertOrAssign(keys[i], values[i] + 1))
+			{
+				printf("%s: InsertOrAssign inserted a duplicate key\n", name);
+				return;
+			}
+		}
+		for (int i = 0; i < numKeys; ++i)
+		{
+			if (ht.Upsert(keys[i], [](uint & value) { ++value; }))
+			{
+				printf("%s: Upsert inserted a duplicate key\n", name);
+				return;
+			}
+		}
+		for (int i = 0; i < numKeys; ++i)
+		{
+			uint * pValue = ht.Lookup(keys[i]);
+			uint expected = values[i] + ((i & 1) ? 1 : 2);
+			if (!pValue || *pValue != expected)
+			{
+				printf("%s: lookup returned wrong value after InsertOrAssign/Upsert\n", name);
+				return;
+			}
+		}
+		// Removed keys must be re-insertable without leaving a stale duplicate
+		for (int i = 0; i < numKeys; i += 3)
+			ht.Remove(keys[i]);
+		for (int i = 0; i < numKeys; ++i)
+		{
+			bool inserted = ht.Upsert(keys[i], [](uint & value) { ++value; });
+			if (inserted != (i % 3 == 0))
+			{
+				printf("%s: Upsert disagreed about key presence after removes\n", name);
+				return;
+			}
+		}
+		for (int i = 0; i < numKeys; i += 3)
+		{
+			if (!ht.Remove(keys[i]) || ht.Lookup(keys[i]))
+			{
+				printf("%s: re-inserted key left a duplicate behind\n", name);
+				return;
+			}
+		}
+	}
+	
 	printf("%s: all tests passed\n", name);
 }
 
-void UnitTests()
+// String keys: stored as std::string, probed through StrView and C strings
+// that live in separate memory, so only the contents can make them match
+template<typename HT>
+void StringUnitTests(
+	const std::vector<std::string> & keys,
+	const std::vector<uint> & values,
+	const char * name)
 {
-	static const int numKeys = 1000;
+	int numKeys = int(keys.size());
 
-	// Create a list of guaranteed unique keys by random shuffling
-	std::vector<uint> keys(numKeys);
+	// Copy all the keys into one NUL-separated buffer to probe with
+	std::vector<char> text;
+	std::vector<size_t> offsets(numKeys);
 	for (int i = 0; i < numKeys; ++i)
-		keys[i] = i;
-	XorshiftRNG rng = { 0xbeeff00d };
-	std::shuffle(keys.begin(), keys.end(), rng);
+	{
+		offsets[i] = text.size();
+		text.insert(text.end(), keys[i].begin(), keys[i].end());
+		text.push_back('\0');
+	}
 
-	// Create a list of random values
-	std::vector<uint> values(numKeys);
+	HT ht;
 	for (int i = 0; i < numKeys; ++i)
-		values[i] = rng();
-
-	// Run tests
-	UnitTests<UMHashTable<uint, uint>>(numKeys, keys, values, "unordered_map");
-	UnitTests<C0HashTable<uint, uint>>(numKeys, keys, values, "C0HashTable");
-	UnitTests<C1HashTable<uint, uint>>(numKeys, keys, values, "C1HashTable");
-	UnitTests<OLHashTable<uint, uint>>(numKeys, keys, values, "OLHashTable");
-	UnitTests<OQHashTable<uint, uint>>(numKeys, keys, values, "OQHashTable");
-	UnitTests<DO1HashTable<uint, uint>>(numKeys, keys, values, "DO1HashTable");
-	UnitTests<DO2HashTable<uint, uint>>(numKeys, keys, values, "DO2HashTable");
+		ht.Insert(keys[i], values[i]);
+	for (int i = 0; i < numKeys; ++i)
+	{
+		StrView view(&text[offsets[i]], keys[i].size());
+		uint * pValue = ht.Lookup(view);
+		if (!pValue || *pValue != values[i] || ht.Lookup(&text[offsets[i]]) != pValue)
+		{
+			printf("%s: failed to lookup string key by StrView / C string\n", name);
+			return;
+		}
+		if (ht.FindOrInsert(view).second)
+		{
+			printf("%s: FindOrInsert by StrView inserted a duplicate string key\n", name);
+			return;
+		}
+		// A prefix of a key must not match it
+		if (ht.Lookup(StrView(view.data, view.size - 1)))
+		{
+			printf("%s: lookup matched a prefix of a string key\n", name);
+			return;
+		}
+	}
+	for (int i = 0; i < numKeys; i += 2)
+	{
+		if (!ht.Remove(StrView(&text[offsets[i]], keys[i].size())))
+		{
+			printf("%s: failed to remove string key by StrView\n", name);
+			return;
+		}
+	}
+	for (int i = 0; i < numKeys; ++i)
+	{
+		bool present = (ht.Lookup(keys[i]) != nullptr);
+		if (present != ((i & 1) != 0))
+		{
+			printf("%s: string key presence wrong after removes\n", name);
+			return;
+		}
+	}
 
-	UnitTests<D0HashTable<uint, uint>>(numKeys, keys, values, "D0HashTable");
-	UnitTests<D1HashTable<uint, uint>>(numKeys, keys, values, "D1HashTable");
+	printf("%s: all string-key tests passed\n", name);
 }
 
+// Bulk build: into an empty table, then again on top of the result
+template<typename HT>
+void BulkBuildUnitTests(
+	int numKeys,
+	const std::vector<uint> & keys,
+	const std::vector<uint> & values,
+	const char * name)
+{
+	std::vector<std::pair<uint, uint>> pairs(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		pairs[i] = std::make_pair(keys[i], values[i]);
 
+	HT ht;
+	ht.BulkBuild(pairs.begin(), pairs.begin() + numKeys / 2);
+	ht.BulkBuild(pairs.begin() + numKeys / 2, pairs.end());
+	for (int i = 0; i < numKeys; ++i)
+	{
+		uint * pValue = ht.Lookup(keys[i]);
+		if (!pValue || *pValue != values[i])
+		{
+			printf("%s: lookup failed after bulk build\n", name);
+			return;
+		}
+	}
 
-// Timing tests
+	printf("%s: all bulk build tests passed\n", name);
+}
 
-template<typename K, typename V>
-void FillTiming(int numKeys, bool presize)
+// Parallel rehash: grow a table well past s_parallelRehashMinBuckets with
+// rehashThreads set, removing some keys on the way so the old buckets have
+// holes in them, and check the right keys are still there after each step
+template<typename HT>
+void ParallelRehashUnitTests(int numThreads, const char * name)
 {
-	// Create a list of guaranteed unique keys by random shuffling
+	static const int numKeys = 200000;
 	std::vector<uint> keys(numKeys);
 	for (int i = 0; i < numKeys; ++i)
 		keys[i] = i;
-	XorshiftRNG rng = { 0xf002beef };
+	XorshiftRNG rng = { 0xdeadf00d };
 	std::shuffle(keys.begin(), keys.end(), rng);
 
-	// Run tests and measure timing
-	float timeMin;
-	timeMin = FLT_MAX;
-	g_allocs = 0;
-	for (int i = 0; i < g_reps; ++i)
+	HT ht;
+	ht.rehashThreads = numThreads;
+	for (int i = 0; i < numKeys; ++i)
+		ht.Insert(keys[i], uint(i));
+	for (int i = 0; i < numKeys; i += 3)
+		ht.Remove(keys[i]);
+	ht.Reserve(numKeys * 4);
+
+	for (int i = 0; i < numKeys; ++i)
 	{
-		UMHashTable<K, V> ht;
-		Timer timer;
-		timer.Start();
-		if (presize)
-			ht.Reserve(numKeys);
-		for (int i = 0; i < numKeys; ++i)
+		uint * pValue = ht.Lookup(keys[i]);
+		if (i % 3 == 0 ? pValue != nullptr : (!pValue || *pValue != uint(i)))
 		{
-			ht.Insert(keys[i], V());
+			printf("%s: lookup failed after parallel rehash\n", name);
+			return;
 		}
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_allocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
 
-	timeMin = FLT_MAX;
-	g_allocs = 0;
-	for (int i = 0; i < g_reps; ++i)
+	printf("%s: all parallel rehash tests passed\n", name);
+}
+
+// Parallel bulk build: as BulkBuildUnitTests, but big enough to use the threads
+template<typename HT>
+void ParallelBulkBuildUnitTests(int numThreads, const char * name)
+{
+	static const int numKeys = 200000;
+	std::vector<std::pair<uint, uint>> pairs(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		pairs[i] = std::make_pair(uint(i), uint(i) * 7);
+	XorshiftRNG rng = { 0xf00dbeef };
+	std::shuffle(pairs.begin(), pairs.end(), rng);
+
+	HT ht;
+	ht.rehashThreads = numThreads;
+	ht.BulkBuild(pairs.begin(), pairs.begin() + numKeys / 2);
+	ht.BulkBuild(pairs.begin() + numKeys / 2, pairs.end());
+	if (ht.size != size_t(numKeys))
 	{
-		C0HashTable<K, V> ht;
-		Timer timer;
-		timer.Start();
-		if (presize)
-			ht.Reserve(numKeys);
-		for (int i = 0; i < numKeys; ++i)
+		printf("%s: wrong size after parallel bulk build\n", name);
+		return;
+	}
+	for (int i = 0; i < numKeys; ++i)
+	{
+		uint * pValue = ht.Lookup(pairs[i].first);
+		if (!pValue || *pValue != pairs[i].second)
 		{
-			ht.Insert(keys[i], V());
+			printf("%s: lookup failed after parallel bulk build\n", name);
+			return;
 		}
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_allocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
 
-	timeMin = FLT_MAX;
-	g_allocs = 0;
-	for (int i = 0; i < g_reps; ++i)
+	printf("%s: all parallel bulk build tests passed\n", name);
+}
+
+// Fixed-capacity tables: fill to capacity, then the same remove, re-insert
+// and update checks as UnitTests, on one table that never grows
+template<typename HT, int N>
+void FixedUnitTests(
+	const std::vector<uint> & keys,
+	const std::vector<uint> & values,
+	const char * name)
+{
+	HT ht;
+	for (int i = 0; i < N; ++i)
+		ht.Insert(keys[i], values[i]);
+	for (int i = 0; i < N; ++i)
 	{
-		OLHashTable<K, V> ht;
-		Timer timer;
-		timer.Start();
-		if (presize)
-			ht.Reserve(numKeys);
-		for (int i = 0; i < numKeys; ++i)
+		uint * pValue = ht.Lookup(keys[i]);
+		if (!pValue || *pValue != values[i])
 		{
-			ht.Insert(keys[i], V());
+			printf("%s: lookup returned wrong value\n", name);
+			return;
 		}
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_allocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
+	if (ht.Lookup(keys[N]))
+	{
+		printf("%s: found a key that was never inserted\n", name);
+		return;
+	}
 
-	timeMin = FLT_MAX;
-	g_allocs = 0;
-	for (int i = 0; i < g_reps; ++i)
+	// Removing a third of the keys must leave the rest findable
+	for (int i = 0; i < N; i += 3)
 	{
-		DO1HashTable<K, V> ht;
-		Timer timer;
-		timer.Start();
-		if (presize)
-			ht.Reserve(numKeys);
-		for (int i = 0; i < numKeys; ++i)
+		if (!ht.Remove(keys[i]) || ht.Remove(keys[i]))
 		{
-			ht.Insert(keys[i], V());
+			printf("%s: Remove gave the wrong answer\n", name);
+			return;
+		}
+	}
+	for (int i = 0; i < N; ++i)
+	{
+		uint * pValue = ht.Lookup(keys[i]);
+		if (i % 3 == 0 ? pValue != nullptr : (!pValue || *pValue != values[i]))
+		{
+			printf("%s: lookup returned wrong value after removes\n", name);
+			return;
 		}
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_allocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
 
-	timeMin = FLT_MAX;
-	g_allocs = 0;
-	for (int i = 0; i < g_reps; ++i)
+	// Then refill it to capacity through the find-or-insert family
+	for (int i = 0; i < N; ++i)
 	{
-		DO2HashTable<K, V> ht;
-		Timer timer;
-		timer.Start();
-		if (presize)
-			ht.Reserve(numKeys);
-		for (int i = 0; i < numKeys; ++i)
+		bool inserted = ht.Upsert(keys[i], [](uint & value) { ++value; });
+		if (inserted != (i % 3 == 0))
 		{
-			ht.Insert(keys[i], V());
+			printf("%s: Upsert disagreed about key presence after removes\n", name);
+			return;
+		}
+	}
+	for (int i = 0; i < N; ++i)
+	{
+		uint * pValue = ht.Lookup(keys[i]);
+		uint expected = (i % 3 == 0) ? 1 : values[i] + 1;
+		if (ht.size != size_t(N) || !pValue || *pValue != expected)
+		{
+			printf("%s: lookup returned wrong value after Upsert\n", name);
+			return;
 		}
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_allocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
 
-	timeMin = FLT_MAX;
-	g_allocs = 0;
-	for (int i = 0; i < g_reps; ++i)
+	ht.Reset();
+	for (int i = 0; i < N; ++i)
 	{
-		D0HashTable<K, V> ht;
-		Timer timer;
-		timer.Start();
-		if (presize)
-			ht.Reserve(numKeys);
-		for (int i = 0; i < numKeys; ++i)
+		if (ht.Lookup(keys[i]))
 		{
-			ht.Insert(keys[i], V());
+			printf("%s: key still findable after Reset\n", name);
+			return;
 		}
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
 	}
 
-#if COUNT_ALLOCS
-	Log("\t%d", g_allocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
+	printf("%s: all fixed-capacity tests passed\n", name);
+}
 
+// Perfect hashing: build over a key set, check every key finds its value and
+// keys outside the set find nothing, and that duplicate keys are refused
+template<typename K>
+void PerfectHashUnitTests(
+	const std::vector<K> & keys,
+	const std::vector<K> & missingKeys,
+	const std::vector<uint> & values,
+	const char * name)
+{
+	std::vector<std::pair<K, uint>> pairs(keys.size());
+	for (size_t i = 0, iEnd = keys.size(); i < iEnd; ++i)
+		pairs[i] = std::make_pair(keys[i], values[i]);
 
-	timeMin = FLT_MAX;
-	g_allocs = 0;
-	for (int i = 0; i < g_reps; ++i)
+	PerfectHashTable<K, uint> ht;
+	if (!ht.Build(pairs.begin(), pairs.end()) || ht.size != keys.size())
 	{
-		D1HashTable<K, V> ht;
-		Timer timer;
-		timer.Start();
-		if (presize)
-			ht.Reserve(numKeys);
-		for (int i = 0; i < numKeys; ++i)
+		printf("%s: build failed\n", name);
+		return;
+	}
+	for (size_t i = 0, iEnd = keys.size(); i < iEnd; ++i)
+	{
+		const uint * pValue = ht.Lookup(keys[i]);
+		if (!pValue || *pValue != values[i])
 		{
-			ht.Insert(keys[i], V());
+			printf("%s: lookup returned wrong value\n", name);
+			return;
 		}
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+	for (size_t i = 0, iEnd = missingKeys.size(); i < iEnd; ++i)
+	{
+		if (ht.Lookup(missingKeys[i]))
+		{
+			printf("%s: found a key that isn't in the set\n", name);
+			return;
+		}
+	}
+	if (ht.MetadataBytes() * 8 > keys.size() * 5)
+	{
+		printf("%s: metadata took more than 5 bits per key\n", name);
+		return;
 	}
 
-#if COUNT_ALLOCS
-	Log("\t%d", g_allocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
+	pairs.push_back(pairs[pairs.size() / 2]);
+	if (ht.Build(pairs.begin(), pairs.end()) || ht.Lookup(keys[0]))
+	{
+		printf("%s: build accepted a duplicate key\n", name);
+		return;
+	}
 
+	printf("%s: all perfect hash tests passed\n", name);
 }
 
-// Helper functions to fill a hash table with some keys
-template<typename K, typename V, template<typename, typename> class HT>
-void Fill(HT<K, V> & ht, int numKeys)
+// Batch hashing: each kernel must give exactly the hashes HashKey does, for
+// 4- and 8-byte keys, with counts that leave a ragged tail after the vectors
+template<typename Lanes>
+void HashBatchUnitTests(const std::vector<uint> & keys)
 {
-	// Create a list of guaranteed unique keys by random shuffling
-	std::vector<uint> keys(numKeys);
-	for (int i = 0; i < numKeys; ++i)
-		keys[i] = i;
-	XorshiftRNG rng = { 0xf002beef };
-	std::shuffle(keys.begin(), keys.end(), rng);
+	std::vector<uint64_t> wideKeys(keys.size());
+	for (size_t i = 0, iEnd = keys.size(); i < iEnd; ++i)
+		wideKeys[i] = (uint64_t(keys[iEnd - 1 - i]) << 32) ^ keys[i];
 
-	ht.Reserve(numKeys);
-	for (int i = 0; i < numKeys; ++i)
+	std::vector<uint32_t> hashes(keys.size());
+	for (size_t count = keys.size() - 37; count <= keys.size(); count += 9)
 	{
-		ht.Insert(keys[i], V());
+		HashKeysLanes<Lanes, 4>(&keys[0], count, &hashes[0], 0xffffffffU);
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (hashes[i] != HashKey(keys[i]))
+			{
+				printf("%s: 4-byte key hash doesn't match HashKey\n", Lanes::Name());
+				return;
+			}
+		}
+		HashKeysLanes<Lanes, 8>(&wideKeys[0], count, &hashes[0], 0x3ff);
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (hashes[i] != (HashKey(wideKeys[i]) & 0x3ff))
+			{
+				printf("%s: 8-byte key bucket index doesn't match HashKey\n", Lanes::Name());
+				return;
+			}
+		}
 	}
-}
 
-// Write lookup results to a dummy volatile to prevent compiler from optimizing them away
-volatile size_t dummy;
+	printf("%s: all batch hashing tests passed\n", Lanes::Name());
+}
 
-template<typename K, typename V>
-void LookupTiming(int numKeys, bool fail)
+// Batch lookup: fill a table with half the keys, then look all of them up in
+// one batch and check the hits and misses agree with Lookup
+template<typename HT, typename K>
+void LookupBatchUnitTests(
+	const std::vector<K> & keys,
+	const std::vector<uint> & values,
+	const char * name)
 {
-	static const int numLookups = 100000;
-	XorshiftRNG rng = { 0xfaf4f00d };
+	HT ht;
+	size_t numKeys = keys.size();
+	for (size_t i = 0; i < numKeys / 2; ++i)
+		ht.Insert(keys[i], values[i]);
+
+	std::vector<uint *> results(numKeys);
+	ht.LookupBatch(&keys[0], numKeys, &results[0]);
+	for (size_t i = 0; i < numKeys; ++i)
+	{
+		if (results[i] != ht.Lookup(keys[i]) || (i < numKeys / 2 && *results[i] != values[i]))
+		{
+			printf("%s: batch lookup doesn't match Lookup\n", name);
+			return;
+		}
+	}
+
+	printf("%s: all batch lookup tests passed\n", name);
+}
+
+// Batch insert: a batch into an empty table, then another after removing
+// some of the first, so it lands among tombstones; every key has to come
+// back through Lookup
+template<typename HT, typename K>
+void InsertBatchUnitTests(
+	const std::vector<K> & keys,
+	const std::vector<uint> & values,
+	const char * name)
+{
+	HT ht;
+	size_t numKeys = keys.size();
+	ht.InsertBatch(&keys[0], &values[0], numKeys / 2);
+	for (size_t i = 0; i < numKeys / 2; i += 2)
+		ht.Remove(keys[i]);
+	ht.InsertBatch(&keys[numKeys / 2], &values[numKeys / 2], numKeys - numKeys / 2);
+	if (ht.size != numKeys - (numKeys / 2 + 1) / 2)
+	{
+		printf("%s: batch insert size is wrong\n", name);
+		return;
+	}
+	for (size_t i = 0; i < numKeys; ++i)
+	{
+		const uint * pValue = ht.Lookup(keys[i]);
+		bool present = (i >= numKeys / 2 || i % 2 != 0);
+		if ((pValue != nullptr) != present || (pValue && *pValue != values[i]))
+		{
+			printf("%s: batch insert lookup failed\n", name);
+			return;
+		}
+	}
+
+	printf("%s: all batch insert tests passed\n", name);
+}
+
+// Hash quality: the tables' hash has to pass the quality checks for every key
+// distribution and bucket index method, and the checks have to catch a weak
+// hash (identity, on page-aligned keys)
+void HashQualityUnitTests()
+{
+	static const size_t numKeys = 1 << 14;
+	std::vector<uint32_t> keys;
+	HashQualityStats stats;
+	for (int dist = 0; dist < KEYDIST_Count; ++dist)
+	{
+		MakeKeyDist(KEYDIST(dist), numKeys, keys);
+		for (int bucketIndex = 0; bucketIndex < BUCKETINDEX_Count; ++bucketIndex)
+		{
+			MeasureHashQuality(HashPolicySpooky(), keys, BUCKETINDEX(bucketIndex), stats);
+			if (!HashQualityAcceptable(stats))
+			{
+				printf("Hash quality: Spooky failed on %s keys with %s\n", KeyDistName(KEYDIST(dist)), BucketIndexName(BUCKETINDEX(bucketIndex)));
+				return;
+			}
+		}
+	}
+	if (AvalancheWorstBias(HashPolicySpooky(), 10000) > s_hashQualityAvalancheBiasMax)
+	{
+		printf("Hash quality: Spooky failed avalanche\n");
+		return;
+	}
+
+	MakeKeyDist(KEYDIST_Stride4K, numKeys, keys);
+	MeasureHashQuality(HashPolicyIdentity(), keys, BUCKETINDEX_Mask, stats);
+	if (HashQualityAcceptable(stats) || AvalancheWorstBias(HashPolicyIdentity(), 1000) <= s_hashQualityAvalancheBiasMax)
+	{
+		printf("Hash quality: identity hash wasn't caught\n");
+		return;
+	}
+
+	printf("Hash quality: all hash quality tests passed\n");
+}
+
+// Stats: fill a table and remove some of the keys, then check GetStats counts
+// what's left and its numbers are consistent with each other
+template<typename HT>
+void StatsUnitTests(
+	int numKeys,
+	const std::vector<uint> & keys,
+	const std::vector<uint> & values,
+	bool chained,
+	const char * name)
+{
+	HT ht;
+	HashTableStats stats = ht.GetStats();
+	if (stats.size != 0 || stats.maxProbeHit != 0 || stats.tombstones != 0)
+	{
+		printf("%s: stats of an empty table aren't empty\n", name);
+		return;
+	}
+
+	for (int i = 0; i < numKeys; ++i)
+		ht.Insert(keys[i], values[i]);
+	for (int i = 0; i < numKeys / 3; ++i)
+		ht.Remove(keys[i]);
+
+	stats = ht.GetStats();
+	size_t chains = 0, clusters = 0;
+	for (int i = 0; i < s_statsHistogramLength; ++i)
+	{
+		chains += stats.chainHistogram[i];
+		clusters += stats.clusterHistogram[i];
+	}
+	if (stats.size != size_t(numKeys - numKeys / 3) ||
+		stats.loadFactor != float(stats.size) / float(stats.bucketCount))
+	{
+		printf("%s: stats have the wrong size\n", name);
+		return;
+	}
+	if (stats.avgProbeHit < 1.0f || stats.avgProbeHit > float(stats.maxProbeHit) ||
+		stats.avgProbeMiss > float(stats.maxProbeMiss))
+	{
+		printf("%s: stats probe lengths are inconsistent\n", name);
+		return;
+	}
+	if (chained ? (chains != stats.bucketCount || clusters != 0 || stats.tombstones != 0) :
+				  (chains != 0 || clusters == 0 || stats.tombstones == 0))
+	{
+		printf("%s: stats histograms are inconsistent\n", name);
+		return;
+	}
+
+	printf("%s: all stats tests passed\n", name);
+}
+
+// Churn: remove and insert keys many times over at a steady size, so Insert
+// keeps clearing out tombstones in place; then check the table still holds
+// exactly the keys it should, and never grew
+template<typename HT, typename K>
+void ChurnUnitTests(
+	int numKeys,
+	const std::vector<K> & keys,
+	const std::vector<uint> & values,
+	const char * name)
+{
+	HT ht;
+	int numLive = numKeys / 2;
+	for (int i = 0; i < numLive; ++i)
+		ht.Insert(keys[i], values[i]);
+	size_t bucketCount = ht.GetStats().bucketCount;
+
+	// Keys [iFirst, iFirst + numLive) mod numKeys are in the table
+	int iFirst = 0;
+	for (int cycle = 0; cycle < numKeys * 20; ++cycle)
+	{
+		ht.Remove(keys[iFirst]);
+		int iNew = (iFirst + numLive) % numKeys;
+		ht.Insert(keys[iNew], values[iNew]);
+		iFirst = (iFirst + 1) % numKeys;
+	}
+
+	HashTableStats stats = ht.GetStats();
+	if (stats.bucketCount != bucketCount || stats.size != size_t(numLive) ||
+		stats.tombstones != size_t(ht.tombstones) ||
+		(stats.size + stats.tombstones) * 4 > stats.bucketCount * 3)
+	{
+		printf("%s: churn left the wrong bucket, key or tombstone count\n", name);
+		return;
+	}
+
+	ht.RehashInPlace();
+	stats = ht.GetStats();
+	if (stats.bucketCount != bucketCount || stats.size != size_t(numLive) || stats.tombstones != 0 || ht.tombstones != 0)
+	{
+		printf("%s: RehashInPlace left tombstones behind\n", name);
+		return;
+	}
+
+	for (int i = 0; i < numKeys; ++i)
+	{
+		bool live = ((i - iFirst + numKeys) % numKeys) < numLive;
+		uint * pValue = ht.Lookup(keys[i]);
+		if (live ? (!pValue || *pValue != values[i]) : (pValue != nullptr))
+		{
+			printf("%s: churn lost or kept the wrong keys\n", name);
+			return;
+		}
+	}
+
+	printf("%s: all churn tests passed\n", name);
+}
+
+// Arena churn: the same remove/insert cycles as ChurnUnitTests, with every
+// key long enough to spill, mustn't leave the arena growing without bound
+template<typename HT>
+void ArenaChurnUnitTests(int numKeys, const char * name)
+{
+	std::vector<std::string> keys(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+	{
+		char buf[64];
+		snprintf(buf, sizeof(buf), "spilled key %026d", i);
+		keys[i] = buf;
+	}
+
+	HT ht;
+	int numLive = numKeys / 2;
+	for (int i = 0; i < numLive; ++i)
+		ht.Insert(keys[i], uint(i));
+	size_t liveBytes = size_t(numLive) * keys[0].size();
+
+	int iFirst = 0;
+	size_t arenaMax = 0;
+	for (int cycle = 0; cycle < numKeys * 20; ++cycle)
+	{
+		ht.Remove(keys[iFirst]);
+		int iNew = (iFirst + numLive) % numKeys;
+		ht.Insert(keys[iNew], uint(iNew));
+		iFirst = (iFirst + 1) % numKeys;
+		arenaMax = std::max(arenaMax, ht.arena.size());
+	}
+	if (arenaMax > liveBytes * 2 + ht.buckets.size() + keys[0].size())
+	{
+		printf("%s: churn grew the arena to %d bytes for %d live\n", name, int(arenaMax), int(liveBytes));
+		return;
+	}
+
+	for (int i = 0; i < numKeys; ++i)
+	{
+		bool live = ((i - iFirst + numKeys) % numKeys) < numLive;
+		uint * pValue = ht.Lookup(keys[i]);
+		if (live ? (!pValue || *pValue != uint(i)) : (pValue != nullptr))
+		{
+			printf("%s: arena churn lost or kept the wrong keys\n", name);
+			return;
+		}
+	}
+
+	printf("%s: all arena churn tests passed\n", name);
+}
+
+// Shrinking: remove most of the keys, then check ShrinkToFit (and, on another
+// table, autoShrink) gives back buckets without losing any keys
+template<typename HT, typename K>
+void ShrinkUnitTests(
+	int numKeys,
+	const std::vector<K> & keys,
+	const std::vector<uint> & values,
+	const char * name)
+{
+	int numKept = numKeys / 16;
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		bool autoShrink = (pass == 1);
+		HT ht;
+		ht.autoShrink = autoShrink;
+		for (int i = 0; i < numKeys; ++i)
+			ht.Insert(keys[i], values[i]);
+		size_t bucketCountFull = ht.GetStats().bucketCount;
+
+		for (int i = numKept; i < numKeys; ++i)
+			ht.Remove(keys[i]);
+		if (!autoShrink)
+			ht.ShrinkToFit();
+
+		HashTableStats stats = ht.GetStats();
+		// (after an automatic shrink, the removes since can leave tombstones)
+		if (stats.size != size_t(numKept) || (!autoShrink && stats.tombstones != 0) ||
+			stats.bucketCount * 4 > bucketCountFull)
+		{
+			printf("%s: %s didn't shrink the table\n", name, autoShrink ? "autoShrink" : "ShrinkToFit");
+			return;
+		}
+
+		for (int i = 0; i < numKeys; ++i)
+		{
+			uint * pValue = ht.Lookup(keys[i]);
+			if ((i < numKept) ? (!pValue || *pValue != values[i]) : (pValue != nullptr))
+			{
+				printf("%s: shrinking lost or kept the wrong keys\n", name);
+				return;
+			}
+		}
+
+		// And it has to grow back as normal
+		for (int i = numKept; i < numKeys; ++i)
+			ht.Insert(keys[i], values[i]);
+		for (int i = 0; i < numKeys; ++i)
+		{
+			uint * pValue = ht.Lookup(keys[i]);
+			if (!pValue || *pValue != values[i])
+			{
+				printf("%s: table lost keys growing back after a shrink\n", name);
+				return;
+			}
+		}
+	}
+
+	printf("%s: all shrink tests passed\n", name);
+}
+
+// The keys OSHashTable reserves as markers still have to work as keys, kept
+// in their side slots, alongside the keys in the buckets
+template<typename HT>
+void SentinelKeyUnitTests(const char * name)
+{
+	static const uint s_keys[] = { 0, ~0U, 1, 2, 3 };
+	HT ht;
+	for (uint i = 0; i < 5; ++i)
+		ht.Insert(s_keys[i], i + 10);
+	for (uint i = 0; i < 5; ++i)
+	{
+		uint * pValue = ht.Lookup(s_keys[i]);
+		if (!pValue || *pValue != i + 10)
+		{
+			printf("%s: lookup of a sentinel or ordinary key failed\n", name);
+			return;
+		}
+	}
+	if (ht.size != 5 || ht.GetStats().size != 5)
+	{
+		printf("%s: sentinel keys weren't counted\n", name);
+		return;
+	}
+	if (ht.FindOrInsert(~0U).second || !ht.Remove(0U) || ht.Remove(0U) || ht.Lookup(0U))
+	{
+		printf("%s: find-or-insert or remove of a sentinel key failed\n", name);
+		return;
+	}
+	// A removed bucket mustn't read as the removed-marker key
+	ht.Remove(2U);
+	if (!ht.Lookup(~0U) || ht.Lookup(2U) || ht.size != 3)
+	{
+		printf("%s: removing a key disturbed the sentinel keys\n", name);
+		return;
+	}
+	ht.Reserve(1000);
+	if (!ht.Lookup(~0U) || !ht.Lookup(1U) || !ht.Lookup(3U) || ht.size != 3)
+	{
+		printf("%s: rehash lost a key\n", name);
+		return;
+	}
+
+	printf("%s: all sentinel key tests passed\n", name);
+}
+
+// With IndirectValues, the value array holds one value per key, each with
+// the slot of the key that owns it; without, it stays empty
+template<typename K, typename V, typename A>
+bool ChunkedValuesPacked(const F14HashTable<K, V, true, A> & ht)
+{
+	const int slots = F14HashTable<K, V, true, A>::s_chunkSlots;
+	if (ht.values.size() != ht.size || ht.valueSlots.size() != ht.size)
+		return false;
+	for (size_t i = 0, iEnd = ht.valueSlots.size(); i < iEnd; ++i)
+	{
+		size_t iSlot = ht.valueSlots[i];
+		const auto & chunk = ht.chunks[iSlot / slots];
+		if (chunk.tags[iSlot % slots] == 0 || chunk.items[iSlot % slots].iValue != i)
+			return false;
+	}
+	return true;
+}
+template<typename K, typename V, typename A>
+bool ChunkedValuesPacked(const F14HashTable<K, V, false, A> & ht)
+{
+	return ht.values.empty() && ht.valueSlots.empty();
+}
+
+// F14HashTable's bookkeeping, at the full 12-of-14 load where keys overflow
+// their home chunks: misses still miss, removing keys keeps the values
+// packed, and removing them all takes every overflow count back to 0
+template<typename HT>
+void ChunkedUnitTests(const char * name)
+{
+	HT ht;
+	uint numKeys = 0;
+	while (ht.size < ht.chunkCount * HT::s_chunkSlotsMax || ht.chunkCount < 64)
+	{
+		ht.Insert(numKeys, numKeys * 7);
+		++numKeys;
+	}
+
+	bool overflowed = false;
+	for (size_t i = 0; i < ht.chunkCount; ++i)
+		overflowed |= (ht.chunks[i].outboundOverflow != 0);
+	if (!overflowed)
+	{
+		printf("%s: a full table had no chunk overflow\n", name);
+		return;
+	}
+	for (uint i = 0; i < numKeys; ++i)
+	{
+		uint * pValue = ht.Lookup(i);
+		if (!pValue || *pValue != i * 7 || ht.Lookup(numKeys + i))
+		{
+			printf("%s: lookup in a full table failed\n", name);
+			return;
+		}
+	}
+
+	for (uint i = 0; i < numKeys; i += 2)
+		ht.Remove(i);
+	if (!ChunkedValuesPacked(ht))
+	{
+		printf("%s: values not packed after removes\n", name);
+		return;
+	}
+	for (uint i = 0; i < numKeys; ++i)
+	{
+		uint * pValue = ht.Lookup(i);
+		if ((i & 1) ? (!pValue || *pValue != i * 7) : (pValue != nullptr))
+		{
+			printf("%s: removes lost or kept the wrong keys\n", name);
+			return;
+		}
+	}
+
+	for (uint i = 1; i < numKeys; i += 2)
+		ht.Remove(i);
+	for (size_t i = 0; i < ht.chunkCount; ++i)
+	{
+		if (ht.chunks[i].outboundOverflow != 0)
+		{
+			printf("%s: overflow counts not back to 0 with the table empty\n", name);
+			return;
+		}
+	}
+	if (ht.size != 0 || !ChunkedValuesPacked(ht))
+	{
+		printf("%s: table not empty after removing every key\n", name);
+		return;
+	}
+
+	printf("%s: all chunk tests passed\n", name);
+}
+
+// Linear hashing grows by one bucket per key past one per bucket, never more,
+// and every key stays findable through the splits and across the round where
+// every bucket has split and the next bit of the hash comes into use
+template<typename HT>
+void LinearHashUnitTests(
+	int numKeys,
+	const std::vector<uint> & keys,
+	const std::vector<uint> & values,
+	const char * name)
+{
+	HT ht;
+	for (int i = 0; i < numKeys; ++i)
+	{
+		ht.Insert(keys[i], values[i]);
+		if (ht.bucketCount != std::max(ht.size, size_t(16)) || ht.lowMask + 1 + ht.iSplit != ht.bucketCount)
+		{
+			printf("%s: bucket count out of step with the keys\n", name);
+			return;
+		}
+		// Check everything so far at each change of round
+		if (ht.iSplit == 0)
+		{
+			for (int j = 0; j <= i; ++j)
+			{
+				uint * pValue = ht.Lookup(keys[j]);
+				if (!pValue || *pValue != values[j])
+				{
+					printf("%s: a split lost a key\n", name);
+					return;
+				}
+			}
+		}
+	}
+
+	// Removes don't shrink it, and leave their elements to be reused
+	size_t bucketCount = ht.bucketCount;
+	size_t elemSegmentCount = ht.elemSegments.size();
+	for (int i = 0; i < numKeys / 2; ++i)
+		ht.Remove(keys[i]);
+	for (int i = 0; i < numKeys / 2; ++i)
+		ht.Insert(keys[i], values[i]);
+	if (ht.bucketCount != bucketCount || ht.elemSegments.size() != elemSegmentCount)
+	{
+		printf("%s: reinserting removed keys grew the table\n", name);
+		return;
+	}
+	for (int i = 0; i < numKeys; ++i)
+	{
+		uint * pValue = ht.Lookup(keys[i]);
+		if (!pValue || *pValue != values[i])
+		{
+			printf("%s: lookup after remove and reinsert failed\n", name);
+			return;
+		}
+	}
+
+	printf("%s: all linear hashing tests passed\n", name);
+}
+
+// Extendible hashing: enough keys for dozens of pages through a cache of
+// only a few, so splits and lookups keep evicting pages and reading them back
+template<typename HT>
+void ExtendibleHashUnitTests(int numKeys, const char * name)
+{
+	static const char * s_path = "extendible-test.tmp";
+
+	// An odd multiplier never maps two keys together
+	std::vector<uint> keys(numKeys * 2);
+	for (int i = 0; i < numKeys * 2; ++i)
+		keys[i] = uint(i) * 0x9e3779b1U;
+
+	HT ht;
+	if (!ht.Open(s_path, s_pageCacheFramesMin))
+	{
+		printf("%s: failed to open page file\n", name);
+		return;
+	}
+
+	bool ok = true;
+	for (int i = 0; i < numKeys; ++i)
+		ht.Insert(keys[i], uint(i));
+	if (ht.size != size_t(numKeys) || ht.directory.size() != (size_t(1) << ht.globalDepth) || ht.cache.writes == 0)
+	{
+		printf("%s: table didn't grow through the cache\n", name);
+		ok = false;
+	}
+	for (int i = 0; i < numKeys * 2 && ok; ++i)
+	{
+		const uint * pValue = ht.Lookup(keys[i]);
+		if ((pValue != nullptr) != (i < numKeys) || (pValue && *pValue != uint(i)))
+		{
+			printf("%s: lookup after evictions failed\n", name);
+			ok = false;
+		}
+	}
+
+	// Remove every third key, then put half of them back through the
+	// other insert paths
+	for (int i = 0; i < numKeys && ok; i += 3)
+		ok = ht.Remove(keys[i]) && !ht.Remove(keys[i]);
+	for (int i = 0; i < numKeys && ok; i += 6)
+		ok = ht.InsertOrAssign(keys[i], uint(i)) && !ht.Upsert(keys[i + 1], [](uint & value) { ++value; });
+	for (int i = 0; i < numKeys && ok; ++i)
+	{
+		bool present = (i % 3 != 0 || i % 6 == 0);
+		uint expected = (i % 6 == 1) ? uint(i + 1) : uint(i);
+		const uint * pValue = ht.Lookup(keys[i]);
+		ok = (pValue != nullptr) == present && (!pValue || *pValue == expected);
+	}
+	if (!ok)
+		printf("%s: lookup after remove and reinsert failed\n", name);
+
+	if (ok && (!ht.Flush() || ht.FindOrInsert(keys[1]).second || !ht.FindOrInsert(keys[numKeys]).second))
+	{
+		printf("%s: FindOrInsert or flush failed\n", name);
+		ok = false;
+	}
+
+	// Blind inserts of one key fill pages that no split can part, so they
+	// go on an overflow chain rather than splitting on every bit of the hash;
+	// each Remove then takes out one copy
+	const int copies = int(HT::s_pageSlotsFull) * 3;
+	const size_t sizeBefore = ht.size;
+	for (int i = 0; i < copies && ok; ++i)
+		ht.Insert(keys[numKeys + 1], uint(i));
+	if (ok && (ht.size != sizeBefore + copies || ht.globalDepth >= 24 || !ht.Lookup(keys[numKeys + 1]) || !ht.Lookup(keys[2])))
+	{
+		printf("%s: duplicate keys didn't go on an overflow chain\n", name);
+		ok = false;
+	}
+	bool removed = true;
+	for (int i = 0; i < copies && ok && removed; ++i)
+		removed = ht.Remove(keys[numKeys + 1]);
+	if (ok && (!removed || ht.Remove(keys[numKeys + 1]) || ht.Lookup(keys[numKeys + 1]) || ht.size != sizeBefore))
+	{
+		printf("%s: removing duplicate keys failed\n", name);
+		ok = false;
+	}
+
+	ht.Close();
+	remove(s_path);
+	if (ok)
+		printf("%s: all extendible hashing tests passed\n", name);
+}
+
+// Multimap: key i gets (i % 5) + 1 values, inserted a round at a time so runs
+// have to move, and each key's values must come back in insertion order.
+// Then the same through BulkBuild, into an empty table and on top of a full
+// one, whose runs should come out packed.
+template<typename HT, typename K>
+bool MultimapMatches(HT & ht, int numKeys, const std::vector<K> & keys, const std::vector<uint> & values, int removeEvery)
+{
+	for (int i = 0; i < numKeys; ++i)
+	{
+		bool present = (removeEvery == 0 || i % removeEvery != 0);
+		size_t count = present ? size_t(i % 5 + 1) : 0;
+		auto range = ht.EqualRange(keys[i]);
+		if (ht.Count(keys[i]) != count || size_t(range.second - range.first) != count)
+			return false;
+		if ((ht.Lookup(keys[i]) != nullptr) != present || (present && ht.Lookup(keys[i]) != range.first))
+			return false;
+		for (size_t j = 0; j < count; ++j)
+		{
+			if (range.first[j] != values[i] + uint(j))
+				return false;
+		}
+	}
+	return true;
+}
+
+template<typename HT, typename K>
+void MultimapUnitTests(
+	int numKeys,
+	const std::vector<K> & keys,
+	const std::vector<uint> & values,
+	const char * name)
+{
+	// The last key is never inserted
+	--numKeys;
+
+	HT ht;
+	size_t numValues = 0;
+	for (int round = 0; round < 5; ++round)
+	{
+		for (int i = 0; i < numKeys; ++i)
+		{
+			if (round <= i % 5)
+			{
+				ht.Insert(keys[i], values[i] + uint(round));
+				++numValues;
+			}
+		}
+	}
+	if (ht.keyCount != size_t(numKeys) || ht.size != numValues || !MultimapMatches(ht, numKeys, keys, values, 0))
+	{
+		printf("%s: insert lost or reordered values\n", name);
+		return;
+	}
+	if (ht.Lookup(keys[numKeys]) || ht.Count(keys[numKeys]) != 0 || ht.EqualRange(keys[numKeys]).first)
+	{
+		printf("%s: found a key never inserted\n", name);
+		return;
+	}
+
+	// Removing a key takes all its values and leaves holes, which Compact
+	// (on its own, or once they're half the array) packs out
+	for (int i = 0; i < numKeys; i += 3)
+	{
+		if (!ht.Remove(keys[i]) || ht.Remove(keys[i]))
+		{
+			printf("%s: remove failed\n", name);
+			return;
+		}
+	}
+	if (ht.holes * 2 > ht.values.size() || !MultimapMatches(ht, numKeys, keys, values, 3))
+	{
+		printf("%s: lookup after remove failed\n", name);
+		return;
+	}
+	ht.Compact();
+	if (ht.holes != 0 || ht.values.size() != ht.size || !MultimapMatches(ht, numKeys, keys, values, 3))
+	{
+		printf("%s: compact lost values or left holes\n", name);
+		return;
+	}
+	if (ht.GetStats().size != ht.keyCount)
+	{
+		printf("%s: stats miscounted the keys\n", name);
+		return;
+	}
+
+	// Bulk build the same pairs, shuffled; each key's values keep their order
+	std::vector<std::pair<K, uint>> pairs;
+	for (int round = 0; round < 5; ++round)
+	{
+		for (int i = 0; i < numKeys; ++i)
+		{
+			if (round <= i % 5)
+				pairs.push_back(std::make_pair(keys[i], values[i] + uint(round)));
+		}
+	}
+	HT htBulk;
+	htBulk.BulkBuild(pairs.begin(), pairs.end());
+	if (htBulk.size != pairs.size() || htBulk.values.size() != pairs.size() || htBulk.holes != 0 ||
+		!MultimapMatches(htBulk, numKeys, keys, values, 0))
+	{
+		printf("%s: bulk build failed\n", name);
+		return;
+	}
+
+	// Again on top: every key's run is its old values then the new ones
+	htBulk.BulkBuild(pairs.begin(), pairs.end());
+	for (int i = 0; i < numKeys; ++i)
+	{
+		auto range = htBulk.EqualRange(keys[i]);
+		int count = i % 5 + 1;
+		bool ok = (range.second - range.first == count * 2);
+		for (int j = 0; j < count * 2 && ok; ++j)
+			ok = (range.first[j] == values[i] + uint(j % count));
+		if (!ok || htBulk.values.size() != htBulk.size)
+		{
+			printf("%s: bulk build on top of a table failed\n", name);
+			return;
+		}
+	}
+
+	htBulk.Reset();
+	if (htBulk.size != 0 || htBulk.Lookup(keys[0]))
+	{
+		printf("%s: reset failed\n", name);
+		return;
+	}
+
+	printf("%s: all multimap tests passed\n", name);
+}
+
+// Radix-partitioned table: enough keys to split it many times over, one at a
+// time and in batches, with every sub-table staying within its byte budget
+// and batch lookups agreeing with Lookup
+template<typename HT>
+void PartitionedUnitTests(int numKeys, const char * name)
+{
+	// An odd multiplier never maps two keys together; the second half of
+	// the list is never inserted
+	std::vector<uint> keys(numKeys * 2), values(numKeys);
+	for (int i = 0; i < numKeys * 2; ++i)
+		keys[i] = uint(i) * 0x9e3779b1U;
+	for (int i = 0; i < numKeys; ++i)
+		values[i] = uint(i) ^ 0x5a5a5a5aU;
+
+	HT ht;
+	for (int i = 0; i < numKeys / 2; ++i)
+		ht.Insert(keys[i], values[i]);
+	ht.InsertBatch(&keys[numKeys / 2], &values[numKeys / 2], numKeys - numKeys / 2);
+	if (ht.partitionBits == 0 || ht.subTables.size() != (size_t(1) << ht.partitionBits) || ht.size != size_t(numKeys))
+	{
+		printf("%s: table didn't split\n", name);
+		return;
+	}
+	for (const auto & subTable : ht.subTables)
+	{
+		size_t bytes = subTable.buckets.size() * (sizeof(subTable.buckets[0]) + sizeof(subTable.keyvals[0]));
+		if (bytes > HT::s_subTableBytesMax || subTable.size > ht.subTableSizeMax)
+		{
+			printf("%s: sub-table outgrew its budget\n", name);
+			return;
+		}
+	}
+
+	std::vector<uint *> results(numKeys * 2);
+	ht.LookupBatch(&keys[0], numKeys * 2, &results[0]);
+	for (int i = 0; i < numKeys * 2; ++i)
+	{
+		uint * pValue = ht.Lookup(keys[i]);
+		if (results[i] != pValue || (pValue != nullptr) != (i < numKeys) || (pValue && *pValue != values[i]))
+		{
+			printf("%s: lookup after split failed\n", name);
+			return;
+		}
+	}
+
+	// Remove every third key, then put half of them back
+	bool ok = true;
+	for (int i = 0; i < numKeys && ok; i += 3)
+		ok = ht.Remove(keys[i]) && !ht.Remove(keys[i]);
+	for (int i = 0; i < numKeys && ok; i += 6)
+		ok = ht.InsertOrAssign(keys[i], values[i]) && !ht.FindOrInsert(keys[i + 1]).second;
+	for (int i = 0; i < numKeys && ok; ++i)
+	{
+		bool present = (i % 3 != 0 || i % 6 == 0);
+		uint * pValue = ht.Lookup(keys[i]);
+		ok = (pValue != nullptr) == present && (!pValue || *pValue == values[i]);
+	}
+	if (!ok || ht.GetStats().size != ht.size)
+	{
+		printf("%s: lookup after remove and reinsert failed\n", name);
+		return;
+	}
+
+	// Presized, it never has to split
+	HT htReserved;
+	htReserved.Reserve(numKeys);
+	int partitionBits = htReserved.partitionBits;
+	for (int i = 0; i < numKeys; ++i)
+		htReserved.Insert(keys[i], values[i]);
+	if (partitionBits == 0 || htReserved.partitionBits != partitionBits)
+	{
+		printf("%s: reserve didn't presize the sub-tables\n", name);
+		return;
+	}
+
+	ht.Reset();
+	if (ht.size != 0 || ht.partitionBits != 0 || ht.Lookup(keys[1]))
+	{
+		printf("%s: reset failed\n", name);
+		return;
+	}
+
+	printf("%s: all partitioning tests passed\n", name);
+}
+
+// Bloom filter: no key added is ever missed, and keys never added mostly
+// are, both in a presized filter and in front of a table that grew from
+// empty and had keys removed and replaced
+void BloomFilterUnitTests(const char * name)
+{
+	static const int numKeys = 20000;
+
+	{
+		BlockedBloomFilter filter;
+		filter.Reset(numKeys);
+		for (int i = 0; i < numKeys; ++i)
+			filter.Insert(FilterHash(uint(i)));
+		int falsePositives = 0;
+		for (int i = 0; i < numKeys * 2; ++i)
+		{
+			bool present = filter.MayContain(FilterHash(uint(i)));
+			if (i < numKeys && !present)
+			{
+				printf("%s: missed a key it was given\n", name);
+				return;
+			}
+			falsePositives += (i >= numKeys && present);
+		}
+		// About 0.5%
+		if (falsePositives > numKeys / 100)
+		{
+			printf("%s: %d false positives in %d\n", name, falsePositives, numKeys);
+			return;
+		}
+	}
+
+	{
+		// Fill, remove half, put in as many new ones, and check the filter
+		// hasn't kept the removed ones past its rebuilds
+		FilteredHashTable<uint, uint, OLHashTable<uint, uint>> ht;
+		for (int i = 0; i < numKeys; ++i)
+			ht.Insert(uint(i), uint(i));
+		for (int i = 0; i < numKeys; i += 2)
+			ht.Remove(uint(i));
+		for (int i = numKeys; i < numKeys * 3 / 2; ++i)
+			ht.FindOrInsert(uint(i));
+		int falsePositives = 0;
+		for (int i = 0; i < numKeys * 2; ++i)
+		{
+			bool present = ht.filter.MayContain(FilterHash(uint(i)));
+			bool expected = (i % 2 == 1 && i < numKeys) || (i >= numKeys && i < numKeys * 3 / 2);
+			if (expected && !present)
+			{
+				printf("%s: table's filter missed a key\n", name);
+				return;
+			}
+			falsePositives += (!expected && present);
+		}
+		if (falsePositives > numKeys / 100 || ht.filter.size > ht.filter.capacity)
+		{
+			printf("%s: %d false positives in %d after growing and removes\n", name, falsePositives, numKeys);
+			return;
+		}
+	}
+
+	printf("%s: all Bloom filter tests passed\n", name);
+}
+
+// Cuckoo and quotient filters: no false negatives, a false-positive rate
+// near what the fingerprint size promises, removes that take out only what
+// they're asked to, and a merge of two halves that has both
+template<typename FT>
+void FingerprintFilterUnitTests(float maxFalsePositiveRate, const char * name)
+{
+	static const int numKeys = 20000;
+
+	FT filter(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+	{
+		if (!filter.Insert(uint(i)))
+		{
+			printf("%s: filled up before its capacity\n", name);
+			return;
+		}
+	}
+	int falsePositives = 0;
+	for (int i = 0; i < numKeys * 2; ++i)
+	{
+		bool present = filter.MayContain(uint(i));
+		if (i < numKeys && !present)
+		{
+			printf("%s: missed a key it was given\n", name);
+			return;
+		}
+		falsePositives += (i >= numKeys && present);
+	}
+	if (falsePositives > int(maxFalsePositiveRate * numKeys))
+	{
+		printf("%s: %d false positives in %d\n", name, falsePositives, numKeys);
+		return;
+	}
+
+	// Remove every other key; the rest stay, most of the removed go
+	for (int i = 0; i < numKeys; i += 2)
+	{
+		if (!filter.Remove(uint(i)))
+		{
+			printf("%s: failed to remove a key it was given\n", name);
+			return;
+		}
+	}
+	int removedStillThere = 0;
+	for (int i = 0; i < numKeys; ++i)
+	{
+		bool present = filter.MayContain(uint(i));
+		if (i % 2 && !present)
+		{
+			printf("%s: remove took out another key\n", name);
+			return;
+		}
+		removedStillThere += (i % 2 == 0 && present);
+	}
+	if (filter.size != size_t(numKeys / 2) || removedStillThere > int(maxFalsePositiveRate * numKeys))
+	{
+		printf("%s: remove left too much behind\n", name);
+		return;
+	}
+
+	// Put the removed half in another filter, and merge the two
+	FT other(numKeys);
+	for (int i = 0; i < numKeys; i += 2)
+		other.Insert(uint(i));
+	if (!filter.Merge(other) || filter.size != size_t(numKeys))
+	{
+		printf("%s: merge failed\n", name);
+		return;
+	}
+	for (int i = 0; i < numKeys; ++i)
+	{
+		if (!filter.MayContain(uint(i)))
+		{
+			printf("%s: merged filter missed a key\n", name);
+			return;
+		}
+	}
+
+	printf("%s: all filter tests passed\n", name);
+}
+
+// A quotient filter counts the copies of a key it's given
+void CountingFilterUnitTests(const char * name)
+{
+	CountingQuotientFilter<uint16_t> filter(1000);
+	for (int i = 0; i < 500; ++i)
+	{
+		for (int j = 0; j <= i % 4; ++j)
+			filter.Insert(uint(i));
+	}
+	for (int i = 0; i < 500; ++i)
+	{
+		if (filter.Count(uint(i)) != size_t(i % 4 + 1))
+		{
+			printf("%s: wrong count for a key\n", name);
+			return;
+		}
+	}
+	for (int i = 0; i < 500; ++i)
+		filter.Remove(uint(i));
+	for (int i = 0; i < 500; ++i)
+	{
+		if (filter.Count(uint(i)) != size_t(i % 4))
+		{
+			printf("%s: wrong count after a remove\n", name);
+			return;
+		}
+	}
+	printf("%s: all counting tests passed\n", name);
+}
+
+FILE * OpenFile(const char * path, const char * mode)
+{
+#ifdef _MSC_VER
+	FILE * pFile = nullptr;
+	fopen_s(&pFile, path, mode);
+	return pFile;
+#else
+	return fopen(path, mode);
+#endif
+}
+
+// Snapshots: save a table that has had some keys removed, map it back and
+// check it gives the same answers, then check a damaged file is rejected
+template<typename HT, typename ST>
+void SnapshotUnitTests(
+	int numKeys,
+	const std::vector<uint> & keys,
+	const std::vector<uint> & values,
+	const char * name)
+{
+	static const char * s_path = "snapshot-test.tmp";
+
+	{
+		HT ht;
+		for (int i = 0; i < numKeys; ++i)
+			ht.Insert(keys[i], values[i]);
+		for (int i = 0; i < numKeys; i += 4)
+			ht.Remove(keys[i]);
+		if (!ht.SaveSnapshot(s_path))
+		{
+			printf("%s: failed to save snapshot\n", name);
+			return;
+		}
+	}
+
+	{
+		ST st;
+		if (!st.Open(s_path, true))
+		{
+			printf("%s: failed to open snapshot\n", name);
+			remove(s_path);
+			return;
+		}
+		if (st.size != size_t(numKeys - (numKeys + 3) / 4))
+		{
+			printf("%s: snapshot has the wrong size\n", name);
+			remove(s_path);
+			return;
+		}
+		for (int i = 0; i < numKeys; ++i)
+		{
+			const uint * pValue = st.Lookup(keys[i]);
+			bool expected = (i % 4 != 0);
+			if ((pValue != nullptr) != expected || (pValue && *pValue != values[i]))
+			{
+				printf("%s: snapshot lookup doesn't match the table\n", name);
+				remove(s_path);
+				return;
+			}
+		}
+	}
+
+	// Flip a bit in the first array: only the verified open notices
+	if (FILE * pFile = OpenFile(s_path, "r+b"))
+	{
+		fseek(pFile, long(s_snapshotAlignment), SEEK_SET);
+		int byte = fgetc(pFile);
+		fseek(pFile, long(s_snapshotAlignment), SEEK_SET);
+		fputc(byte ^ 1, pFile);
+		fclose(pFile);
+	}
+	{
+		ST st;
+		if (!st.Open(s_path, false) || st.Open(s_path, true))
+		{
+			printf("%s: checksum didn't catch a damaged snapshot\n", name);
+			remove(s_path);
+			return;
+		}
+	}
+
+	remove(s_path);
+	printf("%s: all snapshot tests passed\n", name);
+}
+
+// Builds numKeys unique strings with lengths drawn from the given distribution;
+// the first 8 characters spell out the index in hex, to guarantee uniqueness
+void MakeStringKeys(int numKeys, const StringKeyLengths & lengths, uint seed, std::vector<std::string> & keys)
+{
+	static const char s_hexDigits[] = "0123456789abcdef";
+	assert(lengths.minLength >= 8 && lengths.maxLength >= lengths.minLength);
+	assert(lengths.longPercent == 0 || lengths.longMaxLength > lengths.maxLength);
+	XorshiftRNG rng = { seed };
+	keys.resize(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+	{
+		std::string & key = keys[i];
+		if (int(rng() % 100) < lengths.longPercent)
+			key.resize(lengths.maxLength + 1 + rng() % (lengths.longMaxLength - lengths.maxLength));
+		else
+			key.resize(lengths.minLength + rng() % (lengths.maxLength - lengths.minLength + 1));
+		for (int j = 0; j < 8; ++j)
+			key[j] = s_hexDigits[(uint(i) >> (4 * j)) & 0xf];
+		for (size_t j = 8, jEnd = key.size(); j < jEnd; ++j)
+			key[j] = char('a' + rng() % 26);
+	}
+}
+
+void UnitTests()
+{
+	static const int numKeys = 1000;
+
+	// Create a list of guaranteed unique keys by random shuffling
+	std::vector<uint> keys(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		keys[i] = i;
+	XorshiftRNG rng = { 0xbeeff00d };
+	std::shuffle(keys.begin(), keys.end(), rng);
+
+	// Create a list of random values
+	std::vector<uint> values(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		values[i] = rng();
+
+	// Run tests
+	UnitTests<UMHashTable<uint, uint>>(numKeys, keys, values, "unordered_map");
+	UnitTests<C0HashTable<uint, uint>>(numKeys, keys, values, "C0HashTable");
+	UnitTests<C1HashTable<uint, uint>>(numKeys, keys, values, "C1HashTable");
+	UnitTests<LHHashTable<uint, uint>>(numKeys, keys, values, "LHHashTable");
+	UnitTests<OLHashTable<uint, uint>>(numKeys, keys, values, "OLHashTable");
+	UnitTests<OSHashTable<uint, uint>>(numKeys, keys, values, "OSHashTable");
+	UnitTests<OQHashTable<uint, uint>>(numKeys, keys, values, "OQHashTable");
+	UnitTests<F14HashTable<uint, uint>>(numKeys, keys, values, "F14HashTable");
+	UnitTests<F14HashTable<uint, uint, true>>(numKeys, keys, values, "F14HashTable (indirect)");
+	UnitTests<DO1HashTable<uint, uint>>(numKeys, keys, values, "DO1HashTable");
+	UnitTests<RPHashTable<uint, uint>>(numKeys, keys, values, "RPHashTable");
+	UnitTests<DO2HashTable<uint, uint>>(numKeys, keys, values, "DO2HashTable");
+
+	UnitTests<D0HashTable<uint, uint>>(numKeys, keys, values, "D0HashTable");
+	UnitTests<D1HashTable<uint, uint>>(numKeys, keys, values, "D1HashTable");
+	UnitTests<FilteredHashTable<uint, uint, C0HashTable<uint, uint>>>(numKeys, keys, values, "C0HashTable (filtered)");
+	UnitTests<FilteredHashTable<uint, uint, OLHashTable<uint, uint>>>(numKeys, keys, values, "OLHashTable (filtered)");
+	BloomFilterUnitTests("BlockedBloomFilter");
+	FingerprintFilterUnitTests<CuckooFilter<uint8_t>>(0.04f, "CuckooFilter<8>");
+	FingerprintFilterUnitTests<CuckooFilter<uint16_t>>(0.001f, "CuckooFilter<16>");
+	FingerprintFilterUnitTests<CountingQuotientFilter<uint8_t>>(0.01f, "CountingQuotientFilter<8>");
+	FingerprintFilterUnitTests<CountingQuotientFilter<uint16_t>>(0.001f, "CountingQuotientFilter<16>");
+	CountingFilterUnitTests("CountingQuotientFilter<16>");
+
+	// Same again with the tables' storage in an arena and in a pool; both get
+	// reused across tests, so a table that writes through a stale pointer into
+	// memory a previous table gave back will show up here
+	Arena arena;
+	ArenaAllocator<char> arenaAlloc(&arena);
+	UnitTests<UMHashTable<uint, uint, ArenaAllocator<char>>>(numKeys, keys, values, "unordered_map (arena)", arenaAlloc);
+	UnitTests<C1HashTable<uint, uint, ArenaAllocator<char>>>(numKeys, keys, values, "C1HashTable (arena)", arenaAlloc);
+	UnitTests<DO2HashTable<uint, uint, ArenaAllocator<char>>>(numKeys, keys, values, "DO2HashTable (arena)", arenaAlloc);
+	UnitTests<D0HashTable<uint, uint, ArenaAllocator<char>>>(numKeys, keys, values, "D0HashTable (arena)", arenaAlloc);
+	arena.Reset();
+	UnitTests<OLHashTable<uint, uint, ArenaAllocator<char>>>(numKeys, keys, values, "OLHashTable (arena, after Reset)", arenaAlloc);
+
+	SizeClassPool pool;
+	PoolAllocator<char> poolAlloc(&pool);
+	UnitTests<C0HashTable<uint, uint, PoolAllocator<char>>>(numKeys, keys, values, "C0HashTable (pool)", poolAlloc);
+	UnitTests<LHHashTable<uint, uint, PoolAllocator<char>>>(numKeys, keys, values, "LHHashTable (pool)", poolAlloc);
+	UnitTests<OQHashTable<uint, uint, PoolAllocator<char>>>(numKeys, keys, values, "OQHashTable (pool)", poolAlloc);
+	UnitTests<DO1HashTable<uint, uint, PoolAllocator<char>>>(numKeys, keys, values, "DO1HashTable (pool)", poolAlloc);
+	UnitTests<D1HashTable<uint, uint, PoolAllocator<char>>>(numKeys, keys, values, "D1HashTable (pool)", poolAlloc);
+	UnitTests<F14HashTable<uint, uint, true, PoolAllocator<char>>>(numKeys, keys, values, "F14HashTable (indirect, pool)", poolAlloc);
+
+	std::vector<std::string> stringKeys;
+	static const StringKeyLengths s_testStringKeys = { 8, 16, 25, 40 };
+	MakeStringKeys(numKeys, s_testStringKeys, 0xdeadf00d, stringKeys);
+	StringUnitTests<UMHashTable<std::string, uint>>(stringKeys, values, "unordered_map");
+	StringUnitTests<C0HashTable<std::string, uint>>(stringKeys, values, "C0HashTable");
+	StringUnitTests<C1HashTable<std::string, uint>>(stringKeys, values, "C1HashTable");
+	StringUnitTests<LHHashTable<std::string, uint>>(stringKeys, values, "LHHashTable");
+	StringUnitTests<OLHashTable<std::string, uint>>(stringKeys, values, "OLHashTable");
+	StringUnitTests<OQHashTable<std::string, uint>>(stringKeys, values, "OQHashTable");
+	StringUnitTests<DO1HashTable<std::string, uint>>(stringKeys, values, "DO1HashTable");
+	StringUnitTests<RPHashTable<std::string, uint>>(stringKeys, values, "RPHashTable");
+	StringUnitTests<DO2HashTable<std::string, uint>>(stringKeys, values, "DO2HashTable");
+	StringUnitTests<D0HashTable<std::string, uint>>(stringKeys, values, "D0HashTable");
+	StringUnitTests<D1HashTable<std::string, uint>>(stringKeys, values, "D1HashTable");
+	StringUnitTests<DO1StrHashTable<uint>>(stringKeys, values, "DO1StrHashTable");
+
+	BulkBuildUnitTests<OLHashTable<uint, uint>>(numKeys, keys, values, "OLHashTable");
+	BulkBuildUnitTests<DO1HashTable<uint, uint>>(numKeys, keys, values, "DO1HashTable");
+	BulkBuildUnitTests<DO2HashTable<uint, uint>>(numKeys, keys, values, "DO2HashTable");
+	BulkBuildUnitTests<D0HashTable<uint, uint>>(numKeys, keys, values, "D0HashTable");
+
+	// An odd thread count, so the regions aren't powers of two either
+	ParallelRehashUnitTests<OLHashTable<uint, uint>>(3, "OLHashTable");
+	ParallelRehashUnitTests<DO1HashTable<uint, uint>>(3, "DO1HashTable");
+	ParallelRehashUnitTests<DO2HashTable<uint, uint>>(3, "DO2HashTable");
+	ParallelRehashUnitTests<D0HashTable<uint, uint>>(3, "D0HashTable");
+	ParallelRehashUnitTests<D1HashTable<uint, uint>>(3, "D1HashTable");
+	ParallelBulkBuildUnitTests<OLHashTable<uint, uint>>(3, "OLHashTable");
+	ParallelBulkBuildUnitTests<DO1HashTable<uint, uint>>(3, "DO1HashTable");
+	ParallelBulkBuildUnitTests<DO2HashTable<uint, uint>>(3, "DO2HashTable");
+
+	FixedUnitTests<FixedHashTable<uint, uint, 5>, 5>(keys, values, "FixedHashTable<5>");
+	FixedUnitTests<FixedHashTable<uint, uint, 16>, 16>(keys, values, "FixedHashTable<16>");
+	FixedUnitTests<FixedHashTable<uint, uint, 16, false>, 16>(keys, values, "FixedHashTable<16> (hashed)");
+	FixedUnitTests<FixedHashTable<uint, uint, 64>, 64>(keys, values, "FixedHashTable<64>");
+	FixedUnitTests<FixedHashTable<uint, uint, 96>, 96>(keys, values, "FixedHashTable<96>");
+
+	{
+		std::vector<uint> missingKeys(numKeys);
+		for (int i = 0; i < numKeys; ++i)
+			missingKeys[i] = uint(numKeys + i);
+		PerfectHashUnitTests(keys, missingKeys, values, "PerfectHashTable");
+		// Each string key starts with its index, so the second half of a list
+		// twice as long can't overlap the set
+		std::vector<std::string> missingStringKeys;
+		MakeStringKeys(numKeys * 2, s_testStringKeys, 0xcafef00d, missingStringKeys);
+		missingStringKeys.erase(missingStringKeys.begin(), missingStringKeys.begin() + numKeys);
+		PerfectHashUnitTests(stringKeys, missingStringKeys, values, "PerfectHashTable (string keys)");
+	}
+
+	StatsUnitTests<UMHashTable<uint, uint>>(numKeys, keys, values, true, "unordered_map");
+	StatsUnitTests<C0HashTable<uint, uint>>(numKeys, keys, values, true, "C0HashTable");
+	StatsUnitTests<C1HashTable<uint, uint>>(numKeys, keys, values, true, "C1HashTable");
+	StatsUnitTests<LHHashTable<uint, uint>>(numKeys, keys, values, true, "LHHashTable");
+	StatsUnitTests<OLHashTable<uint, uint>>(numKeys, keys, values, false, "OLHashTable");
+	StatsUnitTests<OQHashTable<uint, uint>>(numKeys, keys, values, false, "OQHashTable");
+	StatsUnitTests<DO1HashTable<uint, uint>>(numKeys, keys, values, false, "DO1HashTable");
+	StatsUnitTests<DO2HashTable<uint, uint>>(numKeys, keys, values, false, "DO2HashTable");
+	StatsUnitTests<D0HashTable<uint, uint>>(numKeys, keys, values, true, "D0HashTable");
+	StatsUnitTests<D1HashTable<uint, uint>>(numKeys, keys, values, false, "D1HashTable");
+
+	ChurnUnitTests<OLHashTable<uint, uint>>(numKeys, keys, values, "OLHashTable");
+	ChurnUnitTests<OSHashTable<uint, uint>>(numKeys, keys, values, "OSHashTable");
+	ChurnUnitTests<OQHashTable<uint, uint>>(numKeys, keys, values, "OQHashTable");
+	ChurnUnitTests<DO1HashTable<uint, uint>>(numKeys, keys, values, "DO1HashTable");
+	ChurnUnitTests<DO2HashTable<uint, uint>>(numKeys, keys, values, "DO2HashTable");
+	ChurnUnitTests<D1HashTable<uint, uint>>(numKeys, keys, values, "D1HashTable");
+	ChurnUnitTests<DO1StrHashTable<uint>>(numKeys, stringKeys, values, "DO1StrHashTable");
+	ArenaChurnUnitTests<DO1StrHashTable<uint>>(numKeys, "DO1StrHashTable");
+
+	ShrinkUnitTests<UMHashTable<uint, uint>>(numKeys, keys, values, "unordered_map");
+	ShrinkUnitTests<C0HashTable<uint, uint>>(numKeys, keys, values, "C0HashTable");
+	ShrinkUnitTests<C1HashTable<uint, uint>>(numKeys, keys, values, "C1HashTable");
+	ShrinkUnitTests<LHHashTable<uint, uint>>(numKeys, keys, values, "LHHashTable");
+	LinearHashUnitTests<LHHashTable<uint, uint>>(numKeys, keys, values, "LHHashTable");
+	ShrinkUnitTests<OLHashTable<uint, uint>>(numKeys, keys, values, "OLHashTable");
+	ShrinkUnitTests<OSHashTable<uint, uint>>(numKeys, keys, values, "OSHashTable");
+	SentinelKeyUnitTests<OSHashTable<uint, uint>>("OSHashTable");
+	ShrinkUnitTests<OQHashTable<uint, uint>>(numKeys, keys, values, "OQHashTable");
+	ShrinkUnitTests<F14HashTable<uint, uint>>(numKeys, keys, values, "F14HashTable");
+	ShrinkUnitTests<F14HashTable<uint, uint, true>>(numKeys, keys, values, "F14HashTable (indirect)");
+	ChunkedUnitTests<F14HashTable<uint, uint>>("F14HashTable");
+	ChunkedUnitTests<F14HashTable<uint, uint, true>>("F14HashTable (indirect)");
+	ShrinkUnitTests<DO1HashTable<uint, uint>>(numKeys, keys, values, "DO1HashTable");
+	ShrinkUnitTests<DO2HashTable<uint, uint>>(numKeys, keys, values, "DO2HashTable");
+	ShrinkUnitTests<D0HashTable<uint, uint>>(numKeys, keys, values, "D0HashTable");
+	ShrinkUnitTests<D1HashTable<uint, uint>>(numKeys, keys, values, "D1HashTable");
+	ShrinkUnitTests<DO1StrHashTable<uint>>(numKeys, stringKeys, values, "DO1StrHashTable");
+
+	HashQualityUnitTests();
+
+	HashBatchUnitTests<HashLanesScalar>(keys);
+#if defined(__AVX2__)
+	HashBatchUnitTests<HashLanesAVX2>(keys);
+#endif
+#if defined(__AVX512F__)
+	HashBatchUnitTests<HashLanesAVX512>(keys);
+#endif
+	LookupBatchUnitTests<OLHashTable<uint, uint>>(keys, values, "OLHashTable");
+	LookupBatchUnitTests<DO1HashTable<uint, uint>>(keys, values, "DO1HashTable");
+	LookupBatchUnitTests<DO2HashTable<uint, uint>>(keys, values, "DO2HashTable");
+	LookupBatchUnitTests<RPHashTable<uint, uint>>(keys, values, "RPHashTable");
+	LookupBatchUnitTests<DO2HashTable<std::string, uint>>(stringKeys, values, "DO2HashTable (string keys)");
+	InsertBatchUnitTests<DO1HashTable<uint, uint>>(keys, values, "DO1HashTable");
+	InsertBatchUnitTests<RPHashTable<uint, uint>>(keys, values, "RPHashTable");
+
+	SnapshotUnitTests<DO2HashTable<uint, uint>, DO2SnapshotTable<uint, uint>>(numKeys, keys, values, "DO2SnapshotTable");
+	SnapshotUnitTests<D0HashTable<uint, uint>, D0SnapshotTable<uint, uint>>(numKeys, keys, values, "D0SnapshotTable");
+	ExtendibleHashUnitTests<EHHashTable<uint, uint>>(numKeys * 20, "EHHashTable");
+	MultimapUnitTests<MMHashTable<uint, uint>>(numKeys, keys, values, "MMHashTable");
+	MultimapUnitTests<MMHashTable<std::string, uint>>(numKeys, stringKeys, values, "MMHashTable (string keys)");
+	PartitionedUnitTests<RPHashTable<uint, uint>>(numKeys * 200, "RPHashTable");
+}
+
+
+
+// Timing tests
+
+// Allocators for the tables under test.  Get() is called for each table
+// constructed, and Release() once each table is destroyed: the arena is reset
+// then (freeing everything the table used in one go), while the pool keeps
+// its free lists so the next table recycles the same blocks.
+template <typename A>
+struct TestAllocators
+{
+	A Get() { return A(); }
+	void Release() {}
+};
+
+template <>
+struct TestAllocators<ArenaAllocator<char>>
+{
+	Arena arena;
+	ArenaAllocator<char> Get() { return ArenaAllocator<char>(&arena); }
+	void Release() { arena.Reset(); }
+};
+
+template <>
+struct TestAllocators<PoolAllocator<char>>
+{
+	SizeClassPool pool;
+	PoolAllocator<char> Get() { return PoolAllocator<char>(&pool); }
+	void Release() {}
+};
+
+template<typename K, typename V, typename A>
+void FillTiming(int numKeys, bool presize)
+{
+	// Create a list of guaranteed unique keys by random shuffling
+	std::vector<uint> keys(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		keys[i] = i;
+	XorshiftRNG rng = { 0xf002beef };
+	std::shuffle(keys.begin(), keys.end(), rng);
+
+	// Run tests and measure timing
+	TestAllocators<A> allocs;
+	float timeMin;
+	timeMin = FLT_MAX;
+	g_allocs = 0;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		allocs.Release();
+		UMHashTable<K, V, A> ht(allocs.Get());
+		Timer timer;
+		timer.Start();
+		if (presize)
+			ht.Reserve(numKeys);
+		for (int i = 0; i < numKeys; ++i)
+		{
+			ht.Insert(keys[i], V());
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_allocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+	timeMin = FLT_MAX;
+	g_allocs = 0;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		allocs.Release();
+		C0HashTable<K, V, A> ht(allocs.Get());
+		Timer timer;
+		timer.Start();
+		if (presize)
+			ht.Reserve(numKeys);
+		for (int i = 0; i < numKeys; ++i)
+		{
+			ht.Insert(keys[i], V());
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_allocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+	timeMin = FLT_MAX;
+	g_allocs = 0;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		allocs.Release();
+		OLHashTable<K, V, A> ht(allocs.Get());
+		Timer timer;
+		timer.Start();
+		if (presize)
+			ht.Reserve(numKeys);
+		for (int i = 0; i < numKeys; ++i)
+		{
+			ht.Insert(keys[i], V());
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_allocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+	timeMin = FLT_MAX;
+	g_allocs = 0;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		allocs.Release();
+		DO1HashTable<K, V, A> ht(allocs.Get());
+		Timer timer;
+		timer.Start();
+		if (presize)
+			ht.Reserve(numKeys);
+		for (int i = 0; i < numKeys; ++i)
+		{
+			ht.Insert(keys[i], V());
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_allocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+	timeMin = FLT_MAX;
+	g_allocs = 0;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		allocs.Release();
+		DO2HashTable<K, V, A> ht(allocs.Get());
+		Timer timer;
+		timer.Start();
+		if (presize)
+			ht.Reserve(numKeys);
+		for (int i = 0; i < numKeys; ++i)
+		{
+			ht.Insert(keys[i], V());
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_allocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+	timeMin = FLT_MAX;
+	g_allocs = 0;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		allocs.Release();
+		D0HashTable<K, V, A> ht(allocs.Get());
+		Timer timer;
+		timer.Start();
+		if (presize)
+			ht.Reserve(numKeys);
+		for (int i = 0; i < numKeys; ++i)
+		{
+			ht.Insert(keys[i], V());
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+
+#if COUNT_ALLOCS
+	Log("\t%d", g_allocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+
+	timeMin = FLT_MAX;
+	g_allocs = 0;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		allocs.Release();
+		D1HashTable<K, V, A> ht(allocs.Get());
+		Timer timer;
+		timer.Start();
+		if (presize)
+			ht.Reserve(numKeys);
+		for (int i = 0; i < numKeys; ++i)
+		{
+			ht.Insert(keys[i], V());
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+
+#if COUNT_ALLOCS
+	Log("\t%d", g_allocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+}
+
+// Helper functions to fill a hash table with some keys
+template<typename K, typename V, typename A, template<typename, typename, typename> class HT>
+void Fill(HT<K, V, A> & ht, int numKeys)
+{
+	// Create a list of guaranteed unique keys by random shuffling
+	std::vector<uint> keys(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		keys[i] = i;
+	XorshiftRNG rng = { 0xf002beef };
+	std::shuffle(keys.begin(), keys.end(), rng);
+
+	ht.Reserve(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+	{
+		ht.Insert(keys[i], V());
+	}
+}
+
+// Write lookup results to a dummy volatile to prevent compiler from optimizing them away
+volatile size_t dummy;
+
+template<typename K, typename V>
+void LookupTiming(int numKeys, bool fail)
+{
+	static const int numLookups = 100000;
+	XorshiftRNG rng = { 0xfaf4f00d };
 
 	// Create a list of random keys to lookup
 	std::vector<uint> keys(numLookups);
 	if (fail)
 	{
-		for (int i = 0; i < numLookups; ++i)
-			keys[i] = numKeys + (rng() % numKeys);
+		for (int i = 0; i < numLookups; ++i)
+			keys[i] = numKeys + (rng() % numKeys);
+	}
+	else
+	{
+		for (int i = 0; i < numLookups; ++i)
+			keys[i] = rng() % numKeys;
+	}
+
+	// Run tests and measure timing
+	float timeMin;
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		UMHashTable<K, V> ht;
+		Fill(ht, numKeys);
+		Timer timer;
+		timer.Start();
+		for (int i = 0; i < numLookups; ++i)
+		{
+			V * pValue = ht.Lookup(keys[i]);
+			if (pValue)
+				dummy = *(size_t *)pValue;
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+	Log("\t%0.2f", timeMin);
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		C0HashTable<K, V> ht;
+		Fill(ht, numKeys);
+		Timer timer;
+		timer.Start();
+		for (int i = 0; i < numLookups; ++i)
+		{
+			V * pValue = ht.Lookup(keys[i]);
+			if (pValue)
+				dummy = *(size_t *)pValue;
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+	Log("\t%0.2f", timeMin);
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		OLHashTable<K, V> ht;
+		Fill(ht, numKeys);
+		Timer timer;
+		timer.Start();
+		for (int i = 0; i < numLookups; ++i)
+		{
+			V * pValue = ht.Lookup(keys[i]);
+			if (pValue)
+				dummy = *(size_t *)pValue;
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+	Log("\t%0.2f", timeMin);
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		DO1HashTable<K, V> ht;
+		Fill(ht, numKeys);
+		Timer timer;
+		timer.Start();
+		for (int i = 0; i < numLookups; ++i)
+		{
+			V * pValue = ht.Lookup(keys[i]);
+			if (pValue)
+				dummy = *(size_t *)pValue;
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+	Log("\t%0.2f", timeMin);
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		DO2HashTable<K, V> ht;
+		Fill(ht, numKeys);
+		Timer timer;
+		timer.Start();
+		for (int i = 0; i < numLookups; ++i)
+		{
+			V * pValue = ht.Lookup(keys[i]);
+			if (pValue)
+				dummy = *(size_t *)pValue;
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+	Log("\t%0.2f", timeMin);
+
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		D0HashTable<K, V> ht;
+		Fill(ht, numKeys);
+		Timer timer;
+		timer.Start();
+		for (int i = 0; i < numLookups; ++i)
+		{
+			V * pValue = ht.Lookup(keys[i]);
+			if (pValue)
+				dummy = *(size_t *)pValue;
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+	Log("\t%0.2f", timeMin);
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		D1HashTable<K, V> ht;
+		Fill(ht, numKeys);
+		Timer timer;
+		timer.Start();
+		for (int i = 0; i < numLookups; ++i)
+		{
+			V * pValue = ht.Lookup(keys[i]);
+			if (pValue)
+				dummy = *(size_t *)pValue;
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+	Log("\t%0.2f", timeMin);
+}
+
+template<typename K, typename V>
+void RemoveTiming(int numKeys)
+{
+	int numRemoves = numKeys / 2;
+	XorshiftRNG rng = { 0xba28beef };
+
+	// Create a list of random keys to remove
+	std::vector<uint> keys(numRemoves);
+	for (int i = 0; i < numRemoves; ++i)
+		keys[i] = rng() % numKeys;
+
+	// Run tests and measure timing
+	float timeMin;
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		UMHashTable<K, V> ht;
+		Fill(ht, numKeys);
+		g_deallocs = 0;
+		Timer timer;
+		timer.Start();
+		for (int i = 0; i < numRemoves; ++i)
+		{
+			ht.Remove(keys[i]);
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_deallocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		C0HashTable<K, V> ht;
+		Fill(ht, numKeys);
+		g_deallocs = 0;
+		Timer timer;
+		timer.Start();
+		for (int i = 0; i < numRemoves; ++i)
+		{
+			ht.Remove(keys[i]);
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_deallocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		OLHashTable<K, V> ht;
+		Fill(ht, numKeys);
+		g_deallocs = 0;
+		Timer timer;
+		timer.Start();
+		for (int i = 0; i < numRemoves; ++i)
+		{
+			ht.Remove(keys[i]);
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_deallocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		DO1HashTable<K, V> ht;
+		Fill(ht, numKeys);
+		g_deallocs = 0;
+		Timer timer;
+		timer.Start();
+		for (int i = 0; i < numRemoves; ++i)
+		{
+			ht.Remove(keys[i]);
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_deallocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		DO2HashTable<K, V> ht;
+		Fill(ht, numKeys);
+		g_deallocs = 0;
+		Timer timer;
+		timer.Start();
+		for (int i = 0; i < numRemoves; ++i)
+		{
+			ht.Remove(keys[i]);
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_deallocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		D0HashTable<K, V> ht;
+		Fill(ht, numKeys);
+		g_deallocs = 0;
+		Timer timer;
+		timer.Start();
+		for (int i = 0; i < numRemoves; ++i)
+		{
+			ht.Remove(keys[i]);
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_deallocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		D1HashTable<K, V> ht;
+		Fill(ht, numKeys);
+		g_deallocs = 0;
+		Timer timer;
+		timer.Start();
+		for (int i = 0; i < numRemoves; ++i)
+		{
+			ht.Remove(keys[i]);
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_deallocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+}
+
+template<typename K, typename V, typename A>
+void DestructTiming(int numKeys)
+{
+	// Run tests and measure timing
+	TestAllocators<A> allocs;
+	float timeMin;
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		UMHashTable<K, V, A> * ht = new UMHashTable<K, V, A>(allocs.Get());
+		Fill(*ht, numKeys);
+		g_deallocs = 0;
+		Timer timer;
+		timer.Start();
+		delete ht;
+		allocs.Release();
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_deallocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		C0HashTable<K, V, A> * ht = new C0HashTable<K, V, A>(allocs.Get());
+		Fill(*ht, numKeys);
+		g_deallocs = 0;
+		Timer timer;
+		timer.Start();
+		delete ht;
+		allocs.Release();
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_deallocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		OLHashTable<K, V, A> * ht = new OLHashTable<K, V, A>(allocs.Get());
+		Fill(*ht, numKeys);
+		g_deallocs = 0;
+		Timer timer;
+		timer.Start();
+		delete ht;
+		allocs.Release();
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_deallocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		DO1HashTable<K, V, A> * ht = new DO1HashTable<K, V, A>(allocs.Get());
+		Fill(*ht, numKeys);
+		g_deallocs = 0;
+		Timer timer;
+		timer.Start();
+		delete ht;
+		allocs.Release();
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_deallocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		DO2HashTable<K, V, A> * ht = new DO2HashTable<K, V, A>(allocs.Get());
+		Fill(*ht, numKeys);
+		g_deallocs = 0;
+		Timer timer;
+		timer.Start();
+		delete ht;
+		allocs.Release();
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_deallocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		D0HashTable<K, V, A> * ht = new D0HashTable<K, V, A>(allocs.Get());
+		Fill(*ht, numKeys);
+		g_deallocs = 0;
+		Timer timer;
+		timer.Start();
+		delete ht;
+		allocs.Release();
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_deallocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+
+	timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		D1HashTable<K, V, A> * ht = new D1HashTable<K, V, A>(allocs.Get());
+		Fill(*ht, numKeys);
+		g_deallocs = 0;
+		Timer timer;
+		timer.Start();
+		delete ht;
+		allocs.Release();
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+#if COUNT_ALLOCS
+	Log("\t%d", g_deallocs);
+#else
+	Log("\t%0.2f", timeMin);
+#endif
+
+}
+
+// Word-count style workload: a skewed stream of keys, each occurrence of
+// which bumps a counter, either via Lookup + Insert-on-miss (two probes for
+// every new key) or via FindOrInsert (one probe)
+template<typename HT>
+float CountTiming(const std::vector<uint> & words, bool findOrInsert)
+{
+	float timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		HT ht;
+		Timer timer;
+		timer.Start();
+		if (findOrInsert)
+		{
+			for (size_t j = 0, jEnd = words.size(); j < jEnd; ++j)
+				++*ht.FindOrInsert(words[j]).first;
+		}
+		else
+		{
+			for (size_t j = 0, jEnd = words.size(); j < jEnd; ++j)
+			{
+				if (auto * pCount = ht.Lookup(words[j]))
+					++*pCount;
+				else
+					ht.Insert(words[j], 1);
+			}
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+		dummy = *ht.Lookup(words[0]);
+	}
+	return timeMin;
+}
+
+template<typename K, typename V>
+void CountTiming(int numKeys, bool findOrInsert)
+{
+	// Create a stream of "words": 8 per distinct key, skewed towards the low
+	// keys so a few are very common and many are rare, like real text
+	int numWords = numKeys * 8;
+	XorshiftRNG rng = { 0xc0ffee11 };
+	std::vector<uint> words(numWords);
+	for (int i = 0; i < numWords; ++i)
+	{
+		uint64_t r = rng() % numKeys;
+		words[i] = uint((r * r) / numKeys);
+	}
+
+	// Run tests and measure timing
+	Log("\t%0.2f", CountTiming<UMHashTable<K, V>>(words, findOrInsert));
+	Log("\t%0.2f", CountTiming<C0HashTable<K, V>>(words, findOrInsert));
+	Log("\t%0.2f", CountTiming<OLHashTable<K, V>>(words, findOrInsert));
+	Log("\t%0.2f", CountTiming<DO1HashTable<K, V>>(words, findOrInsert));
+	Log("\t%0.2f", CountTiming<DO2HashTable<K, V>>(words, findOrInsert));
+	Log("\t%0.2f", CountTiming<D0HashTable<K, V>>(words, findOrInsert));
+	Log("\t%0.2f", CountTiming<D1HashTable<K, V>>(words, findOrInsert));
+}
+
+// String-key workloads.  Lookups go through StrViews into one big buffer of
+// text, the way a parser would see them, so no std::string is built per lookup
+// (except by unordered_map, which has no heterogeneous find).
+
+template<typename HT>
+float StringFillTiming(const std::vector<std::string> & keys)
+{
+	float timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		HT ht;
+		Timer timer;
+		timer.Start();
+		for (size_t j = 0, jEnd = keys.size(); j < jEnd; ++j)
+			ht.Insert(keys[j], 0);
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+	return timeMin;
+}
+
+template<typename V>
+void StringFillTiming(int numKeys, const StringKeyLengths & lengths)
+{
+	std::vector<std::string> keys;
+	MakeStringKeys(numKeys, lengths, 0xf002beef, keys);
+
+	Log("\t%0.2f", StringFillTiming<UMHashTable<std::string, V>>(keys));
+	Log("\t%0.2f", StringFillTiming<C0HashTable<std::string, V>>(keys));
+	Log("\t%0.2f", StringFillTiming<OLHashTable<std::string, V>>(keys));
+	Log("\t%0.2f", StringFillTiming<DO1HashTable<std::string, V>>(keys));
+	Log("\t%0.2f", StringFillTiming<DO2HashTable<std::string, V>>(keys));
+	Log("\t%0.2f", StringFillTiming<D0HashTable<std::string, V>>(keys));
+	Log("\t%0.2f", StringFillTiming<D1HashTable<std::string, V>>(keys));
+	Log("\t%0.2f", StringFillTiming<DO1StrHashTable<V>>(keys));
+}
+
+template<typename HT>
+float StringLookupTiming(const std::vector<std::string> & keys, const std::vector<StrView> & probes)
+{
+	float timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		HT ht;
+		ht.Reserve(keys.size());
+		for (size_t j = 0, jEnd = keys.size(); j < jEnd; ++j)
+			ht.Insert(keys[j], 0);
+		Timer timer;
+		timer.Start();
+		for (size_t j = 0, jEnd = probes.size(); j < jEnd; ++j)
+		{
+			auto * pValue = ht.Lookup(probes[j]);
+			if (pValue)
+				dummy = *pValue;
+		}
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
 	}
-	else
+	return timeMin;
+}
+
+template<typename V>
+void StringLookupTiming(int numKeys, const StringKeyLengths & lengths)
+{
+	static const int numLookups = 100000;
+	std::vector<std::string> keys;
+	MakeStringKeys(numKeys, lengths, 0xf002beef, keys);
+
+	// Lay out the keys to look up end to end in a text buffer
+	XorshiftRNG rng = { 0xfaf4f00d };
+	std::vector<int> lookupIndices(numLookups);
+	size_t textSize = 0;
+	for (int i = 0; i < numLookups; ++i)
+	{
+		lookupIndices[i] = rng() % numKeys;
+		textSize += keys[lookupIndices[i]].size();
+	}
+	std::vector<char> text(textSize);
+	std::vector<StrView> probes(numLookups);
+	for (int i = 0, offset = 0; i < numLookups; ++i)
+	{
+		const std::string & key = keys[lookupIndices[i]];
+		memcpy(&text[offset], key.data(), key.size());
+		probes[i] = StrView(&text[offset], key.size());
+		offset += int(key.size());
+	}
+
+	Log("\t%0.2f", StringLookupTiming<UMHashTable<std::string, V>>(keys, probes));
+	Log("\t%0.2f", StringLookupTiming<C0HashTable<std::string, V>>(keys, probes));
+	Log("\t%0.2f", StringLookupTiming<OLHashTable<std::string, V>>(keys, probes));
+	Log("\t%0.2f", StringLookupTiming<DO1HashTable<std::string, V>>(keys, probes));
+	Log("\t%0.2f", StringLookupTiming<DO2HashTable<std::string, V>>(keys, probes));
+	Log("\t%0.2f", StringLookupTiming<D0HashTable<std::string, V>>(keys, probes));
+	Log("\t%0.2f", StringLookupTiming<D1HashTable<std::string, V>>(keys, probes));
+	Log("\t%0.2f", StringLookupTiming<DO1StrHashTable<V>>(keys, probes));
+}
+
+template<typename HT, typename A>
+float LargeTableTiming(const std::vector<uint> & keys, const std::vector<uint> & probes, const A & alloc, int64_t & dtlbMisses)
+{
+	// Only one table this size is built at a time, and only once
+	HT ht(alloc);
+	ht.Reserve(keys.size());
+	for (size_t i = 0, iEnd = keys.size(); i < iEnd; ++i)
+		ht.Insert(keys[i], keys[i]);
+
+	float timeMin = FLT_MAX;
+	dtlbMisses = -1;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		DtlbMissCounter counter;
+		Timer timer;
+		counter.Start();
+		timer.Start();
+		for (size_t j = 0, jEnd = probes.size(); j < jEnd; ++j)
+			dummy = *ht.Lookup(probes[j]);
+		timer.Stop();
+		counter.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+		if (counter.valid && (dtlbMisses < 0 || counter.countAccumulated < dtlbMisses))
+			dtlbMisses = counter.countAccumulated;
+	}
+	return timeMin;
+}
+
+template<typename A>
+void LargeTableTiming(int numKeys, int numLookups, const A & alloc)
+{
+	// Create a list of guaranteed unique keys by random shuffling
+	std::vector<uint> keys(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		keys[i] = i;
+	XorshiftRNG rng = { 0xf002beef };
+	std::shuffle(keys.begin(), keys.end(), rng);
+
+	std::vector<uint> probes(numLookups);
+	for (int i = 0; i < numLookups; ++i)
+		probes[i] = keys[rng() % numKeys];
+
+	int64_t dtlbMisses[4];
+	Log("\t%0.2f", LargeTableTiming<OLHashTable<uint, uint, A>>(keys, probes, alloc, dtlbMisses[0]));
+	Log("\t%0.2f", LargeTableTiming<DO1HashTable<uint, uint, A>>(keys, probes, alloc, dtlbMisses[1]));
+	Log("\t%0.2f", LargeTableTiming<DO2HashTable<uint, uint, A>>(keys, probes, alloc, dtlbMisses[2]));
+	Log("\t%0.2f", LargeTableTiming<D0HashTable<uint, uint, A>>(keys, probes, alloc, dtlbMisses[3]));
+	Log("\t");
+	for (int i = 0; i < 4; ++i)
+	{
+		// perf counters are often unavailable (containers, VMs, paranoid kernels)
+		if (dtlbMisses[i] < 0)
+			Log("\tn/a");
+		else
+			Log("\t%0.2f", double(dtlbMisses[i]) * 1e-6);
+	}
+}
+
+// Startup from a snapshot vs. rebuilding by re-inserting everything.  The
+// lookups are the first ones after mapping, so they include the page faults.
+template<typename HT, typename ST>
+void SnapshotTiming(const std::vector<uint> & keys, const std::vector<uint> & probes)
+{
+	static const char * s_path = "snapshot-timing.tmp";
+
+	float timeRebuild = FLT_MAX, timeMap = FLT_MAX, timeVerify = FLT_MAX, timeLookups = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		{
+			HT ht;
+			Timer timer;
+			timer.Start();
+			ht.Reserve(uint32_t(keys.size()));
+			for (size_t j = 0, jEnd = keys.size(); j < jEnd; ++j)
+				ht.Insert(keys[j], keys[j]);
+			timer.Stop();
+			timeRebuild = std::min(timeRebuild, timer.msAccumulated);
+			if (i == 0)
+				ht.SaveSnapshot(s_path);
+		}
+		{
+			ST st;
+			Timer timer;
+			timer.Start();
+			st.Open(s_path);
+			timer.Stop();
+			timeMap = std::min(timeMap, timer.msAccumulated);
+
+			Timer timerLookups;
+			timerLookups.Start();
+			for (size_t j = 0, jEnd = probes.size(); j < jEnd; ++j)
+				dummy = *st.Lookup(probes[j]);
+			timerLookups.Stop();
+			timeLookups = std::min(timeLookups, timerLookups.msAccumulated);
+		}
+		{
+			ST st;
+			Timer timer;
+			timer.Start();
+			st.Open(s_path, true);
+			timer.Stop();
+			timeVerify = std::min(timeVerify, timer.msAccumulated);
+		}
+	}
+	remove(s_path);
+
+	Log("\t%0.2f\t%0.2f\t%0.2f\t%0.2f", timeRebuild, timeMap, timeVerify, timeLookups);
+}
+
+void SnapshotTiming(int numKeys)
+{
+	static const int numLookups = 100000;
+
+	// Create a list of guaranteed unique keys by random shuffling
+	std::vector<uint> keys(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		keys[i] = i;
+	XorshiftRNG rng = { 0xf002beef };
+	std::shuffle(keys.begin(), keys.end(), rng);
+
+	std::vector<uint> probes(numLookups);
+	for (int i = 0; i < numLookups; ++i)
+		probes[i] = keys[rng() % numKeys];
+
+	SnapshotTiming<DO2HashTable<uint, uint>, DO2SnapshotTable<uint, uint>>(keys, probes);
+	Log("\t");
+	SnapshotTiming<D0HashTable<uint, uint>, D0SnapshotTable<uint, uint>>(keys, probes);
+}
+
+// Filling one insert at a time (growing as it goes, or presized) vs. BulkBuild
+template<typename HT>
+void BulkBuildTiming(const std::vector<std::pair<uint, uint>> & pairs)
+{
+	float timeFill = FLT_MAX, timePresized = FLT_MAX, timeBulk = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		{
+			HT ht;
+			Timer timer;
+			timer.Start();
+			for (size_t j = 0, jEnd = pairs.size(); j < jEnd; ++j)
+				ht.Insert(pairs[j].first, pairs[j].second);
+			timer.Stop();
+			timeFill = std::min(timeFill, timer.msAccumulated);
+		}
+		{
+			HT ht;
+			Timer timer;
+			timer.Start();
+			ht.Reserve(uint32_t(pairs.size()));
+			for (size_t j = 0, jEnd = pairs.size(); j < jEnd; ++j)
+				ht.Insert(pairs[j].first, pairs[j].second);
+			timer.Stop();
+			timePresized = std::min(timePresized, timer.msAccumulated);
+		}
+		{
+			HT ht;
+			Timer timer;
+			timer.Start();
+			ht.BulkBuild(pairs.begin(), pairs.end());
+			timer.Stop();
+			timeBulk = std::min(timeBulk, timer.msAccumulated);
+		}
+	}
+
+	Log("\t%0.2f\t%0.2f\t%0.2f", timeFill, timePresized, timeBulk);
+}
+
+void BulkBuildTiming(int numKeys)
+{
+	// Create a list of guaranteed unique keys by random shuffling
+	std::vector<std::pair<uint, uint>> pairs(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		pairs[i] = std::make_pair(uint(i), uint(i));
+	XorshiftRNG rng = { 0xf002beef };
+	std::shuffle(pairs.begin(), pairs.end(), rng);
+
+	BulkBuildTiming<OLHashTable<uint, uint>>(pairs); Log("\t");
+	BulkBuildTiming<DO1HashTable<uint, uint>>(pairs); Log("\t");
+	BulkBuildTiming<DO2HashTable<uint, uint>>(pairs); Log("\t");
+	BulkBuildTiming<D0HashTable<uint, uint>>(pairs);
+}
+
+// Growing a full table to hold twice as many keys: the one big Rehash that
+// rehashThreads is there to speed up
+template<typename HT>
+void ParallelRehashTiming(const std::vector<std::pair<uint, uint>> & pairs, int numThreads)
+{
+	float timeRehash = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		HT ht;
+		for (size_t j = 0, jEnd = pairs.size(); j < jEnd; ++j)
+			ht.Insert(pairs[j].first, pairs[j].second);
+		ht.rehashThreads = numThreads;
+
+		Timer timer;
+		timer.Start();
+		ht.Reserve(uint32_t(pairs.size() * 2));
+		timer.Stop();
+		timeRehash = std::min(timeRehash, timer.msAccumulated);
+	}
+
+	Log("\t%0.2f", timeRehash);
+}
+
+template<typename HT>
+void ParallelBulkBuildTiming(const std::vector<std::pair<uint, uint>> & pairs, int numThreads)
+{
+	float timeBulk = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		HT ht;
+		ht.rehashThreads = numThreads;
+
+		Timer timer;
+		timer.Start();
+		ht.BulkBuild(pairs.begin(), pairs.end());
+		timer.Stop();
+		timeBulk = std::min(timeBulk, timer.msAccumulated);
+	}
+
+	Log("\t%0.2f", timeBulk);
+}
+
+void ParallelRehashTiming(int numKeys)
+{
+	// Create a list of guaranteed unique keys by random shuffling
+	std::vector<std::pair<uint, uint>> pairs(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		pairs[i] = std::make_pair(uint(i), uint(i));
+	XorshiftRNG rng = { 0xbeef5eed };
+	std::shuffle(pairs.begin(), pairs.end(), rng);
+
+	int numThreadsMax = std::max(8, int(std::thread::hardware_concurrency()));
+	for (int numThreads = 1; numThreads <= numThreadsMax; numThreads *= 2)
+	{
+		Log("%d", numThreads);
+		ParallelRehashTiming<OLHashTable<uint, uint>>(pairs, numThreads);
+		ParallelRehashTiming<DO1HashTable<uint, uint>>(pairs, numThreads);
+		ParallelRehashTiming<DO2HashTable<uint, uint>>(pairs, numThreads);
+		ParallelRehashTiming<D0HashTable<uint, uint>>(pairs, numThreads);
+		ParallelRehashTiming<D1HashTable<uint, uint>>(pairs, numThreads);
+		Log("\t");
+		ParallelBulkBuildTiming<OLHashTable<uint, uint>>(pairs, numThreads);
+		ParallelBulkBuildTiming<DO1HashTable<uint, uint>>(pairs, numThreads);
+		ParallelBulkBuildTiming<DO2HashTable<uint, uint>>(pairs, numThreads);
+		Log("\n");
+	}
+}
+
+// Lots of short-lived small tables: the case where the dynamic tables' initial
+// allocation and per-insert load check are most of the work
+template<typename HT>
+void SmallTableTiming(const std::vector<uint> & keys, int numKeys, int numTables)
+{
+	float timeTotal = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		Timer timer;
+		timer.Start();
+		for (int j = 0; j < numTables; ++j)
+		{
+			HT ht;
+			const uint * pKeys = &keys[(j * numKeys) & 0xffff];
+			for (int k = 0; k < numKeys; ++k)
+				ht.Insert(pKeys[k], uint(k));
+			for (int k = 0; k < numKeys; ++k)
+				dummy += *ht.Lookup(pKeys[k]);
+		}
+		timer.Stop();
+		timeTotal = std::min(timeTotal, timer.msAccumulated);
+	}
+
+	Log("\t%0.2f", timeTotal);
+}
+
+template<int N>
+void SmallTableTiming(int numTables)
+{
+	// Each table gets its own window of a shuffled range, so no two tables in
+	// a row hold the same keys
+	std::vector<uint> keys(0x10000 + N);
+	for (size_t i = 0, iEnd = keys.size(); i < iEnd; ++i)
+		keys[i] = uint(i);
+	XorshiftRNG rng = { 0x5ca1ab1e };
+	std::shuffle(keys.begin(), keys.end(), rng);
+
+	SmallTableTiming<FixedHashTable<uint, uint, N, true>>(keys, N, numTables);
+	SmallTableTiming<FixedHashTable<uint, uint, N, false>>(keys, N, numTables);
+	SmallTableTiming<UMHashTable<uint, uint>>(keys, N, numTables);
+	SmallTableTiming<OLHashTable<uint, uint>>(keys, N, numTables);
+	SmallTableTiming<DO1HashTable<uint, uint>>(keys, N, numTables);
+	SmallTableTiming<D0HashTable<uint, uint>>(keys, N, numTables);
+	SmallTableTiming<D1HashTable<uint, uint>>(keys, N, numTables);
+}
+
+// Memory held by each table's arrays, for bytes per key
+template<typename K, typename V>
+size_t TableBytes(const PerfectHashTable<K, V> & ht)
+{
+	return ht.MetadataBytes() + ht.keyvals.size() * sizeof(ht.keyvals[0]);
+}
+template<typename K, typename V>
+size_t TableBytes(const OLHashTable<K, V> & ht)
+{
+	return ht.buckets.size() * sizeof(ht.buckets[0]) + ht.states.Bytes();
+}
+template<typename K, typename V>
+size_t TableBytes(const OSHashTable<K, V> & ht)
+{
+	return ht.buckets.size() * sizeof(ht.buckets[0]) + sizeof(ht.sideSlots);
+}
+template<typename K, typename V>
+size_t TableBytes(const DO1HashTable<K, V> & ht)
+{
+	return ht.buckets.size() * sizeof(ht.buckets[0]) + ht.keyvals.size() * sizeof(ht.keyvals[0]);
+}
+template<typename K, typename V>
+size_t TableBytes(const D1HashTable<K, V> & ht)
+{
+	return ht.keyAndStates.size() * sizeof(ht.keyAndStates[0]) + ht.values.size() * sizeof(V);
+}
+template<typename K, typename V>
+size_t TableBytes(const DO2HashTable<K, V> & ht)
+{
+	return ht.buckets.size() * sizeof(ht.buckets[0]) + ht.keys.size() * sizeof(K) + ht.values.size() * sizeof(V);
+}
+template<typename K, typename V>
+size_t TableBytes(const D0HashTable<K, V> & ht)
+{
+	return ht.buckets.size() * sizeof(uint32_t) + ht.keyAndNexts.size() * sizeof(ht.keyAndNexts[0]) + ht.values.size() * sizeof(V);
+}
+template<typename K, typename V, bool IndirectValues>
+size_t TableBytes(const F14HashTable<K, V, IndirectValues> & ht)
+{
+	return ht.Bytes();
+}
+
+// Building the dynamic tables is a presized fill, the fastest way they have
+template<typename HT>
+void BuildTable(HT & ht, const std::vector<std::pair<uint, uint>> & pairs)
+{
+	ht.Reserve(uint32_t(pairs.size()));
+	for (size_t i = 0, iEnd = pairs.size(); i < iEnd; ++i)
+		ht.Insert(pairs[i].first, pairs[i].second);
+}
+void BuildTable(PerfectHashTable<uint, uint> & ht, const std::vector<std::pair<uint, uint>> & pairs)
+{
+	ht.Build(pairs.begin(), pairs.end());
+}
+
+template<typename HT>
+void PerfectHashTiming(
+	const std::vector<std::pair<uint, uint>> & pairs,
+	const std::vector<uint> & probes,
+	float * pTimeBuild,
+	float * pTimeLookup,
+	float * pBytesPerKey)
+{
+	*pTimeBuild = FLT_MAX;
+	*pTimeLookup = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		HT ht;
+		Timer timerBuild;
+		timerBuild.Start();
+		BuildTable(ht, pairs);
+		timerBuild.Stop();
+		*pTimeBuild = std::min(*pTimeBuild, timerBuild.msAccumulated);
+
+		Timer timerLookup;
+		timerLookup.Start();
+		for (size_t j = 0, jEnd = probes.size(); j < jEnd; ++j)
+			dummy += *ht.Lookup(probes[j]);
+		timerLookup.Stop();
+		*pTimeLookup = std::min(*pTimeLookup, timerLookup.msAccumulated);
+
+		*pBytesPerKey = float(TableBytes(ht)) / float(pairs.size());
+	}
+}
+
+void PerfectHashTiming(int numKeys, int numLookups)
+{
+	// Create a list of guaranteed unique keys by random shuffling
+	std::vector<std::pair<uint, uint>> pairs(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		pairs[i] = std::make_pair(uint(i), uint(i));
+	XorshiftRNG rng = { 0x9e3779b9 };
+	std::shuffle(pairs.begin(), pairs.end(), rng);
+
+	std::vector<uint> probes(numLookups);
+	for (int i = 0; i < numLookups; ++i)
+		probes[i] = pairs[rng() % numKeys].first;
+
+	float timesBuild[4], timesLookup[4], bytesPerKey[4];
+	PerfectHashTiming<PerfectHashTable<uint, uint>>(pairs, probes, &timesBuild[0], &timesLookup[0], &bytesPerKey[0]);
+	PerfectHashTiming<OLHashTable<uint, uint>>(pairs, probes, &timesBuild[1], &timesLookup[1], &bytesPerKey[1]);
+	PerfectHashTiming<DO2HashTable<uint, uint>>(pairs, probes, &timesBuild[2], &timesLookup[2], &bytesPerKey[2]);
+	PerfectHashTiming<D0HashTable<uint, uint>>(pairs, probes, &timesBuild[3], &timesLookup[3], &bytesPerKey[3]);
+
+	for (int i = 0; i < 4; ++i)
+		Log("\t%0.2f", timesBuild[i]);
+	Log("\t");
+	for (int i = 0; i < 4; ++i)
+		Log("\t%0.2f", timesLookup[i]);
+	Log("\t");
+	for (int i = 0; i < 4; ++i)
+		Log("\t%0.2f", bytesPerKey[i]);
+}
+
+// Hashes the same keys over and over, and logs the best rate of g_reps runs
+template<typename F>
+void BatchHashTiming(int numKeys, F hashAll)
+{
+	static const int numPasses = 200;
+	float timeMin = FLT_MAX;
+	for (int i = 0; i < g_reps; ++i)
+	{
+		Timer timer;
+		timer.Start();
+		for (int j = 0; j < numPasses; ++j)
+			hashAll();
+		timer.Stop();
+		timeMin = std::min(timeMin, timer.msAccumulated);
+	}
+
+	Log("\t%0.1f", float(numKeys) * float(numPasses) / (timeMin * 1000.0f));
+}
+
+template<typename K>
+void BatchHashTiming(const std::vector<K> & keys)
+{
+	int numKeys = int(keys.size());
+	std::vector<uint32_t> hashes(numKeys);
+	BatchHashTiming(numKeys, [&]() {
+		for (int i = 0; i < numKeys; ++i)
+			hashes[i] = HashKey(keys[i]);
+	});
+	BatchHashTiming(numKeys, [&]() { HashKeysLanes<HashLanesScalar, sizeof(K)>(&keys[0], numKeys, &hashes[0], 0xffffffffU); });
+#if defined(__AVX2__)
+	BatchHashTiming(numKeys, [&]() { HashKeysLanes<HashLanesAVX2, sizeof(K)>(&keys[0], numKeys, &hashes[0], 0xffffffffU); });
+#else
+	Log("\t-");
+#endif
+#if defined(__AVX512F__)
+	BatchHashTiming(numKeys, [&]() { HashKeysLanes<HashLanesAVX512, sizeof(K)>(&keys[0], numKeys, &hashes[0], 0xffffffffU); });
+#else
+	Log("\t-");
+#endif
+	dummy += hashes[numKeys / 2];
+}
+
+void BatchHashTiming(int numKeys)
+{
+	XorshiftRNG rng = { 0xba7c4ed5 };
+	std::vector<uint> keys(numKeys);
+	std::vector<uint64_t> wideKeys(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+	{
+		keys[i] = rng();
+		wideKeys[i] = (uint64_t(rng()) << 32) | rng();
+	}
+
+	Log("4");
+	BatchHashTiming(keys);
+	Log("\n8");
+	BatchHashTiming(wideKeys);
+	Log("\n");
+}
+
+template<typename H>
+void HashQualityReport(int numKeys)
+{
+	std::vector<uint32_t> keys;
+	HashQualityStats stats;
+	for (int dist = 0; dist < KEYDIST_Count; ++dist)
+	{
+		MakeKeyDist(KEYDIST(dist), numKeys, keys);
+		for (int bucketIndex = 0; bucketIndex < BUCKETINDEX_Count; ++bucketIndex)
+		{
+			MeasureHashQuality(H(), keys, BUCKETINDEX(bucketIndex), stats);
+			Log("%s\t%s\t%s", H::Name(), BucketIndexName(BUCKETINDEX(bucketIndex)), KeyDistName(KEYDIST(dist)));
+			Log("\t%0.2f\t%d\t%d", stats.chiSquareZ, int(stats.bucketCollisions), stats.maxChain);
+			for (int i = 0; i < s_chainHistogramLength; ++i)
+				Log("\t%d", int(stats.chainHistogram[i]));
+			Log("\t\t%d\t%0.2f", stats.maxProbeLinear, stats.avgProbeLinear);
+			if (stats.maxProbeQuadratic >= 0)
+				Log("\t%d\t%0.2f", stats.maxProbeQuadratic, stats.avgProbeQuadratic);
+			else
+				Log("\t-\t-");
+			Log("\t\t%d%s\n", int(stats.hashCollisions), HashQualityAcceptable(stats) ? "" : "\tWEAK");
+		}
+	}
+}
+
+void HashQualityReport(int numKeys)
+{
+	HashQualityReport<HashPolicySpooky>(numKeys);
+	HashQualityReport<HashPolicyIdentity>(numKeys);
+	HashQualityReport<HashPolicyFibonacci>(numKeys);
+	HashQualityReport<HashPolicyMurmurMix>(numKeys);
+
+	static const int numSamples = 100000;
+	Log("\nAvalanche (%d samples)\tWorst bias\n", numSamples);
+	Log("%s\t%0.4f\n", HashPolicySpooky::Name(), AvalancheWorstBias(HashPolicySpooky(), numSamples));
+	Log("%s\t%0.4f\n", HashPolicyIdentity::Name(), AvalancheWorstBias(HashPolicyIdentity(), numSamples));
+	Log("%s\t%0.4f\n", HashPolicyFibonacci::Name(), AvalancheWorstBias(HashPolicyFibonacci(), numSamples));
+	Log("%s\t%0.4f\n", HashPolicyMurmurMix::Name(), AvalancheWorstBias(HashPolicyMurmurMix(), numSamples));
+}
+
+template<typename HT>
+void TableStatsTiming(const std::vector<uint> & keys, const std::vector<uint> & probes, int numKeys, const char * name)
+{
+	HT ht;
+	int numChurn = numKeys / 4;
+	for (int i = 0; i < numKeys; ++i)
+		ht.Insert(keys[i], uint(i));
+	for (int i = 0; i < numChurn; ++i)
+		ht.Remove(keys[i]);
+	for (int i = numKeys; i < numKeys + numChurn; ++i)
+		ht.Insert(keys[i], uint(i));
+
+	HashTableStats stats = ht.GetStats();
+	Log("%d\t%s\t%0.3f\t%d\t", numKeys, name, stats.loadFactor, int(stats.tombstones));
+	Log("\t%0.2f\t%d\t%0.2f\t%d", stats.avgProbeHit, stats.maxProbeHit, stats.avgProbeMiss, stats.maxProbeMiss);
+
+	// Hits are the keys still in the table; misses are the churned-out ones
+	for (int miss = 0; miss < 2; ++miss)
+	{
+		float timeMin = FLT_MAX;
+		for (int i = 0; i < g_reps; ++i)
+		{
+			Timer timer;
+			timer.Start();
+			for (int j = 0, jEnd = int(probes.size()); j < jEnd; ++j)
+			{
+				uint * pValue = ht.Lookup(miss ? keys[probes[j] % numChurn] : keys[numChurn + probes[j] % numKeys]);
+				if (pValue)
+					dummy += *pValue;
+			}
+			timer.Stop();
+			timeMin = std::min(timeMin, timer.msAccumulated);
+		}
+		Log("\t%0.2f", timeMin);
+	}
+
+	const size_t * histogram = (stats.chainHistogram[0] || stats.chainHistogram[1]) ? stats.chainHistogram : stats.clusterHistogram;
+	for (int i = 0; i < s_statsHistogramLength; ++i)
+		Log("\t%d", int(histogram[i]));
+	Log("\n");
+}
+
+void TableStatsTiming(int numKeys)
+{
+	static const int numLookups = 100000;
+
+	// Unique keys in random order; the last quarter are inserted by the churn
+	std::vector<uint> keys(numKeys + numKeys / 4);
+	for (size_t i = 0, iEnd = keys.size(); i < iEnd; ++i)
+		keys[i] = uint(i);
+	XorshiftRNG rng = { 0x57a75f00 };
+	std::shuffle(keys.begin(), keys.end(), rng);
+
+	std::vector<uint> probes(numLookups);
+	for (int i = 0; i < numLookups; ++i)
+		probes[i] = rng();
+
+	TableStatsTiming<UMHashTable<uint, uint>>(keys, probes, numKeys, "UM");
+	TableStatsTiming<C0HashTable<uint, uint>>(keys, probes, numKeys, "C0");
+	TableStatsTiming<C1HashTable<uint, uint>>(keys, probes, numKeys, "C1");
+	TableStatsTiming<OLHashTable<uint, uint>>(keys, probes, numKeys, "OL");
+	TableStatsTiming<OQHashTable<uint, uint>>(keys, probes, numKeys, "OQ");
+	TableStatsTiming<DO1HashTable<uint, uint>>(keys, probes, numKeys, "DO1");
+	TableStatsTiming<DO2HashTable<uint, uint>>(keys, probes, numKeys, "DO2");
+	TableStatsTiming<D0HashTable<uint, uint>>(keys, probes, numKeys, "D0");
+	TableStatsTiming<D1HashTable<uint, uint>>(keys, probes, numKeys, "D1");
+}
+
+// Removes the oldest key in the window keys[iFirst, iFirst + numKeys) (mod
+// the key count) and inserts the one after the newest, numCycles times
+template<typename HT>
+void ChurnCycles(HT & ht, const std::vector<uint> & keys, int numKeys, int iFirst, int numCycles)
+{
+	const int numKeysAll = int(keys.size());
+	for (int i = 0; i < numCycles; ++i)
 	{
-		for (int i = 0; i < numLookups; ++i)
-			keys[i] = rng() % numKeys;
+		int iOld = (iFirst + i) % numKeysAll;
+		int iNew = (iOld + numKeys) % numKeysAll;
+		ht.Remove(keys[iOld]);
+		ht.Insert(keys[iNew], uint(iNew));
 	}
+}
 
-	// Run tests and measure timing
-	float timeMin;
-	timeMin = FLT_MAX;
+template<typename HT>
+float ChurnLookupTime(HT & ht, const std::vector<uint> & keys, const std::vector<uint> & probes, int numKeys, int iFirst)
+{
+	const int numKeysAll = int(keys.size());
+	float timeMin = FLT_MAX;
 	for (int i = 0; i < g_reps; ++i)
 	{
-		UMHashTable<K, V> ht;
-		Fill(ht, numKeys);
 		Timer timer;
 		timer.Start();
-		for (int i = 0; i < numLookups; ++i)
+		for (int j = 0, jEnd = int(probes.size()); j < jEnd; ++j)
 		{
-			V * pValue = ht.Lookup(keys[i]);
+			uint * pValue = ht.Lookup(keys[(iFirst + probes[j] % numKeys) % numKeysAll]);
 			if (pValue)
-				dummy = *(size_t *)pValue;
+				dummy += *pValue;
 		}
 		timer.Stop();
 		timeMin = std::min(timeMin, timer.msAccumulated);
 	}
-	Log("\t%0.2f", timeMin);
+	return timeMin;
+}
 
-	timeMin = FLT_MAX;
-	for (int i = 0; i < g_reps; ++i)
+void ChurnTiming(int numKeys, int numCycles)
+{
+	static const int numCheckpoints = 10;
+	static const int numLookups = 100000;
+
+	// Unique keys in random order; the tables hold a window of numKeys of
+	// them, which moves along one key per cycle and wraps around
+	std::vector<uint> keys(size_t(numKeys) * 2);
+	for (size_t i = 0, iEnd = keys.size(); i < iEnd; ++i)
+		keys[i] = uint(i);
+	XorshiftRNG rng = { 0xc4a27f00 };
+	std::shuffle(keys.begin(), keys.end(), rng);
+
+	std::vector<uint> probes(numLookups);
+	for (int i = 0; i < numLookups; ++i)
+		probes[i] = rng();
+
+	OLHashTable<uint, uint> ol;
+	OQHashTable<uint, uint> oq;
+	DO1HashTable<uint, uint> do1;
+	DO2HashTable<uint, uint> do2;
+	D1HashTable<uint, uint> d1;
+	for (int i = 0; i < numKeys; ++i)
 	{
-		C0HashTable<K, V> ht;
-		Fill(ht, numKeys);
-		Timer timer;
-		timer.Start();
-		for (int i = 0; i < numLookups; ++i)
+		ol.Insert(keys[i], uint(i));
+		oq.Insert(keys[i], uint(i));
+		do1.Insert(keys[i], uint(i));
+		do2.Insert(keys[i], uint(i));
+		d1.Insert(keys[i], uint(i));
+	}
+
+	const int numCyclesStep = numCycles / numCheckpoints;
+	int iFirst = 0;
+	for (int checkpoint = 0; checkpoint <= numCheckpoints; ++checkpoint)
+	{
+		if (checkpoint > 0)
 		{
-			V * pValue = ht.Lookup(keys[i]);
-			if (pValue)
-				dummy = *(size_t *)pValue;
+			ChurnCycles(ol, keys, numKeys, iFirst, numCyclesStep);
+			ChurnCycles(oq, keys, numKeys, iFirst, numCyclesStep);
+			ChurnCycles(do1, keys, numKeys, iFirst, numCyclesStep);
+			ChurnCycles(do2, keys, numKeys, iFirst, numCyclesStep);
+			ChurnCycles(d1, keys, numKeys, iFirst, numCyclesStep);
+			iFirst = int((size_t(iFirst) + numCyclesStep) % keys.size());
 		}
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
+
+		Log("%d", checkpoint * numCyclesStep);
+		Log("\t%0.2f", ChurnLookupTime(ol, keys, probes, numKeys, iFirst));
+		Log("\t%0.2f", ChurnLookupTime(oq, keys, probes, numKeys, iFirst));
+		Log("\t%0.2f", ChurnLookupTime(do1, keys, probes, numKeys, iFirst));
+		Log("\t%0.2f", ChurnLookupTime(do2, keys, probes, numKeys, iFirst));
+		Log("\t%0.2f", ChurnLookupTime(d1, keys, probes, numKeys, iFirst));
+		Log("\n");
 	}
-	Log("\t%0.2f", timeMin);
+}
 
-	timeMin = FLT_MAX;
+template<typename HT>
+float ShrinkLookupTime(HT & ht, const std::vector<uint> & keys, const std::vector<uint> & probes, int numKeys)
+{
+	float timeMin = FLT_MAX;
 	for (int i = 0; i < g_reps; ++i)
 	{
-		OLHashTable<K, V> ht;
-		Fill(ht, numKeys);
 		Timer timer;
 		timer.Start();
-		for (int i = 0; i < numLookups; ++i)
+		for (int j = 0, jEnd = int(probes.size()); j < jEnd; ++j)
 		{
-			V * pValue = ht.Lookup(keys[i]);
+			uint * pValue = ht.Lookup(keys[probes[j] % numKeys]);
 			if (pValue)
-				dummy = *(size_t *)pValue;
+				dummy += *pValue;
 		}
 		timer.Stop();
 		timeMin = std::min(timeMin, timer.msAccumulated);
 	}
-	Log("\t%0.2f", timeMin);
+	return timeMin;
+}
 
-	timeMin = FLT_MAX;
+template<typename HT>
+void ShrinkTiming(const std::vector<uint> & keys, const std::vector<uint> & probes, int numKeys, const char * name)
+{
+	HT ht;
+	for (int i = 0, iEnd = int(keys.size()); i < iEnd; ++i)
+		ht.Insert(keys[i], uint(i));
+	for (int i = numKeys, iEnd = int(keys.size()); i < iEnd; ++i)
+		ht.Remove(keys[i]);
+
+	size_t bucketCountBefore = ht.GetStats().bucketCount;
+	float timeBefore = ShrinkLookupTime(ht, keys, probes, numKeys);
+	ht.ShrinkToFit();
+	size_t bucketCountAfter = ht.GetStats().bucketCount;
+	float timeAfter = ShrinkLookupTime(ht, keys, probes, numKeys);
+
+	Log("%d\t%s\t%d\t%d\t%0.2f\t%0.2f\n", numKeys, name, int(bucketCountBefore), int(bucketCountAfter), timeBefore, timeAfter);
+}
+
+void ShrinkTiming(int numKeys)
+{
+	static const int numLookups = 100000;
+
+	// Unique keys in random order; the first numKeys are the ones kept
+	std::vector<uint> keys(size_t(numKeys) * 10);
+	for (size_t i = 0, iEnd = keys.size(); i < iEnd; ++i)
+		keys[i] = uint(i);
+	XorshiftRNG rng = { 0x5481f700 };
+	std::shuffle(keys.begin(), keys.end(), rng);
+
+	std::vector<uint> probes(numLookups);
+	for (int i = 0; i < numLookups; ++i)
+		probes[i] = rng();
+
+	ShrinkTiming<UMHashTable<uint, uint>>(keys, probes, numKeys, "UM");
+	ShrinkTiming<C0HashTable<uint, uint>>(keys, probes, numKeys, "C0");
+	ShrinkTiming<C1HashTable<uint, uint>>(keys, probes, numKeys, "C1");
+	ShrinkTiming<OLHashTable<uint, uint>>(keys, probes, numKeys, "OL");
+	ShrinkTiming<OQHashTable<uint, uint>>(keys, probes, numKeys, "OQ");
+	ShrinkTiming<DO1HashTable<uint, uint>>(keys, probes, numKeys, "DO1");
+	ShrinkTiming<DO2HashTable<uint, uint>>(keys, probes, numKeys, "DO2");
+	ShrinkTiming<D0HashTable<uint, uint>>(keys, probes, numKeys, "D0");
+	ShrinkTiming<D1HashTable<uint, uint>>(keys, probes, numKeys, "D1");
+}
+
+template<typename HT>
+float SentinelLookupTime(HT & ht, const std::vector<uint> & probes)
+{
+	float timeMin = FLT_MAX;
 	for (int i = 0; i < g_reps; ++i)
 	{
-		DO1HashTable<K, V> ht;
-		Fill(ht, numKeys);
 		Timer timer;
 		timer.Start();
-		for (int i = 0; i < numLookups; ++i)
+		for (int j = 0, jEnd = int(probes.size()); j < jEnd; ++j)
 		{
-			V * pValue = ht.Lookup(keys[i]);
+			uint * pValue = ht.Lookup(probes[j]);
 			if (pValue)
-				dummy = *(size_t *)pValue;
+				dummy += *pValue;
 		}
 		timer.Stop();
 		timeMin = std::min(timeMin, timer.msAccumulated);
 	}
-	Log("\t%0.2f", timeMin);
+	return timeMin;
+}
 
-	timeMin = FLT_MAX;
+template<typename HT>
+void SentinelKeyTiming(const std::vector<uint> & keys, const std::vector<uint> & hits, const std::vector<uint> & misses, const char * name)
+{
+	float timeFill = FLT_MAX;
 	for (int i = 0; i < g_reps; ++i)
 	{
-		DO2HashTable<K, V> ht;
-		Fill(ht, numKeys);
+		HT ht;
 		Timer timer;
 		timer.Start();
-		for (int i = 0; i < numLookups; ++i)
-		{
-			V * pValue = ht.Lookup(keys[i]);
-			if (pValue)
-				dummy = *(size_t *)pValue;
-		}
+		for (int j = 0, jEnd = int(keys.size()); j < jEnd; ++j)
+			ht.Insert(keys[j], uint(j));
 		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
+		timeFill = std::min(timeFill, timer.msAccumulated);
 	}
-	Log("\t%0.2f", timeMin);
 
+	HT ht;
+	for (int j = 0, jEnd = int(keys.size()); j < jEnd; ++j)
+		ht.Insert(keys[j], uint(j));
+	float bytesPerKey = float(TableBytes(ht)) / float(keys.size());
+	float timeHits = SentinelLookupTime(ht, hits);
+	float timeMisses = SentinelLookupTime(ht, misses);
 
-	timeMin = FLT_MAX;
+	Log("%d\t%s\t%0.1f\t%0.2f\t%0.2f\t%0.2f\n", int(keys.size()), name, bytesPerKey, timeFill, timeHits, timeMisses);
+}
+
+void SentinelKeyTiming(int numKeys)
+{
+	static const int numLookups = 100000;
+
+	// Unique keys in random order, including 0, which OS keeps in a side slot
+	std::vector<uint> keys(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		keys[i] = uint(i);
+	XorshiftRNG rng = { 0x5e471e1 };
+	std::shuffle(keys.begin(), keys.end(), rng);
+
+	std::vector<uint> hits(numLookups), misses(numLookups);
+	for (int i = 0; i < numLookups; ++i)
+	{
+		hits[i] = uint(rng() % numKeys);
+		misses[i] = uint(numKeys + rng() % numKeys);
+	}
+
+	SentinelKeyTiming<OSHashTable<uint, uint>>(keys, hits, misses, "OS");
+	SentinelKeyTiming<OLHashTable<uint, uint>>(keys, hits, misses, "OL");
+	SentinelKeyTiming<DO1HashTable<uint, uint>>(keys, hits, misses, "DO1");
+	SentinelKeyTiming<D1HashTable<uint, uint>>(keys, hits, misses, "D1");
+}
+
+template<typename HT>
+float ChunkedLookupTime(HT & ht, const std::vector<uint> & probes)
+{
+	float timeMin = FLT_MAX;
 	for (int i = 0; i < g_reps; ++i)
 	{
-		D0HashTable<K, V> ht;
-		Fill(ht, numKeys);
 		Timer timer;
 		timer.Start();
-		for (int i = 0; i < numLookups; ++i)
+		for (int j = 0, jEnd = int(probes.size()); j < jEnd; ++j)
 		{
-			V * pValue = ht.Lookup(keys[i]);
+			auto * pValue = ht.Lookup(probes[j]);
 			if (pValue)
-				dummy = *(size_t *)pValue;
+				dummy += *reinterpret_cast<const uint *>(pValue);
 		}
 		timer.Stop();
 		timeMin = std::min(timeMin, timer.msAccumulated);
 	}
-	Log("\t%0.2f", timeMin);
+	return timeMin;
+}
 
-	timeMin = FLT_MAX;
+template<typename HT, typename V>
+void ChunkedTiming(const std::vector<uint> & keys, const std::vector<uint> & hits, const std::vector<uint> & misses, const char * payload, const char * name)
+{
+	float timeFill = FLT_MAX;
 	for (int i = 0; i < g_reps; ++i)
 	{
-		D1HashTable<K, V> ht;
-		Fill(ht, numKeys);
+		HT ht;
 		Timer timer;
 		timer.Start();
-		for (int i = 0; i < numLookups; ++i)
-		{
-			V * pValue = ht.Lookup(keys[i]);
-			if (pValue)
-				dummy = *(size_t *)pValue;
-		}
+		for (int j = 0, jEnd = int(keys.size()); j < jEnd; ++j)
+			ht.Insert(keys[j], V());
 		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
+		timeFill = std::min(timeFill, timer.msAccumulated);
 	}
-	Log("\t%0.2f", timeMin);
+
+	HT ht;
+	for (int j = 0, jEnd = int(keys.size()); j < jEnd; ++j)
+		ht.Insert(keys[j], V());
+	float bytesPerKey = float(TableBytes(ht)) / float(keys.size());
+	float timeHits = ChunkedLookupTime(ht, hits);
+	float timeMisses = ChunkedLookupTime(ht, misses);
+
+	Log("%d\t%s\t%s\t%0.1f\t%0.2f\t%0.2f\t%0.2f\n", int(keys.size()), payload, name, bytesPerKey, timeFill, timeHits, timeMisses);
 }
 
-template<typename K, typename V>
-void RemoveTiming(int numKeys)
+template<typename V>
+void ChunkedTiming(int numKeys, const char * payload)
 {
-	int numRemoves = numKeys / 2;
-	XorshiftRNG rng = { 0xba28beef };
+	static const int numLookups = 100000;
 
-	// Create a list of random keys to remove
-	std::vector<uint> keys(numRemoves);
-	for (int i = 0; i < numRemoves; ++i)
-		keys[i] = rng() % numKeys;
+	// Unique keys in random order; the misses are keys past the last one
+	std::vector<uint> keys(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		keys[i] = uint(i);
+	XorshiftRNG rng = { 0xc4a2c14 };
+	std::shuffle(keys.begin(), keys.end(), rng);
 
-	// Run tests and measure timing
-	float timeMin;
-	timeMin = FLT_MAX;
-	for (int i = 0; i < g_reps; ++i)
+	std::vector<uint> hits(numLookups), misses(numLookups);
+	for (int i = 0; i < numLookups; ++i)
+	{
+		hits[i] = uint(rng() % numKeys);
+		misses[i] = uint(numKeys + rng() % numKeys);
+	}
+
+	ChunkedTiming<F14HashTable<uint, V>, V>(keys, hits, misses, payload, "F14");
+	ChunkedTiming<F14HashTable<uint, V, true>, V>(keys, hits, misses, payload, "F14i");
+	ChunkedTiming<OLHashTable<uint, V>, V>(keys, hits, misses, payload, "OL");
+	ChunkedTiming<DO1HashTable<uint, V>, V>(keys, hits, misses, payload, "DO1");
+	ChunkedTiming<D0HashTable<uint, V>, V>(keys, hits, misses, payload, "D0");
+}
+
+// Inserts the keys into an empty table one at a time, timing each insert (in
+// microseconds), and noting the bytes live and the peak so far after every
+// 1/numCheckpoints of them
+template<typename HT>
+void GrowthTiming(const std::vector<uint> & keys, int numCheckpoints, std::vector<size_t> & bytesLive, std::vector<size_t> & bytesPeak, std::vector<float> & latencies)
+{
+	AllocationCounter counter;
+	CountingAllocator<char> alloc(&counter);
+	HT ht(alloc);
+
+	const int numKeys = int(keys.size());
+	const int numKeysStep = numKeys / numCheckpoints;
+	latencies.resize(numKeys);
+	for (int i = 0; i < numKeys; ++i)
 	{
-		UMHashTable<K, V> ht;
-		Fill(ht, numKeys);
-		g_deallocs = 0;
 		Timer timer;
 		timer.Start();
-		for (int i = 0; i < numRemoves; ++i)
+		ht.Insert(keys[i], uint(i));
+		timer.Stop();
+		latencies[i] = timer.msAccumulated * 1000.0f;
+
+		if ((i + 1) % numKeysStep == 0)
 		{
-			ht.Remove(keys[i]);
+			bytesLive.push_back(counter.bytesLive);
+			bytesPeak.push_back(counter.bytesPeak);
 		}
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_deallocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
+}
 
-	timeMin = FLT_MAX;
+void GrowthTiming(int numKeys)
+{
+	static const int numCheckpoints = 10;
+	static const int numTables = 3;
+	static const char * s_names[numTables] = { "LH", "OL", "D0" };
+
+	// Unique keys in random order
+	std::vector<uint> keys(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		keys[i] = uint(i);
+	XorshiftRNG rng = { 0x6207f00d };
+	std::shuffle(keys.begin(), keys.end(), rng);
+
+	std::vector<size_t> bytesLive[numTables], bytesPeak[numTables];
+	std::vector<float> latencies[numTables];
+	GrowthTiming<LHHashTable<uint, uint, CountingAllocator<char>>>(keys, numCheckpoints, bytesLive[0], bytesPeak[0], latencies[0]);
+	GrowthTiming<OLHashTable<uint, uint, CountingAllocator<char>>>(keys, numCheckpoints, bytesLive[1], bytesPeak[1], latencies[1]);
+	GrowthTiming<D0HashTable<uint, uint, CountingAllocator<char>>>(keys, numCheckpoints, bytesLive[2], bytesPeak[2], latencies[2]);
+
+	for (int i = 0; i < numCheckpoints; ++i)
+	{
+		Log("%d", (i + 1) * (numKeys / numCheckpoints));
+		for (int t = 0; t < numTables; ++t)
+			Log("\t%0.1f\t%0.1f", float(bytesLive[t][i]) / 1048576.0f, float(bytesPeak[t][i]) / 1048576.0f);
+		Log("\n");
+	}
+
+	Log(
+		"\n"
+		"Growth, insert latency (us)\n"
+		"Table\tp50\tp99\tp99.9\tp99.99\tMax\tTotal (ms)\n"
+		);
+	for (int t = 0; t < numTables; ++t)
+	{
+		std::vector<float> & sorted = latencies[t];
+		double total = 0.0;
+		for (size_t i = 0, iEnd = sorted.size(); i < iEnd; ++i)
+			total += sorted[i];
+		std::sort(sorted.begin(), sorted.end());
+		const size_t n = sorted.size();
+		Log("%s\t%0.2f\t%0.2f\t%0.2f\t%0.2f\t%0.0f\t%0.1f\n",
+			s_names[t], sorted[n / 2], sorted[n * 99 / 100], sorted[n * 999 / 1000], sorted[n * 9999 / 10000],
+			sorted[n - 1], total / 1000.0);
+	}
+}
+
+// Fills an extendible-hashing table through a cache of cacheFrames pages,
+// then looks up hits and misses in random order, so with a cache smaller
+// than the file most lookups go to it.  One run each rather than the best of
+// g_reps: the fill alone does a read and write per insert once the cache
+// is small.
+void DiskTableTiming(const std::vector<uint> & keys, const std::vector<uint> & hits, const std::vector<uint> & misses, size_t cacheFrames, size_t pageCountFile)
+{
+	static const char * s_path = "extendible-timing.tmp";
+
+	EHHashTable<uint, uint> ht;
+	if (!ht.Open(s_path, cacheFrames))
+	{
+		Log("%d\tcan't open %s\n", int(cacheFrames), s_path);
+		return;
+	}
+
+	Timer timerFill;
+	timerFill.Start();
+	for (size_t i = 0, iEnd = keys.size(); i < iEnd; ++i)
+		ht.Insert(keys[i], keys[i]);
+	ht.Flush();
+	timerFill.Stop();
+
+	uint64_t hitsBefore = ht.cache.hits, missesBefore = ht.cache.misses;
+	Timer timerHits;
+	timerHits.Start();
+	for (size_t i = 0, iEnd = hits.size(); i < iEnd; ++i)
+		dummy = *ht.Lookup(hits[i]);
+	timerHits.Stop();
+
+	Timer timerMisses;
+	timerMisses.Start();
+	for (size_t i = 0, iEnd = misses.size(); i < iEnd; ++i)
+		dummy = size_t(ht.Lookup(misses[i]));
+	timerMisses.Stop();
+
+	uint64_t lookupHits = ht.cache.hits - hitsBefore, lookupMisses = ht.cache.misses - missesBefore;
+	Log("%d\t%0.1f%%\t%0.1f\t%0.2f\t%0.2f\t%0.1f%%\t%d\t%d%s\n",
+		int(cacheFrames), 100.0 * double(cacheFrames) / double(pageCountFile),
+		timerFill.msAccumulated, timerHits.msAccumulated, timerMisses.msAccumulated,
+		100.0 * double(lookupHits) / double(lookupHits + lookupMisses),
+		int(ht.cache.reads), int(ht.cache.writes),
+		ht.cache.failed ? "\tI/O failed" : "");
+
+	ht.Close();
+	remove(s_path);
+}
+
+void DiskTableTiming(int numKeys)
+{
+	static const int numLookups = 100000;
+	static const int s_cacheDivisors[] = { 2, 4, 10, 100 };
+
+	// Unique keys in random order
+	std::vector<uint> keys(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		keys[i] = uint(i);
+	XorshiftRNG rng = { 0xd15c7ab1 };
+	std::shuffle(keys.begin(), keys.end(), rng);
+
+	std::vector<uint> hits(numLookups), misses(numLookups);
+	for (int i = 0; i < numLookups; ++i)
+	{
+		hits[i] = uint(rng() % numKeys);
+		misses[i] = uint(numKeys + rng() % numKeys);
+	}
+
+	// A page holds a few hundred 8-byte entries, so one frame per hundred
+	// keys caches the whole file; that run measures how big the file gets
+	size_t pageCountFile;
+	{
+		EHHashTable<uint, uint> ht;
+		ht.Open("extendible-timing.tmp", 0);
+		for (int i = 0; i < numKeys; ++i)
+			ht.Insert(keys[i], keys[i]);
+		pageCountFile = ht.pageCount;
+		ht.Close();
+		remove("extendible-timing.tmp");
+	}
+	DiskTableTiming(keys, hits, misses, pageCountFile, pageCountFile);
+	for (int divisor : s_cacheDivisors)
+		DiskTableTiming(keys, hits, misses, std::max(pageCountFile / divisor, s_pageCacheFramesMin), pageCountFile);
+
+	// The same in memory, for reference
+	{
+		OLHashTable<uint, uint> ht;
+		Timer timerFill;
+		timerFill.Start();
+		for (int i = 0; i < numKeys; ++i)
+			ht.Insert(keys[i], keys[i]);
+		timerFill.Stop();
+
+		Timer timerHits;
+		timerHits.Start();
+		for (int i = 0; i < numLookups; ++i)
+			dummy = *ht.Lookup(hits[i]);
+		timerHits.Stop();
+
+		Timer timerMisses;
+		timerMisses.Start();
+		for (int i = 0; i < numLookups; ++i)
+			dummy = size_t(ht.Lookup(misses[i]));
+		timerMisses.Stop();
+
+		Log("OL, in memory\t\t%0.1f\t%0.2f\t%0.2f\n", timerFill.msAccumulated, timerHits.msAccumulated, timerMisses.msAccumulated);
+	}
+}
+
+template<typename HT>
+float FilterLookupTime(HT & ht, const std::vector<uint> & probes)
+{
+	float timeMin = FLT_MAX;
 	for (int i = 0; i < g_reps; ++i)
 	{
-		C0HashTable<K, V> ht;
-		Fill(ht, numKeys);
-		g_deallocs = 0;
 		Timer timer;
 		timer.Start();
-		for (int i = 0; i < numRemoves; ++i)
+		for (int j = 0, jEnd = int(probes.size()); j < jEnd; ++j)
 		{
-			ht.Remove(keys[i]);
+			uint * pValue = ht.Lookup(probes[j]);
+			if (pValue)
+				dummy += *pValue;
 		}
 		timer.Stop();
 		timeMin = std::min(timeMin, timer.msAccumulated);
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_deallocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
+	return timeMin;
+}
+
+// The same lookups on a table alone and behind a presized Bloom filter
+template<typename HT>
+void FilterTiming(const std::vector<uint> & keys, const std::vector<uint> & mix, const std::vector<uint> & hits, const std::vector<uint> & misses, const char * name)
+{
+	HT ht;
+	ht.Reserve(keys.size());
+	FilteredHashTable<uint, uint, HT> htFiltered;
+	htFiltered.Reserve(keys.size());
+	for (int i = 0, iEnd = int(keys.size()); i < iEnd; ++i)
+	{
+		ht.Insert(keys[i], uint(i));
+		htFiltered.Insert(keys[i], uint(i));
+	}
+
+	int falsePositives = 0;
+	for (int i = 0, iEnd = int(misses.size()); i < iEnd; ++i)
+		falsePositives += htFiltered.filter.MayContain(FilterHash(misses[i]));
+
+	Log("%d\t%s\t%0.2f\t%0.2f\t\t%0.2f\t%0.2f\t\t%0.2f\t%0.2f\t\t%0.1f\t%0.2f%%\n",
+		int(keys.size()), name,
+		FilterLookupTime(ht, mix), FilterLookupTime(htFiltered, mix),
+		FilterLookupTime(ht, hits), FilterLookupTime(htFiltered, hits),
+		FilterLookupTime(ht, misses), FilterLookupTime(htFiltered, misses),
+		float(htFiltered.filter.Bytes() * 8) / float(keys.size()),
+		100.0f * float(falsePositives) / float(misses.size()));
+}
+
+void FilterTiming(int numKeys, int missPercent)
+{
+	static const int numLookups = 100000;
+
+	// Unique keys in random order
+	std::vector<uint> keys(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		keys[i] = uint(i);
+	XorshiftRNG rng = { 0xb100f17e };
+	std::shuffle(keys.begin(), keys.end(), rng);
+
+	std::vector<uint> mix(numLookups), hits(numLookups), misses(numLookups);
+	for (int i = 0; i < numLookups; ++i)
+	{
+		hits[i] = uint(rng() % numKeys);
+		misses[i] = uint(numKeys + rng() % numKeys);
+		mix[i] = (int(rng() % 100) < missPercent) ? misses[i] : hits[i];
+	}
+
+	FilterTiming<UMHashTable<uint, uint>>(keys, mix, hits, misses, "UM");
+	FilterTiming<C0HashTable<uint, uint>>(keys, mix, hits, misses, "C0");
+	FilterTiming<OLHashTable<uint, uint>>(keys, mix, hits, misses, "OL");
+	FilterTiming<DO1HashTable<uint, uint>>(keys, mix, hits, misses, "DO1");
+	FilterTiming<D0HashTable<uint, uint>>(keys, mix, hits, misses, "D0");
+}
 
-	timeMin = FLT_MAX;
+// One filter type through the same workload: the keys inserted, looked up
+// (all hits) and the same number of keys never inserted looked up; then
+// two filters of half the keys each merged, and half the keys removed.
+// Bloom filters can do neither, and show "-" there.
+template<typename FT>
+float FilterStructureInsertTime(const std::vector<uint> & keys, size_t capacity)
+{
+	float timeMin = FLT_MAX;
 	for (int i = 0; i < g_reps; ++i)
 	{
-		OLHashTable<K, V> ht;
-		Fill(ht, numKeys);
-		g_deallocs = 0;
+		FT filter(capacity);
 		Timer timer;
 		timer.Start();
-		for (int i = 0; i < numRemoves; ++i)
-		{
-			ht.Remove(keys[i]);
-		}
+		for (size_t j = 0, jEnd = keys.size(); j < jEnd; ++j)
+			filter.Insert(keys[j]);
 		timer.Stop();
 		timeMin = std::min(timeMin, timer.msAccumulated);
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_deallocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
+	return timeMin;
+}
 
-	timeMin = FLT_MAX;
+template<typename FT>
+float FilterStructureLookupTime(const FT & filter, const std::vector<uint> & probes, int * pFound)
+{
+	float timeMin = FLT_MAX;
 	for (int i = 0; i < g_reps; ++i)
 	{
-		DO1HashTable<K, V> ht;
-		Fill(ht, numKeys);
-		g_deallocs = 0;
+		int found = 0;
 		Timer timer;
 		timer.Start();
-		for (int i = 0; i < numRemoves; ++i)
-		{
-			ht.Remove(keys[i]);
-		}
+		for (size_t j = 0, jEnd = probes.size(); j < jEnd; ++j)
+			found += filter.MayContain(probes[j]);
 		timer.Stop();
 		timeMin = std::min(timeMin, timer.msAccumulated);
+		*pFound = found;
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_deallocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
+	return timeMin;
+}
 
-	timeMin = FLT_MAX;
+template<typename FT>
+void FilterStructureMergeRemoveTiming(FT & filter, const std::vector<uint> & keys)
+{
+	const size_t half = keys.size() / 2;
+	float timeMerge = FLT_MAX;
 	for (int i = 0; i < g_reps; ++i)
 	{
-		DO2HashTable<K, V> ht;
-		Fill(ht, numKeys);
-		g_deallocs = 0;
+		FT a(keys.size()), b(keys.size());
+		for (size_t j = 0; j < half; ++j)
+			a.Insert(keys[j]);
+		for (size_t j = half, jEnd = keys.size(); j < jEnd; ++j)
+			b.Insert(keys[j]);
 		Timer timer;
 		timer.Start();
-		for (int i = 0; i < numRemoves; ++i)
-		{
-			ht.Remove(keys[i]);
-		}
+		a.Merge(b);
 		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
+		timeMerge = std::min(timeMerge, timer.msAccumulated);
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_deallocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
 
+	// Removes change the filter, so only once
+	Timer timer;
+	timer.Start();
+	for (size_t j = 0; j < half; ++j)
+		filter.Remove(keys[j]);
+	timer.Stop();
 
-	timeMin = FLT_MAX;
-	for (int i = 0; i < g_reps; ++i)
+	Log("\t%0.1f\t%0.1f", timeMerge, timer.msAccumulated);
+}
+
+// A Bloom filter sized by bits per key (as the others are by their slot
+// size), taking keys as the others do
+template<int BitsPerKey>
+struct BloomFilterOfSize : BlockedBloomFilter
+{
+	explicit BloomFilterOfSize(size_t capacity)
+	:	BlockedBloomFilter(BitsPerKey)
 	{
-		D0HashTable<K, V> ht;
-		Fill(ht, numKeys);
-		g_deallocs = 0;
-		Timer timer;
-		timer.Start();
-		for (int i = 0; i < numRemoves; ++i)
-		{
-			ht.Remove(keys[i]);
-		}
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
+		Reset(capacity);
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_deallocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
 
+	void Insert(uint key)				{ BlockedBloomFilter::Insert(FilterHash(key)); }
+	bool MayContain(uint key) const		{ return BlockedBloomFilter::MayContain(FilterHash(key)); }
+};
 
+// Bloom filters can't merge or remove
+template<int BitsPerKey>
+void FilterStructureMergeRemoveTiming(BloomFilterOfSize<BitsPerKey> &, const std::vector<uint> &)
+{
+	Log("\t-\t-");
+}
 
-	timeMin = FLT_MAX;
-	for (int i = 0; i < g_reps; ++i)
+template<typename FT>
+void FilterStructureTiming(const std::vector<uint> & keys, const std::vector<uint> & misses, const char * name)
+{
+	FT filter(keys.size());
+	for (size_t i = 0, iEnd = keys.size(); i < iEnd; ++i)
+		filter.Insert(keys[i]);
+
+	int found = 0, falsePositives = 0;
+	float timeInsert = FilterStructureInsertTime<FT>(keys, keys.size());
+	float timeHits = FilterStructureLookupTime(filter, keys, &found);
+	float timeMisses = FilterStructureLookupTime(filter, misses, &falsePositives);
+
+	Log("%s\t%0.1f\t%0.3f%%\t%0.1f\t%0.1f\t%0.1f",
+		name, float(filter.Bytes() * 8) / float(keys.size()), 100.0f * float(falsePositives) / float(misses.size()),
+		timeInsert, timeHits, timeMisses);
+	FilterStructureMergeRemoveTiming(filter, keys);
+	Log("%s\n", (found == int(keys.size())) ? "" : "\tmissed keys!");
+}
+
+void FilterStructureTiming(int numKeys)
+{
+	// Unique keys in random order, and as many others never inserted
+	std::vector<uint> keys(numKeys), misses(numKeys);
+	for (int i = 0; i < numKeys; ++i)
 	{
-		D1HashTable<K, V> ht;
-		Fill(ht, numKeys);
-		g_deallocs = 0;
-		Timer timer;
-		timer.Start();
-		for (int i = 0; i < numRemoves; ++i)
+		keys[i] = uint(i);
+		misses[i] = uint(numKeys + i);
+	}
+	XorshiftRNG rng = { 0xf117e25 };
+	std::shuffle(keys.begin(), keys.end(), rng);
+	std::shuffle(misses.begin(), misses.end(), rng);
+
+	// Powers of two, as the Bloom filter's block count is rounded up to one
+	FilterStructureTiming<BloomFilterOfSize<4>>(keys, misses, "Bloom, 4 bits/key");
+	FilterStructureTiming<BloomFilterOfSize<8>>(keys, misses, "Bloom, 8 bits/key");
+	FilterStructureTiming<BloomFilterOfSize<16>>(keys, misses, "Bloom, 16 bits/key");
+	FilterStructureTiming<CuckooFilter<uint8_t>>(keys, misses, "Cuckoo, 8-bit");
+	FilterStructureTiming<CuckooFilter<uint16_t>>(keys, misses, "Cuckoo, 16-bit");
+	FilterStructureTiming<CountingQuotientFilter<uint8_t>>(keys, misses, "Quotient, 8-bit");
+	FilterStructureTiming<CountingQuotientFilter<uint16_t>>(keys, misses, "Quotient, 16-bit");
+}
+
+// Join probe over a multimap: build rows with valuesPerKey rows per distinct
+// key, then probe rows of which half hit, each summing every value its key
+// has (as a join emitting each matched pair would touch them)
+// A matched value: the element itself for MM, the pair's second for UMM
+inline uint MultimapValue(uint value)									{ return value; }
+inline uint MultimapValue(const std::pair<const uint, uint> & element)	{ return element.second; }
+
+template<typename F>
+size_t MultimapProbe(const std::vector<uint> & probeKeys, F equalRange)
+{
+	size_t matches = 0, sum = 0;
+	for (uint key : probeKeys)
+	{
+		auto range = equalRange(key);
+		for (auto it = range.first; it != range.second; ++it)
 		{
-			ht.Remove(keys[i]);
+			sum += MultimapValue(*it);
+			++matches;
 		}
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_deallocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
+	dummy = sum;
+	return matches;
+}
+
+void MultimapTiming(int numRows, int valuesPerKey)
+{
+	typedef std::unordered_multimap<uint, uint, UMHashTable<uint, uint>::Hasher> UMM;
+
+	// Build rows in random order; key k's values are k * valuesPerKey + j
+	int numKeys = numRows / valuesPerKey;
+	std::vector<std::pair<uint, uint>> rows(size_t(numKeys) * valuesPerKey);
+	for (int k = 0; k < numKeys; ++k)
+	{
+		for (int j = 0; j < valuesPerKey; ++j)
+			rows[size_t(k) * valuesPerKey + j] = std::make_pair(uint(k), uint(k * valuesPerKey + j));
+	}
+	XorshiftRNG rng = { 0x70196e5 };
+	std::shuffle(rows.begin(), rows.end(), rng);
+
+	std::vector<uint> probeKeys(numRows);
+	for (int i = 0; i < numRows; ++i)
+		probeKeys[i] = (i & 1) ? uint(rng() % numKeys) : uint(numKeys + rng() % numKeys);
+
+	Timer timerBuildUMM, timerBuildMM, timerBuildBulk;
+	Timer timerProbeUMM, timerProbeMM, timerProbeBulk;
+	size_t matches = 0;
+	{
+		UMM map;
+		timerBuildUMM.Start();
+		for (const auto & row : rows)
+			map.insert(row);
+		timerBuildUMM.Stop();
+
+		timerProbeUMM.Start();
+		matches = MultimapProbe(probeKeys, [&](uint key) { return map.equal_range(key); });
+		timerProbeUMM.Stop();
+	}
+	{
+		MMHashTable<uint, uint> ht;
+		timerBuildMM.Start();
+		for (const auto & row : rows)
+			ht.Insert(row.first, row.second);
+		timerBuildMM.Stop();
 
+		timerProbeMM.Start();
+		size_t matchesMM = MultimapProbe(probeKeys, [&](uint key) { return ht.EqualRange(key); });
+		timerProbeMM.Stop();
+		assert(matchesMM == matches);
+		(void)matchesMM;
+	}
+	{
+		MMHashTable<uint, uint> ht;
+		timerBuildBulk.Start();
+		ht.BulkBuild(rows.begin(), rows.end());
+		timerBuildBulk.Stop();
+
+		timerProbeBulk.Start();
+		size_t matchesBulk = MultimapProbe(probeKeys, [&](uint key) { return ht.EqualRange(key); });
+		timerProbeBulk.Stop();
+		assert(matchesBulk == matches);
+		(void)matchesBulk;
+	}
+
+	Log("%d\t%0.1f\t%0.1f\t%0.1f\t\t%0.1f\t%0.1f\t%0.1f\t\t%d\t%0.1f\n",
+		valuesPerKey,
+		timerBuildUMM.msAccumulated, timerBuildMM.msAccumulated, timerBuildBulk.msAccumulated,
+		timerProbeUMM.msAccumulated, timerProbeMM.msAccumulated, timerProbeBulk.msAccumulated,
+		int(matches), double(numRows) / timerProbeBulk.msAccumulated / 1000.0);
 }
 
-template<typename K, typename V>
-void DestructTiming(int numKeys)
+// Hash join: build rows (unique keys, with a payload) go into a table, then
+// each probe row looks up its key and reads the matching payload.  A probe
+// row matches with probability matchPercent%, and the matches are either
+// spread evenly over the build keys or skewed towards a few of them.
+//
+// Partitioned, both sides are first radix-partitioned by bits of the key's
+// hash into enough partitions that each one's table fits in
+// s_joinCacheBytes, then each partition is built and probed in turn while its
+// table is in cache.  The partitioning pass counts towards the build and
+// probe times.  The partition bits are the ones just below the top 7, which
+// F14 takes its tags from, and above the low bits a partition's table indexes
+// by, so the partition a key is in tells the tables nothing; partitioning by
+// the top bits would give every key in a partition (nearly) the same F14 tag.
+static const size_t s_joinCacheBytes = 256 * 1024;
+static const int s_joinPartitionBitsMax = 8;
+
+// The payload's first four bytes carry the build row's index, so probing
+// reads real data out of the matched row
+template<typename V>
+V JoinPayload(uint iRow)
 {
-	// Run tests and measure timing
-	float timeMin;
-	timeMin = FLT_MAX;
-	for (int i = 0; i < g_reps; ++i)
+	static_assert(sizeof(V) >= sizeof(uint), "payload too small to carry a row index");
+	V value = V();
+	memcpy(&value, &iRow, sizeof(iRow));
+	return value;
+}
+
+template<typename V>
+uint JoinPayloadRow(const V & value)
+{
+	uint iRow;
+	memcpy(&iRow, &value, sizeof(iRow));
+	return iRow;
+}
+
+// Scatters rows into 2^bits partitions by bits 25 - bits to 24 of their keys'
+// hashes (see above); partition i is [starts[i], starts[i + 1]) of partitioned
+template<typename T, typename FKey>
+void JoinPartition(const std::vector<T> & rows, int bits, FKey key, std::vector<T> & partitioned, std::vector<size_t> & starts)
+{
+	starts.assign((size_t(1) << bits) + 1, 0);
+	std::vector<uint32_t> iParts(rows.size());
+	for (size_t i = 0, iEnd = rows.size(); i < iEnd; ++i)
 	{
-		UMHashTable<K, V> * ht = new UMHashTable<K, V>;
-		Fill(*ht, numKeys);
-		g_deallocs = 0;
-		Timer timer;
-		timer.Start();
-		delete ht;
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
+		iParts[i] = (HashKey(key(rows[i])) >> (25 - bits)) & ((1U << bits) - 1);
+		++starts[iParts[i] + 1];
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_deallocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
+	for (size_t i = 1, iEnd = starts.size(); i < iEnd; ++i)
+		starts[i] += starts[i - 1];
 
-	timeMin = FLT_MAX;
-	for (int i = 0; i < g_reps; ++i)
+	std::vector<size_t> offsets(starts.begin(), starts.end() - 1);
+	partitioned.resize(rows.size());
+	for (size_t i = 0, iEnd = rows.size(); i < iEnd; ++i)
+		partitioned[offsets[iParts[i]]++] = rows[i];
+}
+
+template<typename HT, typename V>
+void JoinTiming(const std::vector<std::pair<uint, V>> & buildRows, const std::vector<uint> & probeRows, int partitionBits, float * pBuildMs, float * pProbeMs)
+{
+	Timer timerBuild, timerProbe;
+
+	// Unpartitioned is one partition of everything, in the order given
+	std::vector<std::pair<uint, V>> buildPartitioned;
+	std::vector<uint> probePartitioned;
+	std::vector<size_t> buildStarts(2, 0), probeStarts(2, 0);
+	buildStarts[1] = buildRows.size();
+	probeStarts[1] = probeRows.size();
+	if (partitionBits > 0)
 	{
-		C0HashTable<K, V> * ht = new C0HashTable<K, V>;
-		Fill(*ht, numKeys);
-		g_deallocs = 0;
-		Timer timer;
-		timer.Start();
-		delete ht;
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
+		timerBuild.Start();
+		JoinPartition(buildRows, partitionBits, [](const std::pair<uint, V> & row) { return row.first; }, buildPartitioned, buildStarts);
+		timerBuild.Stop();
+		timerProbe.Start();
+		JoinPartition(probeRows, partitionBits, [](uint key) { return key; }, probePartitioned, probeStarts);
+		timerProbe.Stop();
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_deallocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
+	const std::vector<std::pair<uint, V>> & build = (partitionBits > 0) ? buildPartitioned : buildRows;
+	const std::vector<uint> & probe = (partitionBits > 0) ? probePartitioned : probeRows;
 
-	timeMin = FLT_MAX;
-	for (int i = 0; i < g_reps; ++i)
+	// The build side's size is known, so each table is presized for it
+	size_t sum = 0;
+	for (size_t iPart = 0; iPart + 1 < buildStarts.size(); ++iPart)
 	{
-		OLHashTable<K, V> * ht = new OLHashTable<K, V>;
-		Fill(*ht, numKeys);
-		g_deallocs = 0;
-		Timer timer;
-		timer.Start();
-		delete ht;
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
+		HT ht;
+		timerBuild.Start();
+		ht.Reserve(buildStarts[iPart + 1] - buildStarts[iPart]);
+		for (size_t i = buildStarts[iPart], iEnd = buildStarts[iPart + 1]; i < iEnd; ++i)
+			ht.Insert(build[i].first, build[i].second);
+		timerBuild.Stop();
+
+		timerProbe.Start();
+		for (size_t i = probeStarts[iPart], iEnd = probeStarts[iPart + 1]; i < iEnd; ++i)
+		{
+			if (const V * pValue = ht.Lookup(probe[i]))
+				sum += JoinPayloadRow(*pValue);
+		}
+		timerProbe.Stop();
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_deallocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
+	dummy = sum;
 
-	timeMin = FLT_MAX;
-	for (int i = 0; i < g_reps; ++i)
+	*pBuildMs = timerBuild.msAccumulated;
+	*pProbeMs = timerProbe.msAccumulated;
+}
+
+template<typename V>
+void JoinTiming(int numBuild, int numProbe, int matchPercent, bool skewed, bool partitioned, const char * payload)
+{
+	// Build keys are unique, in random order
+	std::vector<std::pair<uint, V>> buildRows(numBuild);
+	std::vector<uint> keys(numBuild);
+	for (int i = 0; i < numBuild; ++i)
+		keys[i] = uint(i);
+	XorshiftRNG rng = { 0x70117ab1 };
+	std::shuffle(keys.begin(), keys.end(), rng);
+	for (int i = 0; i < numBuild; ++i)
+		buildRows[i] = std::make_pair(keys[i], JoinPayload<V>(uint(i)));
+
+	// Skewed matches favour the low keys, as in CountTiming; misses are keys
+	// past the last build key
+	std::vector<uint> probeRows(numProbe);
+	for (int i = 0; i < numProbe; ++i)
 	{
-		DO1HashTable<K, V> * ht = new DO1HashTable<K, V>;
-		Fill(*ht, numKeys);
-		g_deallocs = 0;
-		Timer timer;
-		timer.Start();
-		delete ht;
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
+		uint64_t r = rng() % numBuild;
+		if (int(rng() % 100) >= matchPercent)
+			probeRows[i] = uint(numBuild + r);
+		else
+			probeRows[i] = skewed ? uint((r * r) / numBuild) : uint(r);
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_deallocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
 
-	timeMin = FLT_MAX;
-	for (int i = 0; i < g_reps; ++i)
+	// Enough partitions that each holds about s_joinCacheBytes of table at
+	// the open-addressed tables' 2/3 load
+	int partitionBits = 0;
+	if (partitioned)
 	{
-		DO2HashTable<K, V> * ht = new DO2HashTable<K, V>;
-		Fill(*ht, numKeys);
-		g_deallocs = 0;
-		Timer timer;
-		timer.Start();
-		delete ht;
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
+		size_t tableBytes = size_t(numBuild) * (sizeof(uint) + sizeof(V)) * 3 / 2;
+		while ((tableBytes >> partitionBits) > s_joinCacheBytes && partitionBits < s_joinPartitionBitsMax)
+			++partitionBits;
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_deallocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
 
-	timeMin = FLT_MAX;
-	for (int i = 0; i < g_reps; ++i)
+	float buildMs[6], probeMs[6];
+	JoinTiming<UMHashTable<uint, V>>(buildRows, probeRows, partitionBits, &buildMs[0], &probeMs[0]);
+	JoinTiming<OLHashTable<uint, V>>(buildRows, probeRows, partitionBits, &buildMs[1], &probeMs[1]);
+	JoinTiming<DO1HashTable<uint, V>>(buildRows, probeRows, partitionBits, &buildMs[2], &probeMs[2]);
+	JoinTiming<D0HashTable<uint, V>>(buildRows, probeRows, partitionBits, &buildMs[3], &probeMs[3]);
+	JoinTiming<F14HashTable<uint, V>>(buildRows, probeRows, partitionBits, &buildMs[4], &probeMs[4]);
+	JoinTiming<MMHashTable<uint, V>>(buildRows, probeRows, partitionBits, &buildMs[5], &probeMs[5]);
+
+	// Throughput in millions of rows a second
+	Log("%s\t%s\t%d\t%d", payload, skewed ? "skewed" : "uniform", matchPercent, 1 << partitionBits);
+	for (float ms : buildMs)
+		Log("\t%0.1f", float(numBuild) / ms / 1000.0f);
+	Log("\t");
+	for (float ms : probeMs)
+		Log("\t%0.1f", float(numProbe) / ms / 1000.0f);
+	Log("\n");
+}
+
+// Radix-partitioned table against the monolithic ones on batched work: fill
+// numKeys keys, then look up random keys, batchSize at a time.  Each table
+// is presized before its fill is timed, so none of them pays for growing.
+template<typename HT>
+float PartitionedLookupTiming(HT & ht, const std::vector<uint> & lookups, int batchSize)
+{
+	std::vector<uint *> results(batchSize);
+	size_t sum = 0;
+	Timer timer;
+	timer.Start();
+	for (size_t iBatch = 0, count = lookups.size(); iBatch < count; iBatch += batchSize)
 	{
-		D0HashTable<K, V> * ht = new D0HashTable<K, V>;
-		Fill(*ht, numKeys);
-		g_deallocs = 0;
-		Timer timer;
-		timer.Start();
-		delete ht;
-		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
+		size_t n = std::min(count - iBatch, size_t(batchSize));
+		ht.LookupBatch(&lookups[iBatch], n, &results[0]);
+		for (size_t i = 0; i < n; ++i)
+			sum += *results[i];
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_deallocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
+	timer.Stop();
+	dummy = sum;
+	return timer.msAccumulated;
+}
+
+template<typename HT>
+float PartitionedFillTiming(HT & ht, const std::vector<uint> & keys)
+{
+	ht.Reserve(keys.size());
+	Timer timer;
+	timer.Start();
+	for (uint key : keys)
+		ht.Insert(key, key);
+	timer.Stop();
+	return timer.msAccumulated;
+}
 
+void PartitionedTiming(int numKeys, int batchSize)
+{
+	static const int numLookups = 4000000;
 
-	timeMin = FLT_MAX;
-	for (int i = 0; i < g_reps; ++i)
+	// Unique keys in random order, and lookups of random ones of them
+	std::vector<uint> keys(numKeys);
+	for (int i = 0; i < numKeys; ++i)
+		keys[i] = uint(i);
+	XorshiftRNG rng = { 0x2ad1c5 };
+	std::shuffle(keys.begin(), keys.end(), rng);
+	std::vector<uint> lookups(numLookups);
+	for (int i = 0; i < numLookups; ++i)
+		lookups[i] = uint(rng() % numKeys);
+
+	float fillDO1, fillOL, fillRP, lookupDO1, lookupOL, lookupRP, lookupRPSingle;
 	{
-		D1HashTable<K, V> * ht = new D1HashTable<K, V>;
-		Fill(*ht, numKeys);
-		g_deallocs = 0;
+		DO1HashTable<uint, uint> ht;
+		fillDO1 = PartitionedFillTiming(ht, keys);
+		lookupDO1 = PartitionedLookupTiming(ht, lookups, batchSize);
+	}
+	{
+		OLHashTable<uint, uint> ht;
+		fillOL = PartitionedFillTiming(ht, keys);
+		lookupOL = PartitionedLookupTiming(ht, lookups, batchSize);
+	}
+	int partitions;
+	{
+		RPHashTable<uint, uint> ht;
+		ht.Reserve(numKeys);
 		Timer timer;
 		timer.Start();
-		delete ht;
+		for (int iBatch = 0; iBatch < numKeys; iBatch += batchSize)
+			ht.InsertBatch(&keys[iBatch], &keys[iBatch], std::min(numKeys - iBatch, batchSize));
 		timer.Stop();
-		timeMin = std::min(timeMin, timer.msAccumulated);
+		fillRP = timer.msAccumulated;
+		partitions = int(ht.subTables.size());
+		lookupRP = PartitionedLookupTiming(ht, lookups, batchSize);
+
+		size_t sum = 0;
+		Timer timerSingle;
+		timerSingle.Start();
+		for (uint key : lookups)
+			sum += *ht.Lookup(key);
+		timerSingle.Stop();
+		dummy = sum;
+		lookupRPSingle = timerSingle.msAccumulated;
 	}
-#if COUNT_ALLOCS
-	Log("\t%d", g_deallocs);
-#else
-	Log("\t%0.2f", timeMin);
-#endif
 
+	Log("%d\t%d\t%d\t%0.1f\t%0.1f\t%0.1f\t\t%0.1f\t%0.1f\t%0.1f\t%0.1f\n",
+		numKeys, batchSize, partitions, fillDO1, fillOL, fillRP, lookupDO1, lookupOL, lookupRP, lookupRPSingle);
 }
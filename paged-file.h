@@ -0,0 +1,328 @@
+#pragma once
+
+// Page I/O for tables too big for memory: a file of fixed-size pages, read
+// and written one page at a time at its offset (pread/pwrite, or ReadFile/
+// WriteFile with an offset on Windows), and an LRU cache of pages on top.
+// Pages are plain bytes; what's in them is up to the table.
+//
+// Writes go through the OS's own file cache, same as any buffered file, so
+// a page the LRU cache misses on may still come back without touching the
+// disk; the counters here count calls, not disk I/O.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#if defined(WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const size_t s_pageSize = 4096;
+
+// A file of s_pageSize pages.  Reading a page past the end of the file (one
+// that's never been written) gives zeros.
+class PageFile
+{
+public:
+	PageFile()
+#if defined(WIN32)
+	:	hFile(INVALID_HANDLE_VALUE)
+#else
+	:	fd(-1)
+#endif
+	{
+	}
+
+	~PageFile()
+	{
+		Close();
+	}
+
+	// Creates the file, or empties it if it exists
+	bool Open(const char * path)
+	{
+		Close();
+#if defined(WIN32)
+		hFile = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_RANDOM_ACCESS, nullptr);
+		return hFile != INVALID_HANDLE_VALUE;
+#else
+		fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		return fd >= 0;
+#endif
+	}
+
+	void Close()
+	{
+#if defined(WIN32)
+		if (hFile != INVALID_HANDLE_VALUE)
+			CloseHandle(hFile);
+		hFile = INVALID_HANDLE_VALUE;
+#else
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+#endif
+	}
+
+	bool Read(uint32_t iPage, void * pData)
+	{
+		uint64_t offset = uint64_t(iPage) * s_pageSize;
+		size_t bytesRead = 0;
+#if defined(WIN32)
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = DWORD(offset);
+		overlapped.OffsetHigh = DWORD(offset >> 32);
+		DWORD count = 0;
+		if (!ReadFile(hFile, pData, DWORD(s_pageSize), &count, &overlapped) && GetLastError() != ERROR_HANDLE_EOF)
+			return false;
+		bytesRead = count;
+#else
+		ssize_t count = pread(fd, pData, s_pageSize, off_t(offset));
+		if (count < 0)
+			return false;
+		bytesRead = size_t(count);
+#endif
+		memset(static_cast<char *>(pData) + bytesRead, 0, s_pageSize - bytesRead);
+		return true;
+	}
+
+	bool Write(uint32_t iPage, const void * pData)
+	{
+		uint64_t offset = uint64_t(iPage) * s_pageSize;
+#if defined(WIN32)
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = DWORD(offset);
+		overlapped.OffsetHigh = DWORD(offset >> 32);
+		DWORD count = 0;
+		return WriteFile(hFile, pData, DWORD(s_pageSize), &count, &overlapped) && count == s_pageSize;
+#else
+		return pwrite(fd, pData, s_pageSize, off_t(offset)) == ssize_t(s_pageSize);
+#endif
+	}
+
+private:
+#if defined(WIN32)
+	HANDLE	hFile;
+#else
+	int		fd;
+#endif
+
+	PageFile(const PageFile &);
+	PageFile & operator = (const PageFile &);
+};
+
+// A fixed number of page frames over a PageFile, evicting the least recently
+// used page when it needs a frame, and writing it back first if it's dirty.
+// A pointer Fetch returns stays good until a Fetch of some other page evicts
+// it; the cache always has room for at least the last s_pageCacheFramesMin-1
+// pages fetched.
+static const size_t s_pageCacheFramesMin = 4;
+
+class PageCache
+{
+public:
+	// Since Open
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	reads;
+	uint64_t	writes;
+	// Set by the first read or write that fails, and left set
+	bool		failed;
+
+	PageCache()
+	:	hits(0),
+		misses(0),
+		reads(0),
+		writes(0),
+		failed(false),
+		frameCountUsed(0),
+		iFrameHead(s_none),
+		iFrameTail(s_none)
+	{
+	}
+
+	~PageCache()
+	{
+		Close();
+	}
+
+	// Creates (or empties) the file at path, with frameCount page frames
+	bool Open(const char * path, size_t frameCount)
+	{
+		Close();
+		if (frameCount < s_pageCacheFramesMin || !file.Open(path))
+			return false;
+		frames.assign(frameCount, Frame());
+		data.assign(frameCount * (s_pageSize / sizeof(uint64_t)), 0);
+		frameOfPage.clear();
+		frameOfPage.reserve(frameCount);
+		frameCountUsed = 0;
+		iFrameHead = iFrameTail = s_none;
+		hits = misses = reads = writes = 0;
+		failed = false;
+		return true;
+	}
+
+	// Writes back the dirty pages and closes the file
+	void Close()
+	{
+		Flush();
+		file.Close();
+		frames.clear();
+		data.clear();
+		frameOfPage.clear();
+		frameCountUsed = 0;
+		iFrameHead = iFrameTail = s_none;
+	}
+
+	// The page's bytes, read in if it isn't cached.  Pass dirty if the
+	// caller is going to change them.
+	char * Fetch(uint32_t iPage, bool dirty)
+	{
+		auto it = frameOfPage.find(iPage);
+		uint32_t iFrame;
+		if (it != frameOfPage.end())
+		{
+			++hits;
+			iFrame = it->second;
+			Unlink(iFrame);
+		}
+		else
+		{
+			++misses;
+			iFrame = TakeFrame(iPage);
+			++reads;
+			if (!file.Read(iPage, FrameData(iFrame)))
+				failed = true;
+		}
+		PushFront(iFrame);
+		frames[iFrame].dirty |= dirty;
+		return FrameData(iFrame);
+	}
+
+	// A page that's never been written: zeros, without reading the file
+	char * Create(uint32_t iPage)
+	{
+		auto it = frameOfPage.find(iPage);
+		uint32_t iFrame;
+		if (it != frameOfPage.end())
+		{
+			iFrame = it->second;
+			Unlink(iFrame);
+		}
+		else
+		{
+			iFrame = TakeFrame(iPage);
+		}
+		memset(FrameData(iFrame), 0, s_pageSize);
+		PushFront(iFrame);
+		frames[iFrame].dirty = true;
+		return FrameData(iFrame);
+	}
+
+	// Writes back every dirty page, keeping them cached
+	bool Flush()
+	{
+		for (uint32_t iFrame = 0; iFrame < frameCountUsed; ++iFrame)
+		{
+			if (frames[iFrame].dirty)
+				WriteBack(iFrame);
+		}
+		return !failed;
+	}
+
+	size_t FrameCount() const	{ return frames.size(); }
+
+private:
+	static const uint32_t s_none = ~uint32_t(0);
+
+	struct Frame
+	{
+		uint32_t	iPage;
+		uint32_t	iPrev;		// towards the most recently used
+		uint32_t	iNext;		// towards the least
+		bool		dirty;
+	};
+
+	PageFile								file;
+	std::vector<Frame>						frames;
+	// The frames' pages, one after another; uint64_t to align them
+	std::vector<uint64_t>					data;
+	std::unordered_map<uint32_t, uint32_t>	frameOfPage;
+	uint32_t								frameCountUsed;
+	uint32_t								iFrameHead;
+	uint32_t								iFrameTail;
+
+	char * FrameData(uint32_t iFrame)
+	{
+		return reinterpret_cast<char *>(&data[iFrame * (s_pageSize / sizeof(uint64_t))]);
+	}
+
+	void WriteBack(uint32_t iFrame)
+	{
+		++writes;
+		if (!file.Write(frames[iFrame].iPage, FrameData(iFrame)))
+			failed = true;
+		frames[iFrame].dirty = false;
+	}
+
+	// A frame for iPage, unlinked: a never-used one if there is one, else
+	// the least recently used, written back if it's dirty
+	uint32_t TakeFrame(uint32_t iPage)
+	{
+		uint32_t iFrame;
+		if (frameCountUsed < frames.size())
+		{
+			iFrame = frameCountUsed++;
+		}
+		else
+		{
+			iFrame = iFrameTail;
+			Unlink(iFrame);
+			if (frames[iFrame].dirty)
+				WriteBack(iFrame);
+			frameOfPage.erase(frames[iFrame].iPage);
+		}
+		frames[iFrame].iPage = iPage;
+		frames[iFrame].dirty = false;
+		frameOfPage[iPage] = iFrame;
+		return iFrame;
+	}
+
+	void Unlink(uint32_t iFrame)
+	{
+		Frame & f = frames[iFrame];
+		if (f.iPrev != s_none)
+			frames[f.iPrev].iNext = f.iNext;
+		else
+			iFrameHead = f.iNext;
+		if (f.iNext != s_none)
+			frames[f.iNext].iPrev = f.iPrev;
+		else
+			iFrameTail = f.iPrev;
+	}
+
+	void PushFront(uint32_t iFrame)
+	{
+		Frame & f = frames[iFrame];
+		f.iPrev = s_none;
+		f.iNext = iFrameHead;
+		if (iFrameHead != s_none)
+			frames[iFrameHead].iPrev = iFrame;
+		iFrameHead = iFrame;
+		if (iFrameTail == s_none)
+			iFrameTail = iFrame;
+	}
+
+	PageCache(const PageCache &);
+	PageCache & operator = (const PageCache &);
+};
@@ -0,0 +1,283 @@
+#pragma once
+
+// On-disk format for hash table snapshots, and the file plumbing to write
+// them and map them back in.  A snapshot is the table's flat arrays written
+// out verbatim: the header fills the first page, and each array starts on a
+// page boundary after it, so a read-only mapping of the file can be used as
+// the arrays directly, with no deserialization.
+//
+// Snapshots are only meant to be read by the same build that wrote them (the
+// bucket bitfields and struct padding are compiler-specific); the header
+// records the element sizes so a mismatch is at least caught at load time.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#if defined(WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Included from hash-tables.h, after SpookyHash (whose header has no include
+// guard, so it can't be included again here)
+
+enum SNAPSHOTKIND
+{
+	SNAPSHOTKIND_DO2 = 1,
+	SNAPSHOTKIND_D0 = 2,
+};
+
+static const uint32_t s_snapshotVersion = 1;
+static const uint64_t s_snapshotAlignment = 4096;
+static const int s_snapshotArraysMax = 4;
+
+struct SnapshotHeader
+{
+	char		magic[8];			// "HTSNAP" plus padding
+	uint32_t	version;
+	uint32_t	kind;				// SNAPSHOTKIND of the table that wrote it
+	uint32_t	keySize;			// sizeof(K) and sizeof(V) of the writer
+	uint32_t	valueSize;
+	uint64_t	bucketCount;
+	uint64_t	size;				// number of keys stored
+	uint64_t	extra;				// table-specific; D0 puts its free-list head here
+	uint32_t	numArrays;
+	uint32_t	pad;
+	struct
+	{
+		uint64_t	offset;			// from the start of the file, page-aligned
+		uint64_t	elemSize;
+		uint64_t	count;
+	}			arrays[s_snapshotArraysMax];
+	uint64_t	payloadChecksum;	// SpookyHash of all the arrays, chained in order
+	uint64_t	headerChecksum;		// SpookyHash of the header up to this field
+};
+
+static_assert(sizeof(SnapshotHeader) <= s_snapshotAlignment, "Snapshot header must fit in one page");
+
+// One array for WriteSnapshot to write
+struct SnapshotArray
+{
+	const void *	pData;
+	size_t			elemSize;
+	size_t			count;
+};
+
+inline uint64_t SnapshotHeaderChecksum(const SnapshotHeader & header)
+{
+	return SpookyHash::Hash64(&header, offsetof(SnapshotHeader, headerChecksum), 0);
+}
+
+inline uint64_t SnapshotPayloadChecksum(const char * pBase, const SnapshotHeader & header)
+{
+	uint64_t checksum = 0;
+	for (uint32_t i = 0; i < header.numArrays; ++i)
+	{
+		checksum = SpookyHash::Hash64(
+						pBase + header.arrays[i].offset,
+						size_t(header.arrays[i].elemSize * header.arrays[i].count),
+						checksum);
+	}
+	return checksum;
+}
+
+// Fills in the array table and checksums of the header (the caller sets the
+// table-specific fields), then writes the header and arrays out to path.
+// Returns false if the file can't be written.
+inline bool WriteSnapshot(const char * path, SnapshotHeader & header, const SnapshotArray * arrays, int numArrays)
+{
+	memcpy(header.magic, "HTSNAP\0\0", sizeof(header.magic));
+	header.version = s_snapshotVersion;
+	header.numArrays = uint32_t(numArrays);
+	header.pad = 0;
+
+	uint64_t offset = s_snapshotAlignment;
+	uint64_t checksum = 0;
+	for (int i = 0; i < s_snapshotArraysMax; ++i)
+	{
+		if (i >= numArrays)
+		{
+			header.arrays[i].offset = header.arrays[i].elemSize = header.arrays[i].count = 0;
+			continue;
+		}
+		size_t sizeBytes = arrays[i].elemSize * arrays[i].count;
+		header.arrays[i].offset = offset;
+		header.arrays[i].elemSize = arrays[i].elemSize;
+		header.arrays[i].count = arrays[i].count;
+		checksum = SpookyHash::Hash64(arrays[i].pData, sizeBytes, checksum);
+		offset = (offset + sizeBytes + s_snapshotAlignment - 1) & ~(s_snapshotAlignment - 1);
+	}
+	header.payloadChecksum = checksum;
+	header.headerChecksum = SnapshotHeaderChecksum(header);
+
+#ifdef _MSC_VER
+	FILE * pFile = nullptr;
+	fopen_s(&pFile, path, "wb");
+#else
+	FILE * pFile = fopen(path, "wb");
+#endif
+	if (!pFile)
+		return false;
+
+	// Zero padding out to each page boundary
+	static const char s_zeros[s_snapshotAlignment] = {};
+	bool ok = (fwrite(&header, sizeof(header), 1, pFile) == 1) &&
+			  (fwrite(s_zeros, s_snapshotAlignment - sizeof(header), 1, pFile) == 1);
+	for (int i = 0; ok && i < numArrays; ++i)
+	{
+		size_t sizeBytes = arrays[i].elemSize * arrays[i].count;
+		if (sizeBytes > 0)
+			ok = (fwrite(arrays[i].pData, sizeBytes, 1, pFile) == 1);
+		size_t padding = size_t((s_snapshotAlignment - sizeBytes % s_snapshotAlignment) % s_snapshotAlignment);
+		if (ok && padding > 0 && i + 1 < numArrays)
+			ok = (fwrite(s_zeros, padding, 1, pFile) == 1);
+	}
+	if (fclose(pFile) != 0)
+		ok = false;
+	if (!ok)
+		remove(path);
+	return ok;
+}
+
+// Read-only mapping of a whole file
+class MappedFile
+{
+public:
+	const char *	data;
+	size_t			size;
+
+	MappedFile()
+	:	data(nullptr),
+		size(0)
+#if defined(WIN32)
+		, hMapping(nullptr)
+#endif
+	{
+	}
+
+	~MappedFile()
+	{
+		Close();
+	}
+
+	bool Open(const char * path)
+	{
+		Close();
+#if defined(WIN32)
+		HANDLE hFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart == 0)
+		{
+			CloseHandle(hFile);
+			return false;
+		}
+		hMapping = CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		CloseHandle(hFile);
+		if (!hMapping)
+			return false;
+		data = static_cast<const char *>(MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+		if (!data)
+		{
+			CloseHandle(hMapping);
+			hMapping = nullptr;
+			return false;
+		}
+		size = size_t(fileSize.QuadPart);
+#else
+		int fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			close(fd);
+			return false;
+		}
+		void * p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED)
+			return false;
+		// Lookups touch pages at random, so readahead would only waste I/O
+		madvise(p, size_t(st.st_size), MADV_RANDOM);
+		data = static_cast<const char *>(p);
+		size = size_t(st.st_size);
+#endif
+		return true;
+	}
+
+	void Close()
+	{
+		if (!data)
+			return;
+#if defined(WIN32)
+		UnmapViewOfFile(data);
+		CloseHandle(hMapping);
+		hMapping = nullptr;
+#else
+		munmap(const_cast<char *>(data), size);
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+private:
+#if defined(WIN32)
+	HANDLE			hMapping;
+#endif
+
+	MappedFile(const MappedFile &);
+	MappedFile & operator = (const MappedFile &);
+};
+
+// Maps a snapshot and checks that it's intact and was written by a table of
+// the expected kind and element sizes.  The payload checksum means reading
+// the entire file, so it's optional; without it, opening costs only the
+// header page, and the rest is faulted in as lookups touch it.
+inline const SnapshotHeader * OpenSnapshot(
+	MappedFile & file,
+	const char * path,
+	uint32_t kind,
+	uint32_t keySize,
+	uint32_t valueSize,
+	const uint64_t * elemSizes,
+	uint32_t numArrays,
+	bool verifyPayload)
+{
+	if (!file.Open(path))
+		return nullptr;
+
+	const SnapshotHeader * pHeader = reinterpret_cast<const SnapshotHeader *>(file.data);
+	bool ok = file.size >= s_snapshotAlignment &&
+			  memcmp(pHeader->magic, "HTSNAP\0\0", sizeof(pHeader->magic)) == 0 &&
+			  pHeader->headerChecksum == SnapshotHeaderChecksum(*pHeader) &&
+			  pHeader->version == s_snapshotVersion &&
+			  pHeader->kind == kind &&
+			  pHeader->keySize == keySize &&
+			  pHeader->valueSize == valueSize &&
+			  pHeader->numArrays == numArrays;
+	for (uint32_t i = 0; ok && i < numArrays; ++i)
+	{
+		ok = pHeader->arrays[i].elemSize == elemSizes[i] &&
+			 pHeader->arrays[i].offset % s_snapshotAlignment == 0 &&
+			 pHeader->arrays[i].offset + pHeader->arrays[i].elemSize * pHeader->arrays[i].count <= file.size;
+	}
+	if (ok && verifyPayload)
+		ok = (pHeader->payloadChecksum == SnapshotPayloadChecksum(file.data, *pHeader));
+
+	if (!ok)
+	{
+		file.Close();
+		return nullptr;
+	}
+	return pHeader;
+}
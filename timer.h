@@ -74,3 +74,86 @@ public:
 
 #endif
 
+// Counts data TLB misses (loads that missed the dTLB) between Start and Stop,
+// using perf_event_open.  valid is false if the counter isn't available, e.g.
+// when perf_event_paranoid forbids it, under a VM, or off Linux.
+#if defined(__linux__)
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+
+class DtlbMissCounter
+{
+public:
+	bool valid;
+	int64_t countAccumulated;
+	int fd;
+
+	DtlbMissCounter()
+	:	valid(false),
+		countAccumulated(0),
+		fd(-1)
+	{
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = PERF_COUNT_HW_CACHE_DTLB |
+					  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+					  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+		valid = (fd >= 0);
+	}
+
+	~DtlbMissCounter()
+	{
+		if (valid)
+			close(fd);
+	}
+
+	void Start()
+	{
+		if (!valid)
+			return;
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	void Stop()
+	{
+		if (!valid)
+			return;
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		int64_t count = 0;
+		if (read(fd, &count, sizeof(count)) == sizeof(count))
+			countAccumulated += count;
+	}
+
+private:
+	DtlbMissCounter(const DtlbMissCounter &);
+	DtlbMissCounter & operator = (const DtlbMissCounter &);
+};
+
+#else
+
+#include <cstdint>
+
+class DtlbMissCounter
+{
+public:
+	bool valid;
+	int64_t countAccumulated;
+
+	DtlbMissCounter() : valid(false), countAccumulated(0) {}
+	void Start() {}
+	void Stop() {}
+};
+
+#endif
+